@@ -55,7 +55,8 @@
 #define XCLK_FREQ_HZ 20000000
 #define CAMERA_PIXFORMAT PIXFORMAT_GRAYSCALE
 #define CAMERA_FRAME_SIZE FRAMESIZE_240X240//240*240
-#define CAMERA_FB_COUNT 1
+#define CAMERA_FB_COUNT 2 // one frame captured while the other one is decoded
+#define CAMERA_GRAB_MODE CAMERA_GRAB_LATEST
 
 /**
  * @brief Init camera
@@ -66,6 +67,12 @@ extern "C"
 {
 #endif
     esp_err_t app_camera_init();
+
+    /**
+     * @brief Init camera with another number of frame buffers or grab mode,
+     *        after esp_camera_deinit() to switch
+     */
+    esp_err_t app_camera_init_with(size_t fb_count, camera_grab_mode_t grab_mode);
 #ifdef __cplusplus
 }
 #endif
\ No newline at end of file
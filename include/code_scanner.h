@@ -0,0 +1,79 @@
+#pragma once
+#include <stdint.h>
+#include "esp_err.h"
+#include "esp_camera.h"
+#include "esp_code_scanner.h"
+
+typedef struct {
+    uint32_t sessions; // scanners created
+    uint32_t configs; // sizes of image configured, a crop of another size is one more
+    uint32_t frames; // images scanned
+    uint32_t decoded; // images with at least one code
+    int64_t setup_us; // spent in create and set_config
+    int64_t scan_us; // spent in esp_code_scanner_scan_image
+} code_scanner_stats_t;
+
+/**
+ * @brief Session of the code scanner: created and configured once, reused for
+ *        every frame of the same size, destroyed with the object or by close().
+ *        A new size of image, as crops of the frames have, only configures
+ *        the scanner again.
+ */
+class CodeScanner {
+    private:
+        const char *_tag = "CodeScanner";
+        esp_image_scanner_t *scanner = NULL;
+        uint32_t width = 0;
+        uint32_t height = 0;
+        code_scanner_stats_t stats = {};
+    public:
+        CodeScanner() {}
+        ~CodeScanner();
+        CodeScanner(const CodeScanner&) = delete;
+        CodeScanner& operator=(const CodeScanner&) = delete;
+
+        /**
+         * @brief Create the scanner for grayscale images of width x height, or
+         *        configure it for this size, nothing to do when it is already
+         *        open for it
+         */
+        esp_err_t open(uint32_t width, uint32_t height);
+        void close();
+        bool is_open() const {return scanner != NULL;}
+
+        /**
+         * @brief Decode a grayscale image, opening the scanner for its size first
+         *
+         * @return number of codes found, 0 if none or if the scanner could not be created
+         */
+        int scan(const uint8_t *image, uint32_t width, uint32_t height);
+        int scan(const camera_fb_t *fb);
+
+        /**
+         * @brief First code found by the last scan(), its data is valid until
+         *        the next scan() or close()
+         */
+        esp_code_scanner_symbol_t result();
+
+        const code_scanner_stats_t& get_stats() const {return stats;}
+};
+
+/**
+ * @brief Frame buffer of the camera, given back to the driver when it goes out
+ *        of scope, whatever the path out of the block
+ */
+class CameraFrame {
+    private:
+        camera_fb_t *fb;
+    public:
+        CameraFrame() : fb(esp_camera_fb_get()) {}
+        explicit CameraFrame(camera_fb_t *fb) : fb(fb) {}
+        ~CameraFrame() {release();}
+        CameraFrame(const CameraFrame&) = delete;
+        CameraFrame& operator=(const CameraFrame&) = delete;
+
+        void release();
+        camera_fb_t* get() const {return fb;}
+        camera_fb_t* operator->() const {return fb;}
+        explicit operator bool() const {return fb != NULL;}
+};
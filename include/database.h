@@ -4,51 +4,775 @@
 #include "esp_log.h"
 #include "esp_partition.h"
 #include "esp_system.h"
+#include "esp_timer.h"
 #include "nvs_flash.h"
 #include "nvs.h"
+#include "uid.h"
 
 
 #define P_USER "user_db"
 #define P_HISTORY "history"
 #define P_HISTORY_CTRL "history_ctrl"
 
+#define HISTORY_PAGE_SIZE 4096 // flash sector size, max size of a write-back batch
+#define HISTORY_FLUSH_PERIOD_MS 60000 // max time a record waits in RAM before being flushed
+#define HISTORY_ERASE_AHEAD 2 // sectors kept erased in front of the write head
 
+#define USER_STORE_MAGIC 0x5355484A // "JHUS"
+#define USER_STORE_FORMAT 3
+#define USER_STORE_HEADER_SIZE 32 // records start after it, 4-byte aligned
+#define USER_STORE_SLOT_ALIGN 0x10000 // MMU page: each slot is mapped from its start
+
+#define USER_FILTER_MAGIC 0x4655484A // "JHUF"
+#define USER_FILTER_BITS_PER_USER 10 // about 1% false positives with 7 hashes
+#define USER_FILTER_MAX_HASHES 16
+#define USER_IMPORT_BATCH 1024 // users an import buffer starts with
+#define USER_VERSION_KEEP UINT32_MAX // an update that leaves the version of the list as it is
+#define USER_QUOTA_SLOTS 256 // daily counts of the users with a quota kept in RAM, a power of 2
+#define USER_POLICY_SIZE 13 // bytes of a policy in a delta
+
+/*
+ * User list delta, for a LoRa downlink, moves the list from version v to v+1:
+ *   [varint v] then ops [tag][UID bytes][rights], tag is op << 4 | UID length,
+ *   no rights byte for USER_DELTA_REMOVE, USER_POLICY_SIZE bytes of policy
+ *   instead for USER_DELTA_POLICY: valid_from, valid_until, 3 bytes of hours,
+ *   weekdays, quota, little endian. A user added has no restriction, a modify
+ *   keeps the policy and a policy op keeps the rights.
+ * A delta applies to the list of version v only, in one update. An add needs
+ * a UID unknown to the list, a modify or a remove a known one, and a UID shows
+ * up once: otherwise the list is not the one the delta was made for, the delta
+ * is refused and the list stays as it was.
+ */
+#define USER_DELTA_SET 0 // add or modify with the policy given, not in deltas: UserDB::set
+#define USER_DELTA_ADD 1
+#define USER_DELTA_MODIFY 2
+#define USER_DELTA_REMOVE 3
+#define USER_DELTA_POLICY 4
+#define USER_DELTA_RIGHTS 5 // add, or modify keeping the policy, not in deltas: UserDB::set of one user
+#define USER_DELTA_MAX_OP (1 + HISTORY_UID_MAX_SIZE + USER_POLICY_SIZE) // bytes of an op
+
+#define HISTORY_FORMAT_VERSION 7 // stored in NVS, the log is cleared when it changes
+#define HISTORY_SECTOR_MAGIC 0x5349484A // "JHIS"
+// Default of the sectors at the end of the history partition that hold the
+// summaries, the raw log keeps the others. Chosen per deployment, see
+// ScanHistoryDB(): a summary is x26 denser than the raw scans of a patrol (few
+// badges, scanned all day) but only x2.6 for a site (many badges, a few scans
+// each a day). 32 of 225 sectors keep 86 % of the raw detail, for sites;
+// HISTORY_ROLLUP_SECTORS_PATROL holds about 19 times the days of a raw-only log.
+#define HISTORY_ROLLUP_SECTORS 32
+#define HISTORY_ROLLUP_SECTORS_PATROL 160
+#define HISTORY_UID_MAX_SIZE UID_MAX_SIZE
+#define HISTORY_DICT_SIZE 64 // distinct UIDs remembered per sector
+#define HISTORY_RECORD_MAX_SIZE (1 + 5 + HISTORY_UID_MAX_SIZE + 1)
+#define HISTORY_USAGE_SLOTS 1024 // per-UID counters kept in RAM, a power of 2
+#define HISTORY_USAGE_CHECKPOINT 5000 // scans between two saves of the counters to NVS
+
+/*
+ * Record encoding, first byte is the tag:
+ *   0x00..0x0A  UID length: [tag][varint dt][UID bytes][crc], the UID joins the sector dictionary
+ *   0x80 | i    UID is entry i of the sector dictionary: [tag][varint dt][crc]
+ *   0xFF        erased flash, end of the sector
+ * dt is the zigzag varint of (timestamp - base_time of the sector), crc is the
+ * CRC-8 of the record seeded with the low byte of its entry number.
+ *
+ * Each flush is committed by a second write clearing HISTORY_TAG_PENDING in the
+ * tag of its first record: a tag with this bit set ends the sector, and records
+ * of a batch cut by a power loss are never decoded.
+ */
+#define HISTORY_TAG_DICT 0x80
+#define HISTORY_TAG_PENDING 0x40
+#define HISTORY_TAG_FREE 0xFF
+
+/*
+ * Upload batch, for a LoRa uplink:
+ *   [varint first entry] then for each record [UID length][UID bytes][varint dt]
+ * entries are consecutive from the first one, dt is the zigzag varint of the
+ * timestamp minus the one of the previous record of the batch (0 for the first).
+ */
+#define HISTORY_UPLOAD_MAX_RECORD (1 + HISTORY_UID_MAX_SIZE + 5)
+
+
+// First bytes of every used sector of the history partition
+typedef struct {
+    uint32_t seq; // sector sequence number, the sector index in the partition is seq % nb_sectors
+    uint32_t first_entry; // index of the first record of the sector
+    uint32_t base_time; // timestamp of the first record, records store a delta to it
+    uint32_t magic; // HISTORY_SECTOR_MAGIC, last field written
+    uint32_t max_time; // latest timestamp up to the end of the sector, programmed when the next sector starts
+    uint32_t max_time_inv; // ~max_time once the seal is complete
+} history_sector_header_t;
+
+// UIDs seen in a sector, in order of first appearance
+typedef struct {
+    uint8_t nb_uids;
+    uint8_t len[HISTORY_DICT_SIZE];
+    uint8_t uid[HISTORY_DICT_SIZE][HISTORY_UID_MAX_SIZE];
+} history_dict_t;
+
+typedef struct {
+    uint32_t entry;
+    uint32_t timestamp;
+    uint8_t uid_len;
+    uint8_t uid[HISTORY_UID_MAX_SIZE];
+} history_entry_t;
+
+// Position of a sequential decode inside a sector image
+typedef struct {
+    uint32_t seq; // UINT32_MAX if nothing is loaded
+    uint32_t first_entry;
+    uint32_t base_time;
+    uint32_t entry; // entry of the record at pos
+    size_t pos;
+    history_dict_t dict;
+} history_reader_t;
+
+// Scans of one UID since the last clear_history(), uid_len is 0 for a free slot
+typedef struct {
+    uint32_t count;
+    uint32_t last_seen;
+    uint8_t uid_len;
+    uint8_t uid[HISTORY_UID_MAX_SIZE];
+} history_usage_t;
+
+typedef struct {
+    uint32_t appends;
+    uint32_t flushes;
+    uint32_t flash_bytes_written;
+    uint32_t nvs_commits;
+    uint32_t recovery_reads; // sector headers read to find the end of the log, an entry or a time
+    uint32_t erases; // sectors erased ahead of the write head
+    uint32_t sync_erases; // sectors erased in add_history because none was ready
+    uint32_t sector_reads; // whole sectors read to decode records
+    uint32_t usage_checkpoints;
+    uint32_t usage_bytes_written; // size of the saved counters
+    uint32_t usage_replayed; // records counted again at boot, written after the last checkpoint
+    uint32_t torn_writes; // head sectors closed at boot because a flush was cut
+} history_stats_t;
+
+
+class HistoryRollup;
+
+/*
+ * When a user may pass, all zero for no restriction. Checked against the RTC
+ * time with a few integer operations, hours and weekdays in local time (see
+ * UserDB::set_utc_offset).
+ */
+typedef struct {
+    uint32_t valid_from; // first second of validity, 0 for always
+    uint32_t valid_until; // last second of validity, 0 for no end
+    uint32_t hours; // bit h: from h:00 to h:59, 0 for any hour
+    uint8_t weekdays; // bit 0 Monday to bit 6 Sunday, 0 for any day
+    uint8_t quota; // scans granted a day, 0 for no limit
+    uint8_t reserved[2];
+} user_policy_t;
+
+// Rights of a user, uid_len is 0 for a free slot
+typedef struct {
+    uint8_t uid_len;
+    uint8_t rights;
+    uint8_t uid[HISTORY_UID_MAX_SIZE];
+    user_policy_t policy;
+} user_entry_t;
+
+// Outcome of UserDB::check_access()
+typedef enum {
+    USER_GRANTED = 0,
+    USER_UNKNOWN,
+    USER_NO_RIGHTS, // rights are 0
+    USER_NOT_VALID, // before valid_from or after valid_until
+    USER_OFF_HOURS, // weekday or hour not allowed
+    USER_OVER_QUOTA, // quota of the day used up
+} user_access_t;
+
+// Scans granted to a user with a quota on a day
+typedef struct {
+    uint32_t hash; // uid_hash of the user
+    uint16_t day; // local day since the epoch
+    uint16_t count;
+} user_quota_t;
+
+// User of an import, with its position: a UID given twice keeps its last rights
+typedef struct {
+    user_entry_t user;
+    uint32_t order;
+    uint8_t op; // USER_DELTA_*
+} user_import_t;
+
+// Next user of an import stream, false at its end
+typedef bool (*user_import_cb_t)(user_entry_t *user, void *arg);
+
+/**
+ * @brief Users and their rights in RAM, an open-addressing hash table of the
+ *        raw UIDs with linear probing. Lookups read a slot or two whatever the
+ *        number of users; the table doubles when it is 3/4 full, reserve()
+ *        sizes it exactly.
+ */
+class UserTable {
+    private:
+        user_entry_t *slots = NULL;
+        uint32_t capacity = 0; // 0 before the first user
+        uint32_t nb_users = 0;
+
+        user_entry_t* find(const uint8_t *uid, uint8_t uid_len) const;
+        void resize(uint32_t new_capacity);
+    public:
+        UserTable() = default;
+        ~UserTable();
+        UserTable(const UserTable&) = delete;
+        UserTable& operator=(const UserTable&) = delete;
+
+        void clear();
+
+        /**
+         * @brief Size the table for `nb` users, so that adding them does not rehash
+         */
+        void reserve(uint32_t nb);
+
+        void set(const user_entry_t *user);
+
+        /**
+         * @return false if the user is unknown, rights is left untouched
+         */
+        bool get(const uint8_t *uid, uint8_t uid_len, uint8_t *rights) const;
+
+        /**
+         * @return the entry of the user, NULL if unknown
+         */
+        const user_entry_t* lookup(const uint8_t *uid, uint8_t uid_len) const;
+        void remove(const uint8_t *uid, uint8_t uid_len);
+
+        uint32_t get_nb_users() const;
+        size_t get_memory() const; // bytes allocated
+};
+
+// Head of the memory of a UserFilter, followed by its bit array
+typedef struct {
+    uint32_t magic; // USER_FILTER_MAGIC
+    uint32_t generation; // of the UserStore list it holds
+    uint32_t nb_bits;
+    uint32_t nb_users; // added since the last clear
+    uint32_t nb_hashes;
+    uint32_t check; // of the fields above, memory kept across a reset can hold anything
+} user_filter_header_t;
+
+typedef struct {
+    uint32_t builds; // times the filter was filled from the list
+    uint32_t checks;
+    uint32_t rejected; // UIDs the filter ruled out
+    uint32_t false_positives; // UIDs the filter let through that the list did not hold
+} user_filter_stats_t;
+
+/**
+ * @brief Bloom filter of the UIDs of the user list, in front of the lookups:
+ *        most unknown badges are rejected after a bit or two, without hashing
+ *        into the table or searching the flash. No false negatives; about 1% of
+ *        unknown UIDs pass with USER_FILTER_BITS_PER_USER bits per user.
+ *
+ * Its memory is allocated, or given with attach(), for instance an
+ * RTC_NOINIT_ATTR buffer: the filter is then kept across deep sleep and is not
+ * rebuilt while is_built() holds for the generation of the list.
+ */
+class UserFilter {
+    private:
+        user_filter_header_t *header = NULL;
+        uint32_t *bits = NULL;
+        size_t memory_size = 0;
+        bool owned = false; // memory allocated by build()
+        mutable user_filter_stats_t stats = {};
+
+        uint32_t header_check() const;
+    public:
+        UserFilter() = default;
+        ~UserFilter();
+        UserFilter(const UserFilter&) = delete;
+        UserFilter& operator=(const UserFilter&) = delete;
+
+        /**
+         * @brief Keep the filter in the `size` bytes at `memory` from now on, a
+         *        filter found there stays valid
+         */
+        void attach(void *memory, size_t size);
+        void release(); // frees allocated memory, attached memory is kept
+
+        /**
+         * @return true if the filter holds the users of the list `generation`
+         */
+        bool is_built(uint32_t generation) const;
+
+        /**
+         * @brief Empty the filter, sized for `nb_users` in allocated memory, or
+         *        taking all the attached memory
+         */
+        void clear(uint32_t nb_users, uint32_t generation);
+        void add(const uint8_t *uid, uint8_t uid_len);
+        void set_generation(uint32_t generation); // after a commit of the users added
+
+        /**
+         * @return false if the user is certainly not in the list
+         */
+        bool may_contain(const uint8_t *uid, uint8_t uid_len) const;
+        void count_false_positive() const; // may_contain() was true for an unknown UID
+
+        bool is_full() const; // more users than bits for USER_FILTER_BITS_PER_USER each
+        bool is_attached() const;
+        uint32_t get_nb_users() const;
+        size_t get_memory() const; // bytes of the bit array and header
+        double get_expected_rate() const; // false positive rate for the users added
+        const user_filter_stats_t& get_stats() const;
+};
+
+/*
+ * User partition: two slots A and B of half the partition each. A slot is a
+ * user_store_header_t, padded to USER_STORE_HEADER_SIZE, then user_record_t
+ * sorted by UID length then UID bytes: a lookup is a binary search of the
+ * mapped slot. An update writes the other slot and its header last, magic
+ * last of all: the slot of the highest generation with a valid header is the
+ * active one, an update cut by a power loss leaves the previous one active.
+ */
+typedef struct {
+    uint32_t generation;
+    uint32_t nb_records;
+    uint32_t version; // of the list on the server, that deltas apply to
+    uint16_t record_size; // sizeof(user_record_t)
+    uint16_t format; // USER_STORE_FORMAT
+    uint32_t magic; // USER_STORE_MAGIC, last field written
+} user_store_header_t;
+
+typedef struct {
+    uint8_t uid_len;
+    uint8_t uid[HISTORY_UID_MAX_SIZE]; // zero padded
+    uint8_t rights;
+    user_policy_t policy;
+} user_record_t;
+
+typedef struct {
+    uint32_t updates; // slots committed
+    uint32_t records_written;
+    uint32_t bytes_written;
+    uint32_t erases;
+    uint32_t lookups;
+    uint32_t lookup_steps; // records compared by the binary searches
+} user_store_stats_t;
+
+/**
+ * @brief Sorted array of fixed-width user records in the user_db partition,
+ *        read in place through the flash cache.
+ *
+ * An update is begin(), append() of the whole new list in order, then
+ * commit(), which switches to it atomically; the list being replaced stays
+ * readable until then.
+ */
+class UserStore {
+    private:
+        const char *_tag = "UserStore";
+        const esp_partition_t *partition = NULL;
+        uint32_t slot_size;
+        uint32_t active = UINT32_MAX; // slot in use, UINT32_MAX when there is none
+        user_store_header_t header; // of the active slot
+        const user_record_t *records = NULL; // mapped records of the active slot
+        spi_flash_mmap_handle_t map_handle;
+
+        // Update being written to the other slot, wb_buffer is NULL outside of one
+        uint8_t *wb_buffer = NULL; // image of the slot sector being filled
+        uint32_t wb_sector;
+        uint32_t wb_len;
+        uint32_t update_nb;
+        uint32_t update_version;
+        user_record_t update_last;
+        mutable user_store_stats_t stats = {};
+
+        bool read_header(uint32_t slot, user_store_header_t *out);
+        void map();
+        void unmap();
+        bool flush_sector();
+    public:
+        UserStore() = default;
+        ~UserStore();
+        UserStore(const UserStore&) = delete;
+        UserStore& operator=(const UserStore&) = delete;
+
+        /**
+         * @brief Find the active slot and map its records
+         */
+        void open();
+        void close();
+
+        /**
+         * @return false if the user is not in the list
+         */
+        bool find(const uint8_t *uid, uint8_t uid_len, user_record_t *out) const;
+
+        /**
+         * @brief Records of the active list, sorted, mapped in the flash cache
+         */
+        const user_record_t* get_records() const;
+        uint32_t get_nb_records() const;
+        uint32_t get_capacity() const; // records a slot holds
+        uint32_t get_generation() const; // 0 before the first commit
+        uint32_t get_version() const; // 0 before the first commit
+
+        /**
+         * @brief Start writing a new list to the inactive slot, an update in
+         *        progress is dropped
+         */
+        void begin();
+
+        /**
+         * @return false if the record is not after the previous one, or the slot is full
+         */
+        bool append(const user_record_t *record);
+        void set_version(uint32_t version); // of the new list, the one in use by default
+
+        /**
+         * @brief Make the new list the active one
+         */
+        bool commit();
+        void abort();
+
+        const user_store_stats_t& get_stats() const;
+};
+
+/**
+ * @brief Users of the user_db partition and their rights, kept in a UserStore.
+ *
+ * open() loads every user in a UserTable, lookups then never touch the flash;
+ * open(false) leaves them in flash and lookups search the mapped partition, for
+ * the lists that do not fit in RAM. Each set() rewrites the whole list: give
+ * it many users at once, or import() them from a stream.
+ *
+ * Both ways, a UserFilter answers first and rejects most unknown UIDs. The
+ * policy of a user comes with its rights in the same entry, check_access()
+ * adds no flash read to get().
+ */
 class UserDB {
     private:
-        nvs_handle_t nvs_handle;
         const char *_tag = "UserDB";
+        UserStore store;
+        UserTable table;
+        UserFilter filter;
+        bool in_ram = false;
+        int32_t utc_offset = 0;
+        user_quota_t quotas[USER_QUOTA_SLOTS] = {};
+
+        bool lookup(const uint8_t *uid, uint8_t uid_len, user_entry_t *out) const;
+        void load_table();
+        void build_filter();
+        esp_err_t update(user_import_t *imports, uint32_t nb, bool replace, uint32_t version);
     public:
-        void open();
+        void open(bool in_ram = true);
         void close();
-        uint8_t get(const char* uid);
-        void set(const char* uid, uint8_t value);
+
+        /**
+         * @brief Keep the filter in `memory` instead of the heap, call it before
+         *        open(); with RTC memory the filter is not rebuilt after deep sleep
+         */
+        void set_filter_memory(void *memory, size_t size);
+
+        /**
+         * @return false if the user is unknown
+         */
+        bool get(const uint8_t *uid, uint8_t uid_len, uint8_t *value) const;
+        bool get(const Uid &uid, uint8_t *value) const;
+
+        /**
+         * @brief Whether the user may pass at `now`: its rights and policy from
+         *        one lookup, checked with integer operations. A granted scan of a
+         *        user with a quota is counted in RAM, in one of USER_QUOTA_SLOTS
+         *        slots: two such users sharing a slot, or a reboot, give back
+         *        the scans of the day.
+         *
+         * @param rights set to the rights of the user when known, may be NULL
+         */
+        user_access_t check_access(const Uid &uid, time_t now, uint8_t *rights = NULL);
+
+        /**
+         * @brief Seconds to add to the RTC time to get the local time of the
+         *        hours, weekdays and days of the quotas, 0 by default
+         */
+        void set_utc_offset(int32_t seconds);
+
+        /**
+         * @brief Add a user, or change its rights, the policy of a user known is kept
+         *
+         * @return false if the list is full
+         */
+        bool set(const uint8_t *uid, uint8_t uid_len, uint8_t value);
+        bool set(const Uid &uid, uint8_t value);
+
+        /**
+         * @brief Add or change many users with a single update of the list: they
+         *        are sorted in RAM, merged with the list and written to the other
+         *        slot, which becomes the active one once complete. With `replace`
+         *        the users not given are removed. The users given get the
+         *        policy of their entry.
+         *
+         *        `version` is the one of the new list, see apply_delta().
+         *
+         * @return false if a UID is invalid or the list is full, the list in use
+         *         is then left as it was
+         */
+        bool set(const user_entry_t *users, uint32_t nb, bool replace = false, uint32_t version = USER_VERSION_KEEP);
+        bool import(user_import_cb_t next, void *arg, bool replace = false,
+                    uint32_t version = USER_VERSION_KEEP); // users read from a stream
+
+        /**
+         * @brief Apply a delta of the user list (see USER_DELTA_*) in one update
+         *
+         * @return ESP_OK when applied, or applied before (a repeated downlink)
+         *         ESP_ERR_INVALID_VERSION if the delta is not for the version of the list
+         *         ESP_ERR_INVALID_ARG if the delta is malformed
+         *         ESP_ERR_INVALID_STATE if its ops do not match the list
+         *         ESP_ERR_NO_MEM if the list is full, ESP_FAIL if it was not written
+         */
+        esp_err_t apply_delta(const uint8_t *delta, size_t len);
+        uint32_t get_version() const; // to report in uplinks
+
+        const UserTable& get_table() const;
+        const UserFilter& get_filter() const;
+        UserStore& get_store();
 };
 
 
+/**
+ * @brief Circular log of scans in the history partition.
+ *
+ * The partition is a ring of 4K sectors followed by the sectors of the daily
+ * summaries (see HistoryRollup), as many as the constructor is given. Each raw sector starts with a
+ * history_sector_header_t followed by variable-size records (see the record
+ * encoding above). Entries are numbered from 0 since the last clear_history();
+ * once the ring is full the oldest sector is overwritten, so valid entries are
+ * [get_oldest_entry(), get_newest_entry()].
+ */
 class ScanHistoryDB {
+    friend class HistoryIterator;
+    friend class HistoryExporter;
+    friend class HistoryRollup;
     private:
         const char *_tag = "ScanHistoryDB";
         const esp_partition_t *partition;
         nvs_handle_t nvs_hist_ctrl;
-        size_t cursor; // sizeof(size_t) = 32 bits
-        size_t block_size; // in bytes
-        size_t uid_size; // = block_size - sizeof(time_t)
+        uint32_t nb_sectors; // of the raw log
+
+        // Ring state, found back at boot
+        uint32_t head_seq; // sector being written, UINT32_MAX when the log is empty
+        uint32_t head_offset; // bytes of the head sector already in flash
+        uint32_t head_first_entry;
+        uint32_t head_base_time;
+        uint32_t head_max_time; // latest timestamp of the log
+        history_dict_t head_dict; // UIDs of the head sector, records refer to them by index
+        uint32_t oldest_seq;
+        uint32_t oldest_entry;
+        uint32_t next_entry;
+        uint32_t erased_ahead = 0; // sectors after the head known to be erased
+
+        // Write-back buffer: bytes to write at head_offset in the head sector
+        uint8_t *wb_buffer;
+        size_t wb_len = 0;
+        size_t wb_limit = HISTORY_PAGE_SIZE; // flush once this many bytes are buffered
+        int64_t wb_first_us = 0; // time the oldest buffered record was added, 0 if none
+        history_stats_t stats = {};
+
+        // Image of the last sector read by get_history(), decoded sequentially
+        uint8_t *rd_buffer;
+        history_reader_t reader;
+
+        // Per-UID counters, open addressing hash table
+        history_usage_t *usage;
+        uint32_t usage_nb = 0;
+        uint32_t usage_entry = 0; // first entry not counted in the last checkpoint
+
+        uint32_t upload_entry = 0; // first entry not acknowledged by the LoRa gateway, saved in NVS
+
+        HistoryRollup *rollup; // summarizes what the raw log drops
+
+        // Whole partition mapped in the flash cache, used by HistoryIterator
+        const uint8_t *mapped = NULL;
+        spi_flash_mmap_handle_t map_handle;
+
+        uint32_t sector_offset(uint32_t seq) const;
+        bool read_sector_header(uint32_t sector, history_sector_header_t *header);
+        uint32_t sector_first_entry(uint32_t seq);
+        bool is_sector_blank(uint32_t sector);
+        void drop_overwritten(uint32_t seq);
+        void start_sector(uint32_t seq, uint32_t base_time);
+        uint32_t sector_max_time(uint32_t seq);
+        uint32_t find_entry_by_time(uint32_t timestamp);
+        bool load_sector(uint32_t seq);
+        void refresh_head();
+        uint32_t find_sector(uint32_t entry);
+        size_t decode_next(history_entry_t *out);
+        bool read_next(history_entry_t *out);
+        bool seek(uint32_t entry);
+        const uint8_t* map_partition();
+        history_usage_t* usage_slot(const uint8_t *uid, uint8_t uid_len);
+        void count_usage(const uint8_t *uid, uint8_t uid_len, uint32_t timestamp);
+        void load_usage();
+
+        /**
+         * @brief Find head and oldest sectors with O(log n) partition reads,
+         *        then decode the head sector to find its end. If a flush was cut
+         *        the head sector is closed: the next record starts a new sector.
+         */
+        void recover();
     public:
-        ScanHistoryDB(size_t uid_size=4);
+        /**
+         * @param rollup_sectors sectors of the daily summaries, taken from the
+         *        raw log (see HISTORY_ROLLUP_SECTORS). Saved with the log: a
+         *        different split at boot clears it.
+         */
+        explicit ScanHistoryDB(uint32_t rollup_sectors = HISTORY_ROLLUP_SECTORS);
+        ~ScanHistoryDB();
+        ScanHistoryDB(const ScanHistoryDB&) = delete;
+        ScanHistoryDB& operator=(const ScanHistoryDB&) = delete;
         void close();
         void clear_history();
-        size_t get_block_size();
-        size_t get_uid_size() const;
         size_t get_cursor();
-        void update_cursor(size_t offset);
         uint32_t get_nb_entries() const;
-        void add_history(const char* uid, const time_t timestamp);
-        void get_history(const uint32_t entry, char *uid, time_t *time_stamp);
+        uint32_t get_oldest_entry() const;
+        uint32_t get_newest_entry() const; // only meaningful if get_nb_entries() > 0
+        void add_history(const uint8_t* uid, uint8_t uid_len, const time_t timestamp);
+        void add_history(const Uid &uid, const time_t timestamp);
+
+        /**
+         * @return false if the entry is not in the log
+         */
+        bool get_history(const uint32_t entry, Uid *uid, time_t *time_stamp);
+
+        /**
+         * @brief Read an entry, uid must hold HISTORY_UID_MAX_SIZE bytes
+         *
+         * @return false if the entry is not in the log
+         */
+        bool get_history(const uint32_t entry, uint8_t *uid, uint8_t *uid_len, time_t *time_stamp);
+
+        /**
+         * @brief Read up to `count` consecutive entries from `first`, one partition
+         *        read per sector
+         *
+         * @return number of entries written to out
+         */
+        uint32_t get_history_range(uint32_t first, uint32_t count, history_entry_t *out);
+
+        /**
+         * @brief Find the entries scanned in [from, to[ by binary search on the
+         *        sector headers, only the two boundary sectors are decoded.
+         *        Read them with get_history_range() or a HistoryIterator.
+         *
+         *        Exact as long as the clock only goes forward: records stamped
+         *        before a clock set back may fall in [first, end[ out of the window.
+         *
+         * @param first first entry with a timestamp >= from
+         * @param end first entry with a timestamp >= to, get_newest_entry() + 1 if none
+         * @return false if no entry was scanned in the window
+         */
+        bool get_time_range(time_t from, time_t to, uint32_t *first, uint32_t *end);
+
+        /**
+         * @brief Number of scans of a UID since the last clear_history(), kept
+         *        up to date by add_history, including entries overwritten in the ring
+         *
+         * @return false if the UID was never scanned
+         */
+        bool get_usage(const uint8_t *uid, uint8_t uid_len, uint32_t *count, time_t *last_seen);
+        bool get_usage(const Uid &uid, uint32_t *count, time_t *last_seen);
+
+        /**
+         * @brief Save the per-UID counters to NVS once HISTORY_USAGE_CHECKPOINT
+         *        scans were added since the last save, or always if `force`.
+         *        At boot only the records after the last save are counted again.
+         *
+         * @return true if the counters were saved
+         */
+        bool checkpoint_usage(bool force=false);
+
+        /**
+         * @brief First entry not acknowledged yet, entries before it are never uploaded again
+         */
+        uint32_t get_upload_entry() const;
+
+        /**
+         * @brief Pack the next records not acknowledged yet into `buffer` (see the
+         *        upload batch format above). The watermark does not move: call
+         *        ack_upload(*end_entry) once the gateway confirmed the batch,
+         *        otherwise the same records come again in the next batch.
+         *        Records still in the write-back buffer are flushed first.
+         *
+         * @param end_entry first entry not in the batch
+         * @return number of bytes written, 0 if every record was acknowledged
+         */
+        size_t get_upload_batch(uint8_t *buffer, size_t size, uint32_t *end_entry);
+
+        /**
+         * @brief Move the watermark to `end_entry` and save it in NVS
+         */
+        void ack_upload(uint32_t end_entry);
         void print_all_history();
-};
 
+        /**
+         * @brief Write buffered records to flash
+         */
+        void flush();
+
+        /**
+         * @brief Flush if the oldest buffered record is older than HISTORY_FLUSH_PERIOD_MS
+         *
+         * @return true if a flush happened
+         */
+        bool flush_if_due();
 
+        /**
+         * @brief Erase one sector in front of the write head, dropping the oldest
+         *        entries once the ring is full. Call it outside of the scan path
+         *        (before light sleep) so that add_history never waits on an erase.
+         *
+         * @return true while less than HISTORY_ERASE_AHEAD sectors are ready
+         */
+        bool erase_ahead();
 
+        /**
+         * @brief Summarize the oldest day of the raw log into the rollup region
+         *        when its sectors are about to be overwritten (see
+         *        HistoryRollup::compact). Call it outside of the scan path:
+         *        `while (compact());`
+         *
+         * @return true if a block of summaries was written
+         */
+        bool compact();
 
+        /**
+         * @brief Daily per-UID summaries, of the days older than the raw log too
+         */
+        HistoryRollup& get_rollup();
 
+        /**
+         * @brief Set the size in bytes of a write-back batch.
+         *        HISTORY_RECORD_MAX_SIZE writes every record on its own, default is HISTORY_PAGE_SIZE.
+         */
+        void set_batch_size(size_t bytes);
+        const history_stats_t& get_stats() const;
+};
+
+
+/**
+ * @brief Walk the history records in place, from the partition mapped in the
+ *        flash cache: no sector is copied to RAM.
+ *
+ * Pending records are flushed when the iterator is created and records added
+ * afterwards are not returned. Do not call erase_ahead() or clear_history()
+ * while iterating.
+ */
+class HistoryIterator {
+    private:
+        ScanHistoryDB &db;
+        const uint8_t *sector = NULL; // mapped sector being decoded, NULL at the end
+        history_reader_t state;
+        uint32_t end_entry;
+        bool load(uint32_t seq);
+    public:
+        HistoryIterator(ScanHistoryDB &db, uint32_t first_entry);
 
+        /**
+         * @return false once every entry up to the newest one has been returned
+         */
+        bool next(history_entry_t *out);
+};
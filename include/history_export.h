@@ -0,0 +1,130 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include "database.h"
+
+#define HISTORY_EXPORT_MAGIC "JHX" // followed by HISTORY_EXPORT_VERSION
+#define HISTORY_EXPORT_VERSION 1
+#define HISTORY_EXPORT_CHUNK 256 // default size of the chunks given to the callback
+#define HISTORY_EXPORT_WINDOW 2048 // bytes a match can look back, at most HISTORY_EXPORT_MAX_OFFSET
+#define HISTORY_EXPORT_MAX_OFFSET 4096
+#define HISTORY_EXPORT_BLOCK 2048 // record bytes compressed at once, a block is stored as is if it does not shrink
+#define HISTORY_EXPORT_MIN_MATCH 3
+#define HISTORY_EXPORT_MAX_MATCH 18
+#define HISTORY_EXPORT_HASH_SIZE 1024 // a power of 2
+#define HISTORY_EXPORT_TAG_SLOT (HISTORY_UID_MAX_SIZE + 1) // first record tag referring to a UID slot
+#define HISTORY_EXPORT_UIDS (256 - HISTORY_EXPORT_TAG_SLOT) // UIDs the stream refers to by slot
+
+/*
+ * Export stream:
+ *   "JHX" [version] [varint first entry] then blocks of records
+ * Block: [16-bit little endian header][payload], the header is the payload length,
+ * with bit 15 set if the payload is LZ-compressed, clear if it holds the bytes as is.
+ * Records, in entry order from the first one:
+ *   [UID length][UID bytes][varint dt]            UID not in the table, it replaces a slot
+ *   [HISTORY_EXPORT_TAG_SLOT + slot][varint dt]   UID in slot of the table
+ * dt is the zigzag varint of the timestamp minus the one of the previous record
+ * (0 before the first). The UID table has HISTORY_EXPORT_UIDS slots, empty at
+ * the start of the stream. A new UID goes in the slot under the clock hand,
+ * skipping (and clearing the flag of) slots referred to since the hand last
+ * passed: frequent badges stay in the table. The decoder replays the same
+ * replacement.
+ * Compression is LZSS: a flag byte announces the next 8 items, lowest bit
+ * first, 0 for a literal byte, 1 for a 2-byte match
+ *   [offset - 1, low 8 bits][(offset - 1) >> 8 << 4 | (length - 3)]
+ * copying `length` bytes from `offset` bytes back, possibly from previous
+ * blocks. The last flag byte of a block may announce less than 8 items.
+ */
+
+// UID table of the export stream, see above
+typedef struct {
+    uint8_t len[HISTORY_EXPORT_UIDS]; // 0 for an empty slot
+    uint8_t uid[HISTORY_EXPORT_UIDS][HISTORY_UID_MAX_SIZE];
+    uint8_t referred[HISTORY_EXPORT_UIDS];
+    uint8_t hand;
+} history_export_uids_t;
+
+typedef struct {
+    uint32_t entries;
+    uint32_t flash_bytes; // bytes of the sectors holding the exported entries
+    uint32_t record_bytes; // records after the delta/varint transform
+    uint32_t stream_bytes; // bytes given to the callback, header included
+    uint32_t uid_hits; // records with a UID from the table
+    uint32_t matches;
+    uint32_t blocks;
+    uint32_t stored_blocks; // blocks that did not shrink
+    uint32_t chunks;
+} history_export_stats_t;
+
+/**
+ * @brief Called with each chunk of the stream, `len` is the chunk size except for the last one
+ *
+ * @return false to stop the export (link down)
+ */
+typedef bool (*history_export_cb_t)(const uint8_t *chunk, size_t len, void *arg);
+
+
+/**
+ * @brief Stream the history out, compressed, for a UART service dump or an uplink.
+ *
+ * Records are read in place from the mapped partition (see HistoryIterator) and
+ * go through a compressor with a HISTORY_EXPORT_WINDOW window: the whole export
+ * needs about 2 * HISTORY_EXPORT_WINDOW + 2 * HISTORY_EXPORT_HASH_SIZE
+ * + 9/8 * HISTORY_EXPORT_BLOCK + sizeof(history_export_uids_t) + chunk_size
+ * bytes of RAM (12 KB), whatever the size of the log.
+ */
+class HistoryExporter {
+    private:
+        const char *_tag = "HistoryExporter";
+        ScanHistoryDB &db;
+        size_t chunk_size;
+        uint8_t *chunk;
+        size_t chunk_len = 0;
+        uint8_t *window; // HISTORY_EXPORT_WINDOW bytes of history, then up to a block and a match to compress
+        uint8_t *block; // header and payload of the block being compressed
+        uint16_t *hash_head; // last position of each 3-byte hash in window, UINT16_MAX if none
+        history_export_uids_t *uids;
+        uint32_t window_len = 0;
+        uint32_t window_pos = 0; // first byte not compressed yet
+        size_t block_len = 0;
+        size_t group_flags = 0; // position of the flag byte in block
+        uint8_t group_items = 0;
+        history_export_cb_t callback = NULL;
+        void *callback_arg = NULL;
+        bool stopped = false;
+        history_export_stats_t stats = {};
+
+        void emit(const uint8_t *data, size_t len);
+        void compress_block(uint32_t end);
+        void feed(const uint8_t *data, size_t len);
+        void finish();
+    public:
+        /**
+         * @brief Find a UID in the table, or put it in the slot under the clock
+         *        hand. The decoder replays it to rebuild the table.
+         *
+         * @param slot slot of the UID
+         * @return true if the UID was in the table
+         */
+        static bool update_uids(history_export_uids_t *uids, const uint8_t *uid, uint8_t uid_len, uint8_t *slot);
+
+        HistoryExporter(ScanHistoryDB &db, size_t chunk_size=HISTORY_EXPORT_CHUNK);
+        ~HistoryExporter();
+        HistoryExporter(const HistoryExporter&) = delete;
+        HistoryExporter& operator=(const HistoryExporter&) = delete;
+
+        /**
+         * @brief Export the entries from `first_entry` to the newest one, pending
+         *        records are flushed first. Do not call erase_ahead() or
+         *        clear_history() meanwhile.
+         *
+         * @return false if the callback stopped the export
+         */
+        bool run(uint32_t first_entry, history_export_cb_t callback, void *arg);
+
+        /**
+         * @brief Counters of the last run, the compression ratio is
+         *        stream_bytes / flash_bytes
+         */
+        const history_export_stats_t& get_stats() const;
+};
@@ -0,0 +1,170 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <time.h>
+#include "database.h"
+
+#define HISTORY_ROLLUP_LEAD 4 // raw sectors summarized ahead of being overwritten
+#define HISTORY_ROLLUP_MAGIC 0x4C52484A // "JHRL"
+#define HISTORY_ROLLUP_UIDS 512 // distinct UIDs summarized at once, a busier day takes several blocks
+#define HISTORY_ROLLUP_TAG_SLOT (HISTORY_UID_MAX_SIZE + 1) // first summary tag referring to the sector dictionary
+#define HISTORY_ROLLUP_TAG_BLOCK 0xFE
+#define HISTORY_ROLLUP_DICT_SIZE (HISTORY_ROLLUP_TAG_BLOCK - HISTORY_ROLLUP_TAG_SLOT)
+#define HISTORY_ROLLUP_INDEX_SIZE 1024 // hash index of the table being filled, a power of 2 above 2 * HISTORY_ROLLUP_UIDS
+#define HISTORY_ROLLUP_BLOCK_HEADER (3 + 5 + 5 + 1) // tag, length, day, end entry and crc at most
+#define SECONDS_PER_DAY 86400
+
+/*
+ * Rollup region: a ring of nb_sectors sectors at the end of the
+ * history partition, each starting with a history_rollup_header_t followed by
+ * day blocks, 0xFF after the last one.
+ * Block:
+ *   [HISTORY_ROLLUP_TAG_BLOCK][16-bit little endian payload length][varint day][varint end entry][payload][crc]
+ * day counts days since the epoch (UTC), end entry is the first raw entry not
+ * summarized yet, crc is the CRC-8 of the block. The block is written with its
+ * tag left erased, then committed by programming the tag: a cut block closes
+ * the sector, as a cut flush does in the raw log.
+ * Payload, one summary per UID scanned that day, by first scan time:
+ *   [UID length][UID bytes][varint count][varint dfirst][varint span]     the UID joins the sector dictionary
+ *   [HISTORY_ROLLUP_TAG_SLOT + i][varint count][varint dfirst][varint span]  UID is entry i of the dictionary
+ * dfirst is the minute of the day of the first scan minus the one of the
+ * previous summary (0 before the first), span is the number of minutes from the
+ * first to the last scan.
+ * A block holds at most HISTORY_ROLLUP_UIDS summaries and always fits in an
+ * empty sector, several blocks of the same day add up.
+ */
+
+typedef struct {
+    uint32_t seq; // the sector index in the rollup region is seq % nb_sectors
+    uint32_t first_day; // day of the first block
+    uint32_t magic; // HISTORY_ROLLUP_MAGIC
+} history_rollup_header_t;
+
+typedef struct {
+    uint8_t nb_uids;
+    uint8_t len[HISTORY_ROLLUP_DICT_SIZE];
+    uint8_t uid[HISTORY_ROLLUP_DICT_SIZE][HISTORY_UID_MAX_SIZE];
+} history_rollup_dict_t;
+
+// Scans of one UID during one day, times have a minute resolution
+typedef struct {
+    uint32_t day;
+    uint32_t first_seen;
+    uint32_t last_seen;
+    uint32_t count;
+    uint8_t uid_len;
+    uint8_t uid[HISTORY_UID_MAX_SIZE];
+} history_daily_t;
+
+typedef struct {
+    uint32_t blocks;
+    uint32_t entries; // raw records summarized
+    uint32_t summaries;
+    uint32_t bytes_written;
+    uint32_t erases;
+    uint32_t forced; // blocks written because a raw sector was about to be overwritten
+    uint32_t lost_entries; // raw records overwritten before being summarized
+    uint32_t torn_blocks; // head sectors closed at boot because a block was cut
+} history_rollup_stats_t;
+
+
+/**
+ * @brief Daily per-UID summaries of the scans older than the raw log.
+ *
+ * compact() turns the raw records of the oldest day into one summary per UID
+ * (count, first and last scan), written to the rollup region, once the raw log
+ * is about to overwrite them: the raw log keeps every scan of the recent days,
+ * the summaries go on far beyond. Owned by ScanHistoryDB, which summarizes what
+ * is left of a raw sector before overwriting it, so no day is lost even if
+ * compact() is never called.
+ */
+class HistoryRollup {
+    private:
+        const char *_tag = "HistoryRollup";
+        ScanHistoryDB &db;
+        uint32_t region_offset; // first byte of the rollup region in the partition
+        uint32_t nb_sectors; // of the rollup region
+
+        // Ring state, found back at boot
+        uint32_t head_seq; // sector being written, UINT32_MAX when the region is empty
+        uint32_t head_offset; // bytes of the head sector written
+        uint32_t oldest_seq;
+        uint32_t rollup_entry = 0; // first raw entry not summarized
+        history_rollup_dict_t *head_dict;
+
+        // Summaries of the day being compacted, with a hash index of entry + 1,
+        // 0 for a free slot. Only allocated during summarize().
+        history_daily_t *table = NULL;
+        uint16_t *index = NULL;
+        uint32_t table_nb = 0;
+        size_t table_bytes = 0; // size of the block encoding the table in an empty sector, at most
+        uint8_t *block; // sector header and block being encoded, or sector being decoded
+        history_rollup_stats_t stats = {};
+
+        uint32_t sector_offset(uint32_t seq) const;
+        bool read_header(uint32_t seq, history_rollup_header_t *header);
+        bool load(uint32_t seq);
+        history_daily_t* table_slot(const uint8_t *uid, uint8_t uid_len);
+        size_t encode_block(uint8_t *out, uint32_t day, uint32_t end_entry);
+        void write_block(uint32_t day, uint32_t end_entry);
+        void skip_lost();
+        uint32_t due_entry();
+        void summarize();
+    public:
+        HistoryRollup(ScanHistoryDB &db, uint32_t region_offset, uint32_t nb_sectors);
+        ~HistoryRollup();
+        HistoryRollup(const HistoryRollup&) = delete;
+        HistoryRollup& operator=(const HistoryRollup&) = delete;
+
+        /**
+         * @brief Find the head of the region and the first raw entry not
+         *        summarized, from the last block. Called by ScanHistoryDB at boot.
+         */
+        void recover();
+
+        /**
+         * @brief Forget every summary, the region must be erased
+         */
+        void reset();
+
+        /**
+         * @brief Summarize the oldest raw records up to the end of their day,
+         *        or to HISTORY_ROLLUP_UIDS distinct UIDs, if they are in the
+         *        raw sectors overwritten by the next HISTORY_ROLLUP_LEAD
+         *        sectors. Call it outside of the scan path: `while (compact());`
+         *
+         * @return true if a block was written
+         */
+        bool compact();
+
+        /**
+         * @brief Summarize the raw records up to `entry` (excluded) now
+         */
+        void cover(uint32_t entry);
+
+        /**
+         * @brief First raw entry not summarized, raw records before it are also in the rollup region
+         */
+        uint32_t get_rollup_entry() const;
+
+        /**
+         * @brief Days held by the summaries and the raw log, exact as long as
+         *        the clock only goes forward
+         *
+         * @return false if the history is empty
+         */
+        bool get_days(uint32_t *first_day, uint32_t *last_day);
+
+        /**
+         * @brief Summaries of a day, from the blocks of the day and the raw
+         *        records not summarized yet. Only the sectors that may hold the
+         *        day are read.
+         *
+         * @return number of UIDs written to out, at most max
+         */
+        uint32_t get_day(uint32_t day, history_daily_t *out, uint32_t max);
+
+        uint32_t get_nb_sectors() const {return nb_sectors;}
+
+        const history_rollup_stats_t& get_stats() const;
+};
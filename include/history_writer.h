@@ -0,0 +1,105 @@
+#pragma once
+#include <stdint.h>
+#include <time.h>
+#include "esp_err.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+#include "database.h"
+
+#define HISTORY_QUEUE_LEN 32 // scans waiting for the writer task, more are dropped
+#define HISTORY_WRITER_BATCH 16 // scans added per lock of the database
+#define HISTORY_WRITER_STACK 4096
+#define HISTORY_EVENT_SYNC 0xFF // uid_len of the event asking for the idle work
+
+typedef struct {
+    uint32_t timestamp; // number of the request for a sync
+    uint8_t uid_len; // HISTORY_EVENT_SYNC for a sync request
+    uint8_t uid[HISTORY_UID_MAX_SIZE];
+} history_event_t;
+
+typedef struct {
+    uint32_t posted;
+    uint32_t dropped; // queue full when posting
+    uint32_t written; // scans given to add_history
+    uint32_t batches;
+    uint32_t syncs;
+    uint32_t max_depth; // highest number of scans seen waiting in the queue
+} history_writer_stats_t;
+
+
+/**
+ * @brief Background task owning a ScanHistoryDB, fed by a FreeRTOS queue.
+ *
+ * Any task or ISR posts scans without waiting: the scan path never does flash
+ * I/O, the writer task adds the scans to the log in batches. When the queue is
+ * full the scan is dropped and counted. Other users of the database (upload,
+ * queries) take it with acquire()/release() so they never run during a batch.
+ */
+class HistoryWriter {
+    private:
+        const char *_tag = "HistoryWriter";
+        ScanHistoryDB &db;
+        QueueHandle_t queue;
+        SemaphoreHandle_t db_lock;
+        SemaphoreHandle_t synced; // given once a sync request is done
+        uint32_t sync_requested = 0; // number of the last sync request, under stats_mux
+        uint32_t sync_done = 0; // number of the last sync request done, under stats_mux
+        TaskHandle_t task = NULL;
+        history_writer_stats_t stats = {};
+        portMUX_TYPE stats_mux = portMUX_INITIALIZER_UNLOCKED;
+
+        static void task_main(void *arg);
+        void run();
+        void count_post(bool queued, UBaseType_t depth);
+    public:
+        HistoryWriter(ScanHistoryDB &db, size_t queue_len=HISTORY_QUEUE_LEN);
+        ~HistoryWriter();
+        HistoryWriter(const HistoryWriter&) = delete;
+        HistoryWriter& operator=(const HistoryWriter&) = delete;
+
+        /**
+         * @brief Create the writer task, only it touches the database afterwards
+         */
+        esp_err_t start(UBaseType_t priority, BaseType_t core);
+
+        /**
+         * @brief Queue a scan, never blocks
+         *
+         * @return false if the queue was full and the scan dropped
+         */
+        bool post(const uint8_t *uid, uint8_t uid_len, time_t timestamp);
+        bool post(const Uid &uid, time_t timestamp);
+
+        /**
+         * @brief Same as post(), from an interrupt handler
+         *
+         * @param woken set to pdTRUE if the writer task should run on ISR exit (portYIELD_FROM_ISR)
+         */
+        bool post_from_isr(const uint8_t *uid, uint8_t uid_len, time_t timestamp, BaseType_t *woken);
+        bool post_from_isr(const Uid &uid, time_t timestamp, BaseType_t *woken);
+
+        /**
+         * @brief Wait until the scans posted before are written, then have the
+         *        writer flush, summarize the closed days, erase ahead and save
+         *        the usage counters.
+         *        Call it before light sleep.
+         *
+         * @return false on timeout, the writer still does the work later
+         */
+        bool sync(TickType_t timeout);
+
+        /**
+         * @brief Take the database from the writer task, for reads or uploads.
+         *        Scans keep being queued meanwhile.
+         */
+        ScanHistoryDB& acquire();
+        void release();
+
+        /**
+         * @brief Scans waiting in the queue
+         */
+        uint32_t get_depth() const;
+        history_writer_stats_t get_stats();
+};
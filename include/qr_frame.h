@@ -0,0 +1,82 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+
+#define QR_FRAME_BASE_SIZE 240 // frames this size are read at every pixel, larger ones at every n-th
+#define QR_FRAME_EDGE_STEP 8 // rows between two rows of the edge pass
+#define QR_FRAME_ROW_STEP 4 // rows between two rows of the finder pass
+#define QR_FRAME_HIST_STEP 4 // rows and columns between two pixels of the histogram
+#define QR_FRAME_MAX_FINDERS 32 // finder patterns kept for the region of interest
+#define QR_ROI_MARGIN 7 // modules around the finder centers: 3.5 to the corner, rotated, and the quiet zone
+#define QR_ROI_ALIGN 8 // pixels the region is aligned to
+
+typedef struct {
+    uint16_t x; // center of the finder pattern on its row, pixels
+    uint16_t y;
+    uint16_t size; // its 7 modules on the row, pixels
+} qr_finder_t;
+
+typedef struct {
+    uint8_t low; // 1st percentile of luma
+    uint8_t high; // 99th percentile of luma
+    uint16_t sharpness; // 256 / width of the edges in pixels: 256 for a step, low when blurred, 0 without edges
+    uint32_t finders; // dark, light, dark, light, dark runs in 1:1:3:1:1 on the rows measured and down their center
+    qr_finder_t found[QR_FRAME_MAX_FINDERS]; // the first ones, top to bottom
+} qr_frame_quality_t;
+
+/**
+ * @brief Thresholds a frame must reach to go to the decoder, 0 does not check
+ */
+typedef struct {
+    uint8_t min_contrast; // high - low, below the frame is flat, dark or blown out
+    uint16_t min_sharpness;
+    uint32_t min_finders; // a code in view crosses a row per finder pattern and module
+} qr_gate_t;
+
+#define QR_GATE_DEFAULT {32, 44, 2}
+#define QR_GATE_OFF {0, 0, 0}
+
+typedef struct {
+    uint16_t x;
+    uint16_t y;
+    uint16_t width;
+    uint16_t height;
+} qr_roi_t;
+
+/**
+ * @brief Measure what a decoder needs on a grayscale frame: contrast from a
+ *        pixel out of 16, sharpness from a row out of QR_FRAME_EDGE_STEP, then
+ *        finder patterns from a row out of QR_FRAME_ROW_STEP. A frame larger
+ *        than QR_FRAME_BASE_SIZE is read at every n-th pixel of every n-th
+ *        row, the cost does not grow with the sensor resolution.
+ *
+ * @param gate if given, stop at the first threshold the frame misses, the
+ *             next fields left 0
+ */
+void qr_frame_measure(const uint8_t *image, uint32_t width, uint32_t height, qr_frame_quality_t *quality,
+                      const qr_gate_t *gate=NULL);
+
+/**
+ * @return false if the frame cannot hold a decodable code
+ */
+bool qr_frame_gate(const qr_frame_quality_t *quality, const qr_gate_t *gate);
+
+/**
+ * @brief Region of the code from the finder patterns measured: the square
+ *        their centers make, completed to 4 corners, plus QR_ROI_MARGIN modules
+ *
+ * @return false without 3 finder patterns of a size, decode the whole frame
+ */
+bool qr_frame_roi(const qr_frame_quality_t *quality, uint32_t width, uint32_t height, qr_roi_t *roi);
+
+/**
+ * @brief Copy the region of a frame `width` pixels wide to `out`, roi->width
+ *        pixels a row. `out` may be the frame itself, cropped in place.
+ */
+void qr_frame_crop(const uint8_t *image, uint32_t width, const qr_roi_t *roi, uint8_t *out);
+
+/**
+ * @brief Mean of each 2x2 block of a frame to `out`, width / 2 pixels a row.
+ *        `out` may be the frame itself, downsampled in place.
+ */
+void qr_frame_downsample(const uint8_t *image, uint32_t width, uint32_t height, uint8_t *out);
@@ -0,0 +1,130 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include "esp_err.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+#include "camera.h"
+#include "code_scanner.h"
+#include "qr_frame.h"
+#include "qr_strategy.h"
+
+#define QR_PIPELINE_QUEUE_LEN 1 // frames captured ahead of the decoder
+#define QR_PIPELINE_DATA_SIZE 128 // chars kept of the code found, terminating zero included
+#define QR_PIPELINE_POLL_MS 50 // longest wait of a task before it sees a stop()
+#define QR_CAMERA_STACK 3072
+#define QR_DECODER_STACK (32 * 1024)
+
+typedef struct {
+    uint32_t captured; // frames taken from the camera
+    uint32_t scanned; // frames through the decoder
+    uint32_t gated; // frames the quality gate kept from the decoder
+    int64_t gate_us; // time spent measuring the frames for the gate
+    uint32_t cropped; // frames scanned on the region of the code only
+    uint64_t scanned_pixels; // pixels through the decoder
+    uint64_t frame_pixels; // pixels of the frames scanned, uncropped
+    uint32_t skipped; // frames given back unscanned once the code was found
+    int64_t scan_us; // time the decoder spent scanning
+    int64_t first_code_us; // from start() to the code found, -1 if none
+    qr_level_t code_level; // level the code was found at
+    int64_t elapsed_us; // from start() to stop()
+    uint32_t decoder_stack_free; // lowest free stack of the decoder task, bytes
+} qr_pipeline_stats_t;
+
+/**
+ * @brief QR scan on two cores: a camera task takes the frames from the driver
+ *        and queues them, a decoder task scans them with one CodeScanner. With
+ *        CAMERA_FB_COUNT buffers the next frame is captured while the current
+ *        one is decoded. The queue is bounded: the camera task waits while the
+ *        decoder is behind, so it never holds more frames than the driver has.
+ *
+ * The tasks run from start() to stop(), once per scan attempt. Every frame
+ * goes back to the driver, whether it was scanned or not. Frames that cannot
+ * hold a decodable code (flat, blurred, no finder pattern) are measured by
+ * qr_frame_measure and skipped before the decoder. On the others, the region
+ * the finder patterns mark is cropped in place, in the frame buffer, and only
+ * it is decoded: the decode time follows the size of the code, not the frame.
+ * A crop without code has the next frame decoded whole.
+ *
+ * Each frame is decoded at the level of resolution QrScanStrategy gives:
+ * downsampled 2x2 first, then as captured after misses.
+ */
+class QrPipeline {
+    private:
+        const char *_tag = "QrPipeline";
+        QueueHandle_t frames; // camera_fb_t* waiting for the decoder
+        SemaphoreHandle_t found; // given when a code is found
+        SemaphoreHandle_t stopped; // given by each task as it exits
+        TaskHandle_t camera_task = NULL;
+        TaskHandle_t decoder_task = NULL;
+        volatile bool running = false;
+        volatile bool code_found = false;
+        char data[QR_PIPELINE_DATA_SIZE];
+        qr_gate_t gate = QR_GATE_DEFAULT;
+        bool crop = true;
+        bool adaptive = true;
+        QrScanStrategy strategy;
+        int64_t start_us = 0;
+        qr_pipeline_stats_t stats = {};
+
+        static void camera_main(void *arg);
+        static void decoder_main(void *arg);
+        void capture();
+        void decode();
+        void drain();
+    public:
+        QrPipeline();
+        ~QrPipeline();
+        QrPipeline(const QrPipeline&) = delete;
+        QrPipeline& operator=(const QrPipeline&) = delete;
+
+        /**
+         * @brief Start the camera and decoder tasks, the camera must be initialized
+         */
+        esp_err_t start(BaseType_t camera_core=1, BaseType_t decoder_core=0, UBaseType_t priority=5);
+
+        /**
+         * @brief Wait for the first code found since start()
+         *
+         * @param data its data, truncated to size - 1 chars
+         * @return false on timeout
+         */
+        bool wait(char *data, size_t size, TickType_t timeout);
+
+        /**
+         * @brief Stop both tasks and give the frames still queued back to the camera
+         */
+        void stop();
+
+        bool is_running() const {return running;}
+
+        /**
+         * @brief Thresholds of the quality gate, QR_GATE_OFF scans every frame.
+         *        Ignored while running.
+         */
+        void set_gate(const qr_gate_t &gate);
+
+        /**
+         * @brief Decode the region of the code only when the finder patterns
+         *        mark one, or always the whole frame. Ignored while running.
+         */
+        void set_crop(bool crop);
+
+        /**
+         * @brief Decode at the level QrScanStrategy learned and go up after
+         *        misses, or always at QR_LEVEL_FULL. Ignored while running.
+         */
+        void set_adaptive(bool adaptive);
+
+        /**
+         * @brief Levels tried and codes found at each, over all the attempts
+         */
+        const QrScanStrategy& get_strategy() const {return strategy;}
+
+        /**
+         * @brief Stats of the last attempt, complete after stop()
+         */
+        const qr_pipeline_stats_t& get_stats() const {return stats;}
+};
@@ -0,0 +1,70 @@
+#pragma once
+#include <stdint.h>
+
+#define QR_STRATEGY_MISSES 2 // frames decoded without code at a level before the next one
+#define QR_STRATEGY_EXPLORE 8 // one attempt out of 8 starts from the lowest level
+#define QR_STRATEGY_HISTORY 32 // attempts counted per level, older ones weigh half
+#define QR_STRATEGY_MIN_RATE 50 // percent of the attempts a level must find the code in to start from it
+
+typedef enum {
+    QR_LEVEL_HALF, // the frame downsampled 2x2, close and large codes
+    QR_LEVEL_FULL, // the frame as the sensor gives it, far and small codes
+    QR_LEVELS
+} qr_level_t;
+
+typedef struct {
+    uint32_t attempts;
+    uint32_t tries[QR_LEVELS]; // attempts that decoded a frame at the level
+    uint32_t codes[QR_LEVELS]; // attempts that found their code at the level
+    uint32_t frames[QR_LEVELS]; // frames decoded at the level
+    uint32_t escalations;
+} qr_strategy_stats_t;
+
+/**
+ * @brief Level of resolution each frame of a scan attempt is decoded at: an
+ *        attempt starts from the level that finds the codes at this
+ *        installation, the lowest one that does it in QR_STRATEGY_MIN_RATE
+ *        percent of the attempts, and goes up a level after
+ *        QR_STRATEGY_MISSES frames decoded without code. One attempt out of
+ *        QR_STRATEGY_EXPLORE starts from the lowest level, so a lower level
+ *        that starts to work is learned again.
+ *
+ * The counts live as long as the object: across the attempts, not across a
+ * reboot. Not thread safe.
+ */
+class QrScanStrategy {
+    private:
+        qr_level_t top;
+        qr_level_t current = QR_LEVEL_HALF;
+        uint32_t misses = 0;
+        bool found = false;
+        bool tried[QR_LEVELS] = {};
+        qr_strategy_stats_t stats = {};
+
+        void enter(qr_level_t level);
+    public:
+        /**
+         * @param top highest level available
+         */
+        explicit QrScanStrategy(qr_level_t top=QR_LEVEL_FULL);
+
+        /**
+         * @brief Start an attempt at the level learned, or at the lowest one
+         */
+        void begin();
+
+        qr_level_t level() const {return current;}
+
+        /**
+         * @brief A frame decoded at `level`. A miss on a frame of a level below
+         *        the current one, captured before it went up, does not count.
+         */
+        void report(qr_level_t level, bool decoded);
+
+        /**
+         * @brief Level the attempts start from
+         */
+        qr_level_t learned() const;
+
+        const qr_strategy_stats_t& get_stats() const {return stats;}
+};
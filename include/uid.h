@@ -0,0 +1,58 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+#define UID_MAX_SIZE 10 // MIFARE triple size UID
+#define UID_HEX_SIZE (2 * UID_MAX_SIZE + 1) // chars of to_hex(), with the terminating zero
+
+/**
+ * @brief FNV-1a of the UID bytes, the hash of the user table and filter
+ */
+uint32_t uid_hash(const uint8_t *uid, uint8_t uid_len);
+
+/**
+ * @brief UID of a badge as the reader gives it: its length and raw bytes, any
+ *        byte value included. The bytes past the length stay zero, so a Uid
+ *        copies, compares and hashes as a plain value. It goes from the reader
+ *        to the lookup and to the log as is; hex text is only for logs and for
+ *        UIDs given as text (QR codes, tools).
+ */
+class Uid {
+    private:
+        uint8_t len = 0;
+        uint8_t bytes[UID_MAX_SIZE] = {};
+    public:
+        Uid() {}
+
+        /**
+         * @brief Empty if uid_len is 0 or above UID_MAX_SIZE
+         */
+        Uid(const uint8_t *uid, uint8_t uid_len);
+
+        /**
+         * @brief Parse a UID given as hex text, 2 digits per byte
+         *
+         * @return false if `hex` is not 1 to UID_MAX_SIZE bytes of hex digits
+         */
+        static bool from_hex(const char *hex, Uid *out);
+
+        /**
+         * @param out UID_HEX_SIZE chars
+         * @return out
+         */
+        char* to_hex(char *out) const;
+
+        uint8_t size() const {return len;}
+        const uint8_t* data() const {return bytes;}
+        bool empty() const {return len == 0;}
+        uint32_t hash() const {return uid_hash(bytes, len);}
+
+        bool operator==(const Uid &other) const {return len == other.len && memcmp(bytes, other.bytes, len) == 0;}
+        bool operator!=(const Uid &other) const {return !(*this == other);}
+        // UID length, then UID bytes: the order of the user list
+        bool operator<(const Uid &other) const
+        {
+            return len != other.len ? len < other.len : memcmp(bytes, other.bytes, len) < 0;
+        }
+};
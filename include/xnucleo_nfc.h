@@ -15,6 +15,7 @@
 #include "esp_intr_alloc.h"
 
 #include "misc.h"
+#include "uid.h"
 
 
 #define NFC_IRQ_IN 39 
@@ -135,6 +136,13 @@ class XNucleoNFC {
          * @return size_t len of uid, 0 if failure
          */
         size_t get_tag_uid();
+
+        /**
+         * @brief UID read by get_tag_uid()
+         *
+         * @return empty if no UID was read
+         */
+        Uid get_uid() const {return Uid(uid, uid_size);}
         size_t listen(TickType_t xTicksToWait);
         void print_uid();
 };
\ No newline at end of file
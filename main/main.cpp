@@ -12,10 +12,11 @@
 #include "freertos/task.h"
 #include "camera.h"
 #include "database.h"
+#include "history_writer.h"
 #include "driver/gpio.h"
 #include "driver/uart.h"
 #include "esp_err.h"
-#include "esp_code_scanner.h"
+#include "qr_pipeline.h"
 #include "color14.h"
 #include "xnucleo_nfc.h"
 #include "led_relay.h"
@@ -25,6 +26,7 @@
 #define BRIGHTNESS_THRESHOLD 2
 #define EXAMPLE_UART_WAKEUP_THRESHOLD 3
 #define READ_QR_TIMEOUT 10000 // ms
+#define HISTORY_SYNC_TIMEOUT 5000 // ms
 #define CONFIG_CAMERA_CORE0
 
 typedef enum
@@ -47,7 +49,12 @@ void check_uid();
 static const char *TAG = "MAIN";
 
 XNucleoNFC nfc_reader;
+ScanHistoryDB *history_db = NULL;
+HistoryWriter *history_writer = NULL; // owns history_db once started
+QrPipeline *qr_pipeline = NULL;
+UserDB user_db;
 bool uid_read = false;
+Uid scan_uid;
 
 
 //decode qr code AES
@@ -79,6 +86,7 @@ static void state_machine(void *args)
         case LORA:
             lora();
             state = IDLE;
+            break;
         case CHECK_UID:
             check_uid();
             state = IDLE;
@@ -124,8 +132,19 @@ esp_err_t init()
     ESP_RETURN_ON_ERROR(gpio_wakeup_enable((gpio_num_t)CONFIG_COLOR14_INT, GPIO_INTR_LOW_LEVEL), TAG, "Enable gpio wakeup failed");
     ESP_RETURN_ON_ERROR(esp_sleep_enable_gpio_wakeup(), TAG, "Configure gpio as wakeup source failed");
 
+    /**** Scan history init ****/
+    history_db = new ScanHistoryDB();
+    history_writer = new HistoryWriter(*history_db);
+    // below the state machine: scans are written while the relay is on
+    ESP_RETURN_ON_ERROR(history_writer->start(5, 1), TAG, "Fail to start history writer");
+
+    /**** User list init ****/
+    user_db.open();
+    ESP_LOGI(TAG, "User list version %u, %u users", user_db.get_version(), user_db.get_store().get_nb_records());
+
     /**** Camera init ****/
     ESP_RETURN_ON_ERROR(app_camera_init(), TAG, "Fail to init camera");
+    qr_pipeline = new QrPipeline();
     
     /**** NFC init ****/
     nfc_reader.init();
@@ -153,6 +172,10 @@ state_t idle()
         * need to wait until UART TX FIFO is empty:
         */
     uart_wait_tx_idle_polling(CONFIG_ESP_CONSOLE_UART_NUM);
+    // buffered scans would be lost on a power cut while sleeping, sector erases
+    // happen here, never between a scan and the relay
+    if (!history_writer->sync(HISTORY_SYNC_TIMEOUT / portTICK_PERIOD_MS))
+        ESP_LOGW(TAG, "History writer busy, %u scans queued", history_writer->get_depth());
 
 
     /* Enter sleep mode */
@@ -192,56 +215,38 @@ void read_qr()
 {
     ESP_LOGI(TAG, "Read QR");
     set_led_color(3);
-    camera_fb_t *fb = NULL;
-    int64_t time1, time2, time3, end, start;
+    char qr_data[QR_PIPELINE_DATA_SIZE];
     unsigned char dec_output[128];
     unsigned char dec_input[128];
     size_t dec_len;
-    int num_codes;
-    start = esp_timer_get_time();
-    while (1)
+    // frames captured on core 1 while the previous one is decoded on core 0
+    if (qr_pipeline->start(1, 0) == ESP_OK)
     {
-        fb = esp_camera_fb_get();
-        if (fb == NULL)
-        {
-            ESP_LOGI(TAG, "camera get failed\n");
-            continue;
-        }
-
-        time1 = esp_timer_get_time();
-        // Decode Progress
-        esp_image_scanner_t *esp_scn = esp_code_scanner_create();
-        if(!esp_scn) ESP_LOGE(TAG, "Fail to create ESP code scanner");
-        esp_code_scanner_config_t config = {ESP_CODE_SCANNER_MODE_FAST, ESP_CODE_SCANNER_IMAGE_GRAY, fb->width, fb->height};
-        esp_code_scanner_set_config(esp_scn, config);
-        int decoded_num = esp_code_scanner_scan_image(esp_scn, fb->buf);
-        ESP_LOGI(TAG, "decoded_num %d", decoded_num);
-        // ESP_LOGI(TAG, "Image size: %zu bytes", fb->len);
-        if (decoded_num)
+        bool found = qr_pipeline->wait(qr_data, sizeof(qr_data), READ_QR_TIMEOUT / portTICK_PERIOD_MS);
+        qr_pipeline->stop();
+        const qr_pipeline_stats_t &stats = qr_pipeline->get_stats();
+        ESP_LOGI(TAG, "%u frames captured, %u skipped by the gate, %u scanned, %u cropped, %.1f frames/s, "
+                 "%lld us a scan", stats.captured, stats.gated, stats.scanned, stats.cropped,
+                 stats.scanned * 1000000.0 / stats.elapsed_us, stats.scanned ? stats.scan_us / stats.scanned : 0);
+        if (found)
         {
-            // Read QR code message
-            esp_code_scanner_symbol_t result = esp_code_scanner_result(esp_scn);
-            time2 = esp_timer_get_time();
-            ESP_LOGI(TAG, "Read QR code in %lld ms.", (time2 - time1) / 1000);
-            ESP_LOGI(TAG, "%s: \"%s\"", result.type_name, result.data);
+            ESP_LOGI(TAG, "Read QR code in %lld ms, at level %d.", stats.first_code_us / 1000, stats.code_level);
+            ESP_LOGI(TAG, "QR-Code: \"%s\"", qr_data);
+            int64_t time2 = esp_timer_get_time();
 
             // Convert QR code from Base64 to hex
-            mbedtls_base64_decode(dec_input, 128, &dec_len, (const unsigned char *)result.data, strlen(result.data));
+            mbedtls_base64_decode(dec_input, 128, &dec_len, (const unsigned char *)qr_data, strlen(qr_data));
 
             // Decode message using AES-ECB
             aes_decrypt(dec_input, dec_len, dec_output, dec_key);
             dec_output[dec_len] = 0;
-            time3 = esp_timer_get_time();
+            int64_t time3 = esp_timer_get_time();
             ESP_LOGI(TAG, "Decode AES in %lld ms.", (time3 - time2) / 1000);
             ESP_LOGI(TAG, "QR message: %s", dec_output);
-            break;
+            // the QR code carries the UID of the badge as hex text, parsed once here
+            uid_read = Uid::from_hex((const char *)dec_output, &scan_uid);
+            if (!uid_read) ESP_LOGW(TAG, "QR message is not a UID");
         }
-        esp_code_scanner_destroy(esp_scn);
-
-        esp_camera_fb_return(fb);
-        vTaskDelay(10 / portTICK_PERIOD_MS);
-        end = esp_timer_get_time();
-        if((end - start) / 1000 > READ_QR_TIMEOUT) break;
     }
     // TODO
     //update RTC
@@ -264,6 +269,8 @@ void read_rfid()
             if(nfc_reader.get_tag_uid())
             {
                 nfc_reader.print_uid();
+                scan_uid = nfc_reader.get_uid();
+                uid_read = !scan_uid.empty();
             }
             break;
         }
@@ -275,17 +282,21 @@ void read_rfid()
 void lora()
 {
     ESP_LOGI(TAG, "LORA");
-    //read history
-    //send history
-
-    //receipt something ?
+    // TODO: once the RAK3172 is wired (its test pins clash with the camera),
+    // upload the history with get_upload_batch() and ack_upload() and sync
+    // the user list, as test/lora does
 }
 
 void check_uid()
 {
     ESP_LOGI(TAG, "Check UID");
-    if(uid_read)
+    time_t now = time(NULL);
+    user_access_t access = uid_read ? user_db.check_access(scan_uid, now) : USER_UNKNOWN;
+    if(access == USER_GRANTED)
     {
+        // queued for the writer task, no flash access before the relay
+        history_writer->post(scan_uid, now);
+        uid_read = false;
         set_led_color(1);
         set_relay(1);
         vTaskDelay(5000/portTICK_PERIOD_MS);
@@ -293,6 +304,12 @@ void check_uid()
     }
     else
     {
+        if (uid_read)
+        {
+            ESP_LOGI(TAG, "Access refused: %d", access);
+            history_writer->post(scan_uid, now); // refused scans are logged too
+        }
+        uid_read = false;
         set_led_color(3);
     }
 }
\ No newline at end of file
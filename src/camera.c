@@ -5,6 +5,11 @@
 static const char *TAG = "app_peripherals";
 
 esp_err_t app_camera_init()
+{
+    return app_camera_init_with(CAMERA_FB_COUNT, CAMERA_GRAB_MODE);
+}
+
+esp_err_t app_camera_init_with(size_t fb_count, camera_grab_mode_t grab_mode)
 {
     ESP_LOGI(TAG, "Camera module is %s", CAMERA_MODULE_NAME);
 
@@ -46,10 +51,9 @@ esp_err_t app_camera_init()
     config.pixel_format = CAMERA_PIXFORMAT;
     config.frame_size = CAMERA_FRAME_SIZE;
     config.jpeg_quality = 12;
-    config.fb_count = CAMERA_FB_COUNT;
+    config.fb_count = fb_count;
     config.fb_location = CAMERA_FB_IN_DRAM;
-    // config.fb_location = CAMERA_FB_IN_DRAM;
-    config.grab_mode = CAMERA_GRAB_WHEN_EMPTY;
+    config.grab_mode = grab_mode;
 
     // camera init
     esp_err_t err = esp_camera_init(&config);
@@ -0,0 +1,75 @@
+#include "code_scanner.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+
+
+CodeScanner::~CodeScanner()
+{
+    close();
+}
+
+esp_err_t CodeScanner::open(uint32_t width, uint32_t height)
+{
+    if (scanner && width == this->width && height == this->height) return ESP_OK;
+    int64_t start = esp_timer_get_time();
+    if (scanner == NULL)
+    {
+        scanner = esp_code_scanner_create();
+        if (scanner == NULL)
+        {
+            ESP_LOGE(_tag, "Fail to create ESP code scanner");
+            return ESP_ERR_NO_MEM;
+        }
+        stats.sessions++;
+    }
+    esp_code_scanner_config_t config = {ESP_CODE_SCANNER_MODE_FAST, ESP_CODE_SCANNER_IMAGE_GRAY, width, height};
+    esp_err_t err = esp_code_scanner_set_config(scanner, config);
+    if (err != ESP_OK)
+    {
+        ESP_LOGE(_tag, "Fail to configure ESP code scanner for %ux%u", width, height);
+        close();
+        return err;
+    }
+    this->width = width;
+    this->height = height;
+    stats.configs++;
+    stats.setup_us += esp_timer_get_time() - start;
+    ESP_LOGD(_tag, "Scanner open for %ux%u", width, height);
+    return ESP_OK;
+}
+
+void CodeScanner::close()
+{
+    if (scanner == NULL) return;
+    esp_code_scanner_destroy(scanner);
+    scanner = NULL;
+    width = 0;
+    height = 0;
+}
+
+int CodeScanner::scan(const uint8_t *image, uint32_t width, uint32_t height)
+{
+    if (open(width, height) != ESP_OK) return 0;
+    int64_t start = esp_timer_get_time();
+    int decoded = esp_code_scanner_scan_image(scanner, image);
+    stats.scan_us += esp_timer_get_time() - start;
+    stats.frames++;
+    if (decoded > 0) stats.decoded++;
+    return decoded > 0 ? decoded : 0;
+}
+
+int CodeScanner::scan(const camera_fb_t *fb)
+{
+    return scan(fb->buf, fb->width, fb->height);
+}
+
+esp_code_scanner_symbol_t CodeScanner::result()
+{
+    return esp_code_scanner_result(scanner);
+}
+
+void CameraFrame::release()
+{
+    if (fb) esp_camera_fb_return(fb);
+    fb = NULL;
+}
@@ -1,60 +1,974 @@
 #include "database.h"
+#include "history_rollup.h"
+#include "history_format.h"
 #include <cstring>
+#include <cstddef>
+#include <cstdlib>
+#include <cmath>
 
-#define LOG_ERR(tag, err)                                       \
-    if (err != ESP_OK)                                     \
-    {                                                      \
-        ESP_LOGE(tag, "Error: %s", esp_err_to_name(err)); \
-        ESP_ERROR_CHECK(err);                              \
+#define USER_TABLE_MIN_SLOTS 1024
+#define USER_FILTER_MIN_USERS 1024
+
+// MurmurHash3 finalizer
+static uint32_t mix32(uint32_t h)
+{
+    h ^= h >> 16;
+    h *= 0x85EBCA6Bu;
+    h ^= h >> 13;
+    h *= 0xC2B2AE35u;
+    h ^= h >> 16;
+    return h;
+}
+
+UserTable::~UserTable()
+{
+    free(slots);
+}
+
+// Slot holding the UID, or the free slot ending its probe sequence
+user_entry_t* UserTable::find(const uint8_t *uid, uint8_t uid_len) const
+{
+    // FNV-1a scaled to the capacity, which needs not be a power of 2, then
+    // linear probing: the load factor keeps free slots in every sequence
+    uint32_t index = (uint64_t)uid_hash(uid, uid_len) * capacity >> 32;
+    for (;;)
+    {
+        user_entry_t *slot = &slots[index];
+        if (slot->uid_len == 0) return slot;
+        if (slot->uid_len == uid_len && slot->uid[0] == uid[0] && memcmp(slot->uid, uid, uid_len) == 0) return slot;
+        if (++index == capacity) index = 0;
     }
+}
 
-void UserDB::open(){
-    // Initialize NVS
-    esp_err_t err = nvs_flash_init_partition(P_USER);
-    if (err == ESP_ERR_NVS_NO_FREE_PAGES || err == ESP_ERR_NVS_NEW_VERSION_FOUND) {
-        ESP_LOGI(_tag, "NVS partition %s was truncated and needs to be erased", P_HISTORY_CTRL);
-        // NVS partition was truncated and needs to be erased
-        // Retry nvs_flash_init
-        ESP_ERROR_CHECK(nvs_flash_erase_partition(P_USER));
-        ESP_LOGI(_tag, "NVS partition %s erased", P_HISTORY_CTRL);
-        err = nvs_flash_init_partition(P_USER);
+void UserTable::resize(uint32_t new_capacity)
+{
+    user_entry_t *old = slots;
+    uint32_t old_capacity = capacity;
+    slots = (user_entry_t*) calloc(new_capacity, sizeof(user_entry_t));
+    assert(slots != NULL);
+    capacity = new_capacity;
+    for (uint32_t i = 0; i < old_capacity; i++)
+    {
+        if (old[i].uid_len) *find(old[i].uid, old[i].uid_len) = old[i];
     }
-    LOG_ERR(_tag, err);
-    ESP_LOGI(_tag, "NVS init from %s partition: DONE", P_USER);
+    free(old);
+}
 
-    // Open
-    err = nvs_open_from_partition(P_USER, "storage", NVS_READWRITE, &nvs_handle);
-    LOG_ERR(_tag, err);
+void UserTable::clear()
+{
+    free(slots);
+    slots = NULL;
+    capacity = 0;
+    nb_users = 0;
 }
 
-void UserDB::close(){
-    nvs_close(nvs_handle);
+void UserTable::reserve(uint32_t nb)
+{
+    uint32_t new_capacity = (uint64_t)nb * 4 / 3 + 1;
+    if (new_capacity < USER_TABLE_MIN_SLOTS) new_capacity = USER_TABLE_MIN_SLOTS;
+    if (new_capacity > capacity) resize(new_capacity);
+}
+
+void UserTable::set(const user_entry_t *user)
+{
+    assert(user->uid_len > 0 && user->uid_len <= HISTORY_UID_MAX_SIZE);
+    user_entry_t *slot = capacity ? find(user->uid, user->uid_len) : NULL;
+    if (slot == NULL || slot->uid_len == 0)
+    {
+        if ((uint64_t)(nb_users + 1) * 4 > (uint64_t)capacity * 3)
+        {
+            resize(capacity ? 2 * capacity : USER_TABLE_MIN_SLOTS);
+            slot = find(user->uid, user->uid_len);
+        }
+        nb_users++;
+    }
+    *slot = *user;
+}
+
+bool UserTable::get(const uint8_t *uid, uint8_t uid_len, uint8_t *rights) const
+{
+    const user_entry_t *slot = lookup(uid, uid_len);
+    if (slot == NULL) return false;
+    *rights = slot->rights;
+    return true;
+}
+
+const user_entry_t* UserTable::lookup(const uint8_t *uid, uint8_t uid_len) const
+{
+    if (capacity == 0 || uid_len == 0 || uid_len > HISTORY_UID_MAX_SIZE) return NULL;
+    const user_entry_t *slot = find(uid, uid_len);
+    return slot->uid_len ? slot : NULL;
+}
+
+void UserTable::remove(const uint8_t *uid, uint8_t uid_len)
+{
+    if (capacity == 0 || uid_len == 0 || uid_len > HISTORY_UID_MAX_SIZE) return;
+    user_entry_t *slot = find(uid, uid_len);
+    if (slot->uid_len == 0) return;
+    // backward shift, no tombstones: each following entry of the probe run
+    // moves to the hole when the hole is between its home slot and it
+    uint32_t hole = slot - slots;
+    uint32_t next = hole;
+    for (;;)
+    {
+        if (++next == capacity) next = 0;
+        if (slots[next].uid_len == 0) break;
+        uint32_t home = (uint64_t)uid_hash(slots[next].uid, slots[next].uid_len) * capacity >> 32;
+        if ((next + capacity - home) % capacity >= (next + capacity - hole) % capacity)
+        {
+            slots[hole] = slots[next];
+            hole = next;
+        }
+    }
+    memset(&slots[hole], 0, sizeof(user_entry_t));
+    nb_users--;
+}
+
+uint32_t UserTable::get_nb_users() const
+{
+    return nb_users;
+}
+
+size_t UserTable::get_memory() const
+{
+    return (size_t)capacity * sizeof(user_entry_t);
+}
+
+UserFilter::~UserFilter()
+{
+    release();
+}
+
+uint32_t UserFilter::header_check() const
+{
+    uint32_t check = mix32(header->magic);
+    check = mix32(check ^ header->generation);
+    check = mix32(check ^ header->nb_bits);
+    check = mix32(check ^ header->nb_users);
+    return mix32(check ^ header->nb_hashes);
+}
+
+void UserFilter::attach(void *memory, size_t size)
+{
+    release();
+    header = NULL;
+    bits = NULL;
+    memory_size = 0;
+    if (memory == NULL) return;
+    assert(size > sizeof(user_filter_header_t));
+    header = (user_filter_header_t*) memory;
+    bits = (uint32_t*)(header + 1);
+    memory_size = size;
+}
+
+void UserFilter::release()
+{
+    if (!owned) return;
+    free(header);
+    header = NULL;
+    bits = NULL;
+    memory_size = 0;
+    owned = false;
+}
+
+bool UserFilter::is_built(uint32_t generation) const
+{
+    return header != NULL && header->magic == USER_FILTER_MAGIC && header->check == header_check()
+           && header->generation == generation && header->nb_bits > 0 && header->nb_hashes > 0
+           && header->nb_hashes <= USER_FILTER_MAX_HASHES
+           && sizeof(user_filter_header_t) + header->nb_bits / 8 <= memory_size;
 }
 
-uint8_t UserDB::get(const char* uid){
-    uint8_t value;
-    esp_err_t err = nvs_get_u8(nvs_handle, uid, &value);
+void UserFilter::clear(uint32_t nb_users, uint32_t generation)
+{
+    if (!is_attached())
+    {
+        // room for a quarter more users before set() has to rebuild it
+        uint32_t planned = nb_users + nb_users / 4;
+        if (planned < USER_FILTER_MIN_USERS) planned = USER_FILTER_MIN_USERS;
+        size_t size = sizeof(user_filter_header_t) + ((uint64_t)planned * USER_FILTER_BITS_PER_USER + 31) / 32 * 4;
+        if (size != memory_size)
+        {
+            release();
+            header = (user_filter_header_t*) malloc(size);
+            assert(header != NULL);
+            bits = (uint32_t*)(header + 1);
+            memory_size = size;
+            owned = true;
+        }
+    }
+    uint32_t nb_words = (memory_size - sizeof(user_filter_header_t)) / 4;
+    memset(bits, 0, nb_words * 4);
+    header->magic = USER_FILTER_MAGIC;
+    header->generation = generation;
+    header->nb_bits = nb_words * 32;
+    header->nb_users = 0;
+    // k = m/n ln 2 minimizes the false positives of n users in m bits
+    uint32_t hashes = (uint32_t)((double)header->nb_bits / (nb_users ? nb_users : 1) * 0.693 + 0.5);
+    header->nb_hashes = hashes < 1 ? 1 : hashes > USER_FILTER_MAX_HASHES ? USER_FILTER_MAX_HASHES : hashes;
+    header->check = header_check();
+    stats.builds++;
+}
+
+void UserFilter::add(const uint8_t *uid, uint8_t uid_len)
+{
+    // double hashing: probe i is at h1 + i*h2, h2 odd
+    uint32_t h1 = mix32(uid_hash(uid, uid_len));
+    uint32_t h2 = mix32(h1 ^ 0x9E3779B9u) | 1;
+    for (uint32_t i = 0; i < header->nb_hashes; i++, h1 += h2)
+    {
+        uint32_t bit = (uint64_t)h1 * header->nb_bits >> 32;
+        bits[bit / 32] |= 1u << (bit % 32);
+    }
+    header->nb_users++;
+    header->check = header_check();
+}
+
+void UserFilter::set_generation(uint32_t generation)
+{
+    header->generation = generation;
+    header->check = header_check();
+}
+
+bool UserFilter::may_contain(const uint8_t *uid, uint8_t uid_len) const
+{
+    if (header == NULL) return true;
+    stats.checks++;
+    uint32_t h1 = mix32(uid_hash(uid, uid_len));
+    uint32_t h2 = mix32(h1 ^ 0x9E3779B9u) | 1;
+    for (uint32_t i = 0; i < header->nb_hashes; i++, h1 += h2)
+    {
+        uint32_t bit = (uint64_t)h1 * header->nb_bits >> 32;
+        if ((bits[bit / 32] & 1u << (bit % 32)) == 0)
+        {
+            stats.rejected++;
+            return false;
+        }
+    }
+    return true;
+}
+
+void UserFilter::count_false_positive() const
+{
+    stats.false_positives++;
+}
+
+bool UserFilter::is_full() const
+{
+    return header != NULL && (uint64_t)header->nb_users * USER_FILTER_BITS_PER_USER > header->nb_bits;
+}
+
+bool UserFilter::is_attached() const
+{
+    return header != NULL && !owned;
+}
+
+uint32_t UserFilter::get_nb_users() const
+{
+    return header ? header->nb_users : 0;
+}
+
+size_t UserFilter::get_memory() const
+{
+    return header ? sizeof(user_filter_header_t) + header->nb_bits / 8 : 0;
+}
+
+double UserFilter::get_expected_rate() const
+{
+    if (header == NULL || header->nb_bits == 0) return 1;
+    double k = header->nb_hashes;
+    return pow(1 - exp(-k * header->nb_users / header->nb_bits), k);
+}
+
+const user_filter_stats_t& UserFilter::get_stats() const
+{
+    return stats;
+}
+
+// Order of the records: UID length, then UID bytes
+static int compare_uid(const user_record_t *record, const uint8_t *uid, uint8_t uid_len)
+{
+    if (record->uid_len != uid_len) return record->uid_len < uid_len ? -1 : 1;
+    return memcmp(record->uid, uid, uid_len);
+}
+
+UserStore::~UserStore()
+{
+    close();
+}
+
+bool UserStore::read_header(uint32_t slot, user_store_header_t *out)
+{
+    esp_err_t err = esp_partition_read(partition, slot * slot_size, out, sizeof(user_store_header_t));
     LOG_ERR(_tag, err);
-    return value;
+    return out->magic == USER_STORE_MAGIC && out->format == USER_STORE_FORMAT
+           && out->record_size == sizeof(user_record_t) && out->nb_records <= get_capacity();
 }
 
-void UserDB::set(const char* uid, uint8_t value){
-    esp_err_t err = nvs_set_u8(nvs_handle, uid, value);
+void UserStore::map()
+{
+    unmap();
+    if (active == UINT32_MAX || header.nb_records == 0) return;
+    const void *ptr;
+    size_t size = USER_STORE_HEADER_SIZE + header.nb_records * sizeof(user_record_t);
+    esp_err_t err = esp_partition_mmap(partition, active * slot_size, size, SPI_FLASH_MMAP_DATA, &ptr, &map_handle);
     LOG_ERR(_tag, err);
-    err = nvs_commit(nvs_handle);
+    records = (const user_record_t*) ((const uint8_t*) ptr + USER_STORE_HEADER_SIZE);
+}
+
+void UserStore::unmap()
+{
+    if (records) spi_flash_munmap(map_handle);
+    records = NULL;
+}
+
+void UserStore::open()
+{
+    partition = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY, P_USER);
+    assert(partition != NULL);
+    slot_size = partition->size / 2 / USER_STORE_SLOT_ALIGN * USER_STORE_SLOT_ALIGN;
+    assert(slot_size > 0);
+
+    active = UINT32_MAX;
+    for (uint32_t slot = 0; slot < 2; slot++)
+    {
+        user_store_header_t candidate;
+        if (!read_header(slot, &candidate)) continue;
+        if (active == UINT32_MAX || candidate.generation > header.generation)
+        {
+            active = slot;
+            header = candidate;
+        }
+    }
+    if (active == UINT32_MAX)
+    {
+        memset(&header, 0, sizeof(header));
+        ESP_LOGW(_tag, "No user list in partition \"%s\"", P_USER);
+    }
+    map();
+    ESP_LOGI(_tag, "%u users, generation %u, slot %u, capacity %u", header.nb_records, header.generation,
+             active, get_capacity());
+}
+
+void UserStore::close()
+{
+    abort();
+    unmap();
+}
+
+bool UserStore::find(const uint8_t *uid, uint8_t uid_len, user_record_t *out) const
+{
+    stats.lookups++;
+    uint32_t low = 0;
+    uint32_t high = records ? header.nb_records : 0;
+    while (low < high)
+    {
+        uint32_t mid = low + (high - low) / 2;
+        int order = compare_uid(&records[mid], uid, uid_len);
+        stats.lookup_steps++;
+        if (order == 0)
+        {
+            *out = records[mid];
+            return true;
+        }
+        if (order < 0) low = mid + 1;
+        else high = mid;
+    }
+    return false;
+}
+
+const user_record_t* UserStore::get_records() const
+{
+    return records;
+}
+
+uint32_t UserStore::get_nb_records() const
+{
+    return records ? header.nb_records : 0;
+}
+
+uint32_t UserStore::get_capacity() const
+{
+    return (slot_size - USER_STORE_HEADER_SIZE) / sizeof(user_record_t);
+}
+
+uint32_t UserStore::get_generation() const
+{
+    return header.generation;
+}
+
+uint32_t UserStore::get_version() const
+{
+    return header.version;
+}
+
+void UserStore::begin()
+{
+    abort();
+    wb_buffer = (uint8_t*) malloc(SPI_FLASH_SEC_SIZE);
+    assert(wb_buffer != NULL);
+    // the old header goes first: the slot is never found valid with half a list
+    uint32_t slot = active == 0 ? 1 : 0;
+    esp_err_t err = esp_partition_erase_range(partition, slot * slot_size, SPI_FLASH_SEC_SIZE);
     LOG_ERR(_tag, err);
+    stats.erases++;
+    memset(wb_buffer, 0xFF, USER_STORE_HEADER_SIZE);
+    wb_sector = 0;
+    wb_len = USER_STORE_HEADER_SIZE;
+    update_nb = 0;
+    update_version = header.version;
+}
+
+// Write the sector image of the slot being updated, the header is left erased
+bool UserStore::flush_sector()
+{
+    uint32_t offset = (active == 0 ? 1 : 0) * slot_size + wb_sector * SPI_FLASH_SEC_SIZE;
+    esp_err_t err;
+    if (wb_sector > 0)
+    {
+        err = esp_partition_erase_range(partition, offset, SPI_FLASH_SEC_SIZE);
+        if (err != ESP_OK) return false;
+        stats.erases++;
+    }
+    uint32_t start = wb_sector == 0 ? USER_STORE_HEADER_SIZE : 0;
+    if (wb_len > start)
+    {
+        err = esp_partition_write(partition, offset + start, wb_buffer + start, wb_len - start);
+        if (err != ESP_OK) return false;
+        stats.bytes_written += wb_len - start;
+    }
+    wb_sector++;
+    wb_len = 0;
+    return true;
+}
+
+bool UserStore::append(const user_record_t *record)
+{
+    if (wb_buffer == NULL || update_nb == get_capacity()) return false;
+    if (record->uid_len == 0 || record->uid_len > HISTORY_UID_MAX_SIZE) return false;
+    if (update_nb > 0 && compare_uid(&update_last, record->uid, record->uid_len) >= 0) return false;
+
+    // zero padding, so that equal lists are equal images
+    user_record_t packed = {};
+    packed.uid_len = record->uid_len;
+    memcpy(packed.uid, record->uid, record->uid_len);
+    packed.rights = record->rights;
+    packed.policy = record->policy;
+    memset(packed.policy.reserved, 0, sizeof(packed.policy.reserved));
+    const uint8_t *bytes = (const uint8_t*) &packed;
+    size_t len = sizeof(packed);
+    while (len > 0)
+    {
+        size_t n = SPI_FLASH_SEC_SIZE - wb_len < len ? SPI_FLASH_SEC_SIZE - wb_len : len;
+        memcpy(wb_buffer + wb_len, bytes, n);
+        wb_len += n;
+        bytes += n;
+        len -= n;
+        if (wb_len == SPI_FLASH_SEC_SIZE && !flush_sector())
+        {
+            ESP_LOGE(_tag, "Fail to write the user list");
+            abort();
+            return false;
+        }
+    }
+    update_last = packed;
+    update_nb++;
+    stats.records_written++;
+    return true;
+}
+
+void UserStore::set_version(uint32_t version)
+{
+    update_version = version;
+}
+
+bool UserStore::commit()
+{
+    if (wb_buffer == NULL) return false;
+    if (wb_len > 0 && !flush_sector())
+    {
+        abort();
+        return false;
+    }
+    uint32_t slot = active == 0 ? 1 : 0;
+    user_store_header_t next;
+    next.generation = header.generation + 1;
+    next.nb_records = update_nb;
+    next.version = update_version;
+    next.record_size = sizeof(user_record_t);
+    next.format = USER_STORE_FORMAT;
+    next.magic = USER_STORE_MAGIC;
+    esp_err_t err = esp_partition_write(partition, slot * slot_size, &next, offsetof(user_store_header_t, magic));
+    if (err == ESP_OK) err = esp_partition_write(partition, slot * slot_size + offsetof(user_store_header_t, magic),
+                                                 &next.magic, sizeof(next.magic));
+    abort();
+    if (err != ESP_OK)
+    {
+        ESP_LOGE(_tag, "Fail to commit the user list: %s", esp_err_to_name(err));
+        return false;
+    }
+    stats.updates++;
+    stats.bytes_written += sizeof(next);
+    active = slot;
+    header = next;
+    map();
+    ESP_LOGI(_tag, "%u users, generation %u, version %u, slot %u", header.nb_records, header.generation,
+             header.version, active);
+    return true;
+}
+
+void UserStore::abort()
+{
+    free(wb_buffer);
+    wb_buffer = NULL;
+}
+
+const user_store_stats_t& UserStore::get_stats() const
+{
+    return stats;
+}
+
+void UserDB::open(bool in_ram){
+    store.open();
+    this->in_ram = in_ram;
+    table.clear();
+    if (!filter.is_built(store.get_generation())) build_filter();
+    else ESP_LOGI(_tag, "Filter of %u users kept", filter.get_nb_users());
+    if (in_ram) load_table();
+}
+
+// Load every user, lookups are served from RAM from now on
+void UserDB::load_table(){
+    int64_t start = esp_timer_get_time();
+    const user_record_t *records = store.get_records();
+    uint32_t nb = store.get_nb_records();
+    table.clear();
+    table.reserve(nb);
+    for (uint32_t i = 0; i < nb; i++)
+    {
+        user_entry_t user = {};
+        user.uid_len = records[i].uid_len;
+        user.rights = records[i].rights;
+        memcpy(user.uid, records[i].uid, records[i].uid_len);
+        user.policy = records[i].policy;
+        table.set(&user);
+    }
+    ESP_LOGI(_tag, "%u users loaded in %lld ms, %u bytes of RAM", table.get_nb_users(),
+             (long long)(esp_timer_get_time() - start) / 1000, (unsigned)table.get_memory());
+}
+
+// Fill the filter with every user of the list
+void UserDB::build_filter(){
+    int64_t start = esp_timer_get_time();
+    const user_record_t *records = store.get_records();
+    uint32_t nb = store.get_nb_records();
+    filter.clear(nb, store.get_generation());
+    for (uint32_t i = 0; i < nb; i++) filter.add(records[i].uid, records[i].uid_len);
+    ESP_LOGI(_tag, "Filter of %u users built in %lld ms, %u bytes, %.2f%% false positives expected", nb,
+             (long long)(esp_timer_get_time() - start) / 1000, (unsigned)filter.get_memory(), filter.get_expected_rate() * 100);
+}
+
+void UserDB::close(){
+    store.close();
+    table.clear();
+    filter.release();
 }
 
+void UserDB::set_filter_memory(void *memory, size_t size){
+    filter.attach(memory, size);
+}
+
+// Entry of a user, from the RAM table or the mapped list, behind the filter
+bool UserDB::lookup(const uint8_t *uid, uint8_t uid_len, user_entry_t *out) const {
+    if (uid_len == 0 || uid_len > HISTORY_UID_MAX_SIZE) return false;
+    if (!filter.may_contain(uid, uid_len)) return false;
+    bool found;
+    if (in_ram)
+    {
+        const user_entry_t *user = table.lookup(uid, uid_len);
+        found = user != NULL;
+        if (found) *out = *user;
+    }
+    else
+    {
+        user_record_t record;
+        found = store.find(uid, uid_len, &record);
+        if (found)
+        {
+            out->uid_len = record.uid_len;
+            out->rights = record.rights;
+            memcpy(out->uid, record.uid, sizeof(out->uid));
+            out->policy = record.policy;
+        }
+    }
+    if (!found) filter.count_false_positive();
+    return found;
+}
 
+bool UserDB::get(const uint8_t *uid, uint8_t uid_len, uint8_t *value) const {
+    user_entry_t user;
+    if (!lookup(uid, uid_len, &user)) return false;
+    *value = user.rights;
+    return true;
+}
+
+user_access_t UserDB::check_access(const Uid &uid, time_t now, uint8_t *rights){
+    user_entry_t user;
+    if (!lookup(uid.data(), uid.size(), &user)) return USER_UNKNOWN;
+    if (rights != NULL) *rights = user.rights;
+    if (user.rights == 0) return USER_NO_RIGHTS;
+    const user_policy_t &policy = user.policy;
+    uint32_t t = now < 0 ? 0 : (uint32_t)now;
+    if (t < policy.valid_from || (policy.valid_until != 0 && t > policy.valid_until)) return USER_NOT_VALID;
+    uint32_t local = t + utc_offset;
+    uint32_t day = local / 86400;
+    // the epoch was a Thursday, bit 3
+    if (policy.weekdays != 0 && !(policy.weekdays >> ((day + 3) % 7) & 1)) return USER_OFF_HOURS;
+    if (policy.hours != 0 && !(policy.hours >> (local % 86400 / 3600) & 1)) return USER_OFF_HOURS;
+    if (policy.quota != 0)
+    {
+        uint32_t hash = uid.hash();
+        user_quota_t &slot = quotas[hash & (USER_QUOTA_SLOTS - 1)];
+        if (slot.hash != hash || slot.day != (uint16_t)day)
+        {
+            slot.hash = hash;
+            slot.day = (uint16_t)day;
+            slot.count = 0;
+        }
+        if (slot.count >= policy.quota) return USER_OVER_QUOTA;
+        slot.count++;
+    }
+    return USER_GRANTED;
+}
+
+void UserDB::set_utc_offset(int32_t seconds){
+    utc_offset = seconds;
+}
+
+bool UserDB::get(const Uid &uid, uint8_t *value) const {
+    return get(uid.data(), uid.size(), value);
+}
+
+// Order of the imports: UID, then position in the import
+static int compare_import(const void *a, const void *b)
+{
+    const user_import_t *ia = (const user_import_t*) a;
+    const user_import_t *ib = (const user_import_t*) b;
+    if (ia->user.uid_len != ib->user.uid_len) return ia->user.uid_len < ib->user.uid_len ? -1 : 1;
+    int order = memcmp(ia->user.uid, ib->user.uid, ia->user.uid_len);
+    if (order != 0) return order;
+    return ia->order < ib->order ? -1 : ia->order > ib->order ? 1 : 0;
+}
+
+esp_err_t UserDB::update(user_import_t *imports, uint32_t nb, bool replace, uint32_t version){
+    for (uint32_t i = 0; i < nb; i++)
+    {
+        if (imports[i].user.uid_len == 0 || imports[i].user.uid_len > HISTORY_UID_MAX_SIZE)
+        {
+            ESP_LOGE(_tag, "User %u of the import has a UID of %u bytes", i, imports[i].user.uid_len);
+            return ESP_ERR_INVALID_ARG;
+        }
+    }
+    // sorted, then the last of each UID only
+    qsort(imports, nb, sizeof(user_import_t), compare_import);
+    uint32_t nb_users = 0;
+    for (uint32_t i = 0; i < nb; i++)
+    {
+        if (nb_users > 0 && imports[nb_users - 1].user.uid_len == imports[i].user.uid_len
+            && memcmp(imports[nb_users - 1].user.uid, imports[i].user.uid, imports[i].user.uid_len) == 0)
+        {
+            if (imports[i].op != USER_DELTA_SET || imports[nb_users - 1].op != USER_DELTA_SET)
+            {
+                ESP_LOGE(_tag, "UID given twice in a delta");
+                return ESP_ERR_INVALID_ARG;
+            }
+            nb_users--;
+        }
+        imports[nb_users++] = imports[i];
+    }
+
+    // merge with the list in use into the other slot
+    const user_record_t *records = store.get_records();
+    uint32_t nb_records = store.get_nb_records();
+    uint32_t i = 0;
+    uint32_t j = 0;
+    uint32_t written = 0;
+    esp_err_t err = ESP_OK;
+    store.begin();
+    if (version != USER_VERSION_KEEP) store.set_version(version);
+    while (err == ESP_OK && (i < nb_records || j < nb_users))
+    {
+        const user_entry_t *user = &imports[j].user;
+        uint8_t op = j < nb_users ? imports[j].op : USER_DELTA_SET;
+        int order = i == nb_records ? 1 : j == nb_users ? -1 : compare_uid(&records[i], user->uid, user->uid_len);
+        if (order < 0)
+        {
+            if (!replace && !store.append(&records[i])) err = ESP_FAIL;
+            written += !replace;
+            i++;
+            continue;
+        }
+        if ((order == 0 && op == USER_DELTA_ADD) || (order > 0 && (op == USER_DELTA_MODIFY || op == USER_DELTA_REMOVE || op == USER_DELTA_POLICY)))
+        {
+            ESP_LOGE(_tag, "Op %u of the delta does not match the list", op);
+            err = ESP_ERR_INVALID_STATE;
+            break;
+        }
+        user_record_t record = {};
+        record.uid_len = user->uid_len;
+        memcpy(record.uid, user->uid, user->uid_len);
+        record.rights = user->rights;
+        record.policy = user->policy;
+        if (order == 0)
+        {
+            if (op == USER_DELTA_MODIFY || op == USER_DELTA_RIGHTS) record.policy = records[i].policy;
+            else if (op == USER_DELTA_POLICY) record.rights = records[i].rights;
+            i++;
+        }
+        // if the update fails the filter only lets one more UID through
+        else if (!replace) filter.add(user->uid, user->uid_len);
+        // as written, for the RAM table
+        imports[j].user.rights = record.rights;
+        imports[j].user.policy = record.policy;
+        j++;
+        if (op == USER_DELTA_REMOVE) continue;
+        if (!store.append(&record)) err = ESP_FAIL;
+        written++;
+    }
+    if (err != ESP_OK)
+    {
+        if (err == ESP_FAIL && written > store.get_capacity())
+        {
+            ESP_LOGE(_tag, "User list full, %u users", store.get_capacity());
+            err = ESP_ERR_NO_MEM;
+        }
+        store.abort();
+        return err;
+    }
+    if (!store.commit()) return ESP_FAIL;
+
+    if (replace)
+    {
+        if (in_ram) load_table();
+        build_filter();
+        return ESP_OK;
+    }
+    if (in_ram)
+    {
+        for (j = 0; j < nb_users; j++)
+        {
+            const user_entry_t *user = &imports[j].user;
+            if (imports[j].op == USER_DELTA_REMOVE) table.remove(user->uid, user->uid_len);
+            else table.set(user);
+        }
+    }
+    // removed users stay in the filter until it is rebuilt, their lookups go on to the list
+    filter.set_generation(store.get_generation());
+    // allocated filters grow, an attached one fills up and lets more UIDs through
+    if (filter.is_full() && !filter.is_attached()) build_filter();
+    return ESP_OK;
+}
+
+bool UserDB::set(const user_entry_t *users, uint32_t nb, bool replace, uint32_t version){
+    user_import_t *imports = (user_import_t*) malloc((nb ? nb : 1) * sizeof(user_import_t));
+    assert(imports != NULL);
+    for (uint32_t i = 0; i < nb; i++)
+    {
+        imports[i].user = users[i];
+        imports[i].order = i;
+        imports[i].op = USER_DELTA_SET;
+    }
+    esp_err_t err = update(imports, nb, replace, version);
+    free(imports);
+    return err == ESP_OK;
+}
+
+bool UserDB::import(user_import_cb_t next, void *arg, bool replace, uint32_t version){
+    int64_t start = esp_timer_get_time();
+    user_import_t *imports = NULL;
+    uint32_t capacity = 0;
+    uint32_t nb = 0;
+    for (;;)
+    {
+        if (nb == capacity)
+        {
+            capacity += capacity < USER_IMPORT_BATCH ? USER_IMPORT_BATCH : capacity / 2;
+            imports = (user_import_t*) realloc(imports, capacity * sizeof(user_import_t));
+            assert(imports != NULL);
+        }
+        if (!next(&imports[nb].user, arg)) break;
+        imports[nb].order = nb;
+        imports[nb].op = USER_DELTA_SET;
+        nb++;
+    }
+    esp_err_t err = update(imports, nb, replace, version);
+    free(imports);
+    if (err == ESP_OK) ESP_LOGI(_tag, "%u users imported in %lld ms, %u in the list", nb,
+                                (long long)(esp_timer_get_time() - start) / 1000, store.get_nb_records());
+    return err == ESP_OK;
+}
 
-ScanHistoryDB::ScanHistoryDB(size_t uid_size){
+bool UserDB::set(const uint8_t *uid, uint8_t uid_len, uint8_t value){
+    if (uid_len == 0 || uid_len > HISTORY_UID_MAX_SIZE) return false;
+    user_import_t import = {};
+    import.user.uid_len = uid_len;
+    memcpy(import.user.uid, uid, uid_len);
+    import.user.rights = value;
+    import.op = USER_DELTA_RIGHTS;
+    return update(&import, 1, false, USER_VERSION_KEEP) == ESP_OK;
+}
+
+esp_err_t UserDB::apply_delta(const uint8_t *delta, size_t len){
+    uint32_t base;
+    size_t pos = get_varint(delta, len, &base);
+    if (pos == 0) return ESP_ERR_INVALID_ARG;
+    uint32_t version = store.get_version();
+    if (base + 1 == version) return ESP_OK;
+    if (base != version)
+    {
+        ESP_LOGW(_tag, "Delta from version %u, the list is at version %u", base, version);
+        return ESP_ERR_INVALID_VERSION;
+    }
+
+    // an op takes 2 bytes at least
+    user_import_t *imports = (user_import_t*) malloc((len / 2 + 1) * sizeof(user_import_t));
+    assert(imports != NULL);
+    uint32_t nb = 0;
+    esp_err_t err = ESP_OK;
+    while (pos < len)
+    {
+        uint8_t op = delta[pos] >> 4;
+        uint8_t uid_len = delta[pos] & 0x0F;
+        size_t op_len = 1 + uid_len + (op == USER_DELTA_REMOVE ? 0 : op == USER_DELTA_POLICY ? USER_POLICY_SIZE : 1);
+        if (op < USER_DELTA_ADD || op > USER_DELTA_POLICY || uid_len == 0 || uid_len > HISTORY_UID_MAX_SIZE
+            || pos + op_len > len)
+        {
+            err = ESP_ERR_INVALID_ARG;
+            break;
+        }
+        user_import_t *import = &imports[nb];
+        memset(import, 0, sizeof(user_import_t));
+        import->user.uid_len = uid_len;
+        memcpy(import->user.uid, delta + pos + 1, uid_len);
+        const uint8_t *value = delta + pos + 1 + uid_len;
+        if (op == USER_DELTA_POLICY)
+        {
+            user_policy_t *policy = &import->user.policy;
+            for (uint8_t i = 0; i < 4; i++)
+            {
+                policy->valid_from |= (uint32_t)value[i] << (8*i);
+                policy->valid_until |= (uint32_t)value[4 + i] << (8*i);
+            }
+            policy->hours = value[8] | value[9] << 8 | (uint32_t)value[10] << 16;
+            policy->weekdays = value[11];
+            policy->quota = value[12];
+        }
+        else if (op != USER_DELTA_REMOVE) import->user.rights = value[0];
+        import->order = nb;
+        import->op = op;
+        nb++;
+        pos += op_len;
+    }
+    if (err == ESP_OK) err = update(imports, nb, false, base + 1);
+    free(imports);
+    if (err == ESP_OK) ESP_LOGI(_tag, "Delta of %u ops applied, version %u, %u users", nb, base + 1,
+                                store.get_nb_records());
+    else ESP_LOGE(_tag, "Delta from version %u refused: %s", base, esp_err_to_name(err));
+    return err;
+}
+
+uint32_t UserDB::get_version() const {
+    return store.get_version();
+}
+
+bool UserDB::set(const Uid &uid, uint8_t value){
+    return set(uid.data(), uid.size(), value);
+}
+
+const UserTable& UserDB::get_table() const {
+    return table;
+}
+
+const UserFilter& UserDB::get_filter() const {
+    return filter;
+}
+
+UserStore& UserDB::get_store() {
+    return store;
+}
+
+
+
+/* -------------------------------------------------------------------------- */
+/*                         history record encoding                            */
+/* -------------------------------------------------------------------------- */
+
+// The dictionary is not updated: the record may not fit in the sector
+static size_t encode_record(uint8_t *out, const history_dict_t *dict, uint32_t base_time, uint32_t entry,
+                            const uint8_t *uid, uint8_t uid_len, uint32_t timestamp)
+{
+    int index = dict_find(dict, uid, uid_len);
+    size_t len = 1 + put_varint(out + 1, zigzag((int32_t)(timestamp - base_time)));
+    if (index >= 0)
+    {
+        out[0] = HISTORY_TAG_DICT | index;
+    }
+    else
+    {
+        out[0] = uid_len;
+        memcpy(out + len, uid, uid_len);
+        len += uid_len;
+    }
+    out[len] = crc8(out, len, (uint8_t)entry);
+    return len + 1;
+}
+
+// return the record size, 0 at the end of the sector, at an uncommitted batch or if the record is corrupted
+static size_t decode_record(const uint8_t *in, size_t avail, history_dict_t *dict, uint32_t base_time,
+                            uint32_t entry, uint8_t *uid, uint8_t *uid_len, uint32_t *timestamp)
+{
+    if (avail == 0 || (in[0] & HISTORY_TAG_PENDING)) return 0; // erased flash has the bit set too
+    uint32_t dt;
+    size_t len = get_varint(in + 1, avail - 1, &dt);
+    if (len == 0) return 0;
+    len += 1;
+    bool in_dict = in[0] & HISTORY_TAG_DICT;
+    uint8_t index = in[0] & ~HISTORY_TAG_DICT;
+    if (in_dict && index >= dict->nb_uids) return 0;
+    if (!in_dict)
+    {
+        if (in[0] > HISTORY_UID_MAX_SIZE) return 0;
+        len += in[0];
+    }
+    if (len >= avail || crc8(in, len, (uint8_t)entry) != in[len]) return 0;
+
+    *timestamp = base_time + unzigzag(dt);
+    if (in_dict)
+    {
+        *uid_len = dict->len[index];
+        memcpy(uid, dict->uid[index], *uid_len);
+    }
+    else
+    {
+        *uid_len = in[0];
+        memcpy(uid, in + len - in[0], *uid_len);
+        dict_add(dict, uid, *uid_len);
+    }
+    return len + 1;
+}
+
+/* -------------------------------------------------------------------------- */
+/*                               ScanHistoryDB                                */
+/* -------------------------------------------------------------------------- */
+
+ScanHistoryDB::ScanHistoryDB(uint32_t rollup_sectors){
     /* -------------------------- get partition handler ------------------------- */
     partition = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY, P_HISTORY);
     assert(partition != NULL);
     ESP_LOGI(_tag, "Get Jacla Scan history partition successfully!");
     ESP_LOGI(_tag, "Partition \"%s\" size: %d bytes", P_HISTORY, partition->size);
 
-    /* ---------- Open nvs handler to read/write cursor and block size ---------- */
+    /* ---------------- Open nvs handler to read/write the log format ---------------- */
     // Initialize NVS
     esp_err_t err = nvs_flash_init_partition(P_HISTORY_CTRL);
     if (err == ESP_ERR_NVS_NO_FREE_PAGES || err == ESP_ERR_NVS_NEW_VERSION_FOUND) {
@@ -70,118 +984,795 @@ ScanHistoryDB::ScanHistoryDB(size_t uid_size){
     err = nvs_open_from_partition(P_HISTORY_CTRL, "storage", NVS_READWRITE, &nvs_hist_ctrl);
     LOG_ERR(_tag, err);
 
-    /* ----------------- get block size from nvs if available ----------------- */
-    err = nvs_get_u32(nvs_hist_ctrl, "block_size", &block_size);
-    if (err == ESP_OK)
+    /* ------------------------- write-back and read buffers ------------------------- */
+    wb_buffer = (uint8_t*) malloc(HISTORY_PAGE_SIZE);
+    assert(wb_buffer != NULL);
+    rd_buffer = (uint8_t*) malloc(HISTORY_PAGE_SIZE);
+    assert(rd_buffer != NULL);
+    reader.seq = UINT32_MAX;
+    usage = (history_usage_t*) calloc(HISTORY_USAGE_SLOTS, sizeof(history_usage_t));
+    assert(usage != NULL);
+
+    // the daily summaries take the end of the partition
+    assert(rollup_sectors >= 2 && partition->size / HISTORY_PAGE_SIZE > rollup_sectors + HISTORY_ERASE_AHEAD);
+    nb_sectors = partition->size / HISTORY_PAGE_SIZE - rollup_sectors;
+    rollup = new HistoryRollup(*this, nb_sectors * HISTORY_PAGE_SIZE, rollup_sectors);
+
+    /* ------- check the log format and split, only written when the log is created ------- */
+    uint32_t version = 0;
+    uint32_t saved_sectors = 0;
+    err = nvs_get_u32(nvs_hist_ctrl, "version", &version);
+    if (err == ESP_OK) err = nvs_get_u32(nvs_hist_ctrl, "rollup", &saved_sectors);
+    if (err == ESP_OK && version == HISTORY_FORMAT_VERSION && saved_sectors == rollup_sectors)
     {
-        if(block_size != uid_size + 4){
-            ESP_LOGW(_tag, "Block size stored in NVS %s is not the equal (uid_size + 4)", P_HISTORY_CTRL);
+        /* ------------- find the ring head and tail, no cursor is stored ------------- */
+        int64_t start = esp_timer_get_time();
+        recover();
+        ESP_LOGI(_tag, "Found entries [%u, %u[ in %u reads (%lld us)", oldest_entry,
+                 next_entry, stats.recovery_reads, (long long)(esp_timer_get_time() - start));
+        rollup->recover();
+        load_usage();
+        err = nvs_get_u32(nvs_hist_ctrl, "uploaded", &upload_entry);
+        if (err == ESP_ERR_NVS_NOT_FOUND) upload_entry = 0;
+        else LOG_ERR(_tag, err);
+        if (upload_entry > next_entry)
+        {
+            // saved by an older firmware that acknowledged records not flushed yet
+            ESP_LOGW(_tag, "Upload watermark %u past the log, back to %u", upload_entry, next_entry);
+            upload_entry = next_entry;
         }
-        ESP_LOGI(_tag, "Load block_size = %d stored in NVS %s", block_size, P_HISTORY_CTRL);
-        this->uid_size = block_size - sizeof(time_t);
-    }
-    else if(err == ESP_ERR_NVS_NOT_FOUND){
-        err = nvs_set_u32(nvs_hist_ctrl, "block_size", uid_size + 4); // sizeof(size_t) + sizeof(time_t)
-        LOG_ERR(_tag, err);
-        err = nvs_commit(nvs_hist_ctrl);
-        LOG_ERR(_tag, err);
-        this->uid_size = uid_size;
     }
-    /* -------------------- get cursor from nvs if available -------------------- */
-    err = nvs_get_u32(nvs_hist_ctrl, "cursor", &cursor);
-    if (err == ESP_OK)
+    else
     {
-        ESP_LOGI(_tag, "Load cursor = %d stored in NVS %s", cursor, P_HISTORY_CTRL);
-    }
-    else if(err == ESP_ERR_NVS_NOT_FOUND){
-        err = nvs_set_u32(nvs_hist_ctrl, "cursor", 0); 
-        LOG_ERR(_tag, err);
-        err = nvs_commit(nvs_hist_ctrl);
-        LOG_ERR(_tag, err);
+        if (err == ESP_OK) ESP_LOGW(_tag, "History was written in an older format or split and is cleared");
+        clear_history();
     }
 
     ESP_LOGI(_tag, "ScanHistoryDB init done!");
 }
 
+ScanHistoryDB::~ScanHistoryDB()
+{
+    if (mapped) spi_flash_munmap(map_handle);
+    free(wb_buffer);
+    free(rd_buffer);
+    free(usage);
+    delete rollup;
+}
+
 void ScanHistoryDB::close()
 {
+    checkpoint_usage(true);
+    flush();
+    if (mapped) spi_flash_munmap(map_handle);
+    mapped = NULL;
     nvs_close(nvs_hist_ctrl);
 }
 
 void ScanHistoryDB::clear_history(){
+    wb_len = 0; // buffered records are dropped with the rest of the history
+    wb_first_us = 0;
+    reader.seq = UINT32_MAX;
     /* ------------------------- clear history partition ------------------------ */
     LOG_ERR(_tag, esp_partition_erase_range(partition, 0, partition->size));
     ESP_LOGI(_tag, "Partition \"%s\" cleared", P_HISTORY);
     /* ---------------------- delete history_ctrl namespace --------------------- */
     esp_err_t err = nvs_erase_all(nvs_hist_ctrl);
     LOG_ERR(_tag, err);
+    err = nvs_set_u32(nvs_hist_ctrl, "version", HISTORY_FORMAT_VERSION);
+    LOG_ERR(_tag, err);
+    err = nvs_set_u32(nvs_hist_ctrl, "rollup", rollup->get_nb_sectors());
+    LOG_ERR(_tag, err);
     err = nvs_commit(nvs_hist_ctrl);
     LOG_ERR(_tag, err);
+    stats.nvs_commits++;
     ESP_LOGI(_tag, "NVS Partition \"%s\" cleared", P_HISTORY_CTRL);
-    update_cursor(0);
+    // empty ring: the first record opens sector 0
+    head_seq = UINT32_MAX;
+    head_offset = HISTORY_PAGE_SIZE;
+    oldest_seq = 0;
+    oldest_entry = 0;
+    next_entry = 0;
+    head_max_time = 0;
+    erased_ahead = HISTORY_ERASE_AHEAD;
+    // the counters checkpoint went with the NVS namespace
+    memset(usage, 0, HISTORY_USAGE_SLOTS * sizeof(history_usage_t));
+    usage_nb = 0;
+    usage_entry = 0;
+    upload_entry = 0;
+    rollup->reset();
 }
 
-size_t ScanHistoryDB::get_block_size(){
-    esp_err_t err = nvs_get_u32(nvs_hist_ctrl, "block_size", &block_size);
-    LOG_ERR(_tag, err);
-    return block_size;
+uint32_t ScanHistoryDB::get_nb_entries() const {
+    return next_entry - oldest_entry;
 }
 
-size_t ScanHistoryDB::get_uid_size() const
+uint32_t ScanHistoryDB::get_oldest_entry() const {
+    return oldest_entry;
+}
+
+uint32_t ScanHistoryDB::get_newest_entry() const {
+    return next_entry - 1;
+}
+
+uint32_t ScanHistoryDB::sector_offset(uint32_t seq) const
 {
-    return uid_size;
+    return (seq % nb_sectors) * HISTORY_PAGE_SIZE;
 }
 
-uint32_t ScanHistoryDB::get_nb_entries() const {
-    return (uint32_t)(cursor/block_size);
+bool ScanHistoryDB::read_sector_header(uint32_t sector, history_sector_header_t *header)
+{
+    LOG_ERR(_tag, esp_partition_read(partition, sector * HISTORY_PAGE_SIZE, header, sizeof(*header)));
+    stats.recovery_reads++;
+    return header->magic == HISTORY_SECTOR_MAGIC;
+}
+
+uint32_t ScanHistoryDB::sector_first_entry(uint32_t seq)
+{
+    history_sector_header_t header;
+    if (seq == head_seq) return head_first_entry; // header may still be in the write-back buffer
+    if (!read_sector_header(seq % nb_sectors, &header) || header.seq != seq) return next_entry;
+    return header.first_entry;
+}
+
+bool ScanHistoryDB::is_sector_blank(uint32_t sector)
+{
+    uint32_t *data = (uint32_t*) rd_buffer;
+    reader.seq = UINT32_MAX;
+    LOG_ERR(_tag, esp_partition_read(partition, sector * HISTORY_PAGE_SIZE, data, HISTORY_PAGE_SIZE));
+    for (size_t i = 0; i < HISTORY_PAGE_SIZE / sizeof(uint32_t); i++)
+    {
+        if (data[i] != 0xFFFFFFFF) return false;
+    }
+    return true;
+}
+
+void ScanHistoryDB::recover()
+{
+    history_sector_header_t header;
+    erased_ahead = 0; // unknown, erase_ahead() checks the next sectors again
+
+    // At most HISTORY_ERASE_AHEAD sectors are invalid (erased or torn) once the
+    // ring has wrapped, and sector 0 is always used first: one of the first
+    // HISTORY_ERASE_AHEAD + 1 sectors is valid unless the log is empty.
+    uint32_t ref = 0;
+    while (ref <= HISTORY_ERASE_AHEAD && ref < nb_sectors && !read_sector_header(ref, &header)) ref++;
+    if (ref > HISTORY_ERASE_AHEAD || ref == nb_sectors)
+    {
+        head_seq = UINT32_MAX;
+        head_offset = HISTORY_PAGE_SIZE;
+        oldest_seq = 0;
+        oldest_entry = 0;
+        next_entry = 0;
+        head_max_time = 0;
+        return;
+    }
+    uint32_t ref_seq = header.seq;
+
+    // Walking the ring from ref: sectors newer than ref up to the head, the
+    // invalid gap, then the sectors older than ref. "invalid or seq >= ref_seq"
+    // is true then false along the walk: binary search the oldest sector.
+    uint32_t low = 1;
+    uint32_t high = nb_sectors;
+    while (low < high)
+    {
+        uint32_t mid = low + (high - low)/2;
+        if (!read_sector_header((ref + mid) % nb_sectors, &header) || header.seq >= ref_seq) low = mid + 1;
+        else high = mid;
+    }
+    uint32_t older_start = low;
+    uint32_t oldest = older_start < nb_sectors ? (ref + older_start) % nb_sectors : ref;
+    read_sector_header(oldest, &header);
+    oldest_seq = header.seq;
+    oldest_entry = header.first_entry;
+
+    // Before the older sectors, valid sectors come first then the gap
+    low = 1;
+    high = older_start;
+    while (low < high)
+    {
+        uint32_t mid = low + (high - low)/2;
+        if (read_sector_header((ref + mid) % nb_sectors, &header)) low = mid + 1;
+        else high = mid;
+    }
+    read_sector_header((ref + low - 1) % nb_sectors, &header);
+
+    // Decode the head sector to rebuild its dictionary and find its end
+    head_seq = header.seq;
+    head_first_entry = header.first_entry;
+    head_base_time = header.base_time;
+    head_offset = HISTORY_PAGE_SIZE; // nothing buffered to overlay
+    load_sector(head_seq);
+    stats.recovery_reads++;
+    history_entry_t record;
+    uint32_t max_time = 0;
+    while (decode_next(&record))
+    {
+        if (record.timestamp > max_time) max_time = record.timestamp;
+    }
+    head_offset = reader.pos;
+    head_dict = reader.dict;
+    next_entry = reader.entry;
+    // a cut flush leaves programmed bytes that cannot be written over
+    for (size_t i = reader.pos; i < HISTORY_PAGE_SIZE; i++)
+    {
+        if (rd_buffer[i] != 0xFF)
+        {
+            ESP_LOGW(_tag, "Torn write at byte %u of sector %u, the sector is closed", head_offset, head_seq);
+            head_offset = HISTORY_PAGE_SIZE;
+            stats.torn_writes++;
+            break;
+        }
+    }
+    if (head_seq > oldest_seq)
+    {
+        uint32_t before = sector_max_time(head_seq - 1);
+        if (before > max_time) max_time = before;
+    }
+    head_max_time = max_time;
+}
+
+void ScanHistoryDB::drop_overwritten(uint32_t seq)
+{
+    // erasing the sector of `seq` loses the entries it held one lap ago
+    if (seq < nb_sectors || seq - nb_sectors < oldest_seq) return;
+    uint32_t first_kept = sector_first_entry(seq - nb_sectors + 1);
+    rollup->cover(first_kept); // nothing goes before being summarized
+    oldest_seq = seq - nb_sectors + 1;
+    oldest_entry = first_kept;
+    if (reader.seq == seq - nb_sectors) reader.seq = UINT32_MAX;
+}
+
+bool ScanHistoryDB::erase_ahead()
+{
+    if (erased_ahead >= HISTORY_ERASE_AHEAD) return false;
+    uint32_t seq = head_seq + 1 + erased_ahead;
+    uint32_t sector = seq % nb_sectors;
+    drop_overwritten(seq);
+    if (!is_sector_blank(sector))
+    {
+        LOG_ERR(_tag, esp_partition_erase_range(partition, sector * HISTORY_PAGE_SIZE, HISTORY_PAGE_SIZE));
+        stats.erases++;
+    }
+    erased_ahead++;
+    return erased_ahead < HISTORY_ERASE_AHEAD;
+}
+
+bool ScanHistoryDB::compact()
+{
+    return rollup->compact();
+}
+
+HistoryRollup& ScanHistoryDB::get_rollup()
+{
+    return *rollup;
+}
+
+void ScanHistoryDB::start_sector(uint32_t seq, uint32_t base_time)
+{
+    flush();
+    if (head_seq != UINT32_MAX)
+    {
+        // seal the head sector: time queries binary search on max_time
+        uint32_t seal[2] = {head_max_time, ~head_max_time};
+        LOG_ERR(_tag, esp_partition_write(partition, sector_offset(head_seq) + offsetof(history_sector_header_t, max_time),
+                                          seal, sizeof(seal)));
+        stats.flash_bytes_written += sizeof(seal);
+    }
+    if (erased_ahead == 0)
+    {
+        ESP_LOGW(_tag, "No sector erased ahead, erasing in the scan path");
+        drop_overwritten(seq);
+        LOG_ERR(_tag, esp_partition_erase_range(partition, sector_offset(seq), HISTORY_PAGE_SIZE));
+        stats.sync_erases++;
+    }
+    else erased_ahead--;
+
+    head_seq = seq;
+    head_offset = 0;
+    head_first_entry = next_entry;
+    head_base_time = base_time;
+    head_dict.nb_uids = 0;
+    // the header goes to flash with the first batch of the sector
+    history_sector_header_t header = {seq, next_entry, base_time, HISTORY_SECTOR_MAGIC, 0xFFFFFFFF, 0xFFFFFFFF};
+    memcpy(wb_buffer, &header, sizeof(header));
+    wb_len = sizeof(header);
+}
+
+void ScanHistoryDB::add_history(const Uid &uid, const time_t timestamp){
+    add_history(uid.data(), uid.size(), timestamp);
+}
+
+void ScanHistoryDB::add_history(const uint8_t* uid, uint8_t uid_len, const time_t timestamp){
+    uint8_t record[HISTORY_RECORD_MAX_SIZE];
+    size_t len = 0;
+    if (uid_len > HISTORY_UID_MAX_SIZE)
+    {
+        ESP_LOGE(_tag, "UID of %d bytes is too long, scan dropped", uid_len);
+        return;
+    }
+    if (head_seq != UINT32_MAX)
+        len = encode_record(record, &head_dict, head_base_time, next_entry, uid, uid_len, timestamp);
+    if (head_seq == UINT32_MAX || head_offset + wb_len + len > HISTORY_PAGE_SIZE)
+    {
+        start_sector(head_seq + 1, timestamp);
+        len = encode_record(record, &head_dict, head_base_time, next_entry, uid, uid_len, timestamp);
+    }
+    else if (wb_len > 0 && wb_len + len > wb_limit) flush();
+
+    if (record[0] < HISTORY_TAG_DICT) dict_add(&head_dict, uid, uid_len);
+    memcpy(wb_buffer + wb_len, record, len);
+    if (wb_first_us == 0) wb_first_us = esp_timer_get_time();
+    wb_len += len;
+    next_entry++;
+    if ((uint32_t)timestamp > head_max_time) head_max_time = timestamp;
+    count_usage(uid, uid_len, timestamp);
+    stats.appends++;
+
+    if (wb_len >= wb_limit) flush();
+    else flush_if_due();
+}
+
+bool ScanHistoryDB::load_sector(uint32_t seq)
+{
+    reader.seq = UINT32_MAX;
+    LOG_ERR(_tag, esp_partition_read(partition, sector_offset(seq), rd_buffer, HISTORY_PAGE_SIZE));
+    stats.sector_reads++;
+    if (seq == head_seq && head_offset < HISTORY_PAGE_SIZE)
+        memcpy(rd_buffer + head_offset, wb_buffer, wb_len); // records not flushed yet
+    history_sector_header_t header;
+    memcpy(&header, rd_buffer, sizeof(header));
+    if (header.magic != HISTORY_SECTOR_MAGIC || header.seq != seq) return false;
+    reader.seq = seq;
+    reader.first_entry = header.first_entry;
+    reader.base_time = header.base_time;
+    reader.entry = header.first_entry;
+    reader.pos = sizeof(header);
+    reader.dict.nb_uids = 0;
+    return true;
 }
 
+uint32_t ScanHistoryDB::find_sector(uint32_t entry)
+{
+    // last sector whose first entry is <= entry
+    uint32_t low = oldest_seq;
+    uint32_t high = head_seq;
+    while (low < high)
+    {
+        uint32_t mid = low + (high - low + 1)/2;
+        if (sector_first_entry(mid) <= entry) low = mid;
+        else high = mid - 1;
+    }
+    return low;
+}
+
+void ScanHistoryDB::refresh_head()
+{
+    // bytes before the reader position were decoded already and cannot change
+    if (reader.pos < head_offset)
+    {
+        LOG_ERR(_tag, esp_partition_read(partition, sector_offset(head_seq) + reader.pos, rd_buffer + reader.pos,
+                                         head_offset - reader.pos));
+    }
+    if (head_offset < HISTORY_PAGE_SIZE) memcpy(rd_buffer + head_offset, wb_buffer, wb_len);
+}
+
+size_t ScanHistoryDB::decode_next(history_entry_t *out)
+{
+    size_t len = decode_record(rd_buffer + reader.pos, HISTORY_PAGE_SIZE - reader.pos, &reader.dict,
+                               reader.base_time, reader.entry, out->uid, &out->uid_len, &out->timestamp);
+    if (len == 0) return 0;
+    reader.pos += len;
+    out->entry = reader.entry++;
+    return len;
+}
 
-void ScanHistoryDB::add_history(const char* uid, const time_t timestamp){
-    char data[block_size];
-    strncpy(data, uid, block_size - sizeof(time_t)); // uid length = block size - sizeof(time_t) bytes
-    for (size_t i = 0; i < sizeof(time_t); i++)
+bool ScanHistoryDB::read_next(history_entry_t *out)
+{
+    if (reader.seq == UINT32_MAX || reader.entry >= next_entry) return false;
+    if (decode_next(out)) return true;
+    // end of the loaded image: go on with the next sector, or reload the head
+    // sector if records were appended since it was loaded. A sector closed by
+    // a torn write may hold no record at all.
+    uint32_t target = reader.entry;
+    uint32_t seq = reader.seq;
+    while (true)
     {
-        data[uid_size + i] = (uint8_t)(timestamp >> (8*i));
+        bool reload = seq == head_seq;
+        if (reload) refresh_head();
+        else if (!load_sector(++seq)) return false;
+        while (reader.entry < target)
+        {
+            if (!decode_next(out)) return false;
+        }
+        if (decode_next(out)) return true;
+        if (reload) return false;
     }
-    LOG_ERR(_tag, esp_partition_write(partition, cursor, data, block_size));
-    update_cursor(cursor + block_size);
 }
 
-void ScanHistoryDB::get_history(const uint32_t entry, char *uid, time_t *time_stamp)
+bool ScanHistoryDB::seek(uint32_t entry)
 {
-    char data[block_size];
+    if (entry < oldest_entry || entry >= next_entry) return false;
+    // sequential reads go on decoding from the last record read
+    if (reader.seq != UINT32_MAX && entry == reader.entry) return true;
+    uint32_t seq = find_sector(entry);
+    if ((seq != reader.seq || entry < reader.entry) && !load_sector(seq)) return false;
+    history_entry_t skipped;
+    while (reader.entry < entry)
+    {
+        if (!read_next(&skipped)) return false;
+    }
+    return true;
+}
+
+bool ScanHistoryDB::get_history(const uint32_t entry, uint8_t *uid, uint8_t *uid_len, time_t *time_stamp)
+{
+    history_entry_t record;
+    // a corrupted record is skipped, the reader then goes on with a later entry
+    if (!seek(entry) || !read_next(&record) || record.entry != entry) return false;
+    memcpy(uid, record.uid, record.uid_len);
+    *uid_len = record.uid_len;
+    *time_stamp = (time_t)record.timestamp;
+    return true;
+}
+
+uint32_t ScanHistoryDB::get_history_range(uint32_t first, uint32_t count, history_entry_t *out)
+{
+    uint32_t nb_read = 0;
+    if (!seek(first)) return 0;
+    while (nb_read < count && read_next(out + nb_read)) nb_read++;
+    return nb_read;
+}
+
+bool ScanHistoryDB::get_history(const uint32_t entry, Uid *uid, time_t *time_stamp)
+{
+    uint8_t data[HISTORY_UID_MAX_SIZE];
+    uint8_t len;
+    *uid = Uid();
     *time_stamp = 0;
-    LOG_ERR(_tag, esp_partition_read(partition, entry*block_size, data, block_size));
-    strncpy(uid, data, uid_size);
-    uid[uid_size] = 0; // array termination
-    for (size_t i = 0; i < sizeof(time_t); i++)
+    if (!get_history(entry, data, &len, time_stamp)) return false;
+    *uid = Uid(data, len);
+    return true;
+}
+
+uint32_t ScanHistoryDB::sector_max_time(uint32_t seq)
+{
+    history_sector_header_t header;
+    if (seq == head_seq) return head_max_time;
+    if (read_sector_header(seq % nb_sectors, &header) && header.seq == seq && header.max_time == ~header.max_time_inv)
+        return header.max_time;
+
+    // power cut before the seal: decode the sector and carry the max of the one before
+    uint32_t max_time = 0;
+    history_entry_t record;
+    if (load_sector(seq))
     {
-        (*time_stamp) += data[uid_size + i] << (8*i); 
+        while (decode_next(&record))
+        {
+            if (record.timestamp > max_time) max_time = record.timestamp;
+        }
     }
+    if (seq > oldest_seq)
+    {
+        uint32_t before = sector_max_time(seq - 1);
+        if (before > max_time) max_time = before;
+    }
+    return max_time;
+}
+
+uint32_t ScanHistoryDB::find_entry_by_time(uint32_t timestamp)
+{
+    if (next_entry == oldest_entry || head_max_time < timestamp) return next_entry;
+    // max_time only grows along the ring: first sector holding a record >= timestamp
+    uint32_t low = oldest_seq;
+    uint32_t high = head_seq;
+    while (low < high)
+    {
+        uint32_t mid = low + (high - low)/2;
+        if (sector_max_time(mid) >= timestamp) high = mid;
+        else low = mid + 1;
+    }
+    history_entry_t record;
+    if (!load_sector(low)) return next_entry;
+    while (read_next(&record))
+    {
+        if (record.timestamp >= timestamp) return record.entry;
+    }
+    return next_entry;
+}
+
+bool ScanHistoryDB::get_time_range(time_t from, time_t to, uint32_t *first, uint32_t *end)
+{
+    *first = find_entry_by_time(from < 0 ? 0 : (uint32_t)from);
+    *end = to <= from ? *first : find_entry_by_time((uint32_t)to);
+    return *first < *end;
 }
 
 void ScanHistoryDB::print_all_history()
 {
-    uint32_t nb_entries = get_nb_entries();
-    char uid[uid_size];
+    Uid uid;
+    char hex[UID_HEX_SIZE];
     time_t time_stamp;
-    for (size_t i = 0; i < nb_entries; i++)
+    for (uint32_t i = oldest_entry; i < next_entry; i++)
     {
-        get_history(i, uid, &time_stamp);
-        ESP_LOGI(_tag, "UID-UNIX time: %s - %ld", uid, time_stamp);
+        get_history(i, &uid, &time_stamp);
+        ESP_LOGI(_tag, "UID-UNIX time: %s - %ld", uid.to_hex(hex), (long)time_stamp);
     }   
 }
 
+void ScanHistoryDB::flush()
+{
+    if (wb_len == 0) return;
+    // write the batch as pending, then commit it by clearing the bit in its first record
+    size_t first = head_offset == 0 ? sizeof(history_sector_header_t) : 0;
+    wb_buffer[first] |= HISTORY_TAG_PENDING;
+    LOG_ERR(_tag, esp_partition_write(partition, sector_offset(head_seq) + head_offset, wb_buffer, wb_len));
+    wb_buffer[first] &= ~HISTORY_TAG_PENDING;
+    LOG_ERR(_tag, esp_partition_write(partition, sector_offset(head_seq) + head_offset + first, wb_buffer + first, 1));
+    stats.flash_bytes_written += wb_len + 1;
+    stats.flushes++;
+    head_offset += wb_len;
+    wb_len = 0;
+    wb_first_us = 0;
+}
+
+bool ScanHistoryDB::flush_if_due()
+{
+    if (wb_first_us == 0) return false;
+    if ((esp_timer_get_time() - wb_first_us) / 1000 < HISTORY_FLUSH_PERIOD_MS) return false;
+    flush();
+    return true;
+}
+
+void ScanHistoryDB::set_batch_size(size_t bytes)
+{
+    flush();
+    if (bytes < HISTORY_RECORD_MAX_SIZE) bytes = HISTORY_RECORD_MAX_SIZE;
+    if (bytes > HISTORY_PAGE_SIZE) bytes = HISTORY_PAGE_SIZE;
+    wb_limit = bytes;
+}
+
+const history_stats_t& ScanHistoryDB::get_stats() const
+{
+    return stats;
+}
+
 size_t ScanHistoryDB::get_cursor(){
-    esp_err_t err = nvs_get_u32(nvs_hist_ctrl, "cursor", &cursor);
+    if (head_seq == UINT32_MAX) return 0;
+    return sector_offset(head_seq) + head_offset;
+}
+
+const uint8_t* ScanHistoryDB::map_partition()
+{
+    if (mapped) return mapped;
+    const void *ptr;
+    esp_err_t err = esp_partition_mmap(partition, 0, partition->size, SPI_FLASH_MMAP_DATA, &ptr, &map_handle);
+    if (err != ESP_OK)
+    {
+        ESP_LOGE(_tag, "Fail to map partition \"%s\": %s", P_HISTORY, esp_err_to_name(err));
+        return NULL;
+    }
+    mapped = (const uint8_t*) ptr;
+    return mapped;
+}
+
+history_usage_t* ScanHistoryDB::usage_slot(const uint8_t *uid, uint8_t uid_len)
+{
+    // linear probing
+    uint32_t hash = uid_hash(uid, uid_len);
+    for (uint32_t i = 0; i < HISTORY_USAGE_SLOTS; i++)
+    {
+        history_usage_t *slot = &usage[(hash + i) & (HISTORY_USAGE_SLOTS - 1)];
+        if (slot->uid_len == 0) return slot;
+        if (slot->uid_len == uid_len && memcmp(slot->uid, uid, uid_len) == 0) return slot;
+    }
+    return NULL;
+}
+
+void ScanHistoryDB::count_usage(const uint8_t *uid, uint8_t uid_len, uint32_t timestamp)
+{
+    if (uid_len == 0) return;
+    history_usage_t *slot = usage_slot(uid, uid_len);
+    if (slot->uid_len == 0)
+    {
+        // keep probe sequences short
+        if (usage_nb >= HISTORY_USAGE_SLOTS * 3/4)
+        {
+            ESP_LOGW(_tag, "Usage table full, scan not counted");
+            return;
+        }
+        slot->uid_len = uid_len;
+        memcpy(slot->uid, uid, uid_len);
+        usage_nb++;
+    }
+    slot->count++;
+    if (timestamp > slot->last_seen) slot->last_seen = timestamp;
+}
+
+void ScanHistoryDB::load_usage()
+{
+    size_t size = 0;
+    esp_err_t err = nvs_get_blob(nvs_hist_ctrl, "usage", NULL, &size);
+    if (err == ESP_OK && size >= 2 * sizeof(uint32_t))
+    {
+        // blob: first entry not counted, number of UIDs, then the used slots
+        uint8_t *blob = (uint8_t*) malloc(size);
+        assert(blob != NULL);
+        LOG_ERR(_tag, nvs_get_blob(nvs_hist_ctrl, "usage", blob, &size));
+        uint32_t nb_uids;
+        memcpy(&usage_entry, blob, sizeof(uint32_t));
+        memcpy(&nb_uids, blob + sizeof(uint32_t), sizeof(uint32_t));
+        const history_usage_t *saved = (const history_usage_t*)(blob + 2 * sizeof(uint32_t));
+        for (uint32_t i = 0; i < nb_uids && 2 * sizeof(uint32_t) + (i + 1) * sizeof(history_usage_t) <= size; i++)
+        {
+            history_usage_t *slot = usage_slot(saved[i].uid, saved[i].uid_len);
+            if (slot == NULL || slot->uid_len != 0) continue;
+            *slot = saved[i];
+            usage_nb++;
+        }
+        free(blob);
+    }
+    else if (err != ESP_ERR_NVS_NOT_FOUND) LOG_ERR(_tag, err);
+
+    // count the records added after the checkpoint
+    uint32_t first = usage_entry;
+    if (first < oldest_entry)
+    {
+        ESP_LOGW(_tag, "%u scans were overwritten before being counted", oldest_entry - first);
+        first = oldest_entry;
+    }
+    history_entry_t record;
+    if (!seek(first)) return;
+    while (read_next(&record))
+    {
+        count_usage(record.uid, record.uid_len, record.timestamp);
+        stats.usage_replayed++;
+    }
+    ESP_LOGI(_tag, "Usage of %u UIDs loaded, %u scans counted again", usage_nb, stats.usage_replayed);
+}
+
+bool ScanHistoryDB::checkpoint_usage(bool force)
+{
+    if (next_entry == usage_entry) return false;
+    if (!force && next_entry - usage_entry < HISTORY_USAGE_CHECKPOINT) return false;
+    flush(); // the counters must not get ahead of the records in flash
+
+    size_t size = 2 * sizeof(uint32_t) + usage_nb * sizeof(history_usage_t);
+    uint8_t *blob = (uint8_t*) malloc(size);
+    assert(blob != NULL);
+    memcpy(blob, &next_entry, sizeof(uint32_t));
+    memcpy(blob + sizeof(uint32_t), &usage_nb, sizeof(uint32_t));
+    history_usage_t *saved = (history_usage_t*)(blob + 2 * sizeof(uint32_t));
+    for (uint32_t i = 0, n = 0; i < HISTORY_USAGE_SLOTS; i++)
+    {
+        if (usage[i].uid_len != 0) saved[n++] = usage[i];
+    }
+    // one blob: the counters and their entry are saved together
+    esp_err_t err = nvs_set_blob(nvs_hist_ctrl, "usage", blob, size);
+    free(blob);
     LOG_ERR(_tag, err);
-    return cursor;
+    LOG_ERR(_tag, nvs_commit(nvs_hist_ctrl));
+    stats.nvs_commits++;
+    stats.usage_checkpoints++;
+    stats.usage_bytes_written += size;
+    usage_entry = next_entry;
+    return true;
 }
 
-void ScanHistoryDB::update_cursor(size_t offset)
+bool ScanHistoryDB::get_usage(const uint8_t *uid, uint8_t uid_len, uint32_t *count, time_t *last_seen)
 {
-    LOG_ERR(_tag, nvs_set_u32(nvs_hist_ctrl, "cursor", offset)); 
+    history_usage_t *slot = uid_len > 0 ? usage_slot(uid, uid_len) : NULL;
+    if (slot == NULL || slot->uid_len == 0)
+    {
+        *count = 0;
+        *last_seen = 0;
+        return false;
+    }
+    *count = slot->count;
+    *last_seen = (time_t)slot->last_seen;
+    return true;
+}
+
+bool ScanHistoryDB::get_usage(const Uid &uid, uint32_t *count, time_t *last_seen)
+{
+    return get_usage(uid.data(), uid.size(), count, last_seen);
+}
+
+uint32_t ScanHistoryDB::get_upload_entry() const
+{
+    return upload_entry;
+}
+
+size_t ScanHistoryDB::get_upload_batch(uint8_t *buffer, size_t size, uint32_t *end_entry)
+{
+    flush(); // the watermark must not get ahead of the records in flash
+    uint32_t first = upload_entry;
+    if (first < oldest_entry)
+    {
+        ESP_LOGW(_tag, "%u scans were overwritten before being uploaded", oldest_entry - first);
+        first = oldest_entry;
+    }
+    *end_entry = first;
+    size_t len = put_varint(buffer, first);
+    if (len + HISTORY_UPLOAD_MAX_RECORD > size || !seek(first)) return 0;
+
+    // the reader stays after the batch: the next one goes on without a read
+    uint32_t previous = 0;
+    history_entry_t record;
+    while (len + HISTORY_UPLOAD_MAX_RECORD <= size && *end_entry < next_entry)
+    {
+        if (!read_next(&record)) break;
+        if (record.entry != *end_entry)
+        {
+            // corrupted records were skipped: entries of a batch are consecutive
+            if (*end_entry != first) break;
+            first = *end_entry = record.entry;
+            len = put_varint(buffer, first);
+        }
+        buffer[len++] = record.uid_len;
+        memcpy(buffer + len, record.uid, record.uid_len);
+        len += record.uid_len;
+        len += put_varint(buffer + len, zigzag((int32_t)(record.timestamp - previous)));
+        previous = record.timestamp;
+        (*end_entry)++;
+    }
+    return *end_entry == first ? 0 : len;
+}
+
+void ScanHistoryDB::ack_upload(uint32_t end_entry)
+{
+    if (end_entry <= upload_entry || end_entry > next_entry) return;
+    upload_entry = end_entry;
+    LOG_ERR(_tag, nvs_set_u32(nvs_hist_ctrl, "uploaded", upload_entry));
     LOG_ERR(_tag, nvs_commit(nvs_hist_ctrl));
-    cursor = offset;
+    stats.nvs_commits++;
+}
+
+/* -------------------------------------------------------------------------- */
+/*                              HistoryIterator                               */
+/* -------------------------------------------------------------------------- */
+
+HistoryIterator::HistoryIterator(ScanHistoryDB &db, uint32_t first_entry) : db(db)
+{
+    db.flush();
+    end_entry = db.next_entry;
+    if (first_entry < db.oldest_entry) first_entry = db.oldest_entry;
+    if (first_entry >= end_entry || !db.map_partition() || !load(db.find_sector(first_entry))) return;
+    history_entry_t skipped;
+    while (state.entry < first_entry && next(&skipped));
+}
+
+bool HistoryIterator::load(uint32_t seq)
+{
+    const uint8_t *base = db.mapped + db.sector_offset(seq);
+    history_sector_header_t header;
+    memcpy(&header, base, sizeof(header));
+    if (header.magic != HISTORY_SECTOR_MAGIC || header.seq != seq)
+    {
+        sector = NULL;
+        return false;
+    }
+    sector = base;
+    state.seq = seq;
+    state.first_entry = header.first_entry;
+    state.base_time = header.base_time;
+    state.entry = header.first_entry;
+    state.pos = sizeof(header);
+    state.dict.nb_uids = 0;
+    return true;
+}
+
+bool HistoryIterator::next(history_entry_t *out)
+{
+    if (sector == NULL || state.entry >= end_entry) return false;
+    size_t len = decode_record(sector + state.pos, HISTORY_PAGE_SIZE - state.pos, &state.dict,
+                               state.base_time, state.entry, out->uid, &out->uid_len, &out->timestamp);
+    if (len == 0)
+    {
+        if (!load(state.seq + 1)) return false;
+        return next(out);
+    }
+    state.pos += len;
+    out->entry = state.entry++;
+    return true;
 }
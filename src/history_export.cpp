@@ -0,0 +1,255 @@
+#include "history_export.h"
+#include "history_format.h"
+#include <cstring>
+#include <cstdlib>
+
+
+static uint32_t hash3(const uint8_t *p)
+{
+    uint32_t value = (uint32_t)p[0] << 16 | (uint32_t)p[1] << 8 | p[2];
+    return (value * 2654435761u) >> 22; // 10 bits, HISTORY_EXPORT_HASH_SIZE
+}
+
+bool HistoryExporter::update_uids(history_export_uids_t *uids, const uint8_t *uid, uint8_t uid_len, uint8_t *slot)
+{
+    for (uint32_t i = 0; i < HISTORY_EXPORT_UIDS; i++)
+    {
+        if (uids->len[i] == uid_len && uids->uid[i][0] == uid[0] && memcmp(uids->uid[i], uid, uid_len) == 0)
+        {
+            uids->referred[i] = 1;
+            *slot = i;
+            return true;
+        }
+    }
+    while (uids->referred[uids->hand])
+    {
+        uids->referred[uids->hand] = 0;
+        uids->hand = (uids->hand + 1) % HISTORY_EXPORT_UIDS;
+    }
+    *slot = uids->hand;
+    uids->len[*slot] = uid_len;
+    memcpy(uids->uid[*slot], uid, uid_len);
+    uids->hand = (uids->hand + 1) % HISTORY_EXPORT_UIDS;
+    return false;
+}
+
+HistoryExporter::HistoryExporter(ScanHistoryDB &db, size_t chunk_size) : db(db), chunk_size(chunk_size)
+{
+    chunk = (uint8_t*) malloc(chunk_size);
+    assert(chunk != NULL);
+    window = (uint8_t*) malloc(2 * HISTORY_EXPORT_WINDOW + HISTORY_EXPORT_MAX_MATCH);
+    assert(window != NULL);
+    // worst case: a flag byte per 8 literals, of a block extended by a match
+    block = (uint8_t*) malloc(2 + (HISTORY_EXPORT_BLOCK + HISTORY_EXPORT_MAX_MATCH) * 9 / 8 + 1);
+    assert(block != NULL);
+    hash_head = (uint16_t*) malloc(HISTORY_EXPORT_HASH_SIZE * sizeof(uint16_t));
+    assert(hash_head != NULL);
+    uids = (history_export_uids_t*) malloc(sizeof(history_export_uids_t));
+    assert(uids != NULL);
+}
+
+HistoryExporter::~HistoryExporter()
+{
+    free(chunk);
+    free(window);
+    free(block);
+    free(hash_head);
+    free(uids);
+}
+
+void HistoryExporter::emit(const uint8_t *data, size_t len)
+{
+    stats.stream_bytes += len;
+    while (len > 0 && !stopped)
+    {
+        size_t n = len < chunk_size - chunk_len ? len : chunk_size - chunk_len;
+        memcpy(chunk + chunk_len, data, n);
+        chunk_len += n;
+        data += n;
+        len -= n;
+        if (chunk_len == chunk_size)
+        {
+            stats.chunks++;
+            stopped = !callback(chunk, chunk_len, callback_arg);
+            chunk_len = 0;
+        }
+    }
+}
+
+// Compress the window up to `end` (matches may go past it) into one block,
+// stored as is if it does not shrink
+void HistoryExporter::compress_block(uint32_t end)
+{
+    uint32_t start = window_pos;
+    block_len = 2;
+    group_items = 0;
+    while (window_pos < end)
+    {
+        uint32_t pos = window_pos;
+        uint32_t avail = window_len - pos;
+        uint32_t match_len = 0;
+        uint32_t offset = 0;
+        if (avail >= HISTORY_EXPORT_MIN_MATCH)
+        {
+            uint32_t h = hash3(window + pos);
+            uint16_t candidate = hash_head[h];
+            hash_head[h] = pos;
+            if (candidate != UINT16_MAX && pos - candidate <= HISTORY_EXPORT_WINDOW)
+            {
+                uint32_t max = avail < HISTORY_EXPORT_MAX_MATCH ? avail : HISTORY_EXPORT_MAX_MATCH;
+                while (match_len < max && window[candidate + match_len] == window[pos + match_len]) match_len++;
+                offset = pos - candidate;
+            }
+        }
+
+        if (group_items == 0)
+        {
+            group_flags = block_len;
+            block[block_len++] = 0;
+        }
+        if (match_len >= HISTORY_EXPORT_MIN_MATCH)
+        {
+            block[group_flags] |= 1 << group_items;
+            block[block_len++] = (uint8_t)(offset - 1);
+            block[block_len++] = (uint8_t)((offset - 1) >> 8 << 4 | (match_len - HISTORY_EXPORT_MIN_MATCH));
+            for (uint32_t i = 1; i < match_len; i++)
+            {
+                if (pos + i + HISTORY_EXPORT_MIN_MATCH <= window_len) hash_head[hash3(window + pos + i)] = pos + i;
+            }
+            window_pos += match_len;
+            stats.matches++;
+        }
+        else
+        {
+            block[block_len++] = window[pos];
+            window_pos++;
+        }
+        group_items = (group_items + 1) % 8;
+    }
+    if (window_pos == start) return;
+
+    // positions hashed above stay valid: the decoder has the bytes either way
+    uint32_t raw_len = window_pos - start;
+    stats.blocks++;
+    if (block_len - 2 < raw_len)
+    {
+        block[0] = (uint8_t)(block_len - 2);
+        block[1] = (uint8_t)((block_len - 2) >> 8 | 0x80);
+        emit(block, block_len);
+        return;
+    }
+    stats.stored_blocks++;
+    block[0] = (uint8_t)raw_len;
+    block[1] = (uint8_t)(raw_len >> 8);
+    emit(block, 2);
+    emit(window + start, raw_len);
+}
+
+void HistoryExporter::feed(const uint8_t *data, size_t len)
+{
+    while (len > 0)
+    {
+        size_t n = 2 * HISTORY_EXPORT_WINDOW + HISTORY_EXPORT_MAX_MATCH - window_len;
+        if (n > len) n = len;
+        memcpy(window + window_len, data, n);
+        window_len += n;
+        data += n;
+        len -= n;
+        // keep a full match ahead of the encoder
+        while (window_len - window_pos >= HISTORY_EXPORT_BLOCK + HISTORY_EXPORT_MAX_MATCH)
+            compress_block(window_pos + HISTORY_EXPORT_BLOCK);
+        if (window_len == 2 * HISTORY_EXPORT_WINDOW + HISTORY_EXPORT_MAX_MATCH)
+        {
+            // drop what is out of reach of the next matches
+            uint32_t shift = window_pos - HISTORY_EXPORT_WINDOW;
+            memmove(window, window + shift, window_len - shift);
+            window_len -= shift;
+            window_pos -= shift;
+            for (uint32_t h = 0; h < HISTORY_EXPORT_HASH_SIZE; h++)
+            {
+                if (hash_head[h] == UINT16_MAX) continue;
+                hash_head[h] = hash_head[h] < shift ? UINT16_MAX : hash_head[h] - shift;
+            }
+        }
+    }
+}
+
+void HistoryExporter::finish()
+{
+    compress_block(window_len);
+    if (chunk_len > 0 && !stopped)
+    {
+        stats.chunks++;
+        stopped = !callback(chunk, chunk_len, callback_arg);
+        chunk_len = 0;
+    }
+}
+
+bool HistoryExporter::run(uint32_t first_entry, history_export_cb_t callback, void *arg)
+{
+    this->callback = callback;
+    callback_arg = arg;
+    stopped = false;
+    stats = {};
+    chunk_len = 0;
+    window_len = 0;
+    window_pos = 0;
+    block_len = 0;
+    group_items = 0;
+    memset(hash_head, 0xFF, HISTORY_EXPORT_HASH_SIZE * sizeof(uint16_t));
+    memset(uids, 0, sizeof(history_export_uids_t));
+
+    HistoryIterator it(db, first_entry);
+    history_entry_t record;
+    bool available = it.next(&record);
+    if (available)
+    {
+        first_entry = record.entry;
+        stats.flash_bytes = (db.head_seq - db.find_sector(first_entry) + 1) * HISTORY_PAGE_SIZE;
+    }
+
+    uint8_t header[4 + 5];
+    memcpy(header, HISTORY_EXPORT_MAGIC, 3);
+    header[3] = HISTORY_EXPORT_VERSION;
+    emit(header, 4 + put_varint(header + 4, first_entry));
+
+    uint32_t timestamp = 0;
+    uint8_t out[1 + HISTORY_UID_MAX_SIZE + 5];
+    while (available && !stopped)
+    {
+        size_t len = 0;
+        uint8_t slot;
+        if (update_uids(uids, record.uid, record.uid_len, &slot))
+        {
+            out[len++] = HISTORY_EXPORT_TAG_SLOT + slot;
+            stats.uid_hits++;
+        }
+        else
+        {
+            out[len++] = record.uid_len;
+            memcpy(out + len, record.uid, record.uid_len);
+            len += record.uid_len;
+        }
+        int32_t dt = (int32_t)(record.timestamp - timestamp);
+        len += put_varint(out + len, zigzag(dt));
+        timestamp = record.timestamp;
+        feed(out, len);
+        stats.record_bytes += len;
+        stats.entries++;
+        available = it.next(&record);
+    }
+    if (!stopped) finish();
+    if (stopped)
+    {
+        ESP_LOGW(_tag, "Export stopped after %u entries", stats.entries);
+        return false;
+    }
+    ESP_LOGI(_tag, "%u entries from %u: %u flash bytes -> %u records bytes -> %u bytes in %u chunks",
+             stats.entries, first_entry, stats.flash_bytes, stats.record_bytes, stats.stream_bytes, stats.chunks);
+    return true;
+}
+
+const history_export_stats_t& HistoryExporter::get_stats() const
+{
+    return stats;
+}
@@ -0,0 +1,96 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include "esp_log.h"
+
+/*
+ * Encoding shared by the history log, its rollup and its export: varints,
+ * zigzag deltas, CRC-8 and the per-sector UID dictionaries.
+ */
+
+#define LOG_ERR(tag, err)                                       \
+    if (err != ESP_OK)                                     \
+    {                                                      \
+        ESP_LOGE(tag, "Error: %s", esp_err_to_name(err)); \
+        ESP_ERROR_CHECK(err);                              \
+    }
+
+static inline size_t put_varint(uint8_t *out, uint32_t value)
+{
+    size_t len = 0;
+    while (value >= 0x80)
+    {
+        out[len++] = (uint8_t)(value | 0x80);
+        value >>= 7;
+    }
+    out[len++] = (uint8_t)value;
+    return len;
+}
+
+// return the number of bytes read, 0 if the varint is truncated
+static inline size_t get_varint(const uint8_t *in, size_t avail, uint32_t *value)
+{
+    *value = 0;
+    for (size_t i = 0; i < avail && i < 5; i++)
+    {
+        *value |= (uint32_t)(in[i] & 0x7F) << (7*i);
+        if (!(in[i] & 0x80)) return i + 1;
+    }
+    return 0;
+}
+
+static inline size_t varint_size(uint32_t value)
+{
+    size_t len = 1;
+    while (value >= 0x80)
+    {
+        value >>= 7;
+        len++;
+    }
+    return len;
+}
+
+static inline uint32_t zigzag(int32_t value)
+{
+    return ((uint32_t)value << 1) ^ (uint32_t)(value >> 31);
+}
+
+static inline int32_t unzigzag(uint32_t value)
+{
+    return (int32_t)(value >> 1) ^ -(int32_t)(value & 1);
+}
+
+// CRC-8, polynomial x^8 + x^2 + x + 1, one nibble at a time
+static const uint8_t crc8_nibble[16] = {0x00, 0x07, 0x0E, 0x09, 0x1C, 0x1B, 0x12, 0x15, 0x38, 0x3F, 0x36, 0x31, 0x24, 0x23, 0x2A, 0x2D};
+
+static inline uint8_t crc8(const uint8_t *data, size_t len, uint8_t crc)
+{
+    for (size_t i = 0; i < len; i++)
+    {
+        crc ^= data[i];
+        crc = (crc << 4) ^ crc8_nibble[crc >> 4];
+        crc = (crc << 4) ^ crc8_nibble[crc >> 4];
+    }
+    return crc;
+}
+
+// Dictionaries are history_dict_t or history_rollup_dict_t: nb_uids, then len and uid arrays of the same size
+template <typename Dict>
+static int dict_find(const Dict *dict, const uint8_t *uid, uint8_t uid_len)
+{
+    for (int i = 0; i < dict->nb_uids; i++)
+    {
+        if (dict->len[i] == uid_len && memcmp(dict->uid[i], uid, uid_len) == 0) return i;
+    }
+    return -1;
+}
+
+template <typename Dict>
+static void dict_add(Dict *dict, const uint8_t *uid, uint8_t uid_len)
+{
+    if (dict->nb_uids >= sizeof(dict->len)) return; // later UIDs of the sector stay raw
+    dict->len[dict->nb_uids] = uid_len;
+    memcpy(dict->uid[dict->nb_uids], uid, uid_len);
+    dict->nb_uids++;
+}
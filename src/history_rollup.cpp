@@ -0,0 +1,469 @@
+#include "history_rollup.h"
+#include "history_format.h"
+#include <cstring>
+#include <cstdlib>
+
+// payload of a block alone in a sector
+static const size_t max_payload = HISTORY_PAGE_SIZE - sizeof(history_rollup_header_t) - HISTORY_ROLLUP_BLOCK_HEADER;
+
+// return the block size, 0 at the end of the sector or if the block is cut
+static size_t decode_block(const uint8_t *in, size_t avail, uint32_t *day, uint32_t *end_entry,
+                           const uint8_t **payload, size_t *payload_len)
+{
+    if (avail < 3 || in[0] != HISTORY_ROLLUP_TAG_BLOCK) return 0;
+    *payload_len = in[1] | (size_t)in[2] << 8;
+    size_t len = 3;
+    size_t n = get_varint(in + len, avail - len, day);
+    if (n == 0) return 0;
+    len += n;
+    n = get_varint(in + len, avail - len, end_entry);
+    if (n == 0) return 0;
+    len += n;
+    if (len + *payload_len + 1 > avail || crc8(in, len + *payload_len, 0) != in[len + *payload_len]) return 0;
+    *payload = in + len;
+    return len + *payload_len + 1;
+}
+
+// return the summary size, 0 if the payload is inconsistent
+static size_t decode_summary(const uint8_t *in, size_t avail, history_rollup_dict_t *dict, uint32_t day,
+                             uint32_t *prev_minute, history_daily_t *out)
+{
+    if (avail == 0) return 0;
+    size_t len = 1;
+    uint8_t tag = in[0];
+    if (tag <= HISTORY_UID_MAX_SIZE)
+    {
+        if (avail < 1 + (size_t)tag) return 0;
+        out->uid_len = tag;
+        memcpy(out->uid, in + 1, tag);
+        len += tag;
+        dict_add(dict, out->uid, out->uid_len);
+    }
+    else
+    {
+        uint8_t index = tag - HISTORY_ROLLUP_TAG_SLOT;
+        if (index >= dict->nb_uids) return 0;
+        out->uid_len = dict->len[index];
+        memcpy(out->uid, dict->uid[index], out->uid_len);
+    }
+    uint32_t dfirst, span;
+    size_t n = get_varint(in + len, avail - len, &out->count);
+    if (n == 0) return 0;
+    len += n;
+    n = get_varint(in + len, avail - len, &dfirst);
+    if (n == 0) return 0;
+    len += n;
+    n = get_varint(in + len, avail - len, &span);
+    if (n == 0) return 0;
+    len += n;
+    *prev_minute += dfirst;
+    out->day = day;
+    out->first_seen = day * SECONDS_PER_DAY + *prev_minute * 60;
+    out->last_seen = out->first_seen + span * 60;
+    return len;
+}
+
+static int compare_first_seen(const void *a, const void *b)
+{
+    uint32_t first_a = ((const history_daily_t*)a)->first_seen;
+    uint32_t first_b = ((const history_daily_t*)b)->first_seen;
+    return first_a < first_b ? -1 : first_a > first_b;
+}
+
+HistoryRollup::HistoryRollup(ScanHistoryDB &db, uint32_t region_offset, uint32_t nb_sectors)
+    : db(db), region_offset(region_offset), nb_sectors(nb_sectors)
+{
+    head_dict = (history_rollup_dict_t*) malloc(sizeof(history_rollup_dict_t));
+    assert(head_dict != NULL);
+    block = (uint8_t*) malloc(HISTORY_PAGE_SIZE);
+    assert(block != NULL);
+    reset();
+}
+
+HistoryRollup::~HistoryRollup()
+{
+    free(head_dict);
+    free(block);
+}
+
+void HistoryRollup::reset()
+{
+    head_seq = UINT32_MAX;
+    head_offset = HISTORY_PAGE_SIZE;
+    oldest_seq = 0;
+    rollup_entry = 0;
+    head_dict->nb_uids = 0;
+}
+
+uint32_t HistoryRollup::sector_offset(uint32_t seq) const
+{
+    return region_offset + (seq % nb_sectors) * HISTORY_PAGE_SIZE;
+}
+
+bool HistoryRollup::read_header(uint32_t seq, history_rollup_header_t *header)
+{
+    LOG_ERR(_tag, esp_partition_read(db.partition, sector_offset(seq), header, sizeof(*header)));
+    return header->magic == HISTORY_ROLLUP_MAGIC && header->seq == seq;
+}
+
+bool HistoryRollup::load(uint32_t seq)
+{
+    LOG_ERR(_tag, esp_partition_read(db.partition, sector_offset(seq), block, HISTORY_PAGE_SIZE));
+    history_rollup_header_t header;
+    memcpy(&header, block, sizeof(header));
+    return header.magic == HISTORY_ROLLUP_MAGIC && header.seq == seq;
+}
+
+void HistoryRollup::recover()
+{
+    reset();
+    // few sectors: read every header
+    history_rollup_header_t header;
+    uint32_t min_seq = UINT32_MAX;
+    for (uint32_t sector = 0; sector < nb_sectors; sector++)
+    {
+        LOG_ERR(_tag, esp_partition_read(db.partition, region_offset + sector * HISTORY_PAGE_SIZE, &header, sizeof(header)));
+        if (header.magic != HISTORY_ROLLUP_MAGIC || header.seq % nb_sectors != sector) continue;
+        if (head_seq == UINT32_MAX || header.seq > head_seq) head_seq = header.seq;
+        if (header.seq < min_seq) min_seq = header.seq;
+    }
+    if (head_seq == UINT32_MAX) return;
+    oldest_seq = min_seq;
+
+    // The last block tells where compaction stopped, it may be in a sector
+    // before the head if the head's first block was cut
+    bool found = false;
+    for (uint32_t seq = head_seq; !found && seq + 1 > oldest_seq; seq--)
+    {
+        if (!load(seq)) continue;
+        size_t pos = sizeof(history_rollup_header_t);
+        size_t len;
+        uint32_t day, end_entry;
+        const uint8_t *payload;
+        size_t payload_len;
+        if (seq == head_seq) head_dict->nb_uids = 0;
+        while ((len = decode_block(block + pos, HISTORY_PAGE_SIZE - pos, &day, &end_entry, &payload, &payload_len)))
+        {
+            found = true;
+            rollup_entry = end_entry;
+            pos += len;
+            if (seq != head_seq) continue;
+            // rebuild the dictionary of the head sector
+            history_daily_t summary;
+            uint32_t minute = 0;
+            size_t offset = 0;
+            while (offset < payload_len)
+            {
+                size_t n = decode_summary(payload + offset, payload_len - offset, head_dict, day, &minute, &summary);
+                if (n == 0) break;
+                offset += n;
+            }
+        }
+        if (seq != head_seq) continue;
+        head_offset = pos;
+        for (size_t i = pos; i < HISTORY_PAGE_SIZE; i++)
+        {
+            if (block[i] != 0xFF)
+            {
+                ESP_LOGW(_tag, "Torn block at byte %u of sector %u, the sector is closed", (unsigned)pos, head_seq);
+                head_offset = HISTORY_PAGE_SIZE;
+                stats.torn_blocks++;
+                break;
+            }
+        }
+    }
+    ESP_LOGI(_tag, "Summaries in sectors [%u, %u], raw entries from %u not summarized", oldest_seq, head_seq, rollup_entry);
+}
+
+// NULL if the UID is new and its summary would not fit in the block
+history_daily_t* HistoryRollup::table_slot(const uint8_t *uid, uint8_t uid_len)
+{
+    // linear probing
+    uint32_t hash = uid_hash(uid, uid_len);
+    for (uint32_t i = 0; i < HISTORY_ROLLUP_INDEX_SIZE; i++)
+    {
+        uint16_t *slot = &index[(hash + i) & (HISTORY_ROLLUP_INDEX_SIZE - 1)];
+        if (*slot == 0)
+        {
+            // raw UID, count, first minute and span of 2 bytes at most
+            size_t size = 1 + uid_len + 1 + 2 + 2;
+            if (table_nb == HISTORY_ROLLUP_UIDS || table_bytes + size > max_payload) return NULL;
+            table_bytes += size;
+            history_daily_t *summary = &table[table_nb++];
+            *slot = table_nb;
+            summary->count = 0;
+            summary->uid_len = uid_len;
+            memcpy(summary->uid, uid, uid_len);
+            return summary;
+        }
+        history_daily_t *summary = &table[*slot - 1];
+        if (summary->uid_len == uid_len && memcmp(summary->uid, uid, uid_len) == 0) return summary;
+    }
+    return NULL;
+}
+
+// UIDs going raw join the head dictionary, restore nb_uids to undo
+size_t HistoryRollup::encode_block(uint8_t *out, uint32_t day, uint32_t end_entry)
+{
+    size_t len = 3;
+    out[0] = HISTORY_ROLLUP_TAG_BLOCK;
+    len += put_varint(out + len, day);
+    len += put_varint(out + len, end_entry);
+    size_t payload = len;
+    uint32_t day_start = day * SECONDS_PER_DAY;
+    uint32_t prev_minute = 0;
+    for (uint32_t i = 0; i < table_nb; i++)
+    {
+        const history_daily_t *summary = &table[i];
+        int index = dict_find(head_dict, summary->uid, summary->uid_len);
+        if (index >= 0) out[len++] = HISTORY_ROLLUP_TAG_SLOT + index;
+        else
+        {
+            out[len++] = summary->uid_len;
+            memcpy(out + len, summary->uid, summary->uid_len);
+            len += summary->uid_len;
+            dict_add(head_dict, summary->uid, summary->uid_len);
+        }
+        uint32_t first_minute = (summary->first_seen - day_start) / 60;
+        uint32_t last_minute = (summary->last_seen - day_start) / 60;
+        len += put_varint(out + len, summary->count);
+        len += put_varint(out + len, first_minute - prev_minute);
+        len += put_varint(out + len, last_minute - first_minute);
+        prev_minute = first_minute;
+    }
+    out[1] = (uint8_t)(len - payload);
+    out[2] = (uint8_t)((len - payload) >> 8);
+    out[len] = crc8(out, len, 0);
+    return len + 1;
+}
+
+void HistoryRollup::write_block(uint32_t day, uint32_t end_entry)
+{
+    qsort(table, table_nb, sizeof(history_daily_t), compare_first_seen);
+    uint8_t nb_uids = head_dict->nb_uids;
+    size_t len = 0;
+    if (head_seq != UINT32_MAX)
+    {
+        len = encode_block(block, day, end_entry);
+        if (head_offset + len > HISTORY_PAGE_SIZE)
+        {
+            head_dict->nb_uids = nb_uids;
+            len = 0;
+        }
+    }
+    if (len == 0)
+    {
+        // the block opens the next sector, which drops the oldest one once the ring is full
+        uint32_t seq = head_seq + 1;
+        if (seq >= nb_sectors && seq - nb_sectors >= oldest_seq)
+            oldest_seq = seq - nb_sectors + 1;
+        LOG_ERR(_tag, esp_partition_erase_range(db.partition, sector_offset(seq), HISTORY_PAGE_SIZE));
+        stats.erases++;
+        head_seq = seq;
+        head_offset = 0;
+        head_dict->nb_uids = 0;
+        history_rollup_header_t header = {seq, day, HISTORY_ROLLUP_MAGIC};
+        memcpy(block, &header, sizeof(header));
+        len = sizeof(header) + encode_block(block + sizeof(header), day, end_entry);
+    }
+    // summarize() keeps the table within an empty sector.
+    // The tag is programmed last: a cut block starts with 0xFF and closes the sector at boot.
+    size_t tag = head_offset == 0 ? sizeof(history_rollup_header_t) : 0;
+    block[tag] = 0xFF;
+    LOG_ERR(_tag, esp_partition_write(db.partition, sector_offset(head_seq) + head_offset, block, len));
+    block[tag] = HISTORY_ROLLUP_TAG_BLOCK;
+    LOG_ERR(_tag, esp_partition_write(db.partition, sector_offset(head_seq) + head_offset + tag, block + tag, 1));
+    head_offset += len;
+    stats.blocks++;
+    stats.bytes_written += len + 1;
+    stats.summaries += table_nb;
+}
+
+void HistoryRollup::skip_lost()
+{
+    if (rollup_entry >= db.oldest_entry) return;
+    ESP_LOGW(_tag, "Entries [%u, %u[ were overwritten before being summarized", rollup_entry, db.oldest_entry);
+    stats.lost_entries += db.oldest_entry - rollup_entry;
+    rollup_entry = db.oldest_entry;
+}
+
+uint32_t HistoryRollup::due_entry()
+{
+    // sector erased once the head moved HISTORY_ROLLUP_LEAD sectors further
+    uint32_t seq = db.head_seq + 1 + HISTORY_ERASE_AHEAD + HISTORY_ROLLUP_LEAD;
+    if (db.head_seq == UINT32_MAX || seq < db.nb_sectors) return 0;
+    uint32_t kept = seq - db.nb_sectors + 1;
+    if (kept <= db.oldest_seq) return db.oldest_entry;
+    if (kept > db.head_seq) return db.next_entry;
+    return db.sector_first_entry(kept);
+}
+
+void HistoryRollup::summarize()
+{
+    HistoryIterator it(db, rollup_entry);
+    history_entry_t record;
+    if (!it.next(&record)) return;
+    uint32_t day = record.timestamp / SECONDS_PER_DAY;
+
+    table = (history_daily_t*) malloc(HISTORY_ROLLUP_UIDS * sizeof(history_daily_t));
+    assert(table != NULL);
+    index = (uint16_t*) calloc(HISTORY_ROLLUP_INDEX_SIZE, sizeof(uint16_t));
+    assert(index != NULL);
+    table_nb = 0;
+    table_bytes = 0;
+    uint32_t end_entry = rollup_entry;
+    do
+    {
+        if (record.timestamp / SECONDS_PER_DAY != day) break;
+        // the day goes on in the next block once this one is full
+        history_daily_t *summary = table_slot(record.uid, record.uid_len);
+        if (summary == NULL) break;
+        if (summary->count == 0)
+        {
+            summary->day = day;
+            summary->first_seen = record.timestamp;
+            summary->last_seen = record.timestamp;
+        }
+        else
+        {
+            size_t grow = varint_size(summary->count + 1) - varint_size(summary->count);
+            if (table_bytes + grow > max_payload) break;
+            table_bytes += grow;
+        }
+        if (record.timestamp < summary->first_seen) summary->first_seen = record.timestamp;
+        if (record.timestamp > summary->last_seen) summary->last_seen = record.timestamp;
+        summary->count++;
+        end_entry = record.entry + 1;
+    } while (it.next(&record));
+
+    write_block(day, end_entry);
+    stats.entries += end_entry - rollup_entry;
+    ESP_LOGD(_tag, "Day %u: entries [%u, %u[ in %u summaries", day, rollup_entry, end_entry, table_nb);
+    rollup_entry = end_entry;
+    free(table);
+    free(index);
+    table = NULL;
+    index = NULL;
+}
+
+bool HistoryRollup::compact()
+{
+    skip_lost();
+    if (rollup_entry >= db.next_entry || rollup_entry >= due_entry()) return false;
+    summarize();
+    return true;
+}
+
+void HistoryRollup::cover(uint32_t entry)
+{
+    skip_lost();
+    while (rollup_entry < entry && rollup_entry < db.next_entry)
+    {
+        summarize();
+        stats.forced++;
+    }
+}
+
+uint32_t HistoryRollup::get_rollup_entry() const
+{
+    return rollup_entry;
+}
+
+bool HistoryRollup::get_days(uint32_t *first_day, uint32_t *last_day)
+{
+    if (db.get_nb_entries() == 0 && head_seq == UINT32_MAX) return false;
+    *last_day = db.head_max_time / SECONDS_PER_DAY;
+    // the oldest sector may have been erased for a new one when the power went off
+    history_rollup_header_t header;
+    for (uint32_t seq = oldest_seq; head_seq != UINT32_MAX && seq <= head_seq; seq++)
+    {
+        if (!read_header(seq, &header)) continue;
+        *first_day = header.first_day;
+        return true;
+    }
+    history_entry_t record;
+    HistoryIterator it(db, db.oldest_entry);
+    if (!it.next(&record)) return false;
+    *first_day = record.timestamp / SECONDS_PER_DAY;
+    return true;
+}
+
+static void merge_summary(history_daily_t *out, uint32_t *nb, uint32_t max, const history_daily_t *summary)
+{
+    uint32_t i = 0;
+    while (i < *nb && (out[i].uid_len != summary->uid_len || memcmp(out[i].uid, summary->uid, summary->uid_len))) i++;
+    if (i == *nb)
+    {
+        if (*nb < max) out[(*nb)++] = *summary;
+        return;
+    }
+    out[i].count += summary->count;
+    if (summary->first_seen < out[i].first_seen) out[i].first_seen = summary->first_seen;
+    if (summary->last_seen > out[i].last_seen) out[i].last_seen = summary->last_seen;
+}
+
+uint32_t HistoryRollup::get_day(uint32_t day, history_daily_t *out, uint32_t max)
+{
+    uint32_t nb = 0;
+    history_daily_t summary;
+    if (head_seq != UINT32_MAX)
+    {
+        history_rollup_dict_t *dict = (history_rollup_dict_t*) malloc(sizeof(history_rollup_dict_t));
+        assert(dict != NULL);
+        for (uint32_t seq = oldest_seq; seq <= head_seq; seq++)
+        {
+            // a sector only holds days up to the first one of the next sector
+            history_rollup_header_t next;
+            if (seq < head_seq && read_header(seq + 1, &next) && next.first_day < day) continue;
+            if (!load(seq)) continue;
+            history_rollup_header_t header;
+            memcpy(&header, block, sizeof(header));
+            if (header.first_day > day) break;
+
+            dict->nb_uids = 0;
+            size_t pos = sizeof(header);
+            size_t len;
+            uint32_t block_day, end_entry;
+            const uint8_t *payload;
+            size_t payload_len;
+            while ((len = decode_block(block + pos, HISTORY_PAGE_SIZE - pos, &block_day, &end_entry, &payload, &payload_len)))
+            {
+                pos += len;
+                uint32_t minute = 0;
+                size_t offset = 0;
+                while (offset < payload_len)
+                {
+                    size_t n = decode_summary(payload + offset, payload_len - offset, dict, block_day, &minute, &summary);
+                    if (n == 0) break;
+                    offset += n;
+                    if (block_day == day) merge_summary(out, &nb, max, &summary);
+                }
+            }
+        }
+        free(dict);
+    }
+
+    // scans of the day not summarized yet
+    uint32_t first, end;
+    if (!db.get_time_range((time_t)day * SECONDS_PER_DAY, (time_t)(day + 1) * SECONDS_PER_DAY, &first, &end)) return nb;
+    if (first < rollup_entry) first = rollup_entry;
+    HistoryIterator it(db, first);
+    history_entry_t record;
+    summary.day = day;
+    summary.count = 1;
+    while (first < end && it.next(&record) && record.entry < end)
+    {
+        if (record.timestamp / SECONDS_PER_DAY != day) continue;
+        summary.first_seen = record.timestamp / 60 * 60;
+        summary.last_seen = summary.first_seen;
+        summary.uid_len = record.uid_len;
+        memcpy(summary.uid, record.uid, record.uid_len);
+        merge_summary(out, &nb, max, &summary);
+    }
+    return nb;
+}
+
+const history_rollup_stats_t& HistoryRollup::get_stats() const
+{
+    return stats;
+}
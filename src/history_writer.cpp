@@ -0,0 +1,196 @@
+#include "history_writer.h"
+#include <cstring>
+#include "esp_attr.h"
+#include "esp_log.h"
+
+
+HistoryWriter::HistoryWriter(ScanHistoryDB &db, size_t queue_len) : db(db)
+{
+    queue = xQueueCreate(queue_len, sizeof(history_event_t));
+    assert(queue != NULL);
+    db_lock = xSemaphoreCreateMutex();
+    assert(db_lock != NULL);
+    synced = xSemaphoreCreateBinary();
+    assert(synced != NULL);
+}
+
+HistoryWriter::~HistoryWriter()
+{
+    if (task)
+    {
+        // the task only blocks on the queue or the lock, never in the middle of a batch
+        xSemaphoreTake(db_lock, portMAX_DELAY);
+        vTaskDelete(task);
+        xSemaphoreGive(db_lock);
+    }
+    vQueueDelete(queue);
+    vSemaphoreDelete(db_lock);
+    vSemaphoreDelete(synced);
+}
+
+esp_err_t HistoryWriter::start(UBaseType_t priority, BaseType_t core)
+{
+    if (task) return ESP_ERR_INVALID_STATE;
+    if (xTaskCreatePinnedToCore(task_main, _tag, HISTORY_WRITER_STACK, this, priority, &task, core) != pdPASS)
+    {
+        ESP_LOGE(_tag, "Fail to create the writer task");
+        task = NULL;
+        return ESP_ERR_NO_MEM;
+    }
+    return ESP_OK;
+}
+
+void HistoryWriter::task_main(void *arg)
+{
+    ((HistoryWriter*)arg)->run();
+}
+
+void HistoryWriter::run()
+{
+    history_event_t event;
+    while (true)
+    {
+        // wake up at least once per flush period so that buffered scans reach the flash
+        if (xQueueReceive(queue, &event, pdMS_TO_TICKS(HISTORY_FLUSH_PERIOD_MS)) != pdTRUE)
+        {
+            xSemaphoreTake(db_lock, portMAX_DELAY);
+            db.flush_if_due();
+            xSemaphoreGive(db_lock);
+            continue;
+        }
+
+        uint32_t nb_written = 0;
+        bool sync = false;
+        uint32_t sync_seq = 0;
+        xSemaphoreTake(db_lock, portMAX_DELAY);
+        do
+        {
+            // scans posted after a sync request wait for the next batch
+            if (event.uid_len == HISTORY_EVENT_SYNC)
+            {
+                sync = true;
+                sync_seq = event.timestamp;
+                break;
+            }
+            db.add_history(event.uid, event.uid_len, event.timestamp);
+            nb_written++;
+        } while (nb_written < HISTORY_WRITER_BATCH && xQueueReceive(queue, &event, 0) == pdTRUE);
+        if (sync)
+        {
+            db.flush();
+            while (db.compact());
+            while (db.erase_ahead());
+            db.checkpoint_usage();
+        }
+        else db.flush_if_due();
+        xSemaphoreGive(db_lock);
+
+        portENTER_CRITICAL(&stats_mux);
+        stats.written += nb_written;
+        if (nb_written) stats.batches++;
+        if (sync)
+        {
+            stats.syncs++;
+            sync_done = sync_seq;
+        }
+        portEXIT_CRITICAL(&stats_mux);
+        if (sync) xSemaphoreGive(synced);
+    }
+}
+
+// called with stats_mux held, from tasks and ISRs
+void IRAM_ATTR HistoryWriter::count_post(bool queued, UBaseType_t depth)
+{
+    stats.posted++;
+    if (!queued) stats.dropped++;
+    if (depth > stats.max_depth) stats.max_depth = depth;
+}
+
+bool HistoryWriter::post(const uint8_t *uid, uint8_t uid_len, time_t timestamp)
+{
+    if (uid_len > HISTORY_UID_MAX_SIZE) return false;
+    history_event_t event;
+    event.timestamp = (uint32_t)timestamp;
+    event.uid_len = uid_len;
+    memcpy(event.uid, uid, uid_len);
+    bool queued = xQueueSendToBack(queue, &event, 0) == pdTRUE;
+    UBaseType_t depth = uxQueueMessagesWaiting(queue);
+    portENTER_CRITICAL(&stats_mux);
+    count_post(queued, depth);
+    portEXIT_CRITICAL(&stats_mux);
+    if (!queued) ESP_LOGW(_tag, "Queue full, scan dropped");
+    return queued;
+}
+
+bool HistoryWriter::post(const Uid &uid, time_t timestamp)
+{
+    return post(uid.data(), uid.size(), timestamp);
+}
+
+bool IRAM_ATTR HistoryWriter::post_from_isr(const uint8_t *uid, uint8_t uid_len, time_t timestamp, BaseType_t *woken)
+{
+    if (uid_len > HISTORY_UID_MAX_SIZE) return false;
+    history_event_t event;
+    event.timestamp = (uint32_t)timestamp;
+    event.uid_len = uid_len;
+    for (uint8_t i = 0; i < uid_len; i++) event.uid[i] = uid[i];
+    bool queued = xQueueSendToBackFromISR(queue, &event, woken) == pdTRUE;
+    UBaseType_t depth = uxQueueMessagesWaitingFromISR(queue);
+    portENTER_CRITICAL_ISR(&stats_mux);
+    count_post(queued, depth);
+    portEXIT_CRITICAL_ISR(&stats_mux);
+    return queued;
+}
+
+bool IRAM_ATTR HistoryWriter::post_from_isr(const Uid &uid, time_t timestamp, BaseType_t *woken)
+{
+    return post_from_isr(uid.data(), uid.size(), timestamp, woken);
+}
+
+bool HistoryWriter::sync(TickType_t timeout)
+{
+    history_event_t event = {};
+    event.uid_len = HISTORY_EVENT_SYNC;
+    portENTER_CRITICAL(&stats_mux);
+    uint32_t seq = ++sync_requested;
+    portEXIT_CRITICAL(&stats_mux);
+    event.timestamp = seq;
+    TimeOut_t start;
+    vTaskSetTimeOutState(&start);
+    if (xQueueSendToBack(queue, &event, timeout) != pdTRUE) return false;
+    // synced may be given late by a request that timed out, or for another
+    // task's request: only the number of the last request done tells
+    while (true)
+    {
+        portENTER_CRITICAL(&stats_mux);
+        bool done = (int32_t)(sync_done - seq) >= 0;
+        portEXIT_CRITICAL(&stats_mux);
+        if (done) return true;
+        if (xTaskCheckForTimeOut(&start, &timeout) == pdTRUE) return false;
+        xSemaphoreTake(synced, timeout);
+    }
+}
+
+ScanHistoryDB& HistoryWriter::acquire()
+{
+    xSemaphoreTake(db_lock, portMAX_DELAY);
+    return db;
+}
+
+void HistoryWriter::release()
+{
+    xSemaphoreGive(db_lock);
+}
+
+uint32_t HistoryWriter::get_depth() const
+{
+    return uxQueueMessagesWaiting(queue);
+}
+
+history_writer_stats_t HistoryWriter::get_stats()
+{
+    portENTER_CRITICAL(&stats_mux);
+    history_writer_stats_t copy = stats;
+    portEXIT_CRITICAL(&stats_mux);
+    return copy;
+}
@@ -0,0 +1,297 @@
+#include "qr_frame.h"
+#include <string.h>
+
+#define QR_FRAME_LOW_PERCENT 1
+#define QR_FRAME_HIGH_PERCENT 99
+#define QR_FRAME_MIN_CONTRAST 8 // below, no edge nor run is looked for
+#define QR_FRAME_EDGE_SHARE 8 // a step of luma counts as an edge above 1/8 of the contrast
+#define QR_FRAME_WINDOW 32 // samples of the local mean a pixel is dark or light against
+
+// 1:1:3:1:1 within half a module, as decoders check finder patterns
+static bool is_finder(const uint16_t *runs)
+{
+    uint32_t total = runs[0] + runs[1] + runs[2] + runs[3] + runs[4];
+    if (total < 7) return false;
+    // in sevenths of the total: a module is total, the center 3 * total
+    for (uint8_t i = 0; i < 5; i++)
+    {
+        if (i == 2) continue;
+        int32_t diff = 7 * (int32_t)runs[i] - (int32_t)total;
+        if (2 * (diff < 0 ? -diff : diff) >= (int32_t)total) return false;
+    }
+    int32_t diff = 7 * (int32_t)runs[2] - 3 * (int32_t)total;
+    return 2 * (diff < 0 ? -diff : diff) < 3 * (int32_t)total;
+}
+
+// Runs of the column through the center of a candidate found on a row: a
+// finder pattern is square, a row crossing stripes or a rectangle is not.
+// The column is read a sample every `step` bytes, `rows` samples long.
+static bool cross_check(const uint8_t *column, uint32_t step, uint32_t rows, uint32_t y, int32_t threshold,
+                        uint32_t total)
+{
+    if (column[y * step] >= threshold) return false;
+    uint16_t runs[5] = {};
+    int32_t i = y;
+    while (i >= 0 && column[i * step] < threshold && runs[2] <= total) runs[2]++, i--;
+    while (i >= 0 && column[i * step] >= threshold && runs[1] <= total) runs[1]++, i--;
+    while (i >= 0 && column[i * step] < threshold && runs[0] <= total) runs[0]++, i--;
+    i = y + 1;
+    while (i < (int32_t)rows && column[i * step] < threshold && runs[2] <= total) runs[2]++, i++;
+    while (i < (int32_t)rows && column[i * step] >= threshold && runs[3] <= total) runs[3]++, i++;
+    while (i < (int32_t)rows && column[i * step] < threshold && runs[4] <= total) runs[4]++, i++;
+    uint32_t vertical = runs[0] + runs[1] + runs[2] + runs[3] + runs[4];
+    return 2 * vertical >= total && vertical <= 2 * total && is_finder(runs);
+}
+
+// Steps of luma between samples of a row at least min_edge, summed and
+// squared. STEP 0 for a step known at run time only, 1 lets the compiler
+// vectorize the loop of a frame read at every pixel.
+template<uint32_t STEP>
+static void sum_edges(const uint8_t *row, uint32_t len, int32_t min_edge, uint32_t *sum_d, uint64_t *sum_d2,
+                      uint32_t step=STEP)
+{
+    step = STEP ? STEP : step;
+    uint32_t sum = 0;
+    uint64_t sum2 = 0;
+    for (uint32_t x = step; x < len; x += step)
+    {
+        int32_t d = (int32_t)row[x] - row[x - step];
+        d = d < 0 ? -d : d;
+        d = d >= min_edge ? d : 0;
+        sum += d;
+        sum2 += d * d;
+    }
+    *sum_d += sum;
+    *sum_d2 += sum2;
+}
+
+void qr_frame_measure(const uint8_t *image, uint32_t width, uint32_t height, qr_frame_quality_t *quality,
+                      const qr_gate_t *gate)
+{
+    *quality = {};
+    if (width < 2 || height == 0) return;
+    // read as a frame of about QR_FRAME_BASE_SIZE, a sample every `scale` pixels and rows
+    uint32_t scale = (width < height ? width : height) / QR_FRAME_BASE_SIZE;
+    scale = scale ? scale : 1;
+    uint32_t samples = width / scale;
+    uint32_t rows = height / scale;
+    uint32_t stride = scale * width;
+
+    uint16_t histogram[256];
+    memset(histogram, 0, sizeof(histogram));
+    uint32_t nb_pixels = 0;
+    for (uint32_t y = QR_FRAME_HIST_STEP / 2; y < rows; y += QR_FRAME_HIST_STEP)
+    {
+        const uint8_t *row = image + y * stride;
+        for (uint32_t x = QR_FRAME_HIST_STEP / 2; x < samples; x += QR_FRAME_HIST_STEP) histogram[row[x * scale]]++;
+        nb_pixels += (samples - QR_FRAME_HIST_STEP / 2 + QR_FRAME_HIST_STEP - 1) / QR_FRAME_HIST_STEP;
+    }
+    uint32_t low_count = nb_pixels * QR_FRAME_LOW_PERCENT / 100;
+    uint32_t high_count = nb_pixels * QR_FRAME_HIGH_PERCENT / 100;
+    uint32_t count = 0;
+    uint32_t luma = 0;
+    for (; luma < 255 && count + histogram[luma] <= low_count; luma++) count += histogram[luma];
+    quality->low = luma;
+    for (; luma < 255 && count + histogram[luma] <= high_count; luma++) count += histogram[luma];
+    quality->high = luma;
+    int32_t contrast = quality->high - quality->low;
+    if (contrast < QR_FRAME_MIN_CONTRAST || (gate && contrast < gate->min_contrast)) return;
+
+    // edges first, a loop without branches the compiler can unroll or vectorize
+    int32_t min_edge = contrast / QR_FRAME_EDGE_SHARE;
+    uint64_t sum_d2 = 0;
+    uint32_t sum_d = 0;
+    for (uint32_t y = QR_FRAME_EDGE_STEP / 2; y < rows; y += QR_FRAME_EDGE_STEP)
+    {
+        if (scale == 1) sum_edges<1>(image + y * stride, samples, min_edge, &sum_d, &sum_d2);
+        else sum_edges<0>(image + y * stride, samples * scale, min_edge, &sum_d, &sum_d2, scale);
+    }
+    if (sum_d == 0) return;
+    // sum(d^2) / sum(d) is the step of luma per sample across the edges
+    uint64_t sharpness = 256 * sum_d2 / sum_d / contrast;
+    quality->sharpness = sharpness > UINT16_MAX ? UINT16_MAX : sharpness;
+    if (gate && quality->sharpness < gate->min_sharpness) return;
+
+    // a pixel changes side when it is 1/8 of the contrast past the local mean
+    int32_t margin = contrast / QR_FRAME_EDGE_SHARE * QR_FRAME_WINDOW;
+    for (uint32_t y = QR_FRAME_ROW_STEP / 2; y < rows; y += QR_FRAME_ROW_STEP)
+    {
+        const uint8_t *row = image + y * stride;
+        // luma over the window centered on x, the edges of the row repeated
+        int32_t sum = QR_FRAME_WINDOW / 2 * row[0];
+        for (uint32_t i = 0; i < QR_FRAME_WINDOW / 2; i++) sum += row[(i < samples ? i : samples - 1) * scale];
+        // the last 5 runs of the row, the newest last
+        uint16_t runs[5] = {};
+        uint32_t nb_runs = 0;
+        bool dark = row[0] * QR_FRAME_WINDOW < sum;
+        uint32_t run_start = 0;
+        for (uint32_t x = 0; x <= samples; x++)
+        {
+            bool pixel_dark = !dark;
+            if (x < samples)
+            {
+                int32_t luma = row[x * scale] * QR_FRAME_WINDOW;
+                pixel_dark = dark ? luma <= sum + margin : luma < sum - margin;
+                sum += row[(x + QR_FRAME_WINDOW / 2 < samples ? x + QR_FRAME_WINDOW / 2 : samples - 1) * scale];
+                sum -= row[(x >= QR_FRAME_WINDOW / 2 ? x - QR_FRAME_WINDOW / 2 : 0) * scale];
+                if (pixel_dark == dark) continue;
+            }
+            // a run ends at x, or the row does
+            runs[0] = runs[1];
+            runs[1] = runs[2];
+            runs[2] = runs[3];
+            runs[3] = runs[4];
+            runs[4] = x - run_start;
+            run_start = x;
+            nb_runs++;
+            if (dark && nb_runs >= 5 && is_finder(runs))
+            {
+                uint32_t total = runs[0] + runs[1] + runs[2] + runs[3] + runs[4];
+                uint32_t center = x - runs[4] - runs[3] - runs[2] / 2 - 1;
+                if (cross_check(image + center * scale, stride, rows, y, sum / QR_FRAME_WINDOW, total))
+                {
+                    if (quality->finders < QR_FRAME_MAX_FINDERS)
+                        quality->found[quality->finders] = {(uint16_t)(center * scale), (uint16_t)(y * scale),
+                                                            (uint16_t)(total * scale)};
+                    quality->finders++;
+                }
+            }
+            dark = pixel_dark;
+        }
+    }
+}
+
+bool qr_frame_gate(const qr_frame_quality_t *quality, const qr_gate_t *gate)
+{
+    return quality->high - quality->low >= gate->min_contrast && quality->sharpness >= gate->min_sharpness
+           && quality->finders >= gate->min_finders;
+}
+
+bool qr_frame_roi(const qr_frame_quality_t *quality, uint32_t width, uint32_t height, qr_roi_t *roi)
+{
+    // the candidates at the same place on nearby rows are one finder pattern
+    typedef struct {
+        int32_t sum_x;
+        int32_t sum_y;
+        int32_t sum_size;
+        int32_t hits;
+        int32_t last_y;
+    } pattern_t;
+    pattern_t patterns[QR_FRAME_MAX_FINDERS];
+    uint32_t nb_patterns = 0;
+    uint32_t nb_found = quality->finders < QR_FRAME_MAX_FINDERS ? quality->finders : QR_FRAME_MAX_FINDERS;
+    for (uint32_t i = 0; i < nb_found; i++)
+    {
+        const qr_finder_t &finder = quality->found[i];
+        uint32_t p = 0;
+        for (; p < nb_patterns; p++)
+        {
+            int32_t dx = finder.x - patterns[p].sum_x / patterns[p].hits;
+            if (2 * (dx < 0 ? -dx : dx) <= finder.size && finder.y - patterns[p].last_y <= finder.size) break;
+        }
+        if (p == nb_patterns) patterns[nb_patterns++] = {};
+        patterns[p].sum_x += finder.x;
+        patterns[p].sum_y += finder.y;
+        patterns[p].sum_size += finder.size;
+        patterns[p].hits++;
+        patterns[p].last_y = finder.y;
+    }
+    if (nb_patterns < 3) return false;
+
+    int32_t px[QR_FRAME_MAX_FINDERS], py[QR_FRAME_MAX_FINDERS], psize[QR_FRAME_MAX_FINDERS];
+    for (uint32_t p = 0; p < nb_patterns; p++)
+    {
+        px[p] = patterns[p].sum_x / patterns[p].hits;
+        py[p] = patterns[p].sum_y / patterns[p].hits;
+        psize[p] = patterns[p].sum_size / patterns[p].hits;
+    }
+
+    // the 3 patterns of a size at the corners of a right isosceles triangle,
+    // crossed by the most rows: a stray candidate in the data or the scene
+    // does not make one with 2 finder patterns
+    int32_t best_hits = 0;
+    uint32_t best[3] = {};
+    for (uint32_t i = 0; i < nb_patterns; i++)
+    for (uint32_t j = i + 1; j < nb_patterns; j++)
+    for (uint32_t k = j + 1; k < nb_patterns; k++)
+    {
+        const uint32_t t[3] = {i, j, k};
+        int32_t hits = patterns[i].hits + patterns[j].hits + patterns[k].hits;
+        if (hits <= best_hits) continue;
+        int32_t min_size = psize[i], max_size = psize[i];
+        int32_t sides[3];
+        for (uint32_t n = 0; n < 3; n++)
+        {
+            min_size = psize[t[n]] < min_size ? psize[t[n]] : min_size;
+            max_size = psize[t[n]] > max_size ? psize[t[n]] : max_size;
+            uint32_t a = t[(n + 1) % 3], b = t[(n + 2) % 3];
+            sides[n] = (px[a] - px[b]) * (px[a] - px[b]) + (py[a] - py[b]) * (py[a] - py[b]);
+        }
+        if (max_size > 2 * min_size) continue;
+        uint32_t n = sides[0] >= sides[1] && sides[0] >= sides[2] ? 0 : sides[1] >= sides[2] ? 1 : 2;
+        int32_t short_a = sides[(n + 1) % 3], short_b = sides[(n + 2) % 3];
+        int32_t shorts = short_a + short_b;
+        // squared: the short sides within 3/4 of each other, the angle within
+        // about 15 degrees of right, the patterns 14 modules apart at least
+        int32_t min_short = short_a < short_b ? short_a : short_b;
+        int32_t max_short = short_a > short_b ? short_a : short_b;
+        if (16 * min_short < 9 * max_short) continue;
+        if (4 * (sides[n] > shorts ? sides[n] - shorts : shorts - sides[n]) > shorts) continue;
+        if (min_short < max_size * max_size) continue;
+        best_hits = hits;
+        best[0] = t[n];
+        best[1] = t[(n + 1) % 3];
+        best[2] = t[(n + 2) % 3];
+    }
+    if (best_hits == 0) return false;
+
+    // the corner pattern faces the longest side, the 4th corner of the code
+    // completes the parallelogram
+    int32_t x[4], y[4], size[3];
+    for (uint32_t k = 0; k < 3; k++)
+    {
+        x[k] = px[best[k]];
+        y[k] = py[best[k]];
+        size[k] = psize[best[k]];
+    }
+    x[3] = x[1] + x[2] - x[0];
+    y[3] = y[1] + y[2] - y[0];
+
+    // a module is 1/7 of a pattern
+    int32_t margin = (size[0] + size[1] + size[2]) * QR_ROI_MARGIN / 21;
+    int32_t x0 = x[0], x1 = x[0], y0 = y[0], y1 = y[0];
+    for (uint32_t k = 1; k < 4; k++)
+    {
+        x0 = x[k] < x0 ? x[k] : x0;
+        x1 = x[k] > x1 ? x[k] : x1;
+        y0 = y[k] < y0 ? y[k] : y0;
+        y1 = y[k] > y1 ? y[k] : y1;
+    }
+    x0 = x0 - margin < 0 ? 0 : (x0 - margin) / QR_ROI_ALIGN * QR_ROI_ALIGN;
+    y0 = y0 - margin < 0 ? 0 : (y0 - margin) / QR_ROI_ALIGN * QR_ROI_ALIGN;
+    x1 = (x1 + margin + QR_ROI_ALIGN - 1) / QR_ROI_ALIGN * QR_ROI_ALIGN;
+    y1 = (y1 + margin + QR_ROI_ALIGN - 1) / QR_ROI_ALIGN * QR_ROI_ALIGN;
+    x1 = x1 > (int32_t)width ? width : x1;
+    y1 = y1 > (int32_t)height ? height : y1;
+    if (x1 <= x0 || y1 <= y0) return false;
+    *roi = {(uint16_t)x0, (uint16_t)y0, (uint16_t)(x1 - x0), (uint16_t)(y1 - y0)};
+    return true;
+}
+
+void qr_frame_crop(const uint8_t *image, uint32_t width, const qr_roi_t *roi, uint8_t *out)
+{
+    const uint8_t *row = image + roi->y * width + roi->x;
+    // in place, a row never moves past the start of the next one
+    for (uint32_t y = 0; y < roi->height; y++, row += width, out += roi->width) memmove(out, row, roi->width);
+}
+
+void qr_frame_downsample(const uint8_t *image, uint32_t width, uint32_t height, uint8_t *out)
+{
+    // in place, a pixel is written behind the 4 it is read from
+    for (uint32_t y = 0; y + 1 < height; y += 2)
+    {
+        const uint8_t *top = image + y * width;
+        const uint8_t *bottom = top + width;
+        for (uint32_t x = 0; x + 1 < width; x += 2) *out++ = (top[x] + top[x + 1] + bottom[x] + bottom[x + 1] + 2) >> 2;
+    }
+}
@@ -0,0 +1,202 @@
+#include "qr_pipeline.h"
+#include <string.h>
+#include "esp_log.h"
+#include "esp_timer.h"
+
+
+QrPipeline::QrPipeline()
+{
+    frames = xQueueCreate(QR_PIPELINE_QUEUE_LEN, sizeof(camera_fb_t*));
+    assert(frames != NULL);
+    found = xSemaphoreCreateBinary();
+    assert(found != NULL);
+    stopped = xSemaphoreCreateCounting(2, 0);
+    assert(stopped != NULL);
+}
+
+QrPipeline::~QrPipeline()
+{
+    stop();
+    vQueueDelete(frames);
+    vSemaphoreDelete(found);
+    vSemaphoreDelete(stopped);
+}
+
+esp_err_t QrPipeline::start(BaseType_t camera_core, BaseType_t decoder_core, UBaseType_t priority)
+{
+    if (running) return ESP_ERR_INVALID_STATE;
+    stats = {};
+    stats.first_code_us = -1;
+    stats.code_level = QR_LEVEL_FULL;
+    if (adaptive) strategy.begin();
+    code_found = false;
+    xSemaphoreTake(found, 0);
+    running = true;
+    start_us = esp_timer_get_time();
+    if (xTaskCreatePinnedToCore(decoder_main, "qr_decoder", QR_DECODER_STACK, this, priority, &decoder_task,
+                                decoder_core) != pdPASS)
+    {
+        ESP_LOGE(_tag, "Fail to create the decoder task");
+        running = false;
+        decoder_task = NULL;
+        return ESP_ERR_NO_MEM;
+    }
+    if (xTaskCreatePinnedToCore(camera_main, "qr_camera", QR_CAMERA_STACK, this, priority, &camera_task,
+                                camera_core) != pdPASS)
+    {
+        ESP_LOGE(_tag, "Fail to create the camera task");
+        camera_task = NULL;
+        stop();
+        return ESP_ERR_NO_MEM;
+    }
+    return ESP_OK;
+}
+
+bool QrPipeline::wait(char *data, size_t size, TickType_t timeout)
+{
+    if (xSemaphoreTake(found, timeout) != pdTRUE) return false;
+    // written by the decoder before it gave the semaphore, never after
+    strncpy(data, this->data, size - 1);
+    data[size - 1] = 0;
+    return true;
+}
+
+void QrPipeline::stop()
+{
+    if (!running) return;
+    running = false;
+    // each task sees the flag within QR_PIPELINE_POLL_MS, or once the camera gives its frame
+    if (camera_task) xSemaphoreTake(stopped, portMAX_DELAY);
+    if (decoder_task) xSemaphoreTake(stopped, portMAX_DELAY);
+    camera_task = NULL;
+    decoder_task = NULL;
+    drain();
+    stats.elapsed_us = esp_timer_get_time() - start_us;
+}
+
+void QrPipeline::set_gate(const qr_gate_t &gate)
+{
+    if (!running) this->gate = gate;
+}
+
+void QrPipeline::set_crop(bool crop)
+{
+    if (!running) this->crop = crop;
+}
+
+void QrPipeline::set_adaptive(bool adaptive)
+{
+    if (!running) this->adaptive = adaptive;
+}
+
+void QrPipeline::drain()
+{
+    camera_fb_t *fb;
+    while (xQueueReceive(frames, &fb, 0) == pdTRUE) esp_camera_fb_return(fb);
+}
+
+void QrPipeline::camera_main(void *arg)
+{
+    QrPipeline *pipeline = (QrPipeline*)arg;
+    pipeline->capture();
+    xSemaphoreGive(pipeline->stopped);
+    vTaskDelete(NULL);
+}
+
+void QrPipeline::decoder_main(void *arg)
+{
+    QrPipeline *pipeline = (QrPipeline*)arg;
+    pipeline->decode();
+    xSemaphoreGive(pipeline->stopped);
+    vTaskDelete(NULL);
+}
+
+void QrPipeline::capture()
+{
+    while (running)
+    {
+        // blocks while the decoder holds a frame and another one is queued
+        camera_fb_t *fb = esp_camera_fb_get();
+        if (fb == NULL)
+        {
+            ESP_LOGW(_tag, "camera get failed");
+            vTaskDelay(pdMS_TO_TICKS(QR_PIPELINE_POLL_MS));
+            continue;
+        }
+        stats.captured++;
+        bool queued = false;
+        while (running && !queued) queued = xQueueSend(frames, &fb, pdMS_TO_TICKS(QR_PIPELINE_POLL_MS)) == pdTRUE;
+        if (!queued) esp_camera_fb_return(fb);
+    }
+}
+
+void QrPipeline::decode()
+{
+    {
+        // one scanner for the attempt, destroyed before the task deletes itself
+        CodeScanner scanner;
+        camera_fb_t *fb;
+        // after a crop without code, the next frame is decoded whole, in case the region was wrong
+        bool whole = false;
+        while (running)
+        {
+            if (xQueueReceive(frames, &fb, pdMS_TO_TICKS(QR_PIPELINE_POLL_MS)) != pdTRUE) continue;
+            CameraFrame frame(fb);
+            if (code_found)
+            {
+                stats.skipped++;
+                continue;
+            }
+            int64_t start = esp_timer_get_time();
+            qr_frame_quality_t quality;
+            qr_frame_measure(frame->buf, frame->width, frame->height, &quality, &gate);
+            bool pass = qr_frame_gate(&quality, &gate);
+            stats.gate_us += esp_timer_get_time() - start;
+            if (!pass)
+            {
+                stats.gated++;
+                continue;
+            }
+            start = esp_timer_get_time();
+            qr_roi_t roi;
+            bool cropped = !whole && crop && qr_frame_roi(&quality, frame->width, frame->height, &roi);
+            qr_level_t level = adaptive ? strategy.level() : QR_LEVEL_FULL;
+            // the frame is the decoder's until given back, cropped and downsampled in place
+            uint8_t *image = frame->buf;
+            uint32_t width = frame->width;
+            uint32_t height = frame->height;
+            stats.frame_pixels += width * height;
+            if (cropped)
+            {
+                qr_frame_crop(image, width, &roi, image);
+                width = roi.width;
+                height = roi.height;
+                stats.cropped++;
+            }
+            if (level == QR_LEVEL_HALF)
+            {
+                qr_frame_downsample(image, width, height, image);
+                width /= 2;
+                height /= 2;
+            }
+            int decoded = scanner.scan(image, width, height);
+            stats.scanned_pixels += width * height;
+            if (adaptive) strategy.report(level, decoded);
+            whole = cropped && !decoded;
+            int64_t end = esp_timer_get_time();
+            stats.scan_us += end - start;
+            stats.scanned++;
+            if (decoded)
+            {
+                esp_code_scanner_symbol_t result = scanner.result();
+                strncpy(data, result.data ? result.data : "", QR_PIPELINE_DATA_SIZE - 1);
+                data[QR_PIPELINE_DATA_SIZE - 1] = 0;
+                stats.first_code_us = end - start_us;
+                stats.code_level = level;
+                code_found = true;
+                xSemaphoreGive(found);
+            }
+        }
+    }
+    stats.decoder_stack_free = uxTaskGetStackHighWaterMark(NULL);
+}
@@ -0,0 +1,58 @@
+#include "qr_strategy.h"
+
+
+QrScanStrategy::QrScanStrategy(qr_level_t top) : top(top)
+{
+}
+
+void QrScanStrategy::begin()
+{
+    stats.attempts++;
+    misses = 0;
+    found = false;
+    for (uint32_t level = 0; level < QR_LEVELS; level++) tried[level] = false;
+    enter(stats.attempts % QR_STRATEGY_EXPLORE == 0 ? QR_LEVEL_HALF : learned());
+}
+
+void QrScanStrategy::enter(qr_level_t level)
+{
+    current = level;
+    misses = 0;
+    if (tried[level]) return;
+    tried[level] = true;
+    // past the history, both counts halve: the rate stays, newer attempts weigh more
+    if (stats.tries[level] >= QR_STRATEGY_HISTORY)
+    {
+        stats.tries[level] /= 2;
+        stats.codes[level] /= 2;
+    }
+    stats.tries[level]++;
+}
+
+void QrScanStrategy::report(qr_level_t level, bool decoded)
+{
+    stats.frames[level]++;
+    if (decoded)
+    {
+        if (!found && tried[level]) stats.codes[level]++;
+        found = true;
+        return;
+    }
+    if (found || level != current || current >= top) return;
+    if (++misses < QR_STRATEGY_MISSES) return;
+    stats.escalations++;
+    enter((qr_level_t)(current + 1));
+}
+
+qr_level_t QrScanStrategy::learned() const
+{
+    // the lowest level good enough, else the one that does best
+    int32_t best = -1;
+    for (uint32_t level = 0; level <= (uint32_t)top; level++)
+    {
+        if (stats.tries[level] == 0) continue;
+        if (100 * stats.codes[level] >= QR_STRATEGY_MIN_RATE * stats.tries[level]) return (qr_level_t)level;
+        if (best < 0 || stats.codes[level] * stats.tries[best] > stats.codes[best] * stats.tries[level]) best = level;
+    }
+    return best < 0 ? QR_LEVEL_HALF : (qr_level_t)best;
+}
@@ -0,0 +1,47 @@
+#include "uid.h"
+
+uint32_t uid_hash(const uint8_t *uid, uint8_t uid_len)
+{
+    uint32_t hash = 2166136261u;
+    for (uint8_t i = 0; i < uid_len; i++) hash = (hash ^ uid[i]) * 16777619u;
+    return hash;
+}
+
+Uid::Uid(const uint8_t *uid, uint8_t uid_len)
+{
+    if (uid_len == 0 || uid_len > UID_MAX_SIZE) return;
+    len = uid_len;
+    memcpy(bytes, uid, uid_len);
+}
+
+bool Uid::from_hex(const char *hex, Uid *out)
+{
+    size_t hex_len = strlen(hex);
+    if (hex_len == 0 || hex_len % 2 || hex_len / 2 > UID_MAX_SIZE) return false;
+    Uid uid;
+    for (size_t i = 0; i < hex_len; i++)
+    {
+        char c = hex[i];
+        uint8_t nibble;
+        if (c >= '0' && c <= '9') nibble = c - '0';
+        else if (c >= 'a' && c <= 'f') nibble = c - 'a' + 10;
+        else if (c >= 'A' && c <= 'F') nibble = c - 'A' + 10;
+        else return false;
+        uid.bytes[i / 2] = uid.bytes[i / 2] << 4 | nibble;
+    }
+    uid.len = hex_len / 2;
+    *out = uid;
+    return true;
+}
+
+char* Uid::to_hex(char *out) const
+{
+    static const char digits[] = "0123456789ABCDEF";
+    for (uint8_t i = 0; i < len; i++)
+    {
+        out[2*i] = digits[bytes[i] >> 4];
+        out[2*i + 1] = digits[bytes[i] & 0x0F];
+    }
+    out[2*len] = 0;
+    return out;
+}
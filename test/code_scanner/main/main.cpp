@@ -10,20 +10,44 @@
 #include "mbedtls/base64.h"
 #include "camera.h"
 #include "aes.h"
-#include "esp_code_scanner.h"
+#include "code_scanner.h"
 #include "misc.h"
 #include "esp_heap_caps.h"
+#include "esp_timer.h"
 
 static const char *TAG = "APP_CODE_SCANNER";
 const unsigned char dec_key[] = "#LogKerKey2022!!";//CONFIG_AES_KEY;
 const unsigned int keybits = 128;
 
+// What the loop used to pay on every frame: create, configure, scan and destroy
+// a scanner, with the heap it takes and gives back
+static void measure_per_frame_scanner(camera_fb_t *fb)
+{
+    size_t free_before = heap_caps_get_free_size(MALLOC_CAP_8BIT);
+    int64_t start = esp_timer_get_time();
+    esp_image_scanner_t *esp_scn = esp_code_scanner_create();
+    if (!esp_scn)
+    {
+        ESP_LOGE(TAG, "Fail to create ESP code scanner");
+        return;
+    }
+    esp_code_scanner_config_t config = {ESP_CODE_SCANNER_MODE_FAST, ESP_CODE_SCANNER_IMAGE_GRAY, fb->width, fb->height};
+    esp_code_scanner_set_config(esp_scn, config);
+    int64_t setup_us = esp_timer_get_time() - start;
+    esp_code_scanner_scan_image(esp_scn, fb->buf);
+    size_t held = free_before - heap_caps_get_free_size(MALLOC_CAP_8BIT);
+    start = esp_timer_get_time();
+    esp_code_scanner_destroy(esp_scn);
+    int64_t destroy_us = esp_timer_get_time() - start;
+    ESP_LOGI(TAG, "Scanner per frame: %lld us to create and configure, %lld us to destroy, %u bytes allocated "
+             "and freed on every frame", setup_us, destroy_us, (unsigned)held);
+}
+
 static void decode_task(void* arg)
 {
     int64_t time1, time2, time3;
     // Init AES
     size_t dec_len;
-    int num_codes;
     unsigned char dec_output[128];
     unsigned char dec_input[128];
     // Check AES key
@@ -32,49 +56,58 @@ static void decode_task(void* arg)
 
     // Init camera
     SANITY_CHECK_M(app_camera_init(), ESP_OK, TAG, "Fail to init camera");
-    camera_fb_t *fb = NULL;
     ESP_LOGI(TAG, "DMA free size: %zu bytes", heap_caps_get_free_size(MALLOC_CAP_DMA));
+    {
+        CameraFrame fb;
+        if (fb) measure_per_frame_scanner(fb.get());
+    }
 
-
+    // one scanner for all the frames
+    CodeScanner scanner;
+    uint32_t nb_frames = 0;
     while (1)
     {
-        fb = esp_camera_fb_get();
-        if (fb == NULL)
         {
-            ESP_LOGI(TAG, "camera get failed\n");
-            continue;
-        }
+            CameraFrame fb;
+            if (!fb)
+            {
+                ESP_LOGI(TAG, "camera get failed\n");
+                continue;
+            }
 
-        time1 = esp_timer_get_time();
-        // Decode Progress
-        esp_image_scanner_t *esp_scn = esp_code_scanner_create();
-        if(!esp_scn) ESP_LOGE(TAG, "Fail to create ESP code scanner");
-        esp_code_scanner_config_t config = {ESP_CODE_SCANNER_MODE_FAST, ESP_CODE_SCANNER_IMAGE_GRAY, fb->width, fb->height};
-        esp_code_scanner_set_config(esp_scn, config);
-        int decoded_num = esp_code_scanner_scan_image(esp_scn, fb->buf);
-        ESP_LOGI(TAG, "decoded_num %d", decoded_num);
-        // ESP_LOGI(TAG, "Image size: %zu bytes", fb->len);
-        if (decoded_num)
-        {
-            // Read QR code message
-            esp_code_scanner_symbol_t result = esp_code_scanner_result(esp_scn);
-            time2 = esp_timer_get_time();
-            ESP_LOGI(TAG, "Read QR code in %lld ms.", (time2 - time1) / 1000);
-            ESP_LOGI(TAG, "%s: \"%s\"", result.type_name, result.data);
+            nb_frames++;
+            time1 = esp_timer_get_time();
+            // Decode Progress
+            int decoded_num = scanner.scan(fb.get());
+            ESP_LOGI(TAG, "decoded_num %d", decoded_num);
+            // ESP_LOGI(TAG, "Image size: %zu bytes", fb->len);
+            if (decoded_num)
+            {
+                // Read QR code message
+                esp_code_scanner_symbol_t result = scanner.result();
+                time2 = esp_timer_get_time();
+                ESP_LOGI(TAG, "Read QR code in %lld ms.", (time2 - time1) / 1000);
+                ESP_LOGI(TAG, "%s: \"%s\"", result.type_name, result.data);
 
-            // Convert QR code from Base64 to hex
-            mbedtls_base64_decode(dec_input, 128, &dec_len, (const unsigned char *)result.data, strlen(result.data));
+                // Convert QR code from Base64 to hex
+                mbedtls_base64_decode(dec_input, 128, &dec_len, (const unsigned char *)result.data, strlen(result.data));
 
-            // Decode message using AES-ECB
-            aes_decrypt(dec_input, dec_len, dec_output, dec_key);
-            dec_output[dec_len] = 0;
-            time3 = esp_timer_get_time();
-            ESP_LOGI(TAG, "Decode AES in %lld ms.", (time3 - time2) / 1000);
-            ESP_LOGI(TAG, "QR message: %s", dec_output);
+                // Decode message using AES-ECB
+                aes_decrypt(dec_input, dec_len, dec_output, dec_key);
+                dec_output[dec_len] = 0;
+                time3 = esp_timer_get_time();
+                ESP_LOGI(TAG, "Decode AES in %lld ms.", (time3 - time2) / 1000);
+                ESP_LOGI(TAG, "QR message: %s", dec_output);
+            }
         }
-        esp_code_scanner_destroy(esp_scn);
 
-        esp_camera_fb_return(fb);
+        const code_scanner_stats_t &stats = scanner.get_stats();
+        if (nb_frames % 100 == 0 && stats.frames)
+        {
+            ESP_LOGI(TAG, "%u frames, %u decoded, %u scanner created in %lld us, %lld us a scan, %u bytes free",
+                     stats.frames, stats.decoded, stats.sessions, stats.setup_us, stats.scan_us / stats.frames,
+                     (unsigned)heap_caps_get_free_size(MALLOC_CAP_8BIT));
+        }
         vTaskDelay(10 / portTICK_PERIOD_MS);
     }
 }
@@ -0,0 +1,456 @@
+/* ScanHistoryDB benchmark
+   Appends a burst of scans and reports the append rate and the flash
+   traffic per record, with and without the write-back buffer.
+   Checks that the ends of the ring are found back after a reboot, and that
+   no sector erase happens in add_history when erase_ahead() runs in between.
+   Measures how many scans of a realistic mix of 4 and 7-byte UIDs fit in the
+   partition, and the record encode/decode throughput.
+   Compares entry-by-entry, range and memory-mapped reads of the full partition,
+   and time window lookups with a linear scan.
+   Checks the per-UID scan counters against the log, before and after a reboot.
+   Compares the scan path latency of a synchronous write with a post to the
+   HistoryWriter queue fed by two tasks.
+*/
+#include <stdio.h>
+#include <time.h>
+#include <string.h>
+#include <stdlib.h>
+#include "esp_log.h"
+#include "esp_system.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "database.h"
+#include "history_writer.h"
+#include "history_rollup.h"
+
+static const char *TAG = "HISTORY_BENCH";
+
+#define BENCH_NB_RECORDS 2000
+#define BENCH_EPOCH 1650000000 // first timestamp of the simulated scans
+#define NVS_ENTRY_SIZE 32 // bytes programmed by one nvs_set_u32
+#define BENCH_SCANS_PER_WAKEUP 50 // scans between two erase_ahead() passes
+#define BENCH_NB_USERS 500
+#define BENCH_RANGE_CHUNK 64 // entries per get_history_range() call
+#define BENCH_NB_WINDOWS 20
+#define BENCH_USAGE_SCANS 12345 // not a multiple of HISTORY_USAGE_CHECKPOINT: some scans are replayed at boot
+#define BENCH_WRITER_SCANS 2000 // per producer task
+#define BENCH_WRITER_BURST 8 // scans posted back to back, then the producer sleeps 1 tick
+#define OLD_RECORD_OVERHEAD 5 // fixed-size records before the compact encoding: marker + 32-bit time
+
+static const uint8_t bench_badge[] = {0x04, 0xA2, 0x00, 0x3D};
+
+static void bench_append(ScanHistoryDB &history_db, size_t batch_size, const char *name)
+{
+    Uid uid(bench_badge, sizeof(bench_badge));
+    history_db.clear_history();
+    history_db.set_batch_size(batch_size);
+    history_stats_t before = history_db.get_stats();
+
+    int64_t elapsed = 0;
+    int64_t max_latency = 0;
+    for (uint32_t i = 0; i < BENCH_NB_RECORDS; i++)
+    {
+        int64_t start = esp_timer_get_time();
+        history_db.add_history(uid, BENCH_EPOCH + i);
+        int64_t latency = esp_timer_get_time() - start;
+        elapsed += latency;
+        if (latency > max_latency) max_latency = latency;
+        if (i % BENCH_SCANS_PER_WAKEUP == 0) while (history_db.erase_ahead()); // idle state
+    }
+    int64_t start = esp_timer_get_time();
+    history_db.flush();
+    elapsed += esp_timer_get_time() - start;
+
+    history_stats_t after = history_db.get_stats();
+    uint32_t appends = after.appends - before.appends;
+    float data_bytes = (float)(after.flash_bytes_written - before.flash_bytes_written) / appends;
+    float nvs_bytes = (float)(after.nvs_commits - before.nvs_commits) * NVS_ENTRY_SIZE / appends;
+    ESP_LOGI(TAG, "%s: %u appends in %lld ms -> %.0f appends/s", name, appends,
+             (long long)(elapsed / 1000), appends * 1e6f / (elapsed ? elapsed : 1));
+    ESP_LOGI(TAG, "%s: %u flushes, flash bytes/record: %.2f data + %.2f NVS = %.2f", name,
+             after.flushes - before.flushes, data_bytes, nvs_bytes, data_bytes + nvs_bytes);
+    ESP_LOGI(TAG, "%s: max add_history latency %lld us, %u erases in add_history", name,
+             (long long)max_latency, after.sync_erases - before.sync_erases);
+}
+
+// Fill the log, wrapping around the ring if needed, then open it again as after a reboot
+static void bench_recovery(uint32_t nb_entries)
+{
+    Uid uid(bench_badge, sizeof(bench_badge));
+    uint32_t oldest, newest;
+    {
+        ScanHistoryDB history_db;
+        history_db.clear_history();
+        for (uint32_t i = 0; i < nb_entries; i++)
+        {
+            history_db.add_history(uid, BENCH_EPOCH + i);
+            if (i % BENCH_SCANS_PER_WAKEUP == 0) while (history_db.erase_ahead());
+        }
+        history_db.close();
+        oldest = history_db.get_oldest_entry();
+        newest = history_db.get_newest_entry();
+    }
+
+    int64_t start = esp_timer_get_time();
+    ScanHistoryDB history_db;
+    int64_t elapsed = esp_timer_get_time() - start;
+
+    bool ok = history_db.get_nb_entries() == (nb_entries ? newest - oldest + 1 : 0)
+              && history_db.get_oldest_entry() == (nb_entries ? oldest : 0);
+    if (ok && nb_entries > 0)
+    {
+        Uid uid_read;
+        time_t time_read;
+        history_db.get_history(history_db.get_newest_entry(), &uid_read, &time_read);
+        ok = time_read == (time_t)(BENCH_EPOCH + nb_entries - 1) && uid_read == uid;
+        history_db.get_history(history_db.get_oldest_entry(), &uid_read, &time_read);
+        ok = ok && time_read == (time_t)(BENCH_EPOCH + oldest);
+    }
+    ESP_LOGI(TAG, "recovery of %u appends, entries [%u, %u]: %u reads, %lld us -> %s", nb_entries,
+             history_db.get_oldest_entry(), history_db.get_newest_entry(),
+             history_db.get_stats().recovery_reads, (long long)elapsed, ok ? "OK" : "FAILED");
+    history_db.close();
+}
+
+// Badges of 4 (70%) or 7 bytes
+static void user_uid(uint32_t user, uint8_t *uid, uint8_t *uid_len)
+{
+    *uid_len = user % 10 < 7 ? 4 : 7;
+    for (uint8_t i = 0; i < *uid_len; i++) uid[i] = (uint8_t)(user * 2654435761u >> (4*i));
+}
+
+// A few users scan much more often than the others
+static void random_scan(uint8_t *uid, uint8_t *uid_len, uint32_t *timestamp)
+{
+    uint32_t user = (rand() % BENCH_NB_USERS) * (rand() % BENCH_NB_USERS) / BENCH_NB_USERS;
+    user_uid(user, uid, uid_len);
+    *timestamp += 30 + rand() % 1800;
+}
+
+static void bench_encoding()
+{
+    uint8_t uid[HISTORY_UID_MAX_SIZE];
+    uint8_t uid_len;
+    uint32_t timestamp = BENCH_EPOCH;
+    ScanHistoryDB history_db;
+    history_db.clear_history();
+
+    // append until the ring wraps, the log then holds as many scans as it can
+    srand(42);
+    uint32_t appends = 0;
+    int64_t start = esp_timer_get_time();
+    while (history_db.get_oldest_entry() == 0)
+    {
+        random_scan(uid, &uid_len, &timestamp);
+        history_db.add_history(uid, uid_len, timestamp);
+        if (++appends % BENCH_SCANS_PER_WAKEUP == 0) while (history_db.erase_ahead());
+    }
+    history_db.flush();
+    int64_t encode_us = esp_timer_get_time() - start;
+
+    uint32_t nb_entries = history_db.get_nb_entries();
+    uint32_t errors = 0;
+    int64_t decode_us = 0;
+    srand(42);
+    timestamp = BENCH_EPOCH;
+    for (uint32_t i = 0; i <= history_db.get_newest_entry(); i++)
+    {
+        uint8_t uid_read[HISTORY_UID_MAX_SIZE];
+        uint8_t uid_read_len;
+        time_t time_read;
+        random_scan(uid, &uid_len, &timestamp);
+        if (i < history_db.get_oldest_entry()) continue;
+        start = esp_timer_get_time();
+        bool found = history_db.get_history(i, uid_read, &uid_read_len, &time_read);
+        decode_us += esp_timer_get_time() - start;
+        if (!found || time_read != (time_t)timestamp || uid_read_len != uid_len || memcmp(uid_read, uid, uid_len)) errors++;
+    }
+
+    const esp_partition_t *partition = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY, P_HISTORY);
+    // the raw log, the daily summaries take the end of the partition
+    uint32_t usable = (partition->size / HISTORY_PAGE_SIZE - HISTORY_ROLLUP_SECTORS - HISTORY_ERASE_AHEAD);
+    uint32_t old_4 = usable * ((HISTORY_PAGE_SIZE - sizeof(history_sector_header_t)) / (4 + OLD_RECORD_OVERHEAD));
+    uint32_t old_10 = usable * ((HISTORY_PAGE_SIZE - sizeof(history_sector_header_t)) / (10 + OLD_RECORD_OVERHEAD));
+    ESP_LOGI(TAG, "compact encoding: %u scans fit, %.2f bytes/scan", nb_entries, (float)usable * HISTORY_PAGE_SIZE / nb_entries);
+    ESP_LOGI(TAG, "fixed records: %u scans with 4-byte UIDs only, %u with room for 10-byte UIDs -> x%.2f",
+             old_4, old_10, (float)nb_entries / old_10);
+    ESP_LOGI(TAG, "encode %.0f scans/s, decode %.0f scans/s, %u decode errors", appends * 1e6f / (encode_us ? encode_us : 1),
+             nb_entries * 1e6f / (decode_us ? decode_us : 1), errors);
+    history_db.close();
+}
+
+static void report_read(const char *name, ScanHistoryDB &history_db, uint32_t nb_read,
+                        uint64_t checksum, int64_t elapsed, uint32_t sector_reads)
+{
+    ESP_LOGI(TAG, "%s: %u entries, %.0f entries/s, %u sector reads, checksum %llx", name, nb_read,
+             nb_read * 1e6f / (elapsed ? elapsed : 1), history_db.get_stats().sector_reads - sector_reads,
+             (unsigned long long)checksum);
+}
+
+// Dump the whole log, as left full by bench_encoding()
+static void bench_bulk_read()
+{
+    static history_entry_t chunk[BENCH_RANGE_CHUNK];
+    ScanHistoryDB history_db;
+    uint32_t oldest = history_db.get_oldest_entry();
+    uint32_t nb_entries = history_db.get_nb_entries();
+    uint64_t checksum = 0;
+    uint32_t nb_read = 0;
+
+    uint32_t sector_reads = history_db.get_stats().sector_reads;
+    int64_t start = esp_timer_get_time();
+    for (uint32_t i = oldest; i < oldest + nb_entries; i++)
+    {
+        uint8_t uid[HISTORY_UID_MAX_SIZE];
+        uint8_t uid_len;
+        time_t time_read;
+        if (!history_db.get_history(i, uid, &uid_len, &time_read)) break;
+        checksum += time_read + uid[0];
+        nb_read++;
+    }
+    report_read("get_history", history_db, nb_read, checksum, esp_timer_get_time() - start, sector_reads);
+
+    checksum = 0;
+    nb_read = 0;
+    sector_reads = history_db.get_stats().sector_reads;
+    start = esp_timer_get_time();
+    uint32_t got;
+    while ((got = history_db.get_history_range(oldest + nb_read, BENCH_RANGE_CHUNK, chunk)) > 0)
+    {
+        for (uint32_t i = 0; i < got; i++) checksum += chunk[i].timestamp + chunk[i].uid[0];
+        nb_read += got;
+    }
+    report_read("get_history_range", history_db, nb_read, checksum, esp_timer_get_time() - start, sector_reads);
+
+    checksum = 0;
+    nb_read = 0;
+    sector_reads = history_db.get_stats().sector_reads;
+    start = esp_timer_get_time();
+    HistoryIterator it(history_db, oldest);
+    while (it.next(chunk))
+    {
+        checksum += chunk[0].timestamp + chunk[0].uid[0];
+        nb_read++;
+    }
+    report_read("HistoryIterator", history_db, nb_read, checksum, esp_timer_get_time() - start, sector_reads);
+    history_db.close();
+}
+
+// Entries [first, end[ scanned in [from, to[, found by walking the whole log
+static void linear_time_range(ScanHistoryDB &history_db, time_t from, time_t to, uint32_t *first, uint32_t *end)
+{
+    history_entry_t record;
+    *first = *end = history_db.get_newest_entry() + 1;
+    HistoryIterator it(history_db, history_db.get_oldest_entry());
+    while (it.next(&record))
+    {
+        if (*first > record.entry && (time_t)record.timestamp >= from) *first = record.entry;
+        if ((time_t)record.timestamp >= to)
+        {
+            *end = record.entry;
+            break;
+        }
+    }
+}
+
+// Windows of 1 hour to 1 month over the log left full by bench_encoding()
+static void bench_time_query()
+{
+    ScanHistoryDB history_db;
+    history_entry_t oldest, newest;
+    history_db.get_history_range(history_db.get_oldest_entry(), 1, &oldest);
+    history_db.get_history_range(history_db.get_newest_entry(), 1, &newest);
+
+    srand(7);
+    uint32_t errors = 0;
+    uint32_t nb_entries = 0;
+    int64_t elapsed = 0;
+    history_stats_t before = history_db.get_stats();
+    for (uint32_t i = 0; i < BENCH_NB_WINDOWS; i++)
+    {
+        time_t from = oldest.timestamp - 3600 + rand() % (newest.timestamp - oldest.timestamp + 7200);
+        time_t to = from + 3600 * (1 + rand() % (24 * 30));
+        uint32_t first, end, linear_first, linear_end;
+        int64_t start = esp_timer_get_time();
+        history_db.get_time_range(from, to, &first, &end);
+        elapsed += esp_timer_get_time() - start;
+        linear_time_range(history_db, from, to, &linear_first, &linear_end);
+        if (first != linear_first || end != linear_end) errors++;
+        nb_entries += end - first;
+    }
+    history_stats_t after = history_db.get_stats();
+    ESP_LOGI(TAG, "time range: %u windows, %u entries, %.1f header reads + %.1f sector reads per window, %lld us -> %u errors",
+             BENCH_NB_WINDOWS, nb_entries, (float)(after.recovery_reads - before.recovery_reads) / BENCH_NB_WINDOWS,
+             (float)(after.sector_reads - before.sector_reads) / BENCH_NB_WINDOWS, (long long)(elapsed / BENCH_NB_WINDOWS), errors);
+    history_db.close();
+}
+
+// Compare the counters of every user with a count over the whole log
+static uint32_t check_usage(ScanHistoryDB &history_db)
+{
+    static uint32_t counts[BENCH_NB_USERS];
+    static uint32_t last_seen[BENCH_NB_USERS];
+    uint8_t uid[HISTORY_UID_MAX_SIZE];
+    uint8_t uid_len;
+    history_entry_t record;
+    memset(counts, 0, sizeof(counts));
+    memset(last_seen, 0, sizeof(last_seen));
+    HistoryIterator it(history_db, history_db.get_oldest_entry());
+    while (it.next(&record))
+    {
+        for (uint32_t user = 0; user < BENCH_NB_USERS; user++)
+        {
+            user_uid(user, uid, &uid_len);
+            if (uid_len != record.uid_len || memcmp(uid, record.uid, uid_len)) continue;
+            counts[user]++;
+            last_seen[user] = record.timestamp;
+            break;
+        }
+    }
+
+    uint32_t errors = 0;
+    for (uint32_t user = 0; user < BENCH_NB_USERS; user++)
+    {
+        uint32_t count;
+        time_t time_read;
+        user_uid(user, uid, &uid_len);
+        history_db.get_usage(uid, uid_len, &count, &time_read);
+        if (count != counts[user] || (count && time_read != (time_t)last_seen[user])) errors++;
+    }
+    return errors;
+}
+
+static void bench_usage()
+{
+    uint8_t uid[HISTORY_UID_MAX_SIZE];
+    uint8_t uid_len;
+    uint32_t timestamp = BENCH_EPOCH;
+    uint32_t errors;
+    {
+        ScanHistoryDB history_db;
+        history_db.clear_history();
+        srand(1);
+        for (uint32_t i = 0; i < BENCH_USAGE_SCANS; i++)
+        {
+            random_scan(uid, &uid_len, &timestamp);
+            history_db.add_history(uid, uid_len, timestamp);
+            if (i % BENCH_SCANS_PER_WAKEUP == 0)
+            {
+                history_db.flush();
+                while (history_db.erase_ahead());
+                history_db.checkpoint_usage();
+            }
+        }
+        history_db.flush(); // power cut: the last scans are only in the log
+        errors = check_usage(history_db);
+        const history_stats_t &stats = history_db.get_stats();
+        ESP_LOGI(TAG, "usage: %u scans, %u checkpoints, %.2f NVS bytes/scan -> %u errors", BENCH_USAGE_SCANS,
+                 stats.usage_checkpoints, (float)stats.usage_bytes_written / BENCH_USAGE_SCANS, errors);
+    }
+
+    int64_t start = esp_timer_get_time();
+    ScanHistoryDB history_db;
+    int64_t elapsed = esp_timer_get_time() - start;
+    errors = check_usage(history_db);
+    ESP_LOGI(TAG, "usage after reboot: %u scans counted again, boot in %lld us -> %u errors",
+             history_db.get_stats().usage_replayed, (long long)elapsed, errors);
+    history_db.close();
+}
+
+typedef struct {
+    HistoryWriter *writer;
+    uint32_t first_user;
+    int64_t max_latency;
+    SemaphoreHandle_t done;
+} bench_producer_t;
+
+static void bench_producer(void *arg)
+{
+    bench_producer_t *producer = (bench_producer_t*)arg;
+    uint8_t uid[HISTORY_UID_MAX_SIZE];
+    uint8_t uid_len;
+    for (uint32_t i = 0; i < BENCH_WRITER_SCANS; i++)
+    {
+        user_uid(producer->first_user + i % 50, uid, &uid_len);
+        int64_t start = esp_timer_get_time();
+        producer->writer->post(uid, uid_len, BENCH_EPOCH + i);
+        int64_t latency = esp_timer_get_time() - start;
+        if (latency > producer->max_latency) producer->max_latency = latency;
+        if (i % BENCH_WRITER_BURST == BENCH_WRITER_BURST - 1) vTaskDelay(1);
+    }
+    xSemaphoreGive(producer->done);
+    vTaskDelete(NULL);
+}
+
+static void bench_writer()
+{
+    uint8_t uid[HISTORY_UID_MAX_SIZE];
+    uint8_t uid_len;
+    ScanHistoryDB history_db;
+    history_db.clear_history();
+
+    // scan path writing to flash itself, without the idle erase ahead
+    int64_t direct_max = 0;
+    for (uint32_t i = 0; i < BENCH_WRITER_SCANS; i++)
+    {
+        user_uid(i % 50, uid, &uid_len);
+        int64_t start = esp_timer_get_time();
+        history_db.add_history(uid, uid_len, BENCH_EPOCH + i);
+        history_db.flush();
+        int64_t latency = esp_timer_get_time() - start;
+        if (latency > direct_max) direct_max = latency;
+    }
+    ESP_LOGI(TAG, "direct write: max scan path latency %lld us, %u erases in add_history",
+             (long long)direct_max, history_db.get_stats().sync_erases);
+    history_db.clear_history();
+
+    HistoryWriter writer(history_db);
+    ESP_ERROR_CHECK(writer.start(tskIDLE_PRIORITY + 1, 1));
+    SemaphoreHandle_t done = xSemaphoreCreateCounting(2, 0);
+    bench_producer_t producers[2] = {{&writer, 0, 0, done}, {&writer, 100, 0, done}};
+    int64_t start = esp_timer_get_time();
+    for (int i = 0; i < 2; i++)
+        xTaskCreatePinnedToCore(bench_producer, "producer", 4096, &producers[i], tskIDLE_PRIORITY + 2, NULL, i);
+    for (int i = 0; i < 2; i++) xSemaphoreTake(done, portMAX_DELAY);
+    bool synced = writer.sync(portMAX_DELAY);
+    int64_t elapsed = esp_timer_get_time() - start;
+    vSemaphoreDelete(done);
+
+    history_writer_stats_t stats = writer.get_stats();
+    ScanHistoryDB &db = writer.acquire();
+    bool ok = synced && db.get_nb_entries() == stats.written && stats.written + stats.dropped == 2 * BENCH_WRITER_SCANS;
+    uint32_t nb_entries = db.get_nb_entries();
+    writer.release();
+    ESP_LOGI(TAG, "writer task: %u posted, %u dropped, %u written in %u batches, max depth %u/%u, %lld ms",
+             stats.posted, stats.dropped, stats.written, stats.batches, stats.max_depth, HISTORY_QUEUE_LEN,
+             (long long)(elapsed / 1000));
+    ESP_LOGI(TAG, "writer task: max scan path latency %lld us, %u entries in the log -> %s",
+             (long long)(producers[0].max_latency > producers[1].max_latency ? producers[0].max_latency : producers[1].max_latency),
+             nb_entries, ok ? "OK" : "FAILED");
+}
+
+extern "C" void app_main(void)
+{
+    ScanHistoryDB history_db;
+
+    bench_append(history_db, HISTORY_RECORD_MAX_SIZE, "write-through");
+    bench_append(history_db, HISTORY_PAGE_SIZE, "write-back");
+
+    history_db.clear_history();
+    history_db.close();
+
+    bench_recovery(0);
+    bench_recovery(1);
+    bench_recovery(1000);
+    bench_recovery(50000);
+    bench_recovery(400000); // wrapped once
+    bench_recovery(700000); // wrapped twice
+
+    bench_encoding();
+    bench_bulk_read();
+    bench_time_query();
+    bench_usage();
+    bench_writer();
+}
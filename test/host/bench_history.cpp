@@ -0,0 +1,222 @@
+/* Database benchmark on the emulated flash
+   Runs the scan workload of the main application for several months: every
+   scan checks the access of the user in UserDB and is appended to ScanHistoryDB, then the
+   device does its idle work (flush, erase ahead, usage checkpoint) before going
+   back to sleep, and the log is uploaded in LoRa batches every hour.
+   Reports the latency of each call on the host and on the device (estimated
+   from the flash operations), the flash wear of each partition and a cold boot.
+
+   bench_history [image dir]: flash kept in <image dir>/<label>.bin, otherwise in RAM
+*/
+#include <stdio.h>
+#include <string.h>
+#include "esp_log.h"
+#include "flash_emu.h"
+#include "database.h"
+#include "history_rollup.h"
+
+#define BENCH_EPOCH 1650000000
+#define BENCH_NB_USERS 500
+#define BENCH_NB_DAYS 365
+#define BENCH_SCANS_PER_DAY 1000 // 8h to 18h
+#define BENCH_UPLOAD_PERIOD 3600 // s
+#define BENCH_PAYLOAD_SIZE 51 // EU868 application payload at DR0-DR2
+#define BENCH_ERASE_CYCLES 100000 // NOR sector endurance
+
+typedef struct {
+    const char *name;
+    uint32_t count;
+    uint64_t host_us;
+    uint64_t host_max_us;
+    uint64_t device_us;
+    uint64_t device_max_us;
+} bench_op_t;
+
+enum { OP_PROVISION, OP_LOOKUP, OP_ADD, OP_FLUSH, OP_COMPACT, OP_ERASE_AHEAD, OP_CHECKPOINT, OP_UPLOAD, OP_BOOT, OP_COUNT };
+
+static bench_op_t ops[OP_COUNT] = {
+    {"UserDB::set", 0, 0, 0, 0, 0}, {"check_access", 0, 0, 0, 0, 0}, {"add_history", 0, 0, 0, 0, 0},
+    {"flush", 0, 0, 0, 0, 0}, {"compact", 0, 0, 0, 0, 0}, {"erase_ahead", 0, 0, 0, 0, 0},
+    {"checkpoint_usage", 0, 0, 0, 0, 0}, {"upload batch", 0, 0, 0, 0, 0}, {"cold boot", 0, 0, 0, 0, 0},
+};
+
+static Uid user_uid(uint32_t user)
+{
+    uint8_t uid[7];
+    uint8_t uid_len = user % 5 ? 4 : 7;
+    for (uint8_t i = 0; i < uid_len; i++) uid[i] = (uint8_t)((user + 1) * 2654435761u >> (3*i));
+    return Uid(uid, uid_len);
+}
+
+// Device time of the flash operations counted between two snapshots
+static uint64_t device_us(const emu_flash_stats_t &before, const emu_flash_stats_t &after)
+{
+    emu_flash_stats_t delta;
+    delta.read_ops = after.read_ops - before.read_ops;
+    delta.read_bytes = after.read_bytes - before.read_bytes;
+    delta.write_ops = after.write_ops - before.write_ops;
+    delta.write_bytes = after.write_bytes - before.write_bytes;
+    delta.erase_ops = after.erase_ops - before.erase_ops;
+    delta.erase_sectors = after.erase_sectors - before.erase_sectors;
+    return emu_flash_estimated_us(&delta);
+}
+
+template <typename F>
+static auto measure(int op, F call) -> decltype(call())
+{
+    emu_flash_stats_t before = *emu_flash_stats();
+    int64_t start = esp_timer_get_time();
+    struct record {
+        int op;
+        emu_flash_stats_t before;
+        int64_t start;
+        ~record()
+        {
+            uint64_t host = esp_timer_get_time() - start;
+            uint64_t device = device_us(before, *emu_flash_stats());
+            bench_op_t &o = ops[op];
+            o.count++;
+            o.host_us += host;
+            o.device_us += device;
+            if (host > o.host_max_us) o.host_max_us = host;
+            if (device > o.device_max_us) o.device_max_us = device;
+        }
+    } r = {op, before, start};
+    return call();
+}
+
+static void report_ops()
+{
+    printf("%-18s %8s %10s %10s %12s %12s\n", "call", "count", "host avg", "host max", "device avg", "device max");
+    for (const bench_op_t &o : ops)
+    {
+        if (o.count == 0) continue;
+        printf("%-18s %8u %8.1fus %8lluus %10.2fms %10.2fms\n", o.name, o.count,
+               (double)o.host_us / o.count, (unsigned long long)o.host_max_us,
+               (double)o.device_us / o.count / 1000, (double)o.device_max_us / 1000);
+    }
+}
+
+static void report_wear(const char *label, uint32_t nb_days)
+{
+    uint32_t max = emu_partition_max_erase_count(label);
+    if (max == 0)
+    {
+        printf("%-13s no sector erased\n", label);
+        return;
+    }
+    printf("%-13s max %5u erases/sector in %u days -> %.0f years to %u cycles\n", label, max, nb_days,
+           (double)BENCH_ERASE_CYCLES * nb_days / max / 365, BENCH_ERASE_CYCLES);
+}
+
+static void upload(ScanHistoryDB &history_db, uint64_t *payload_bytes)
+{
+    uint8_t payload[BENCH_PAYLOAD_SIZE];
+    uint32_t end_entry;
+    size_t len;
+    while ((len = measure(OP_UPLOAD, [&] {
+        size_t n = history_db.get_upload_batch(payload, sizeof(payload), &end_entry);
+        if (n) history_db.ack_upload(end_entry);
+        return n;
+    })) > 0) *payload_bytes += len;
+}
+
+int main(int argc, char **argv)
+{
+    emu_flash_init(argc > 1 ? argv[1] : NULL);
+    esp_log_level_set("*", ESP_LOG_ERROR);
+    emu_partition_wipe(P_USER);
+    emu_partition_wipe(P_HISTORY);
+    emu_partition_wipe(P_HISTORY_CTRL);
+
+    UserDB user_db;
+    user_db.open();
+    // installation: every user in one update of the list
+    static user_entry_t users[BENCH_NB_USERS];
+    for (uint32_t user = 0; user < BENCH_NB_USERS; user++)
+    {
+        Uid uid = user_uid(user);
+        users[user].uid_len = uid.size();
+        memcpy(users[user].uid, uid.data(), uid.size());
+        users[user].rights = user % 4 ? 1 : 2;
+    }
+    measure(OP_PROVISION, [&] { return user_db.set(users, BENCH_NB_USERS); });
+
+    ScanHistoryDB *history_db = new ScanHistoryDB();
+    uint64_t payload_bytes = 0;
+    uint32_t seed = 1;
+    uint32_t granted = 0;
+    for (uint32_t day = 0; day < BENCH_NB_DAYS; day++)
+    {
+        uint32_t day_start = BENCH_EPOCH + day * 86400 + 8 * 3600;
+        uint32_t next_upload = day_start;
+        for (uint32_t scan = 0; scan < BENCH_SCANS_PER_DAY; scan++)
+        {
+            uint32_t timestamp = day_start + scan * 36000 / BENCH_SCANS_PER_DAY;
+            // a fifth of the users make most of the scans
+            seed = seed * 1103515245 + 12345;
+            uint32_t user = (seed >> 16) % 10 < 8 ? (seed >> 8) % (BENCH_NB_USERS / 5) : (seed >> 8) % BENCH_NB_USERS;
+            Uid uid = user_uid(user);
+
+            if (measure(OP_LOOKUP, [&] { return user_db.check_access(uid, timestamp) == USER_GRANTED; })) granted++;
+            measure(OP_ADD, [&] { history_db->add_history(uid, timestamp); });
+
+            // idle() before light sleep
+            measure(OP_FLUSH, [&] { history_db->flush(); });
+            while (measure(OP_COMPACT, [&] { return history_db->compact(); }));
+            while (measure(OP_ERASE_AHEAD, [&] { return history_db->erase_ahead(); }));
+            measure(OP_CHECKPOINT, [&] { return history_db->checkpoint_usage(); });
+
+            if (timestamp >= next_upload)
+            {
+                upload(*history_db, &payload_bytes);
+                next_upload += BENCH_UPLOAD_PERIOD;
+            }
+        }
+        upload(*history_db, &payload_bytes);
+    }
+    uint32_t nb_scans = BENCH_NB_DAYS * BENCH_SCANS_PER_DAY;
+    uint32_t nb_entries = history_db->get_nb_entries();
+    uint32_t count = 0;
+    time_t last_seen;
+    Uid uid = user_uid(0);
+    history_db->get_usage(uid, &count, &last_seen);
+
+    // cold boot: everything is read back from flash
+    delete history_db;
+    user_db.close();
+    nvs_flash_deinit_partition(P_HISTORY_CTRL);
+    history_db = measure(OP_BOOT, [&] {
+        user_db.open();
+        return new ScanHistoryDB();
+    });
+    uint32_t failures = 0;
+    uint32_t count_boot = 0;
+    uint8_t rights = 0;
+    if (!history_db->get_usage(uid, &count_boot, &last_seen) || count_boot != count
+        || history_db->get_nb_entries() != nb_entries || history_db->get_upload_entry() != nb_scans
+        || !user_db.get(uid, &rights) || rights != 2)
+    {
+        printf("FAILED: state differs after the cold boot\n");
+        failures++;
+    }
+
+    const emu_flash_stats_t *stats = emu_flash_stats();
+    printf("%u scans of %u users in %u days, %u granted, %u kept in the log, %.2f uplink bytes/scan\n",
+           nb_scans, BENCH_NB_USERS, BENCH_NB_DAYS, granted, nb_entries, (double)payload_bytes / nb_scans);
+    uint32_t first_day, last_day;
+    if (history_db->get_rollup().get_days(&first_day, &last_day))
+        printf("daily summaries of days %u to %u, raw scans from entry %u\n", first_day - BENCH_EPOCH / 86400,
+               last_day - BENCH_EPOCH / 86400, history_db->get_oldest_entry());
+    report_ops();
+    printf("flash: %llu KB written, %llu sectors erased, %llu NVS slots written, %llu NOR violations\n",
+           (unsigned long long)stats->write_bytes / 1024, (unsigned long long)stats->erase_sectors,
+           (unsigned long long)stats->nvs_writes, (unsigned long long)stats->nor_violations);
+    report_wear(P_USER, BENCH_NB_DAYS);
+    report_wear(P_HISTORY, BENCH_NB_DAYS);
+    report_wear(P_HISTORY_CTRL, BENCH_NB_DAYS);
+    if (stats->nor_violations) failures++;
+    delete history_db;
+    user_db.close();
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,171 @@
+/* User import and lookup benchmark on the emulated flash
+   Imports lists of 10k, 50k, 100k and 500k users given out of order in one
+   UserDB::set, then looks random users up through UserDB, from the RAM table
+   loaded at open() and from the mapped partition, for users that exist and
+   UIDs that were never provisioned. Reports the capacity of the partition,
+   the time and users/s of the import on the host and on the device (estimated
+   from the flash operations), the RAM taken by the table and its
+   load time, the latency of each lookup on the host, the size of the filter
+   of unknown UIDs and the share of them it lets through.
+   A list that does not fit in the partition is only measured in a UserTable
+   behind a UserFilter.
+*/
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+#include "esp_log.h"
+#include "flash_emu.h"
+#include "database.h"
+
+#define BENCH_NB_LOOKUPS 1000000
+
+typedef struct {
+    uint8_t uid_len;
+    uint8_t uid[7];
+} bench_user_t;
+
+static void user_uid(uint32_t user, bench_user_t *out)
+{
+    out->uid_len = user % 5 ? 4 : 7;
+    // 3 more bytes of the user number for the 7 byte UIDs, so that they stay distinct
+    uint32_t hash = (user + 1) * 2654435761u;
+    for (uint8_t i = 0; i < 4; i++) out->uid[i] = (uint8_t)(hash >> (8*i));
+    for (uint8_t i = 4; i < out->uid_len; i++) out->uid[i] = (uint8_t)(user >> (8*(i-4)));
+}
+
+static uint64_t device_us(const emu_flash_stats_t &before, const emu_flash_stats_t &after)
+{
+    emu_flash_stats_t delta = {};
+    delta.read_ops = after.read_ops - before.read_ops;
+    delta.read_bytes = after.read_bytes - before.read_bytes;
+    delta.write_ops = after.write_ops - before.write_ops;
+    delta.write_bytes = after.write_bytes - before.write_bytes;
+    delta.erase_sectors = after.erase_sectors - before.erase_sectors;
+    return emu_flash_estimated_us(&delta);
+}
+
+typedef struct {
+    double host_ns;
+    uint32_t found;
+} bench_lookup_t;
+
+// Random users of `users`, each lookup returns whether it found the user
+template <typename F>
+static bench_lookup_t measure(const std::vector<bench_user_t> &users, F lookup)
+{
+    bench_lookup_t result = {};
+    uint32_t seed = 1;
+    int64_t start = esp_timer_get_time();
+    for (uint32_t i = 0; i < BENCH_NB_LOOKUPS; i++)
+    {
+        seed = seed * 1103515245 + 12345;
+        if (lookup(users[(seed >> 4) % users.size()])) result.found++;
+    }
+    result.host_ns = (double)(esp_timer_get_time() - start) * 1000 / BENCH_NB_LOOKUPS;
+    return result;
+}
+
+static uint32_t run(uint32_t nb_users, uint32_t capacity)
+{
+    std::vector<bench_user_t> users(nb_users);
+    std::vector<bench_user_t> unknown(nb_users);
+    std::vector<user_entry_t> entries(nb_users);
+    for (uint32_t i = 0; i < nb_users; i++)
+    {
+        user_uid(i, &users[i]);
+        user_uid(nb_users + i, &unknown[i]);
+        entries[i] = {};
+        entries[i].uid_len = users[i].uid_len;
+        memcpy(entries[i].uid, users[i].uid, users[i].uid_len);
+        entries[i].rights = 1;
+    }
+    uint32_t failures = 0;
+    uint8_t rights;
+
+    if (nb_users > capacity)
+    {
+        UserTable table;
+        UserFilter filter;
+        int64_t start = esp_timer_get_time();
+        table.reserve(nb_users);
+        filter.clear(nb_users, 0);
+        for (const user_entry_t &entry : entries)
+        {
+            table.set(&entry);
+            filter.add(entry.uid, entry.uid_len);
+        }
+        double load_ms = (double)(esp_timer_get_time() - start) / 1000;
+        auto lookup = [&](const bench_user_t &u) {
+            if (!filter.may_contain(u.uid, u.uid_len)) return false;
+            if (table.get(u.uid, u.uid_len, &rights)) return true;
+            filter.count_false_positive();
+            return false;
+        };
+        bench_lookup_t hit = measure(users, lookup);
+        bench_lookup_t miss = measure(unknown, lookup);
+        if (hit.found != BENCH_NB_LOOKUPS || miss.found) failures++;
+        printf("%7uk %39s %7u KB %7.0f ms %6.0f ns %6.0f ns %26s %6u KB %5.2f%%\n", nb_users / 1000, "does not fit",
+               (uint32_t)(table.get_memory() / 1024), load_ms, hit.host_ns, miss.host_ns, "-",
+               (uint32_t)(filter.get_memory() / 1024), 100.0 * filter.get_stats().false_positives / BENCH_NB_LOOKUPS);
+        return failures;
+    }
+
+    emu_partition_wipe(P_USER);
+    UserDB user_db;
+    user_db.open(false);
+    emu_flash_stats_t before = *emu_flash_stats();
+    int64_t start = esp_timer_get_time();
+    if (!user_db.set(entries.data(), nb_users, true)) failures++;
+    double update_ms = (double)(esp_timer_get_time() - start) / 1000;
+    double update_device_s = (double)device_us(before, *emu_flash_stats()) / 1000000;
+    user_db.close();
+
+    start = esp_timer_get_time();
+    user_db.open();
+    double load_ms = (double)(esp_timer_get_time() - start) / 1000;
+    size_t memory = user_db.get_table().get_memory();
+    bench_lookup_t hit = measure(users, [&](const bench_user_t &u) { return user_db.get(u.uid, u.uid_len, &rights); });
+    bench_lookup_t miss = measure(unknown, [&](const bench_user_t &u) { return user_db.get(u.uid, u.uid_len, &rights); });
+    user_db.close();
+
+    user_db.open(false);
+    user_store_stats_t stats_before = user_db.get_store().get_stats();
+    bench_lookup_t map_hit = measure(users, [&](const bench_user_t &u) { return user_db.get(u.uid, u.uid_len, &rights); });
+    uint32_t false_positives = user_db.get_filter().get_stats().false_positives;
+    bench_lookup_t map_miss = measure(unknown, [&](const bench_user_t &u) { return user_db.get(u.uid, u.uid_len, &rights); });
+    const user_store_stats_t &stats = user_db.get_store().get_stats();
+    double steps = (double)(stats.lookup_steps - stats_before.lookup_steps) / (stats.lookups - stats_before.lookups);
+    size_t filter_memory = user_db.get_filter().get_memory();
+    false_positives = user_db.get_filter().get_stats().false_positives - false_positives;
+    user_db.close();
+    if (hit.found != BENCH_NB_LOOKUPS || miss.found || map_hit.found != BENCH_NB_LOOKUPS || map_miss.found) failures++;
+
+    printf("%7uk %6.0f ms %7.0fk %6.1f s %8.0f %7u KB %7.0f ms %6.0f ns %6.0f ns %6.0f ns %6.0f ns %5.1f %6u KB %5.2f%%\n",
+           nb_users / 1000, update_ms, nb_users / update_ms, update_device_s, nb_users / update_device_s,
+           (uint32_t)(memory / 1024), load_ms, hit.host_ns, miss.host_ns,
+           map_hit.host_ns, map_miss.host_ns, steps, (uint32_t)(filter_memory / 1024),
+           100.0 * false_positives / BENCH_NB_LOOKUPS);
+    return failures;
+}
+
+int main()
+{
+    emu_flash_init(NULL);
+    esp_log_level_set("*", ESP_LOG_ERROR);
+    UserStore store;
+    store.open();
+    uint32_t capacity = store.get_capacity();
+    store.close();
+
+    printf("capacity of the %s partition: %u users of %u bytes\n", P_USER, capacity, (uint32_t)sizeof(user_record_t));
+    printf("%8s %9s %8s %8s %8s %10s %10s %9s %9s %9s %9s %5s %9s %6s\n", "users", "import", "users/s", "device",
+           "users/s", "RAM", "load",
+           "RAM hit", "miss", "map hit", "miss", "reads", "filter", "false+");
+    uint32_t failures = 0;
+    failures += run(10000, capacity);
+    failures += run(50000, capacity);
+    failures += run(100000, capacity);
+    failures += run(500000, capacity);
+    if (failures) printf("FAILED: %u runs found wrong users\n", failures);
+    return failures ? 1 : 0;
+}
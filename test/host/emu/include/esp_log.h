@@ -0,0 +1,35 @@
+#pragma once
+#include <stdio.h>
+#include <stdint.h>
+#include "esp_err.h"
+
+typedef enum {
+    ESP_LOG_NONE,
+    ESP_LOG_ERROR,
+    ESP_LOG_WARN,
+    ESP_LOG_INFO,
+    ESP_LOG_DEBUG,
+    ESP_LOG_VERBOSE
+} esp_log_level_t;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+extern esp_log_level_t emu_log_level;
+void esp_log_level_set(const char *tag, esp_log_level_t level);
+void emu_log_buffer_hex(const char *tag, const void *buffer, size_t len);
+#ifdef __cplusplus
+}
+#endif
+
+#define EMU_LOG(level, letter, tag, format, ...) do {                        \
+        if (emu_log_level >= level)                                          \
+            printf(letter " (%s) " format "\n", tag, ##__VA_ARGS__);         \
+    } while (0)
+
+#define ESP_LOGE(tag, format, ...) EMU_LOG(ESP_LOG_ERROR, "E", tag, format, ##__VA_ARGS__)
+#define ESP_LOGW(tag, format, ...) EMU_LOG(ESP_LOG_WARN, "W", tag, format, ##__VA_ARGS__)
+#define ESP_LOGI(tag, format, ...) EMU_LOG(ESP_LOG_INFO, "I", tag, format, ##__VA_ARGS__)
+#define ESP_LOGD(tag, format, ...) EMU_LOG(ESP_LOG_DEBUG, "D", tag, format, ##__VA_ARGS__)
+#define ESP_LOGV(tag, format, ...) EMU_LOG(ESP_LOG_VERBOSE, "V", tag, format, ##__VA_ARGS__)
+#define ESP_LOG_BUFFER_HEX(tag, buffer, len) emu_log_buffer_hex(tag, buffer, len)
@@ -0,0 +1,73 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include "esp_partition.h"
+
+/**
+ * @brief Host-side emulation of the ESP32 SPI flash used by the databases.
+ *
+ * Partitions are byte arrays backed by files (or anonymous memory) that follow
+ * NOR rules: a write can only clear bits and only a 4K sector erase sets them
+ * back to 1. Every access is counted so benchmarks can report flash wear.
+ */
+
+typedef struct {
+    uint64_t read_ops;
+    uint64_t read_bytes;
+    uint64_t write_ops;
+    uint64_t write_bytes;
+    uint64_t erase_ops;
+    uint64_t erase_sectors;
+    uint64_t mmap_ops;
+    uint64_t nor_violations; // writes that tried to turn a 0 bit back to 1
+    uint64_t nvs_writes;     // NVS slots programmed (32 bytes each), GC moves included
+    uint64_t nvs_commits;
+    uint64_t nvs_page_erases; // NVS pages reclaimed or erased
+} emu_flash_stats_t;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief Register the partition table of the main application
+ *        (user_db 5M, history 900K, history_ctrl 100K)
+ *
+ * @param dir directory holding <label>.bin images, NULL to keep flash in RAM
+ */
+void emu_flash_init(const char *dir);
+
+/**
+ * @brief Add a partition to the emulated table, must be called before use
+ */
+void emu_partition_register(const char *label, esp_partition_type_t type,
+                            esp_partition_subtype_t subtype, uint32_t size);
+
+/**
+ * @brief Fill a partition with 0xFF and forget its NVS content, without counting wear
+ */
+void emu_partition_wipe(const char *label);
+
+const emu_flash_stats_t *emu_flash_stats(void);
+void emu_flash_reset_stats(void);
+
+/**
+ * @brief Highest number of erase cycles seen by a single sector of a partition
+ */
+uint32_t emu_partition_max_erase_count(const char *label);
+
+/**
+ * @brief Simulate a power cut: only the next `bytes` bytes are programmed,
+ *        every write after that is silently dropped. -1 disables the cut.
+ */
+void emu_flash_cut_after(int64_t bytes);
+
+/**
+ * @brief Device time in us the counted operations would take on an ESP32
+ *        (typical W25Q datasheet figures: 45 ms/sector erase, 0.7 ms/page program)
+ */
+uint64_t emu_flash_estimated_us(const emu_flash_stats_t *stats);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,12 @@
+#pragma once
+#include "nvs.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+esp_err_t nvs_flash_init_partition(const char *partition_label);
+esp_err_t nvs_flash_erase_partition(const char *part_name);
+esp_err_t nvs_flash_deinit_partition(const char *partition_label);
+#ifdef __cplusplus
+}
+#endif
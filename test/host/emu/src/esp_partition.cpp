@@ -0,0 +1,265 @@
+#include <string.h>
+#include <stdio.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <string>
+#include <vector>
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "flash_emu.h"
+
+struct emu_partition {
+    esp_partition_t desc;
+    uint8_t *data;
+    std::vector<uint32_t> erase_count;
+};
+
+static std::vector<emu_partition *> partitions;
+static std::string image_dir;
+static emu_flash_stats_t stats;
+static int64_t cut_budget = -1;
+static uint32_t next_address = 0x9000;
+
+esp_log_level_t emu_log_level = ESP_LOG_WARN;
+
+extern "C" void esp_log_level_set(const char *tag, esp_log_level_t level)
+{
+    (void)tag;
+    emu_log_level = level;
+}
+
+extern "C" void emu_log_buffer_hex(const char *tag, const void *buffer, size_t len)
+{
+    if (emu_log_level < ESP_LOG_INFO) return;
+    const uint8_t *p = (const uint8_t *)buffer;
+    printf("I (%s) ", tag);
+    for (size_t i = 0; i < len; i++) printf("%02x ", p[i]);
+    printf("\n");
+}
+
+extern "C" const char *esp_err_to_name(esp_err_t code)
+{
+    switch (code) {
+    case ESP_OK: return "ESP_OK";
+    case ESP_FAIL: return "ESP_FAIL";
+    case ESP_ERR_NO_MEM: return "ESP_ERR_NO_MEM";
+    case ESP_ERR_INVALID_ARG: return "ESP_ERR_INVALID_ARG";
+    case ESP_ERR_INVALID_STATE: return "ESP_ERR_INVALID_STATE";
+    case ESP_ERR_INVALID_SIZE: return "ESP_ERR_INVALID_SIZE";
+    case ESP_ERR_NOT_FOUND: return "ESP_ERR_NOT_FOUND";
+    case ESP_ERR_NOT_SUPPORTED: return "ESP_ERR_NOT_SUPPORTED";
+    case ESP_ERR_TIMEOUT: return "ESP_ERR_TIMEOUT";
+    case ESP_ERR_INVALID_CRC: return "ESP_ERR_INVALID_CRC";
+    case ESP_ERR_INVALID_VERSION: return "ESP_ERR_INVALID_VERSION";
+    case ESP_ERR_NVS_NOT_INITIALIZED: return "ESP_ERR_NVS_NOT_INITIALIZED";
+    case ESP_ERR_NVS_NOT_FOUND: return "ESP_ERR_NVS_NOT_FOUND";
+    case ESP_ERR_NVS_TYPE_MISMATCH: return "ESP_ERR_NVS_TYPE_MISMATCH";
+    case ESP_ERR_NVS_READ_ONLY: return "ESP_ERR_NVS_READ_ONLY";
+    case ESP_ERR_NVS_NOT_ENOUGH_SPACE: return "ESP_ERR_NVS_NOT_ENOUGH_SPACE";
+    case ESP_ERR_NVS_NO_FREE_PAGES: return "ESP_ERR_NVS_NO_FREE_PAGES";
+    case ESP_ERR_NVS_INVALID_HANDLE: return "ESP_ERR_NVS_INVALID_HANDLE";
+    case ESP_ERR_NVS_INVALID_LENGTH: return "ESP_ERR_NVS_INVALID_LENGTH";
+    default: return "UNKNOWN ERROR";
+    }
+}
+
+extern "C" int64_t esp_timer_get_time(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static emu_partition *find(const char *label)
+{
+    for (auto p : partitions)
+        if (strcmp(p->desc.label, label) == 0) return p;
+    return NULL;
+}
+
+static emu_partition *find(const esp_partition_t *partition)
+{
+    for (auto p : partitions)
+        if (&p->desc == partition) return p;
+    return NULL;
+}
+
+extern "C" void emu_partition_register(const char *label, esp_partition_type_t type,
+                                       esp_partition_subtype_t subtype, uint32_t size)
+{
+    if (find(label)) return;
+    emu_partition *p = new emu_partition();
+    memset(&p->desc, 0, sizeof(p->desc));
+    p->desc.type = type;
+    p->desc.subtype = subtype;
+    p->desc.address = next_address;
+    p->desc.size = size;
+    strncpy(p->desc.label, label, sizeof(p->desc.label) - 1);
+    next_address += size;
+    p->erase_count.assign(size / SPI_FLASH_SEC_SIZE, 0);
+
+    void *mem = MAP_FAILED;
+    if (!image_dir.empty()) {
+        std::string path = image_dir + "/" + label + ".bin";
+        int fd = open(path.c_str(), O_RDWR | O_CREAT, 0644);
+        if (fd >= 0) {
+            off_t old_size = lseek(fd, 0, SEEK_END);
+            if (ftruncate(fd, size) == 0)
+                mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+            close(fd);
+            if (mem != MAP_FAILED && old_size < (off_t)size)
+                memset((uint8_t *)mem + old_size, 0xFF, size - old_size);
+        }
+    }
+    if (mem == MAP_FAILED) {
+        mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        memset(mem, 0xFF, size);
+    }
+    p->data = (uint8_t *)mem;
+    partitions.push_back(p);
+}
+
+extern "C" void emu_flash_init(const char *dir)
+{
+    image_dir = dir ? dir : "";
+    emu_partition_register("nvs", ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_DATA_NVS, 0x6000);
+    emu_partition_register("user_db", ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY, 5 * 1024 * 1024);
+    emu_partition_register("history", ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY, 900 * 1024);
+    emu_partition_register("history_ctrl", ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_DATA_NVS, 100 * 1024);
+}
+
+void emu_nvs_forget(const char *label);
+
+extern "C" void emu_partition_wipe(const char *label)
+{
+    emu_partition *p = find(label);
+    if (!p) return;
+    memset(p->data, 0xFF, p->desc.size);
+    emu_nvs_forget(label);
+}
+
+extern "C" const emu_flash_stats_t *emu_flash_stats(void)
+{
+    return &stats;
+}
+
+extern "C" void emu_flash_reset_stats(void)
+{
+    memset(&stats, 0, sizeof(stats));
+}
+
+emu_flash_stats_t *emu_flash_stats_mut(void)
+{
+    return &stats;
+}
+
+extern "C" uint32_t emu_partition_max_erase_count(const char *label)
+{
+    emu_partition *p = find(label);
+    uint32_t max = 0;
+    if (!p) return 0;
+    for (uint32_t c : p->erase_count)
+        if (c > max) max = c;
+    return max;
+}
+
+extern "C" void emu_flash_cut_after(int64_t bytes)
+{
+    cut_budget = bytes;
+}
+
+extern "C" uint64_t emu_flash_estimated_us(const emu_flash_stats_t *s)
+{
+    // 256 B program pages at ~0.7 ms, 4K sector erase ~45 ms, reads at ~40 MB/s,
+    // plus ~20 us of SPI/cache overhead per operation
+    uint64_t us = 0;
+    us += s->erase_sectors * 45000;
+    us += (s->write_bytes + 255) / 256 * 700 + s->write_ops * 20;
+    us += s->read_bytes / 40 + s->read_ops * 20;
+    // NVS pages live in the emulated partitions, their traffic is already counted above
+    return us;
+}
+
+extern "C" const esp_partition_t *esp_partition_find_first(esp_partition_type_t type,
+        esp_partition_subtype_t subtype, const char *label)
+{
+    for (auto p : partitions) {
+        if (type != ESP_PARTITION_TYPE_ANY && p->desc.type != type) continue;
+        if (subtype != ESP_PARTITION_SUBTYPE_ANY && p->desc.subtype != subtype) continue;
+        if (label && strcmp(p->desc.label, label) != 0) continue;
+        return &p->desc;
+    }
+    return NULL;
+}
+
+extern "C" esp_err_t esp_partition_read(const esp_partition_t *partition,
+        size_t src_offset, void *dst, size_t size)
+{
+    emu_partition *p = find(partition);
+    if (!p || !dst) return ESP_ERR_INVALID_ARG;
+    if (src_offset > p->desc.size || size > p->desc.size - src_offset) return ESP_ERR_INVALID_SIZE;
+    memcpy(dst, p->data + src_offset, size);
+    stats.read_ops++;
+    stats.read_bytes += size;
+    return ESP_OK;
+}
+
+extern "C" esp_err_t esp_partition_write(const esp_partition_t *partition,
+        size_t dst_offset, const void *src, size_t size)
+{
+    emu_partition *p = find(partition);
+    if (!p || !src) return ESP_ERR_INVALID_ARG;
+    if (dst_offset > p->desc.size || size > p->desc.size - dst_offset) return ESP_ERR_INVALID_SIZE;
+    if (cut_budget >= 0 && (int64_t)size > cut_budget) size = (size_t)cut_budget;
+    const uint8_t *in = (const uint8_t *)src;
+    uint8_t *out = p->data + dst_offset;
+    bool violation = false;
+    for (size_t i = 0; i < size; i++) {
+        if (in[i] & ~out[i]) violation = true;
+        out[i] &= in[i];
+    }
+    if (violation) {
+        stats.nor_violations++;
+        ESP_LOGW("flash_emu", "write at 0x%zx of \"%s\" tries to set cleared bits", dst_offset, p->desc.label);
+    }
+    if (cut_budget >= 0) cut_budget -= size;
+    stats.write_ops++;
+    stats.write_bytes += size;
+    return ESP_OK;
+}
+
+extern "C" esp_err_t esp_partition_erase_range(const esp_partition_t *partition,
+        size_t offset, size_t size)
+{
+    emu_partition *p = find(partition);
+    if (!p) return ESP_ERR_INVALID_ARG;
+    if (offset > p->desc.size || size > p->desc.size - offset) return ESP_ERR_INVALID_SIZE;
+    if (offset % SPI_FLASH_SEC_SIZE || size % SPI_FLASH_SEC_SIZE) return ESP_ERR_INVALID_SIZE;
+    if (cut_budget == 0) return ESP_OK;
+    memset(p->data + offset, 0xFF, size);
+    for (size_t s = offset / SPI_FLASH_SEC_SIZE; s < (offset + size) / SPI_FLASH_SEC_SIZE; s++)
+        p->erase_count[s]++;
+    stats.erase_ops++;
+    stats.erase_sectors += size / SPI_FLASH_SEC_SIZE;
+    return ESP_OK;
+}
+
+extern "C" esp_err_t esp_partition_mmap(const esp_partition_t *partition, size_t offset, size_t size,
+        spi_flash_mmap_memory_t memory, const void **out_ptr, spi_flash_mmap_handle_t *out_handle)
+{
+    (void)memory;
+    emu_partition *p = find(partition);
+    if (!p || !out_ptr || !out_handle) return ESP_ERR_INVALID_ARG;
+    if (offset > p->desc.size || size > p->desc.size - offset) return ESP_ERR_INVALID_SIZE;
+    *out_ptr = p->data + offset;
+    *out_handle = 1;
+    stats.mmap_ops++;
+    return ESP_OK;
+}
+
+extern "C" void spi_flash_munmap(spi_flash_mmap_handle_t handle)
+{
+    (void)handle;
+}
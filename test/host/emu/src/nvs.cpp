@@ -0,0 +1,668 @@
+#include <string.h>
+#include <stdio.h>
+#include <map>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include "esp_log.h"
+#include "nvs_flash.h"
+#include "flash_emu.h"
+
+/*
+ * NVS stored as a log of 32-byte entries in the emulated partition, so that it
+ * follows the same NOR rules as raw partitions and survives a restart when the
+ * flash is file backed. The layout is close to the ESP-IDF one without being
+ * compatible with it:
+ *   - each 4K page starts with a page header slot, then 127 entry slots
+ *   - a value is written as one or more chunks, each chunk is a header slot
+ *     followed by its data slots, all in the same page
+ *   - rewriting a key appends a new generation, then marks the chunks of the
+ *     previous one erased by clearing bits of their state byte
+ *   - one page is kept free to move the live chunks of the oldest page before
+ *     erasing it
+ * At init the pages are replayed in write order: the last complete generation
+ * of each key wins, chunks cut by a power loss fail their CRC and are ignored.
+ */
+
+#define NVS_ENTRY_SIZE 32
+#define NVS_SLOTS_PER_PAGE (SPI_FLASH_SEC_SIZE / NVS_ENTRY_SIZE - 1)
+#define NVS_CHUNK_MAX ((NVS_SLOTS_PER_PAGE - 1) * NVS_ENTRY_SIZE)
+#define NVS_PAGE_MAGIC 0x4553564E // "NVSE"
+#define NVS_STATE_EMPTY 0xFF
+#define NVS_STATE_WRITTEN 0xFE
+#define NVS_STATE_ERASED 0xFC
+#define NVS_NS_INDEX 0 // namespace of the namespace name -> index entries
+
+typedef struct {
+    uint32_t magic;
+    uint32_t seq;
+    uint8_t reserved[24];
+} nvs_page_header_t;
+
+typedef struct {
+    uint8_t ns;
+    uint8_t type;
+    uint8_t span; // slots of the chunk, header included
+    uint8_t state;
+    uint8_t gen;
+    uint8_t chunk;
+    uint16_t chunk_len;
+    uint32_t total_len; // value itself for U8/U32
+    uint32_t crc; // header without state and crc, then the chunk data
+    char key[NVS_KEY_NAME_MAX_SIZE];
+} nvs_chunk_header_t;
+
+struct nvs_location {
+    uint32_t page;
+    uint32_t slot;
+    uint8_t span;
+};
+
+struct nvs_value {
+    nvs_type_t type;
+    uint8_t gen;
+    std::vector<uint8_t> data;
+    std::vector<nvs_location> chunks;
+};
+
+typedef std::map<std::string, nvs_value> nvs_namespace;
+
+struct nvs_page {
+    uint32_t seq; // UINT32_MAX if the page is free
+    uint32_t used; // slots written, live or not
+};
+
+struct nvs_store {
+    bool initialized = false;
+    const esp_partition_t *partition = NULL;
+    std::map<std::string, nvs_namespace> namespaces;
+    std::map<std::string, uint8_t> ns_index;
+    nvs_namespace ns_entries; // namespace name -> index entries
+    std::vector<nvs_page> pages;
+    uint32_t active = UINT32_MAX;
+    uint32_t next_seq = 0;
+};
+
+struct nvs_open_handle {
+    std::string part;
+    std::string ns;
+    bool writable;
+};
+
+struct nvs_opaque_iterator_t {
+    nvs_store *store;
+    std::vector<nvs_entry_info_t> entries;
+    std::vector<const nvs_value *> values;
+    size_t index;
+};
+
+static std::map<std::string, nvs_store> stores;
+static std::map<nvs_handle_t, nvs_open_handle> handles;
+static nvs_handle_t next_handle = 1;
+
+emu_flash_stats_t *emu_flash_stats_mut(void);
+
+void emu_nvs_forget(const char *label)
+{
+    stores.erase(label);
+}
+
+static uint32_t crc32(uint32_t crc, const void *data, size_t len)
+{
+    const uint8_t *p = (const uint8_t *)data;
+    crc = ~crc;
+    for (size_t i = 0; i < len; i++) {
+        crc ^= p[i];
+        for (int bit = 0; bit < 8; bit++) crc = (crc >> 1) ^ (0xEDB88320 & -(crc & 1));
+    }
+    return ~crc;
+}
+
+static uint32_t chunk_crc(const nvs_chunk_header_t *header, const uint8_t *data)
+{
+    uint32_t crc = crc32(0, header, offsetof(nvs_chunk_header_t, state));
+    crc = crc32(crc, &header->gen, offsetof(nvs_chunk_header_t, crc) - offsetof(nvs_chunk_header_t, gen));
+    crc = crc32(crc, header->key, sizeof(header->key));
+    return crc32(crc, data, header->chunk_len);
+}
+
+static bool is_inline(nvs_type_t type)
+{
+    return type != NVS_TYPE_BLOB && type != NVS_TYPE_STR;
+}
+
+static size_t slot_offset(uint32_t page, uint32_t slot)
+{
+    return (size_t)page * SPI_FLASH_SEC_SIZE + (1 + slot) * NVS_ENTRY_SIZE;
+}
+
+static uint32_t nb_free_pages(const nvs_store &store)
+{
+    uint32_t nb = 0;
+    for (const nvs_page &p : store.pages)
+        if (p.seq == UINT32_MAX) nb++;
+    return nb;
+}
+
+static esp_err_t activate_free_page(nvs_store &store)
+{
+    for (uint32_t i = 0; i < store.pages.size(); i++) {
+        if (store.pages[i].seq != UINT32_MAX) continue;
+        nvs_page_header_t header;
+        memset(&header, 0xFF, sizeof(header));
+        header.magic = NVS_PAGE_MAGIC;
+        header.seq = store.next_seq++;
+        esp_err_t err = esp_partition_write(store.partition, (size_t)i * SPI_FLASH_SEC_SIZE, &header, sizeof(header));
+        if (err != ESP_OK) return err;
+        store.pages[i].seq = header.seq;
+        store.pages[i].used = 0;
+        store.active = i;
+        return ESP_OK;
+    }
+    return ESP_ERR_NVS_NOT_ENOUGH_SPACE;
+}
+
+static nvs_value *find_chunk_owner(nvs_namespace &ns, uint32_t page, uint32_t slot, size_t *index)
+{
+    for (auto &kv : ns) {
+        for (size_t i = 0; i < kv.second.chunks.size(); i++) {
+            const nvs_location &loc = kv.second.chunks[i];
+            if (loc.page == page && loc.slot == slot) {
+                *index = i;
+                return &kv.second;
+            }
+        }
+    }
+    return NULL;
+}
+
+static nvs_value *find_chunk_owner(nvs_store &store, uint32_t page, uint32_t slot, size_t *index)
+{
+    nvs_value *owner = find_chunk_owner(store.ns_entries, page, slot, index);
+    for (auto it = store.namespaces.begin(); !owner && it != store.namespaces.end(); ++it)
+        owner = find_chunk_owner(it->second, page, slot, index);
+    return owner;
+}
+
+static esp_err_t mark_erased(nvs_store &store, const nvs_location &loc)
+{
+    uint8_t state = NVS_STATE_ERASED;
+    return esp_partition_write(store.partition, slot_offset(loc.page, loc.slot) + offsetof(nvs_chunk_header_t, state),
+                               &state, 1);
+}
+
+// Copy the live chunks of the oldest page to the active one, then erase it
+static esp_err_t reclaim_oldest(nvs_store &store)
+{
+    uint32_t oldest = UINT32_MAX;
+    for (uint32_t i = 0; i < store.pages.size(); i++) {
+        if (i == store.active || store.pages[i].seq == UINT32_MAX) continue;
+        if (oldest == UINT32_MAX || store.pages[i].seq < store.pages[oldest].seq) oldest = i;
+    }
+    if (oldest == UINT32_MAX) return ESP_ERR_NVS_NOT_ENOUGH_SPACE;
+
+    std::vector<uint8_t> buffer(SPI_FLASH_SEC_SIZE);
+    esp_err_t err = esp_partition_read(store.partition, (size_t)oldest * SPI_FLASH_SEC_SIZE, buffer.data(), buffer.size());
+    if (err != ESP_OK) return err;
+    for (uint32_t slot = 0; slot < store.pages[oldest].used;) {
+        nvs_chunk_header_t header;
+        memcpy(&header, buffer.data() + (1 + slot) * NVS_ENTRY_SIZE, sizeof(header));
+        if (header.span == 0 || header.span > NVS_SLOTS_PER_PAGE - slot) break;
+        size_t index;
+        nvs_value *owner = header.state == NVS_STATE_WRITTEN ? find_chunk_owner(store, oldest, slot, &index) : NULL;
+        if (owner) {
+            nvs_page &active = store.pages[store.active];
+            if (active.used + header.span > NVS_SLOTS_PER_PAGE) return ESP_ERR_NVS_NOT_ENOUGH_SPACE;
+            err = esp_partition_write(store.partition, slot_offset(store.active, active.used),
+                                      buffer.data() + (1 + slot) * NVS_ENTRY_SIZE, header.span * NVS_ENTRY_SIZE);
+            if (err != ESP_OK) return err;
+            emu_flash_stats_mut()->nvs_writes += header.span;
+            owner->chunks[index] = {store.active, active.used, header.span};
+            active.used += header.span;
+        }
+        slot += header.span;
+    }
+    err = esp_partition_erase_range(store.partition, (size_t)oldest * SPI_FLASH_SEC_SIZE, SPI_FLASH_SEC_SIZE);
+    if (err != ESP_OK) return err;
+    store.pages[oldest].seq = UINT32_MAX;
+    store.pages[oldest].used = 0;
+    emu_flash_stats_mut()->nvs_page_erases++;
+    return ESP_OK;
+}
+
+// Make room for `span` slots in the active page
+static esp_err_t reserve(nvs_store &store, uint32_t span)
+{
+    for (uint32_t attempt = 0; attempt <= store.pages.size(); attempt++) {
+        if (store.active != UINT32_MAX && store.pages[store.active].used + span <= NVS_SLOTS_PER_PAGE)
+            return ESP_OK;
+        // the last free page is only used to reclaim the oldest one
+        esp_err_t err = activate_free_page(store);
+        if (err != ESP_OK) return err;
+        if (nb_free_pages(store) == 0) {
+            err = reclaim_oldest(store);
+            if (err != ESP_OK) return err;
+        }
+    }
+    return ESP_ERR_NVS_NOT_ENOUGH_SPACE;
+}
+
+static esp_err_t write_value(nvs_store &store, uint8_t ns, const char *key, nvs_value &value)
+{
+    std::vector<nvs_location> chunks;
+    size_t total = is_inline(value.type) ? 0 : value.data.size();
+    size_t pos = 0;
+    uint8_t chunk = 0;
+    do {
+        size_t len = std::min(total - pos, (size_t)NVS_CHUNK_MAX);
+        uint32_t span = 1 + (len + NVS_ENTRY_SIZE - 1) / NVS_ENTRY_SIZE;
+        esp_err_t err = reserve(store, span);
+        if (err != ESP_OK) return err;
+
+        std::vector<uint8_t> slots(span * NVS_ENTRY_SIZE, 0xFF);
+        nvs_chunk_header_t header;
+        memset(&header, 0, sizeof(header));
+        header.ns = ns;
+        header.type = value.type;
+        header.span = span;
+        header.state = NVS_STATE_WRITTEN;
+        header.gen = value.gen;
+        header.chunk = chunk++;
+        header.chunk_len = len;
+        if (is_inline(value.type)) memcpy(&header.total_len, value.data.data(), value.data.size());
+        else header.total_len = total;
+        strncpy(header.key, key, sizeof(header.key) - 1);
+        header.crc = chunk_crc(&header, value.data.data() + pos);
+        memcpy(slots.data(), &header, sizeof(header));
+        if (len) memcpy(slots.data() + NVS_ENTRY_SIZE, value.data.data() + pos, len);
+
+        nvs_page &active = store.pages[store.active];
+        err = esp_partition_write(store.partition, slot_offset(store.active, active.used), slots.data(), slots.size());
+        if (err != ESP_OK) return err;
+        emu_flash_stats_mut()->nvs_writes += span;
+        chunks.push_back({store.active, active.used, (uint8_t)span});
+        active.used += span;
+        pos += len;
+    } while (pos < total);
+    value.chunks = chunks;
+    return ESP_OK;
+}
+
+// Rebuild the keys from the pages, in write order
+static esp_err_t replay(nvs_store &store)
+{
+    std::vector<std::pair<uint32_t, uint32_t>> order; // seq, page
+    std::vector<uint8_t> buffer(SPI_FLASH_SEC_SIZE);
+    for (uint32_t i = 0; i < store.pages.size(); i++) {
+        nvs_page_header_t header;
+        esp_err_t err = esp_partition_read(store.partition, (size_t)i * SPI_FLASH_SEC_SIZE, &header, sizeof(header));
+        if (err != ESP_OK) return err;
+        store.pages[i].seq = UINT32_MAX;
+        store.pages[i].used = 0;
+        if (header.magic == NVS_PAGE_MAGIC) order.push_back({header.seq, i});
+        else if (header.magic != 0xFFFFFFFF) {
+            // page header cut while being written
+            err = esp_partition_erase_range(store.partition, (size_t)i * SPI_FLASH_SEC_SIZE, SPI_FLASH_SEC_SIZE);
+            if (err != ESP_OK) return err;
+        }
+    }
+    std::sort(order.begin(), order.end());
+
+    std::map<uint8_t, std::string> ns_names;
+    // chunks of the generation being assembled, per namespace index and key
+    std::map<std::pair<uint8_t, std::string>, nvs_value> pending;
+    for (auto &entry : order) {
+        uint32_t page = entry.second;
+        store.pages[page].seq = entry.first;
+        store.next_seq = entry.first + 1;
+        store.active = page;
+        esp_err_t err = esp_partition_read(store.partition, (size_t)page * SPI_FLASH_SEC_SIZE, buffer.data(), buffer.size());
+        if (err != ESP_OK) return err;
+
+        // written slots end at the last programmed byte
+        uint32_t used = NVS_SLOTS_PER_PAGE;
+        while (used > 0) {
+            const uint8_t *s = buffer.data() + used * NVS_ENTRY_SIZE;
+            bool blank = true;
+            for (size_t b = 0; b < NVS_ENTRY_SIZE && blank; b++) blank = s[b] == 0xFF;
+            if (!blank) break;
+            used--;
+        }
+        store.pages[page].used = used;
+
+        for (uint32_t slot = 0; slot < used;) {
+            nvs_chunk_header_t header;
+            const uint8_t *s = buffer.data() + (1 + slot) * NVS_ENTRY_SIZE;
+            memcpy(&header, s, sizeof(header));
+            if (header.span == 0 || header.span > NVS_SLOTS_PER_PAGE - slot) break;
+            uint32_t span = header.span;
+            bool valid = header.state == NVS_STATE_WRITTEN && header.chunk_len <= (span - 1) * NVS_ENTRY_SIZE
+                         && header.crc == chunk_crc(&header, s + NVS_ENTRY_SIZE);
+            slot += span;
+            if (!valid) continue;
+
+            std::string key(header.key, strnlen(header.key, sizeof(header.key)));
+            if (header.ns == NVS_NS_INDEX) {
+                ns_names[header.total_len] = key;
+                store.ns_index[key] = header.total_len;
+                store.namespaces[key];
+                nvs_value &index = store.ns_entries[key];
+                index.type = NVS_TYPE_U8;
+                index.gen = 0;
+                index.data.assign(1, (uint8_t)header.total_len);
+                index.chunks.assign(1, {page, slot - span, (uint8_t)span});
+                continue;
+            }
+            nvs_value &value = pending[{header.ns, key}];
+            if (header.chunk == 0 || value.gen != header.gen) {
+                value.type = (nvs_type_t)header.type;
+                value.gen = header.gen;
+                value.data.clear();
+                value.chunks.clear();
+                if (header.chunk != 0) continue;
+            }
+            if (header.chunk != value.chunks.size()) continue;
+            value.chunks.push_back({page, slot - span, (uint8_t)span});
+            if (is_inline(value.type)) {
+                uint8_t size = value.type == NVS_TYPE_U8 ? 1 : 4;
+                value.data.assign((uint8_t *)&header.total_len, (uint8_t *)&header.total_len + size);
+            } else {
+                value.data.insert(value.data.end(), s + NVS_ENTRY_SIZE, s + NVS_ENTRY_SIZE + header.chunk_len);
+                if (value.data.size() < header.total_len) continue;
+            }
+            // complete generation: it replaces the previous value of the key
+            auto ns = ns_names.find(header.ns);
+            if (ns != ns_names.end()) store.namespaces[ns->second][key] = value;
+            value.chunks.clear();
+            value.data.clear();
+        }
+    }
+    return ESP_OK;
+}
+
+static nvs_open_handle *get_handle(nvs_handle_t handle)
+{
+    auto it = handles.find(handle);
+    return it == handles.end() ? NULL : &it->second;
+}
+
+extern "C" esp_err_t nvs_flash_init_partition(const char *partition_label)
+{
+    const esp_partition_t *p = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY,
+                                                        partition_label);
+    if (!p) return ESP_ERR_NOT_FOUND;
+    nvs_store &store = stores[partition_label];
+    if (store.initialized) return ESP_OK;
+    if (p->size < 2 * SPI_FLASH_SEC_SIZE) return ESP_ERR_NVS_NO_FREE_PAGES;
+    store.partition = p;
+    store.pages.assign(p->size / SPI_FLASH_SEC_SIZE, {UINT32_MAX, 0});
+    store.namespaces.clear();
+    store.ns_index.clear();
+    store.ns_entries.clear();
+    store.active = UINT32_MAX;
+    store.next_seq = 0;
+    esp_err_t err = replay(store);
+    if (err != ESP_OK) return err;
+    if (nb_free_pages(store) == 0) return ESP_ERR_NVS_NO_FREE_PAGES;
+    store.initialized = true;
+    return ESP_OK;
+}
+
+extern "C" esp_err_t nvs_flash_deinit_partition(const char *partition_label)
+{
+    stores[partition_label].initialized = false;
+    return ESP_OK;
+}
+
+extern "C" esp_err_t nvs_flash_erase_partition(const char *part_name)
+{
+    const esp_partition_t *p = esp_partition_find_first(ESP_PARTITION_TYPE_DATA,
+                                                        ESP_PARTITION_SUBTYPE_ANY, part_name);
+    if (!p) return ESP_ERR_NOT_FOUND;
+    stores.erase(part_name);
+    emu_flash_stats_mut()->nvs_page_erases += p->size / SPI_FLASH_SEC_SIZE;
+    return esp_partition_erase_range(p, 0, p->size);
+}
+
+extern "C" esp_err_t nvs_open_from_partition(const char *part_name, const char *name,
+        nvs_open_mode_t open_mode, nvs_handle_t *out_handle)
+{
+    auto it = stores.find(part_name);
+    if (it == stores.end() || !it->second.initialized) return ESP_ERR_NVS_NOT_INITIALIZED;
+    nvs_store &store = it->second;
+    if (!store.ns_index.count(name)) {
+        if (open_mode == NVS_READONLY) return ESP_ERR_NVS_NOT_FOUND;
+        if (strlen(name) >= NVS_KEY_NAME_MAX_SIZE || store.ns_index.size() >= 254) return ESP_ERR_INVALID_ARG;
+        nvs_value index;
+        index.type = NVS_TYPE_U8;
+        index.gen = 0;
+        index.data.assign(1, (uint8_t)(store.ns_index.size() + 1));
+        esp_err_t err = write_value(store, NVS_NS_INDEX, name, index);
+        if (err != ESP_OK) return err;
+        store.ns_index[name] = index.data[0];
+        store.ns_entries[name] = index;
+        store.namespaces[name];
+    }
+    handles[next_handle] = {part_name, name, open_mode == NVS_READWRITE};
+    *out_handle = next_handle++;
+    return ESP_OK;
+}
+
+extern "C" void nvs_close(nvs_handle_t handle)
+{
+    handles.erase(handle);
+}
+
+static esp_err_t erase_chunks(nvs_store &store, const nvs_value &value)
+{
+    for (const nvs_location &loc : value.chunks) {
+        esp_err_t err = mark_erased(store, loc);
+        if (err != ESP_OK) return err;
+        emu_flash_stats_mut()->nvs_writes++;
+    }
+    return ESP_OK;
+}
+
+static esp_err_t set_value(nvs_handle_t handle, const char *key, nvs_type_t type,
+                           const void *value, size_t length)
+{
+    nvs_open_handle *h = get_handle(handle);
+    if (!h) return ESP_ERR_NVS_INVALID_HANDLE;
+    if (!h->writable) return ESP_ERR_NVS_READ_ONLY;
+    if (!key || strlen(key) >= NVS_KEY_NAME_MAX_SIZE) return ESP_ERR_INVALID_ARG;
+    nvs_store &store = stores[h->part];
+    nvs_namespace &ns = store.namespaces[h->ns];
+
+    nvs_value next;
+    next.type = type;
+    next.gen = 0;
+    next.data.assign((const uint8_t *)value, (const uint8_t *)value + length);
+    auto old = ns.find(key);
+    if (old != ns.end()) {
+        // like ESP-IDF, an unchanged value is not written again
+        if (old->second.type == type && old->second.data == next.data) return ESP_OK;
+        next.gen = old->second.gen + 1;
+    }
+    esp_err_t err = write_value(store, store.ns_index[h->ns], key, next);
+    if (err != ESP_OK) return err;
+    old = ns.find(key); // chunks may have moved while reclaiming a page
+    if (old != ns.end()) {
+        err = erase_chunks(store, old->second);
+        if (err != ESP_OK) return err;
+    }
+    ns[key] = next;
+    return ESP_OK;
+}
+
+static void read_entry(nvs_store &store, const nvs_value &value)
+{
+    if (value.chunks.empty()) return;
+    uint8_t entry[NVS_ENTRY_SIZE];
+    esp_partition_read(store.partition, slot_offset(value.chunks[0].page, value.chunks[0].slot), entry, sizeof(entry));
+}
+
+static esp_err_t get_value(nvs_handle_t handle, const char *key, nvs_type_t type,
+                           const nvs_value **out)
+{
+    nvs_open_handle *h = get_handle(handle);
+    if (!h) return ESP_ERR_NVS_INVALID_HANDLE;
+    nvs_namespace &ns = stores[h->part].namespaces[h->ns];
+    auto it = ns.find(key);
+    if (it == ns.end() || it->second.type != type) return ESP_ERR_NVS_NOT_FOUND;
+    // like ESP-IDF, the entry found by its hash is read back from flash to check the key
+    read_entry(stores[h->part], it->second);
+    *out = &it->second;
+    return ESP_OK;
+}
+
+extern "C" esp_err_t nvs_set_u8(nvs_handle_t handle, const char *key, uint8_t value)
+{
+    return set_value(handle, key, NVS_TYPE_U8, &value, sizeof(value));
+}
+
+extern "C" esp_err_t nvs_set_u32(nvs_handle_t handle, const char *key, uint32_t value)
+{
+    return set_value(handle, key, NVS_TYPE_U32, &value, sizeof(value));
+}
+
+extern "C" esp_err_t nvs_set_blob(nvs_handle_t handle, const char *key, const void *value, size_t length)
+{
+    return set_value(handle, key, NVS_TYPE_BLOB, value, length);
+}
+
+extern "C" esp_err_t nvs_get_u8(nvs_handle_t handle, const char *key, uint8_t *out_value)
+{
+    const nvs_value *v;
+    esp_err_t err = get_value(handle, key, NVS_TYPE_U8, &v);
+    if (err == ESP_OK) memcpy(out_value, v->data.data(), sizeof(*out_value));
+    return err;
+}
+
+extern "C" esp_err_t nvs_get_u32(nvs_handle_t handle, const char *key, uint32_t *out_value)
+{
+    const nvs_value *v;
+    esp_err_t err = get_value(handle, key, NVS_TYPE_U32, &v);
+    if (err == ESP_OK) memcpy(out_value, v->data.data(), sizeof(*out_value));
+    return err;
+}
+
+extern "C" esp_err_t nvs_get_blob(nvs_handle_t handle, const char *key, void *out_value, size_t *length)
+{
+    const nvs_value *v;
+    esp_err_t err = get_value(handle, key, NVS_TYPE_BLOB, &v);
+    if (err != ESP_OK) return err;
+    if (out_value == NULL) {
+        *length = v->data.size();
+        return ESP_OK;
+    }
+    if (*length < v->data.size()) return ESP_ERR_NVS_INVALID_LENGTH;
+    memcpy(out_value, v->data.data(), v->data.size());
+    *length = v->data.size();
+    return ESP_OK;
+}
+
+extern "C" esp_err_t nvs_erase_key(nvs_handle_t handle, const char *key)
+{
+    nvs_open_handle *h = get_handle(handle);
+    if (!h) return ESP_ERR_NVS_INVALID_HANDLE;
+    if (!h->writable) return ESP_ERR_NVS_READ_ONLY;
+    nvs_store &store = stores[h->part];
+    nvs_namespace &ns = store.namespaces[h->ns];
+    auto it = ns.find(key);
+    if (it == ns.end()) return ESP_ERR_NVS_NOT_FOUND;
+    esp_err_t err = erase_chunks(store, it->second);
+    ns.erase(it);
+    return err;
+}
+
+extern "C" esp_err_t nvs_erase_all(nvs_handle_t handle)
+{
+    nvs_open_handle *h = get_handle(handle);
+    if (!h) return ESP_ERR_NVS_INVALID_HANDLE;
+    if (!h->writable) return ESP_ERR_NVS_READ_ONLY;
+    nvs_store &store = stores[h->part];
+    nvs_namespace &ns = store.namespaces[h->ns];
+    for (auto &kv : ns) {
+        esp_err_t err = erase_chunks(store, kv.second);
+        if (err != ESP_OK) return err;
+    }
+    ns.clear();
+    return ESP_OK;
+}
+
+extern "C" esp_err_t nvs_commit(nvs_handle_t handle)
+{
+    // entries are in flash as soon as they are set
+    if (!get_handle(handle)) return ESP_ERR_NVS_INVALID_HANDLE;
+    emu_flash_stats_mut()->nvs_commits++;
+    return ESP_OK;
+}
+
+extern "C" nvs_iterator_t nvs_entry_find(const char *part_name, const char *namespace_name, nvs_type_t type)
+{
+    auto sit = stores.find(part_name);
+    if (sit == stores.end()) return NULL;
+    nvs_iterator_t it = new nvs_opaque_iterator_t();
+    it->store = &sit->second;
+    it->index = 0;
+    for (auto &ns : sit->second.namespaces) {
+        if (namespace_name && ns.first != namespace_name) continue;
+        for (auto &kv : ns.second) {
+            if (type != NVS_TYPE_ANY && kv.second.type != type) continue;
+            nvs_entry_info_t info;
+            memset(&info, 0, sizeof(info));
+            strncpy(info.namespace_name, ns.first.c_str(), sizeof(info.namespace_name) - 1);
+            strncpy(info.key, kv.first.c_str(), sizeof(info.key) - 1);
+            info.type = kv.second.type;
+            it->entries.push_back(info);
+            it->values.push_back(&kv.second);
+        }
+    }
+    if (it->entries.empty()) {
+        delete it;
+        return NULL;
+    }
+    return it;
+}
+
+extern "C" nvs_iterator_t nvs_entry_next(nvs_iterator_t iterator)
+{
+    if (!iterator) return NULL;
+    if (++iterator->index >= iterator->entries.size()) {
+        delete iterator;
+        return NULL;
+    }
+    return iterator;
+}
+
+extern "C" void nvs_entry_info(nvs_iterator_t iterator, nvs_entry_info_t *out_info)
+{
+    // the ESP-IDF iterator reads each entry from flash
+    read_entry(*iterator->store, *iterator->values[iterator->index]);
+    *out_info = iterator->entries[iterator->index];
+}
+
+extern "C" void nvs_release_iterator(nvs_iterator_t iterator)
+{
+    delete iterator;
+}
+
+extern "C" esp_err_t nvs_get_stats(const char *part_name, nvs_stats_t *nvs_stats)
+{
+    auto sit = stores.find(part_name);
+    if (sit == stores.end() || !sit->second.initialized) return ESP_ERR_NVS_NOT_INITIALIZED;
+    const nvs_store &store = sit->second;
+    size_t used = 0;
+    for (auto &kv : store.ns_entries)
+        for (const nvs_location &loc : kv.second.chunks) used += loc.span;
+    for (auto &ns : store.namespaces)
+        for (auto &kv : ns.second)
+            for (const nvs_location &loc : kv.second.chunks) used += loc.span;
+    size_t written = 0;
+    for (const nvs_page &p : store.pages) written += p.used;
+    nvs_stats->used_entries = used;
+    nvs_stats->total_entries = store.pages.size() * NVS_SLOTS_PER_PAGE;
+    nvs_stats->free_entries = nvs_stats->total_entries - written;
+    nvs_stats->namespace_count = store.ns_index.size();
+    return ESP_OK;
+}
@@ -0,0 +1,104 @@
+#include <string.h>
+#include "export_decoder.h"
+
+static size_t get_varint(const uint8_t *in, size_t avail, uint32_t *value)
+{
+    *value = 0;
+    for (size_t i = 0; i < avail && i < 5; i++)
+    {
+        *value |= (uint32_t)(in[i] & 0x7F) << (7*i);
+        if (!(in[i] & 0x80)) return i + 1;
+    }
+    return 0;
+}
+
+static bool decompress(const uint8_t *in, size_t len, std::vector<uint8_t> *out)
+{
+    size_t pos = 0;
+    while (pos < len)
+    {
+        uint8_t flags = in[pos++];
+        for (int item = 0; item < 8 && pos < len; item++)
+        {
+            if (!(flags & (1 << item)))
+            {
+                out->push_back(in[pos++]);
+                continue;
+            }
+            if (pos + 2 > len) return false;
+            uint32_t offset = (in[pos] | (uint32_t)(in[pos + 1] >> 4) << 8) + 1;
+            uint32_t length = (in[pos + 1] & 0x0F) + HISTORY_EXPORT_MIN_MATCH;
+            pos += 2;
+            if (offset > out->size()) return false;
+            // byte by byte: a match may overlap the bytes it produces
+            size_t from = out->size() - offset;
+            for (uint32_t i = 0; i < length; i++) out->push_back((*out)[from + i]);
+        }
+    }
+    return true;
+}
+
+static bool read_blocks(const uint8_t *in, size_t len, std::vector<uint8_t> *out)
+{
+    size_t pos = 0;
+    while (pos < len)
+    {
+        if (pos + 2 > len) return false;
+        bool compressed = in[pos + 1] & 0x80;
+        size_t block_len = in[pos] | (size_t)(in[pos + 1] & 0x7F) << 8;
+        pos += 2;
+        if (pos + block_len > len) return false;
+        if (compressed)
+        {
+            if (!decompress(in + pos, block_len, out)) return false;
+        }
+        else out->insert(out->end(), in + pos, in + pos + block_len);
+        pos += block_len;
+    }
+    return true;
+}
+
+bool decode_history_export(const uint8_t *stream, size_t len, std::vector<history_entry_t> *out)
+{
+    uint32_t entry;
+    if (len < 5 || memcmp(stream, HISTORY_EXPORT_MAGIC, 3) || stream[3] != HISTORY_EXPORT_VERSION) return false;
+    size_t pos = get_varint(stream + 4, len - 4, &entry);
+    if (pos == 0) return false;
+    pos += 4;
+
+    std::vector<uint8_t> records;
+    if (!read_blocks(stream + pos, len - pos, &records)) return false;
+    uint32_t timestamp = 0;
+    history_export_uids_t uids = {};
+    uint8_t slot;
+    for (pos = 0; pos < records.size();)
+    {
+        history_entry_t record;
+        record.entry = entry++;
+        uint8_t tag = records[pos++];
+        if (tag >= HISTORY_EXPORT_TAG_SLOT)
+        {
+            slot = tag - HISTORY_EXPORT_TAG_SLOT;
+            if (uids.len[slot] == 0) return false;
+            record.uid_len = uids.len[slot];
+            memcpy(record.uid, uids.uid[slot], record.uid_len);
+            uids.referred[slot] = 1;
+        }
+        else
+        {
+            record.uid_len = tag;
+            if (record.uid_len > HISTORY_UID_MAX_SIZE || pos + record.uid_len > records.size()) return false;
+            memcpy(record.uid, &records[pos], record.uid_len);
+            pos += record.uid_len;
+            HistoryExporter::update_uids(&uids, record.uid, record.uid_len, &slot);
+        }
+        uint32_t dt;
+        size_t n = get_varint(&records[pos], records.size() - pos, &dt);
+        if (n == 0) return false;
+        pos += n;
+        timestamp += (int32_t)(dt >> 1) ^ -(int32_t)(dt & 1);
+        record.timestamp = timestamp;
+        out->push_back(record);
+    }
+    return true;
+}
@@ -0,0 +1,13 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+#include "history_export.h"
+
+/**
+ * @brief Decode a history export stream (see history_export.h), on the host
+ *
+ * @param out records of the stream, entry numbers from the first one of the header
+ * @return false if the stream is not an export or is truncated
+ */
+bool decode_history_export(const uint8_t *stream, size_t len, std::vector<history_entry_t> *out);
@@ -0,0 +1,40 @@
+/* History export decoder
+   Prints the records of a stream written by HistoryExporter (UART dump or
+   concatenated uplinks) as CSV: entry,timestamp,UID in hex.
+
+   history_decode <dump file>, or the stream on stdin
+*/
+#include <stdio.h>
+#include <vector>
+#include "export_decoder.h"
+
+int main(int argc, char **argv)
+{
+    FILE *file = argc > 1 ? fopen(argv[1], "rb") : stdin;
+    if (!file)
+    {
+        perror(argv[1]);
+        return 1;
+    }
+    std::vector<uint8_t> stream;
+    uint8_t buffer[4096];
+    size_t n;
+    while ((n = fread(buffer, 1, sizeof(buffer), file)) > 0) stream.insert(stream.end(), buffer, buffer + n);
+    if (file != stdin) fclose(file);
+
+    std::vector<history_entry_t> records;
+    if (!decode_history_export(stream.data(), stream.size(), &records))
+    {
+        fprintf(stderr, "not a history export, or truncated after %zu records\n", records.size());
+        return 1;
+    }
+    printf("entry,timestamp,uid\n");
+    for (const history_entry_t &record : records)
+    {
+        printf("%u,%u,", record.entry, record.timestamp);
+        for (uint8_t i = 0; i < record.uid_len; i++) printf("%02x", record.uid[i]);
+        printf("\n");
+    }
+    fprintf(stderr, "%zu records from %zu bytes\n", records.size(), stream.size());
+    return 0;
+}
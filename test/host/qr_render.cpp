@@ -0,0 +1,187 @@
+#include "qr_render.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <random>
+
+static uint8_t clamp_luma(int32_t luma)
+{
+    return luma < 0 ? 0 : luma > 255 ? 255 : luma;
+}
+
+static void fill(qr_image_t *image, int32_t x0, int32_t y0, int32_t x1, int32_t y1, uint8_t luma)
+{
+    if (x0 < 0) x0 = 0;
+    if (y0 < 0) y0 = 0;
+    if (x1 > (int32_t)image->width) x1 = image->width;
+    if (y1 > (int32_t)image->height) y1 = image->height;
+    for (int32_t y = y0; y < y1; y++)
+    {
+        uint8_t *row = image->row(y);
+        for (int32_t x = x0; x < x1; x++) row[x] = luma;
+    }
+}
+
+void render_scene(qr_image_t *image, uint32_t nb_shapes, uint32_t seed)
+{
+    std::mt19937 rng(seed);
+    int32_t base = 60 + rng() % 120;
+    int32_t dx = (int32_t)(rng() % 81) - 40;
+    int32_t dy = (int32_t)(rng() % 81) - 40;
+    for (uint32_t y = 0; y < image->height; y++)
+    {
+        uint8_t *row = image->row(y);
+        for (uint32_t x = 0; x < image->width; x++)
+            row[x] = clamp_luma(base + dx * (int32_t)x / (int32_t)image->width + dy * (int32_t)y / (int32_t)image->height);
+    }
+    for (uint32_t i = 0; i < nb_shapes; i++)
+    {
+        int32_t w = 8 + rng() % (image->width / 2);
+        int32_t h = 8 + rng() % (image->height / 2);
+        int32_t x = (int32_t)(rng() % image->width) - w / 2;
+        int32_t y = (int32_t)(rng() % image->height) - h / 2;
+        fill(image, x, y, x + w, y + h, rng() % 256);
+    }
+}
+
+// Module (row, col) of the symbol: true if dark
+static bool function_module(uint32_t row, uint32_t col, bool *dark)
+{
+    // finder patterns and their separators
+    const uint32_t corners[3][2] = {{0, 0}, {0, QR_RENDER_MODULES - 7}, {QR_RENDER_MODULES - 7, 0}};
+    for (const auto &corner : corners)
+    {
+        int32_t r = (int32_t)row - (int32_t)corner[0];
+        int32_t c = (int32_t)col - (int32_t)corner[1];
+        if (r < -1 || r > 7 || c < -1 || c > 7) continue;
+        if (r < 0 || r > 6 || c < 0 || c > 6) *dark = false;
+        else
+        {
+            uint32_t ring = std::min(std::min(r, 6 - r), std::min(c, 6 - c));
+            *dark = ring != 1;
+        }
+        return true;
+    }
+    // alignment pattern of version 2, centered on module 18, 18
+    int32_t r = (int32_t)row - 18;
+    int32_t c = (int32_t)col - 18;
+    if (r >= -2 && r <= 2 && c >= -2 && c <= 2)
+    {
+        uint32_t ring = std::max(std::abs(r), std::abs(c));
+        *dark = ring != 1;
+        return true;
+    }
+    // timing patterns
+    if (row == 6 || col == 6)
+    {
+        *dark = (row + col) % 2 == 0;
+        return true;
+    }
+    return false;
+}
+
+// Dark modules of the symbol, the data ones drawn in order from seed
+static std::vector<bool> symbol_modules(uint32_t seed)
+{
+    std::mt19937 rng(seed);
+    std::vector<bool> modules(QR_RENDER_MODULES * QR_RENDER_MODULES);
+    for (uint32_t row = 0; row < QR_RENDER_MODULES; row++)
+    {
+        for (uint32_t col = 0; col < QR_RENDER_MODULES; col++)
+        {
+            bool is_dark;
+            if (!function_module(row, col, &is_dark)) is_dark = rng() % 2;
+            modules[row * QR_RENDER_MODULES + col] = is_dark;
+        }
+    }
+    return modules;
+}
+
+void render_code(qr_image_t *image, int32_t x, int32_t y, uint32_t module, uint8_t dark, uint8_t light,
+                 uint32_t seed)
+{
+    std::vector<bool> modules = symbol_modules(seed);
+    int32_t size = code_size(module);
+    fill(image, x, y, x + size, y + size, light);
+    int32_t x0 = x + QR_RENDER_QUIET * module;
+    int32_t y0 = y + QR_RENDER_QUIET * module;
+    for (uint32_t row = 0; row < QR_RENDER_MODULES; row++)
+    {
+        for (uint32_t col = 0; col < QR_RENDER_MODULES; col++)
+        {
+            if (!modules[row * QR_RENDER_MODULES + col]) continue;
+            int32_t mx = x0 + col * module;
+            int32_t my = y0 + row * module;
+            fill(image, mx, my, mx + module, my + module, dark);
+        }
+    }
+}
+
+void render_code_turned(qr_image_t *image, float cx, float cy, float module, float angle, uint8_t dark,
+                        uint8_t light, uint32_t seed)
+{
+    std::vector<bool> modules = symbol_modules(seed);
+    float side = QR_RENDER_MODULES + 2 * QR_RENDER_QUIET;
+    // the quiet zone turned fits in a square of its diagonal
+    float half = side * module * 0.7072f;
+    int32_t x0 = std::max((int32_t)std::floor(cx - half), 0);
+    int32_t y0 = std::max((int32_t)std::floor(cy - half), 0);
+    int32_t x1 = std::min((int32_t)std::ceil(cx + half), (int32_t)image->width);
+    int32_t y1 = std::min((int32_t)std::ceil(cy + half), (int32_t)image->height);
+    float c = std::cos(angle) / module;
+    float s = std::sin(angle) / module;
+    for (int32_t y = y0; y < y1; y++)
+    {
+        uint8_t *row = image->row(y);
+        for (int32_t x = x0; x < x1; x++)
+        {
+            // the pixel center back in modules of the quiet zone
+            float dx = x + 0.5f - cx;
+            float dy = y + 0.5f - cy;
+            float u = dx * c + dy * s + side / 2;
+            float v = -dx * s + dy * c + side / 2;
+            if (u < 0 || v < 0 || u >= side || v >= side) continue;
+            int32_t col = (int32_t)u - QR_RENDER_QUIET;
+            int32_t r = (int32_t)v - QR_RENDER_QUIET;
+            bool in_symbol = col >= 0 && r >= 0 && col < QR_RENDER_MODULES && r < QR_RENDER_MODULES;
+            row[x] = in_symbol && modules[r * QR_RENDER_MODULES + col] ? dark : light;
+        }
+    }
+}
+
+// Running sum over 2 * radius + 1 pixels, the edges repeated
+static void blur_line(uint8_t *line, uint32_t len, uint32_t step, uint32_t radius, std::vector<uint8_t> *tmp)
+{
+    tmp->resize(len);
+    for (uint32_t i = 0; i < len; i++) (*tmp)[i] = line[i * step];
+    int32_t last = len - 1;
+    uint32_t sum = 0;
+    for (int32_t i = -(int32_t)radius; i <= (int32_t)radius; i++) sum += (*tmp)[std::min(std::max(i, 0), last)];
+    uint32_t width = 2 * radius + 1;
+    for (int32_t i = 0; i <= last; i++)
+    {
+        line[i * step] = (sum + width / 2) / width;
+        sum += (*tmp)[std::min(i + (int32_t)radius + 1, last)];
+        sum -= (*tmp)[std::max(i - (int32_t)radius, 0)];
+    }
+}
+
+void blur_image(qr_image_t *image, uint32_t radius)
+{
+    if (radius == 0) return;
+    std::vector<uint8_t> tmp;
+    for (uint32_t y = 0; y < image->height; y++) blur_line(image->row(y), image->width, 1, radius, &tmp);
+    for (uint32_t x = 0; x < image->width; x++)
+        blur_line(image->pixels.data() + x, image->height, image->width, radius, &tmp);
+}
+
+void expose_image(qr_image_t *image, float gain, int32_t offset, uint32_t noise, uint32_t seed)
+{
+    std::mt19937 rng(seed);
+    for (uint8_t &luma : image->pixels)
+    {
+        int32_t value = (int32_t)((luma - 128) * gain) + 128 + offset;
+        if (noise) value += (int32_t)(rng() % (2 * noise + 1)) - (int32_t)noise;
+        luma = clamp_luma(value);
+    }
+}
@@ -0,0 +1,55 @@
+#pragma once
+#include <stdint.h>
+#include <vector>
+
+#define QR_RENDER_MODULES 25 // version 2 symbol
+#define QR_RENDER_QUIET 4 // modules of quiet zone around the symbol
+
+// Grayscale frame as the camera gives it, row by row
+struct qr_image_t {
+    uint32_t width = 0;
+    uint32_t height = 0;
+    std::vector<uint8_t> pixels;
+
+    qr_image_t() {}
+    qr_image_t(uint32_t width, uint32_t height, uint8_t luma=128)
+        : width(width), height(height), pixels(width * height, luma) {}
+    uint8_t* row(uint32_t y) {return pixels.data() + y * width;}
+};
+
+/**
+ * @brief A scene without code, on the host: a gradient of luma and random
+ *        rectangles, sharp edged
+ */
+void render_scene(qr_image_t *image, uint32_t nb_shapes, uint32_t seed);
+
+/**
+ * @brief Draw a version 2 QR symbol, finder, timing and alignment patterns
+ *        and random data modules, in its quiet zone of QR_RENDER_QUIET modules
+ *
+ * @param x, y top left corner of the quiet zone, the symbol may go past the frame
+ */
+void render_code(qr_image_t *image, int32_t x, int32_t y, uint32_t module, uint8_t dark, uint8_t light,
+                 uint32_t seed);
+
+/**
+ * @brief The same symbol centered on cx, cy and turned by angle radians,
+ *        module pixels a module, sampled at the center of each pixel
+ */
+void render_code_turned(qr_image_t *image, float cx, float cy, float module, float angle, uint8_t dark,
+                        uint8_t light, uint32_t seed);
+
+/**
+ * @brief Pixels of the symbol and its quiet zone on a side
+ */
+inline uint32_t code_size(uint32_t module) {return (QR_RENDER_MODULES + 2 * QR_RENDER_QUIET) * module;}
+
+/**
+ * @brief Box blur of 2 * radius + 1 pixels: an edge becomes a ramp that wide
+ */
+void blur_image(qr_image_t *image, uint32_t radius);
+
+/**
+ * @brief Luma to (luma - 128) * gain + 128 + offset, plus uniform noise of +-noise
+ */
+void expose_image(qr_image_t *image, float gain, int32_t offset, uint32_t noise, uint32_t seed);
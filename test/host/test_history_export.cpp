@@ -0,0 +1,156 @@
+/* History export round trip
+   Fills the ring with a realistic mix of scans, exports it with HistoryExporter
+   in LoRa and UART sized chunks, decodes the stream as the host would and checks
+   every record against the log. Does the same with a log of rounds of the same
+   badges at a fixed period, which the LZ stage compresses. Reports the compression ratio against the
+   sectors a raw dump would send, and the export throughput.
+
+   test_history_export [dump file]: also writes the full export, for history_decode
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+#include "esp_log.h"
+#include "flash_emu.h"
+#include "database.h"
+#include "history_export.h"
+#include "export_decoder.h"
+
+#define TEST_EPOCH 1650000000
+#define TEST_NB_USERS 500
+#define TEST_NB_SCANS 150000 // the ring wraps
+#define TEST_SCANS_PER_WAKEUP 50
+#define TEST_ROUND_SCANS 20000
+#define TEST_ROUND_USERS 40 // badges of a patrol round, scanned every 36 s
+#define TEST_STOP_AFTER 3 // chunks accepted before the link goes down
+
+typedef struct {
+    std::vector<uint8_t> stream;
+    size_t chunk_size;
+    uint32_t bad_chunks; // chunks of the wrong size before the last one
+    uint32_t stop_after; // 0 to accept every chunk
+    uint32_t nb_chunks;
+    bool last_seen;
+} sink_t;
+
+static bool sink(const uint8_t *chunk, size_t len, void *arg)
+{
+    sink_t *s = (sink_t*)arg;
+    if (s->last_seen || len > s->chunk_size || len == 0) s->bad_chunks++;
+    if (len < s->chunk_size) s->last_seen = true;
+    s->stream.insert(s->stream.end(), chunk, chunk + len);
+    s->nb_chunks++;
+    return s->stop_after == 0 || s->nb_chunks < s->stop_after;
+}
+
+// Badges of 4 (70%) or 7 bytes, a few users scan much more often than the others
+static void random_scan(uint8_t *uid, uint8_t *uid_len, uint32_t *timestamp)
+{
+    uint32_t user = (rand() % TEST_NB_USERS) * (rand() % TEST_NB_USERS) / TEST_NB_USERS;
+    *uid_len = user % 10 < 7 ? 4 : 7;
+    for (uint8_t i = 0; i < *uid_len; i++) uid[i] = (uint8_t)(user * 2654435761u >> (4*i));
+    *timestamp += 30 + rand() % 1800;
+}
+
+static uint32_t check(ScanHistoryDB &history_db, uint32_t first_entry, size_t chunk_size, const char *name,
+                      const char *dump_path)
+{
+    sink_t s = {};
+    s.chunk_size = chunk_size;
+    HistoryExporter exporter(history_db, chunk_size);
+    int64_t start = esp_timer_get_time();
+    bool done = exporter.run(first_entry, sink, &s);
+    int64_t elapsed = esp_timer_get_time() - start;
+    const history_export_stats_t &stats = exporter.get_stats();
+
+    std::vector<history_entry_t> records;
+    uint32_t failures = 0;
+    if (!done || s.bad_chunks || s.stream.size() != stats.stream_bytes
+        || !decode_history_export(s.stream.data(), s.stream.size(), &records) || records.size() != stats.entries)
+    {
+        printf("FAILED: %s stream is wrong\n", name);
+        return 1;
+    }
+    uint32_t expected_first = first_entry < history_db.get_oldest_entry() ? history_db.get_oldest_entry() : first_entry;
+    uint32_t expected_nb = history_db.get_nb_entries() ? history_db.get_newest_entry() + 1 - expected_first : 0;
+    if (records.size() != expected_nb) failures++;
+    HistoryIterator it(history_db, expected_first);
+    history_entry_t record;
+    for (const history_entry_t &decoded : records)
+    {
+        if (!it.next(&record) || record.entry != decoded.entry || record.timestamp != decoded.timestamp
+            || record.uid_len != decoded.uid_len || memcmp(record.uid, decoded.uid, record.uid_len)) failures++;
+    }
+    if (dump_path)
+    {
+        FILE *file = fopen(dump_path, "wb");
+        if (file)
+        {
+            fwrite(s.stream.data(), 1, s.stream.size(), file);
+            fclose(file);
+        }
+    }
+    printf("%s: %u entries, %u flash bytes -> %u record bytes -> %u bytes in %u chunks, x%.1f vs sectors, "
+           "x%.2f vs records, %u/%u blocks stored, %.0f MB/s -> %u failures\n", name, stats.entries, stats.flash_bytes,
+           stats.record_bytes, stats.stream_bytes, stats.chunks,
+           stats.stream_bytes ? (double)stats.flash_bytes / stats.stream_bytes : 0,
+           stats.stream_bytes ? (double)stats.record_bytes / stats.stream_bytes : 0, stats.stored_blocks, stats.blocks,
+           elapsed ? (double)stats.flash_bytes / elapsed : 0, failures);
+    return failures;
+}
+
+static uint32_t check_stop(ScanHistoryDB &history_db)
+{
+    sink_t s = {};
+    s.chunk_size = 51;
+    s.stop_after = TEST_STOP_AFTER;
+    HistoryExporter exporter(history_db, s.chunk_size);
+    bool done = exporter.run(0, sink, &s);
+    bool ok = !done && s.nb_chunks == TEST_STOP_AFTER && s.stream.size() == TEST_STOP_AFTER * s.chunk_size;
+    printf("link down after %u chunks: export stopped -> %s\n", TEST_STOP_AFTER, ok ? "OK" : "FAILED");
+    return ok ? 0 : 1;
+}
+
+int main(int argc, char **argv)
+{
+    emu_flash_init(NULL);
+    esp_log_level_set("*", ESP_LOG_ERROR);
+    emu_partition_wipe(P_HISTORY);
+    emu_partition_wipe(P_HISTORY_CTRL);
+
+    uint32_t failures = 0;
+    ScanHistoryDB history_db;
+    failures += check(history_db, 0, 256, "empty log", NULL);
+
+    srand(1);
+    uint8_t uid[HISTORY_UID_MAX_SIZE];
+    uint8_t uid_len;
+    uint32_t timestamp = TEST_EPOCH;
+    random_scan(uid, &uid_len, &timestamp);
+    history_db.add_history(uid, uid_len, timestamp);
+    failures += check(history_db, 0, 256, "one scan", NULL);
+
+    for (uint32_t i = 1; i < TEST_NB_SCANS; i++)
+    {
+        random_scan(uid, &uid_len, &timestamp);
+        history_db.add_history(uid, uid_len, timestamp);
+        if (i % TEST_SCANS_PER_WAKEUP == 0) while (history_db.erase_ahead());
+    }
+    failures += check(history_db, 0, 256, "full ring, UART", argc > 1 ? argv[1] : NULL);
+    failures += check(history_db, 0, 51, "full ring, LoRa", NULL);
+    failures += check(history_db, history_db.get_newest_entry() - 999, 51, "last 1000", NULL);
+    failures += check_stop(history_db);
+
+    history_db.clear_history();
+    for (uint32_t i = 0; i < TEST_ROUND_SCANS; i++)
+    {
+        uint32_t user = i % TEST_ROUND_USERS;
+        uid_len = 4;
+        for (uint8_t j = 0; j < uid_len; j++) uid[j] = (uint8_t)(user * 2654435761u >> (4*j));
+        history_db.add_history(uid, uid_len, TEST_EPOCH + 36 * i);
+        if (i % TEST_SCANS_PER_WAKEUP == 0) while (history_db.erase_ahead());
+    }
+    failures += check(history_db, 0, 256, "rounds", NULL);
+    return failures ? 1 : 0;
+}
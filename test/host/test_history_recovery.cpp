@@ -0,0 +1,144 @@
+/* ScanHistoryDB recovery test
+   Fills the raw log sector by sector until it wraps several times, reboots at
+   every fill level that moves the head, the oldest sector or the erased gap
+   across the ring, and checks that the log found back holds the same entries,
+   reads back right and takes new records, in a number of header reads that
+   grows with log2 of the sectors. Once with each rollup split.
+*/
+#include <stdio.h>
+#include <string.h>
+#include "esp_log.h"
+#include "flash_emu.h"
+#include "database.h"
+
+#define TEST_EPOCH 1650000000
+#define TEST_READ_CHUNK 256
+
+static void expected_scan(uint32_t entry, uint8_t *uid, uint8_t *uid_len, uint32_t *timestamp)
+{
+    uint32_t user = entry * 7 % 211;
+    *uid_len = user % 3 ? 4 : 7;
+    for (uint8_t i = 0; i < *uid_len; i++) uid[i] = (uint8_t)(user * 2654435761u >> (4*i));
+    *timestamp = TEST_EPOCH + 30 * entry + entry % 3;
+}
+
+static void append(ScanHistoryDB &history_db, uint32_t entry)
+{
+    uint8_t uid[HISTORY_UID_MAX_SIZE];
+    uint8_t uid_len;
+    uint32_t timestamp;
+    expected_scan(entry, uid, &uid_len, &timestamp);
+    history_db.add_history(uid, uid_len, timestamp);
+}
+
+static uint32_t ceil_log2(uint32_t n)
+{
+    uint32_t bits = 0;
+    while ((1u << bits) < n) bits++;
+    return bits;
+}
+
+static bool check_entries(ScanHistoryDB &history_db, uint32_t oldest, uint32_t next)
+{
+    if (history_db.get_oldest_entry() != oldest || history_db.get_nb_entries() != next - oldest) return false;
+    history_entry_t records[TEST_READ_CHUNK];
+    for (uint32_t first = oldest; first < next; first += TEST_READ_CHUNK)
+    {
+        uint32_t count = next - first < TEST_READ_CHUNK ? next - first : TEST_READ_CHUNK;
+        if (history_db.get_history_range(first, count, records) != count) return false;
+        for (uint32_t i = 0; i < count; i++)
+        {
+            uint8_t uid[HISTORY_UID_MAX_SIZE];
+            uint8_t uid_len;
+            uint32_t timestamp;
+            expected_scan(first + i, uid, &uid_len, &timestamp);
+            if (records[i].entry != first + i || records[i].timestamp != timestamp ||
+                records[i].uid_len != uid_len || memcmp(records[i].uid, uid, uid_len)) return false;
+        }
+    }
+    return true;
+}
+
+// Reboot, return the header reads of the recovery or UINT32_MAX if the log
+// found back is not the one written
+static uint32_t reboot(ScanHistoryDB *&history_db, uint32_t rollup_sectors)
+{
+    uint32_t oldest = history_db->get_oldest_entry();
+    uint32_t next = oldest + history_db->get_nb_entries();
+    history_db->close();
+    delete history_db;
+    nvs_flash_deinit_partition(P_HISTORY_CTRL);
+    history_db = new ScanHistoryDB(rollup_sectors);
+    uint32_t reads = history_db->get_stats().recovery_reads;
+    if (!check_entries(*history_db, oldest, next)) return UINT32_MAX;
+    return reads;
+}
+
+static uint32_t test_split(uint32_t rollup_sectors)
+{
+    emu_partition_wipe(P_HISTORY);
+    emu_partition_wipe(P_HISTORY_CTRL);
+    ScanHistoryDB *history_db = new ScanHistoryDB(rollup_sectors);
+    const esp_partition_t *partition = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY, P_HISTORY);
+    uint32_t nb_sectors = partition->size / HISTORY_PAGE_SIZE - rollup_sectors;
+    // fill levels, in sectors opened: empty, the first sectors, half full, the
+    // ring about to wrap, wrapped with the gap at both ends, then later laps
+    const uint32_t levels[] = {0, 1, 2, nb_sectors / 2, nb_sectors - 1, nb_sectors, nb_sectors + 1,
+                               nb_sectors + HISTORY_ERASE_AHEAD, 2 * nb_sectors - HISTORY_ERASE_AHEAD,
+                               2 * nb_sectors + nb_sectors / 3, 3 * nb_sectors - 1, 3 * nb_sectors};
+    const uint32_t nb_levels = sizeof(levels) / sizeof(levels[0]);
+    // header scan of the first sectors, two binary searches, the oldest and
+    // head headers, the head sector and the one before it
+    uint32_t bound = HISTORY_ERASE_AHEAD + 1 + 2 * ceil_log2(nb_sectors) + 4;
+
+    uint32_t failures = 0;
+    uint32_t max_reads = 0;
+    uint32_t entry = 0;
+    uint32_t opened = 0;
+    size_t sector = 0;
+    for (uint32_t level = 0; level < nb_levels; level++)
+    {
+        while (opened < levels[level])
+        {
+            append(*history_db, entry++);
+            size_t cursor_sector = history_db->get_cursor() / HISTORY_PAGE_SIZE;
+            if (entry == 1 || cursor_sector != sector) opened++;
+            sector = cursor_sector;
+        }
+        // leave the head sector part written, a different amount each time
+        for (uint32_t i = 0; opened && i < level * 37 % 200; i++) append(*history_db, entry++);
+        sector = history_db->get_cursor() / HISTORY_PAGE_SIZE;
+
+        uint32_t reads = reboot(history_db, rollup_sectors);
+        if (reads == UINT32_MAX || reads > bound)
+        {
+            printf("%u sectors: FAILED after %u sectors opened, %u entries, %u reads\n",
+                   nb_sectors, opened, entry, reads);
+            failures++;
+        }
+        else if (reads > max_reads) max_reads = reads;
+        if (entry && history_db->get_newest_entry() != entry - 1) failures++;
+
+        // the log found back takes new records after the old ones
+        append(*history_db, entry++);
+        if (reboot(history_db, rollup_sectors) == UINT32_MAX) failures++;
+        if (history_db->get_newest_entry() != entry - 1) failures++;
+        sector = history_db->get_cursor() / HISTORY_PAGE_SIZE;
+    }
+    history_db->close();
+    delete history_db;
+    printf("%u sectors: %u reboots up to %.1f laps, %u entries, at most %u header reads (bound %u) -> %u failures\n",
+           nb_sectors, nb_levels, (double)opened / nb_sectors, entry, max_reads, bound, failures);
+    return failures;
+}
+
+int main()
+{
+    emu_flash_init(NULL);
+    esp_log_level_set("*", ESP_LOG_ERROR);
+
+    uint32_t failures = 0;
+    failures += test_split(HISTORY_ROLLUP_SECTORS);
+    failures += test_split(HISTORY_ROLLUP_SECTORS_PATROL);
+    return failures ? 1 : 0;
+}
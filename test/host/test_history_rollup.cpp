@@ -0,0 +1,279 @@
+/* History rollup
+   Runs a site workload (many badges, a few scans each per day) and a patrol
+   workload (few badges, scanned all day long) for long enough that both the raw
+   log and the rollup region wrap, compacting at every wakeup as the writer task
+   does. Checks the daily summaries of every day held against the scans, that
+   no day is lost between the summaries and the raw log, that the region is
+   found back after a reboot, and cuts the flash at every byte of a block.
+   Reports how many days of history the partition holds with the summaries,
+   against a raw log taking the whole partition.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <map>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include "esp_log.h"
+#include "flash_emu.h"
+#include "database.h"
+#include "history_rollup.h"
+
+#define TEST_FIRST_DAY 19000 // 2022-01-08
+#define TEST_SCANS_PER_WAKEUP 50
+#define TEST_CUT_SCANS 200 // scans per day of the power cut test
+
+typedef std::map<std::string, history_daily_t> day_summaries_t;
+typedef std::map<uint32_t, day_summaries_t> expected_t;
+
+typedef struct {
+    const char *name;
+    uint32_t nb_days;
+    uint32_t scans_per_day;
+    uint32_t nb_users;
+    bool patrol; // every badge in turn at a fixed period, instead of random badges at random times
+    uint32_t rollup_sectors; // split of the partition chosen for the deployment
+} workload_t;
+
+static void make_uid(uint32_t user, uint8_t *uid, uint8_t *uid_len)
+{
+    *uid_len = user % 10 < 7 ? 4 : 7;
+    for (uint8_t i = 0; i < *uid_len; i++) uid[i] = (uint8_t)(user * 2654435761u >> (4*i));
+}
+
+static void expect(expected_t &expected, const uint8_t *uid, uint8_t uid_len, uint32_t timestamp)
+{
+    uint32_t day = timestamp / SECONDS_PER_DAY;
+    // summaries keep the minute
+    uint32_t minute = timestamp / 60 * 60;
+    history_daily_t &summary = expected[day][std::string((const char*)uid, uid_len)];
+    if (summary.count == 0)
+    {
+        summary.day = day;
+        summary.first_seen = minute;
+        summary.uid_len = uid_len;
+        memcpy(summary.uid, uid, uid_len);
+    }
+    summary.last_seen = minute;
+    summary.count++;
+}
+
+// Scans of a day, by time, between 8:00 and 18:00
+static void day_scans(const workload_t &workload, uint32_t day, std::vector<std::pair<uint32_t, uint32_t>> *scans)
+{
+    scans->clear();
+    uint32_t start = day * SECONDS_PER_DAY + 8 * 3600;
+    for (uint32_t i = 0; i < workload.scans_per_day; i++)
+    {
+        if (workload.patrol)
+        {
+            scans->push_back({start + i * 36000 / workload.scans_per_day, i % workload.nb_users});
+            continue;
+        }
+        // a few users scan much more often than the others
+        uint32_t user = (rand() % workload.nb_users) * (rand() % workload.nb_users) / workload.nb_users;
+        scans->push_back({start + rand() % 36000, user});
+    }
+    std::sort(scans->begin(), scans->end());
+}
+
+static void run_days(ScanHistoryDB &history_db, const workload_t &workload, uint32_t first_day, uint32_t nb_days,
+                     expected_t &expected)
+{
+    std::vector<std::pair<uint32_t, uint32_t>> scans;
+    uint32_t nb = 0;
+    for (uint32_t day = first_day; day < first_day + nb_days; day++)
+    {
+        day_scans(workload, day, &scans);
+        for (const auto &scan : scans)
+        {
+            uint8_t uid[HISTORY_UID_MAX_SIZE];
+            uint8_t uid_len;
+            make_uid(scan.second, uid, &uid_len);
+            history_db.add_history(uid, uid_len, scan.first);
+            expect(expected, uid, uid_len, scan.first);
+            if (++nb % TEST_SCANS_PER_WAKEUP == 0)
+            {
+                // what the writer task does on a sync request
+                history_db.flush();
+                while (history_db.compact());
+                while (history_db.erase_ahead());
+            }
+        }
+    }
+}
+
+static uint32_t check_day(HistoryRollup &rollup, uint32_t day, const day_summaries_t &expected)
+{
+    std::vector<history_daily_t> out(expected.size() + 1);
+    uint32_t nb = rollup.get_day(day, out.data(), out.size());
+    uint32_t failures = nb == expected.size() ? 0 : 1;
+    for (uint32_t i = 0; i < nb; i++)
+    {
+        auto it = expected.find(std::string((const char*)out[i].uid, out[i].uid_len));
+        if (it == expected.end() || it->second.count != out[i].count || it->second.first_seen != out[i].first_seen
+            || it->second.last_seen != out[i].last_seen || out[i].day != day) failures++;
+    }
+    return failures;
+}
+
+// Every day held but the oldest one, which may have lost its first blocks with the sector before
+static uint32_t check_days(HistoryRollup &rollup, expected_t &expected, uint32_t *first_day, uint32_t *last_day)
+{
+    if (!rollup.get_days(first_day, last_day)) return 1;
+    uint32_t failures = 0;
+    for (uint32_t day = *first_day + 1; day <= *last_day; day++) failures += check_day(rollup, day, expected[day]);
+    return failures;
+}
+
+static uint32_t run_workload(const workload_t &workload)
+{
+    emu_partition_wipe(P_HISTORY);
+    emu_partition_wipe(P_HISTORY_CTRL);
+    srand(1);
+    expected_t expected;
+    ScanHistoryDB *history_db = new ScanHistoryDB(workload.rollup_sectors);
+    int64_t start = esp_timer_get_time();
+    run_days(*history_db, workload, TEST_FIRST_DAY, workload.nb_days, expected);
+    int64_t elapsed = esp_timer_get_time() - start;
+
+    HistoryRollup &rollup = history_db->get_rollup();
+    uint32_t failures = 0;
+    uint32_t first_day, last_day;
+    failures += check_days(rollup, expected, &first_day, &last_day);
+    // the raw log goes on where the summaries stop
+    uint8_t uid[HISTORY_UID_MAX_SIZE];
+    uint8_t uid_len;
+    time_t oldest_time;
+    history_db->get_history(history_db->get_oldest_entry(), uid, &uid_len, &oldest_time);
+    uint32_t raw_first_day = oldest_time / SECONDS_PER_DAY;
+    uint32_t today = TEST_FIRST_DAY + workload.nb_days - 1;
+    const history_rollup_stats_t &stats = rollup.get_stats();
+    if (stats.lost_entries || rollup.get_rollup_entry() < history_db->get_oldest_entry() || last_day != today) failures++;
+
+    // The raw log of nb_sectors holds raw_days, one of the whole partition
+    // would hold the same per sector
+    const esp_partition_t *partition = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY, P_HISTORY);
+    uint32_t total_sectors = partition->size / HISTORY_PAGE_SIZE;
+    uint32_t rollup_sectors = rollup.get_nb_sectors();
+    uint32_t raw_sectors = total_sectors - rollup_sectors;
+    double raw_days = (double)history_db->get_nb_entries() / workload.scans_per_day;
+    double raw_only_days = raw_days * (total_sectors - HISTORY_ERASE_AHEAD) / (raw_sectors - HISTORY_ERASE_AHEAD);
+    uint32_t summarized_days = raw_first_day - TEST_FIRST_DAY;
+    uint32_t held_days = today - first_day + 1;
+    double raw_per_day = (double)(raw_sectors - HISTORY_ERASE_AHEAD) * HISTORY_PAGE_SIZE / raw_days;
+    double summary_per_day = summarized_days ? (double)stats.bytes_written / summarized_days : 0;
+    printf("%s: %u days, %u scans/day from %u badges, %.0f summaries/day\n", workload.name, workload.nb_days,
+           workload.scans_per_day, workload.nb_users, summarized_days ? (double)stats.summaries / summarized_days : 0);
+    printf("  raw log (%u sectors): %.1f days, %.0f B/day; summaries (%u sectors): days %u to %u, %.0f B/day -> x%.1f denser\n",
+           raw_sectors, raw_days, raw_per_day, rollup_sectors, first_day - TEST_FIRST_DAY,
+           raw_first_day - TEST_FIRST_DAY, summary_per_day, summary_per_day ? raw_per_day / summary_per_day : 0);
+    // until the region wraps, at the density of the summaries written
+    double full_days = first_day > TEST_FIRST_DAY ? held_days
+                     : raw_days + (rollup_sectors - 1) * HISTORY_PAGE_SIZE / summary_per_day;
+    printf("  history held: %u days, %.0f once the summaries wrap vs %.1f days for a raw log of the whole partition -> x%.1f\n",
+           held_days, full_days, raw_only_days, full_days / raw_only_days);
+    printf("  %u blocks (%u forced), %u KB written, %u erases, %u lost entries, %.1f s host\n", stats.blocks,
+           stats.forced, stats.bytes_written / 1024, stats.erases, stats.lost_entries, elapsed / 1e6);
+
+    // Reboot: the region is found back and compaction goes on where it stopped
+    uint32_t rollup_entry = rollup.get_rollup_entry();
+    history_db->close();
+    delete history_db;
+    history_db = new ScanHistoryDB(workload.rollup_sectors);
+    HistoryRollup &rebooted = history_db->get_rollup();
+    uint32_t first_after, last_after;
+    if (rebooted.get_rollup_entry() != rollup_entry || !rebooted.get_days(&first_after, &last_after)
+        || first_after != first_day || last_after != last_day) failures++;
+    run_days(*history_db, workload, today + 1, 3, expected);
+    failures += check_days(rebooted, expected, &first_after, &last_after);
+    if (last_after != today + 3) failures++;
+    // a firmware with another split clears the log instead of misreading it
+    history_db->close();
+    delete history_db;
+    history_db = new ScanHistoryDB(workload.rollup_sectors + 8);
+    if (history_db->get_nb_entries() != 0 || history_db->get_rollup().get_days(&first_after, &last_after)) failures++;
+    printf("  reboot: summaries up to entry %u found back, 3 more days, another split clears the log -> %u failures\n",
+           rollup_entry, failures);
+    history_db->close();
+    delete history_db;
+    return failures;
+}
+
+// Three days of scans, the first one summarized, then the second one summarized
+// with the flash cut after `cut` bytes: after the reboot the block is either
+// complete or ignored, and the days read right before and after summarizing again
+static uint32_t run_cut(int64_t cut, uint32_t *block_size)
+{
+    emu_partition_wipe(P_HISTORY);
+    emu_partition_wipe(P_HISTORY_CTRL);
+    srand(2);
+    workload_t workload = {"cut", 3, TEST_CUT_SCANS, 100, false, HISTORY_ROLLUP_SECTORS};
+    expected_t expected;
+    ScanHistoryDB *history_db = new ScanHistoryDB();
+    std::vector<std::pair<uint32_t, uint32_t>> scans;
+    for (uint32_t day = TEST_FIRST_DAY; day < TEST_FIRST_DAY + 3; day++)
+    {
+        day_scans(workload, day, &scans);
+        for (const auto &scan : scans)
+        {
+            uint8_t uid[HISTORY_UID_MAX_SIZE];
+            uint8_t uid_len;
+            make_uid(scan.second, uid, &uid_len);
+            history_db->add_history(uid, uid_len, scan.first);
+            expect(expected, uid, uid_len, scan.first);
+        }
+    }
+    history_db->flush();
+    HistoryRollup &rollup = history_db->get_rollup();
+    rollup.cover(1);
+    uint32_t first_end = rollup.get_rollup_entry();
+    uint32_t written = rollup.get_stats().bytes_written;
+    emu_flash_cut_after(cut);
+    rollup.cover(first_end + 1);
+    emu_flash_cut_after(-1);
+    *block_size = rollup.get_stats().bytes_written - written;
+    delete history_db; // power off
+
+    history_db = new ScanHistoryDB();
+    HistoryRollup &rebooted = history_db->get_rollup();
+    uint32_t failures = 0;
+    bool complete = cut < 0 || cut >= *block_size;
+    bool torn = !complete && cut > 1; // the first byte written is the erased tag
+    if (rebooted.get_rollup_entry() != (complete ? 2 * TEST_CUT_SCANS : first_end)) failures++;
+    if (rebooted.get_stats().torn_blocks != (torn ? 1u : 0u)) failures++;
+    // the raw records of the second day fill in the summaries until it is summarized again
+    for (uint32_t day = TEST_FIRST_DAY; day < TEST_FIRST_DAY + 3; day++)
+        failures += check_day(rebooted, day, expected[day]);
+    rebooted.cover(2 * TEST_CUT_SCANS);
+    if (rebooted.get_rollup_entry() != 2 * TEST_CUT_SCANS) failures++;
+    for (uint32_t day = TEST_FIRST_DAY; day < TEST_FIRST_DAY + 3; day++)
+        failures += check_day(rebooted, day, expected[day]);
+    delete history_db;
+    return failures;
+}
+
+int main()
+{
+    emu_flash_init(NULL);
+    esp_log_level_set("*", ESP_LOG_ERROR);
+
+    uint32_t failures = 0;
+    workload_t site = {"site", 400, 1000, 500, false, HISTORY_ROLLUP_SECTORS};
+    workload_t patrol = {"patrol", 300, 1200, 40, true, HISTORY_ROLLUP_SECTORS_PATROL};
+    failures += run_workload(site);
+    failures += run_workload(patrol);
+
+    uint32_t block_size = 0;
+    uint32_t cut_failures = run_cut(-1, &block_size);
+    uint32_t nb_cuts = block_size + 1;
+    for (int64_t cut = 0; cut <= block_size; cut++)
+    {
+        uint32_t size;
+        cut_failures += run_cut(cut, &size);
+    }
+    printf("power cut at every byte of a %u-byte block: %u cuts -> %u failures\n", block_size, nb_cuts, cut_failures);
+    failures += cut_failures;
+    return failures ? 1 : 0;
+}
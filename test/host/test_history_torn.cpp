@@ -0,0 +1,139 @@
+/* ScanHistoryDB power cut test
+   Replays the same appends with the flash cut after every possible number of
+   programmed bytes, then checks that the log opened after the reboot holds a
+   prefix of the appends, reads back right and takes new records without
+   writing over programmed bytes.
+*/
+#include <stdio.h>
+#include <string.h>
+#include "esp_log.h"
+#include "flash_emu.h"
+#include "database.h"
+
+#define TEST_EPOCH 1650000000
+#define TEST_BATCH_SIZE 40 // several flushes per test, down to one record each
+#define FILL_SECTOR UINT32_MAX // base records filling the first sector up to its last bytes
+
+static void expected_scan(uint32_t entry, uint8_t *uid, uint8_t *uid_len, uint32_t *timestamp)
+{
+    uint32_t user = entry * 7 % 13;
+    *uid_len = user % 3 ? 4 : 7;
+    for (uint8_t i = 0; i < *uid_len; i++) uid[i] = (uint8_t)(user * 2654435761u >> (4*i));
+    *timestamp = TEST_EPOCH + 60 * entry;
+}
+
+static void append(ScanHistoryDB &history_db, uint32_t entry)
+{
+    uint8_t uid[HISTORY_UID_MAX_SIZE];
+    uint8_t uid_len;
+    uint32_t timestamp;
+    expected_scan(entry, uid, &uid_len, &timestamp);
+    history_db.add_history(uid, uid_len, timestamp);
+}
+
+// Fresh log with `base` records in flash, then append `added` records with the
+// flash cut after `cut` bytes, return the number of base records
+static uint32_t run(uint32_t base, uint32_t added, int64_t cut)
+{
+    emu_partition_wipe(P_HISTORY);
+    emu_partition_wipe(P_HISTORY_CTRL);
+    ScanHistoryDB history_db;
+    history_db.set_batch_size(TEST_BATCH_SIZE);
+    uint32_t entry = 0;
+    if (base == FILL_SECTOR)
+    {
+        while (history_db.get_cursor() < HISTORY_PAGE_SIZE - 2 * TEST_BATCH_SIZE) append(history_db, entry++);
+    }
+    else
+    {
+        while (entry < base) append(history_db, entry++);
+    }
+    history_db.flush();
+
+    emu_flash_cut_after(cut);
+    for (uint32_t i = 0; i < added; i++) append(history_db, entry++);
+    history_db.flush();
+    emu_flash_cut_after(-1);
+    return entry - added;
+}
+
+static bool check_entries(ScanHistoryDB &history_db, uint32_t nb_entries)
+{
+    if (history_db.get_oldest_entry() != 0 || history_db.get_nb_entries() != nb_entries) return false;
+    for (uint32_t i = 0; i < nb_entries; i++)
+    {
+        uint8_t uid[HISTORY_UID_MAX_SIZE], uid_read[HISTORY_UID_MAX_SIZE];
+        uint8_t uid_len, uid_read_len;
+        uint32_t timestamp;
+        time_t time_read;
+        expected_scan(i, uid, &uid_len, &timestamp);
+        if (!history_db.get_history(i, uid_read, &uid_read_len, &time_read)) return false;
+        if (time_read != (time_t)timestamp || uid_read_len != uid_len || memcmp(uid_read, uid, uid_len)) return false;
+    }
+    uint32_t first, end;
+    history_db.get_time_range(TEST_EPOCH, TEST_EPOCH + 60 * nb_entries, &first, &end);
+    return first == 0 && end == nb_entries;
+}
+
+// Reboot after the cut, then after one more append
+static bool check_reboot(uint32_t base, uint32_t added, bool complete)
+{
+    uint32_t nb_entries;
+    {
+        ScanHistoryDB history_db;
+        nb_entries = history_db.get_nb_entries();
+        if (nb_entries < base || nb_entries > base + added) return false;
+        if (complete && nb_entries != base + added) return false;
+        if (!check_entries(history_db, nb_entries)) return false;
+        append(history_db, nb_entries);
+        history_db.flush();
+    }
+    ScanHistoryDB history_db;
+    return check_entries(history_db, nb_entries + 1);
+}
+
+static uint32_t test_cuts(const char *name, uint32_t base, uint32_t added)
+{
+    emu_flash_reset_stats();
+    base = run(base, added, -1);
+    // bytes programmed by the appends, measured without cut
+    emu_flash_reset_stats();
+    run(base, added, -1);
+    uint64_t before = emu_flash_stats()->write_bytes;
+    emu_flash_reset_stats();
+    run(base, 0, -1);
+    int64_t nb_bytes = before - emu_flash_stats()->write_bytes;
+
+    uint32_t failures = 0;
+    emu_flash_reset_stats();
+    for (int64_t cut = 0; cut <= nb_bytes; cut++)
+    {
+        run(base, added, cut);
+        if (!check_reboot(base, added, cut == nb_bytes))
+        {
+            printf("%s: FAILED with the flash cut after %lld bytes\n", name, (long long)cut);
+            failures++;
+        }
+    }
+    if (emu_flash_stats()->nor_violations)
+    {
+        printf("%s: FAILED, %llu writes over programmed bytes\n", name,
+               (unsigned long long)emu_flash_stats()->nor_violations);
+        failures++;
+    }
+    printf("%s: %u records after %u, %lld cut points -> %u failures\n", name, added, base,
+           (long long)nb_bytes + 1, failures);
+    return failures;
+}
+
+int main()
+{
+    emu_flash_init(NULL);
+    esp_log_level_set("*", ESP_LOG_ERROR);
+
+    uint32_t failures = 0;
+    failures += test_cuts("empty log", 0, 12);
+    failures += test_cuts("first sector", 1, 12);
+    failures += test_cuts("sector change", FILL_SECTOR, 24);
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,179 @@
+/* ScanHistoryDB upload test
+   Sends the log in LoRa sized batches while scans keep being added, with some
+   confirmations lost, a reboot in the middle and a power cut with scans still
+   in the write-back buffer, and checks that every record reaches the gateway
+   once and in order, and that the watermark never gets ahead of the log.
+*/
+#include <stdio.h>
+#include <string.h>
+#include "esp_log.h"
+#include "flash_emu.h"
+#include "database.h"
+
+#define TEST_EPOCH 1650000000
+#define TEST_PAYLOAD_SIZE 51 // EU868 application payload at DR0-DR2
+#define TEST_NB_SCANS 3000
+#define TEST_LOST_ACK 7 // one confirmation out of 7 is lost
+#define TEST_REBOOT_BATCH 40
+#define TEST_CUT_SCANS 20 // confirmed, then a power cut without a flush
+
+static void expected_scan(uint32_t entry, uint8_t *uid, uint8_t *uid_len, uint32_t *timestamp)
+{
+    uint32_t user = entry * 7 % 113;
+    *uid_len = user % 3 ? 4 : 7;
+    for (uint8_t i = 0; i < *uid_len; i++) uid[i] = (uint8_t)(user * 2654435761u >> (4*i));
+    *timestamp = TEST_EPOCH + 45 * entry + entry % 5;
+}
+
+static void append(ScanHistoryDB &history_db, uint32_t entry)
+{
+    uint8_t uid[HISTORY_UID_MAX_SIZE];
+    uint8_t uid_len;
+    uint32_t timestamp;
+    expected_scan(entry, uid, &uid_len, &timestamp);
+    history_db.add_history(uid, uid_len, timestamp);
+}
+
+static size_t get_varint(const uint8_t *in, size_t avail, uint32_t *value)
+{
+    *value = 0;
+    for (size_t i = 0; i < avail && i < 5; i++)
+    {
+        *value |= (uint32_t)(in[i] & 0x7F) << (7*i);
+        if (!(in[i] & 0x80)) return i + 1;
+    }
+    return 0;
+}
+
+// Gateway side: decode a batch, check it against the expected scans
+// and return the number of records, 0 if the batch is wrong
+static uint32_t check_batch(const uint8_t *payload, size_t len, uint32_t expected_first)
+{
+    uint32_t entry, dt;
+    uint32_t timestamp = 0;
+    uint32_t nb_records = 0;
+    size_t pos = get_varint(payload, len, &entry);
+    if (pos == 0 || entry != expected_first) return 0;
+    while (pos < len)
+    {
+        uint8_t uid[HISTORY_UID_MAX_SIZE];
+        uint8_t uid_len;
+        uint32_t expected_time;
+        expected_scan(entry, uid, &uid_len, &expected_time);
+        if (payload[pos] != uid_len || pos + 1 + uid_len > len || memcmp(payload + pos + 1, uid, uid_len)) return 0;
+        pos += 1 + uid_len;
+        size_t n = get_varint(payload + pos, len - pos, &dt);
+        if (n == 0) return 0;
+        pos += n;
+        timestamp += (int32_t)(dt >> 1) ^ -(int32_t)(dt & 1);
+        if (timestamp != expected_time) return 0;
+        entry++;
+        nb_records++;
+    }
+    return nb_records;
+}
+
+int main()
+{
+    emu_flash_init(NULL);
+    esp_log_level_set("*", ESP_LOG_ERROR);
+    emu_partition_wipe(P_HISTORY);
+    emu_partition_wipe(P_HISTORY_CTRL);
+
+    ScanHistoryDB *history_db = new ScanHistoryDB();
+    uint32_t nb_scans = 0;
+    while (nb_scans < TEST_NB_SCANS / 2) append(*history_db, nb_scans++);
+    history_db->flush();
+
+    uint8_t payload[TEST_PAYLOAD_SIZE];
+    uint32_t delivered = 0; // entries confirmed by the gateway
+    uint32_t nb_batches = 0;
+    uint32_t failures = 0;
+    uint64_t payload_bytes = 0;
+    uint32_t sector_reads = 0;
+    size_t len;
+    uint32_t end_entry;
+    while (true)
+    {
+        // scans keep coming during the sync
+        for (int i = 0; i < 3 && nb_scans < TEST_NB_SCANS; i++) append(*history_db, nb_scans++);
+        if ((len = history_db->get_upload_batch(payload, sizeof(payload), &end_entry)) == 0)
+        {
+            if (nb_scans == TEST_NB_SCANS) break;
+            continue;
+        }
+        nb_batches++;
+        uint32_t nb_records = check_batch(payload, len, delivered);
+        if (nb_records == 0 || delivered + nb_records != end_entry)
+        {
+            printf("FAILED: batch %u from entry %u is wrong\n", nb_batches, delivered);
+            failures++;
+            break;
+        }
+        if (nb_batches % TEST_LOST_ACK == 0) continue; // not confirmed, sent again
+        history_db->ack_upload(end_entry);
+        delivered = end_entry;
+        payload_bytes += len;
+
+        if (nb_batches == TEST_REBOOT_BATCH)
+        {
+            history_db->flush();
+            sector_reads += history_db->get_stats().sector_reads;
+            delete history_db;
+            nvs_flash_deinit_partition(P_HISTORY_CTRL); // watermark read back from flash
+            history_db = new ScanHistoryDB();
+            if (history_db->get_upload_entry() != delivered)
+            {
+                printf("FAILED: watermark %u after reboot instead of %u\n", history_db->get_upload_entry(), delivered);
+                failures++;
+            }
+        }
+    }
+    if (delivered != TEST_NB_SCANS)
+    {
+        printf("FAILED: %u scans delivered out of %u\n", delivered, TEST_NB_SCANS);
+        failures++;
+    }
+
+    // Scans confirmed while still in the write-back buffer, a few more, then a
+    // power cut: the watermark must not get ahead of the log found back
+    for (uint32_t i = 0; i < TEST_CUT_SCANS; i++) append(*history_db, nb_scans++);
+    while ((len = history_db->get_upload_batch(payload, sizeof(payload), &end_entry)) > 0)
+    {
+        if (check_batch(payload, len, delivered) != end_entry - delivered) failures++;
+        history_db->ack_upload(end_entry);
+        delivered = end_entry;
+    }
+    uint32_t confirmed = delivered;
+    for (uint32_t i = 0; i < 3; i++) append(*history_db, nb_scans++);
+    sector_reads += history_db->get_stats().sector_reads;
+    delete history_db;
+    nvs_flash_deinit_partition(P_HISTORY_CTRL);
+    history_db = new ScanHistoryDB();
+    uint32_t kept = history_db->get_oldest_entry() + history_db->get_nb_entries();
+    if (history_db->get_upload_entry() != delivered || delivered > kept || kept == nb_scans)
+    {
+        printf("FAILED: watermark %u after a power cut, %u entries in the log, %u delivered\n",
+               history_db->get_upload_entry(), kept, delivered);
+        failures++;
+    }
+    // the scans lost are made again with the same entries and go up with the next batch
+    for (nb_scans = kept; nb_scans < TEST_NB_SCANS + TEST_CUT_SCANS + 3; nb_scans++) append(*history_db, nb_scans);
+    while ((len = history_db->get_upload_batch(payload, sizeof(payload), &end_entry)) > 0)
+    {
+        if (check_batch(payload, len, delivered) != end_entry - delivered) failures++;
+        history_db->ack_upload(end_entry);
+        delivered = end_entry;
+    }
+    if (delivered != nb_scans)
+    {
+        printf("FAILED: %u scans delivered after the power cut out of %u\n", delivered, nb_scans);
+        failures++;
+    }
+    sector_reads += history_db->get_stats().sector_reads;
+    printf("upload: %u scans in %u batches, %.2f bytes/scan, %u sector reads, power cut after entry %u confirmed "
+           "-> %u failures\n", TEST_NB_SCANS, nb_batches, (float)payload_bytes / TEST_NB_SCANS, sector_reads, confirmed,
+           failures);
+    delete history_db;
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,103 @@
+/* QR frame gate
+   Renders 240x240 grayscale frames of four kinds: a sharp code in view, the
+   same code blurred, a badly exposed frame (dark or blown out) and a scene
+   without a code, and measures each with qr_frame_measure. The default gate
+   must let through the sharp codes and skip the frames that cannot be
+   decoded, stopping at the first threshold missed or not. Prints the skip rate of each kind, the decode attempts a scan
+   attempt saves and the host time of a measure.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <chrono>
+#include "qr_frame.h"
+#include "qr_render.h"
+
+#define TEST_SIZE 240
+#define TEST_NB_FRAMES 1000 // of each kind
+
+typedef enum {
+    FRAME_SHARP,
+    FRAME_BLURRED,
+    FRAME_EXPOSURE,
+    FRAME_EMPTY,
+    FRAME_KINDS
+} frame_kind_t;
+
+static const char *kind_names[FRAME_KINDS] = {"sharp code", "blurred code", "dark or blown out", "no code"};
+
+static void render_frame(qr_image_t *image, frame_kind_t kind, uint32_t seed)
+{
+    srand(seed);
+    render_scene(image, kind == FRAME_EMPTY ? 2 + rand() % 12 : rand() % 6, seed);
+    if (kind != FRAME_EMPTY)
+    {
+        uint32_t module = 3 + rand() % 4;
+        uint32_t size = code_size(module);
+        render_code(image, rand() % (TEST_SIZE - size + 1), rand() % (TEST_SIZE - size + 1), module,
+                    20 + rand() % 40, 170 + rand() % 70, seed);
+    }
+    blur_image(image, kind == FRAME_BLURRED ? 3 + rand() % 3 : rand() % 2);
+    if (kind == FRAME_EXPOSURE)
+    {
+        if (rand() % 2) expose_image(image, 0.05f + (rand() % 8) / 100.0f, -80, rand() % 4, seed);
+        else expose_image(image, 1.0f, 235 + rand() % 20, rand() % 4, seed);
+    }
+    else expose_image(image, 0.8f + (rand() % 40) / 100.0f, (int32_t)(rand() % 41) - 20, rand() % 7, seed);
+}
+
+int main()
+{
+    uint32_t failures = 0;
+    const qr_gate_t gate = QR_GATE_DEFAULT;
+    qr_image_t image(TEST_SIZE, TEST_SIZE);
+    uint32_t skipped[FRAME_KINDS] = {};
+    double elapsed_ns = 0;
+    for (uint32_t kind = 0; kind < FRAME_KINDS; kind++)
+    {
+        for (uint32_t i = 0; i < TEST_NB_FRAMES; i++)
+        {
+            render_frame(&image, (frame_kind_t)kind, kind * TEST_NB_FRAMES + i + 1);
+            qr_frame_quality_t quality;
+            auto start = std::chrono::steady_clock::now();
+            qr_frame_measure(image.pixels.data(), image.width, image.height, &quality, &gate);
+            bool pass = qr_frame_gate(&quality, &gate);
+            elapsed_ns += std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+            if (!pass) skipped[kind]++;
+            // stopping at the first threshold missed decides the same
+            qr_frame_measure(image.pixels.data(), image.width, image.height, &quality);
+            if (qr_frame_gate(&quality, &gate) != pass) failures++;
+        }
+        printf("%s: %.1f%% skipped\n", kind_names[kind], 100.0 * skipped[kind] / TEST_NB_FRAMES);
+    }
+    // a sharp code lost costs a frame period, a blurred one would not decode anyway
+    if (skipped[FRAME_SHARP] > TEST_NB_FRAMES / 100) failures++;
+    if (skipped[FRAME_BLURRED] < TEST_NB_FRAMES * 95 / 100) failures++;
+    if (skipped[FRAME_EXPOSURE] != TEST_NB_FRAMES) failures++;
+    if (skipped[FRAME_EMPTY] < TEST_NB_FRAMES * 95 / 100) failures++;
+
+    // an attempt: the code is brought in front of the camera, then held still
+    uint32_t attempt[FRAME_KINDS] = {10, 8, 4, 8};
+    uint32_t frames = 0;
+    uint32_t saved = 0;
+    for (uint32_t kind = 0; kind < FRAME_KINDS; kind++)
+    {
+        frames += attempt[kind];
+        saved += attempt[kind] * skipped[kind];
+    }
+    printf("attempt of %u frames (%u without code, %u blurred, %u badly exposed, %u sharp): %.1f decodes saved, "
+           "%.0f%% of the decode attempts\n", frames, attempt[FRAME_EMPTY], attempt[FRAME_BLURRED],
+           attempt[FRAME_EXPOSURE], attempt[FRAME_SHARP], (double)saved / TEST_NB_FRAMES,
+           100.0 * saved / TEST_NB_FRAMES / frames);
+
+    // a flat frame has nothing to measure
+    qr_image_t flat(TEST_SIZE, TEST_SIZE, 90);
+    qr_frame_quality_t quality;
+    qr_frame_measure(flat.pixels.data(), flat.width, flat.height, &quality);
+    if (quality.low != 90 || quality.high != 90 || quality.sharpness || quality.finders) failures++;
+    const qr_gate_t off = QR_GATE_OFF;
+    if (!qr_frame_gate(&quality, &off)) failures++;
+
+    printf("measure of a %ux%u frame: %.1f us on the host -> %u failures\n", TEST_SIZE, TEST_SIZE,
+           elapsed_ns / FRAME_KINDS / TEST_NB_FRAMES / 1000, failures);
+    return failures ? 1 : 0;
+}
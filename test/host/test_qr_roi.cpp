@@ -0,0 +1,103 @@
+/* QR region of interest
+   Renders grayscale frames of 240x240 and 480x480 with a sharp code in view,
+   turned by any angle, and looks for the region of the code with
+   qr_frame_roi on the finder patterns qr_frame_measure found. The region must
+   be found on nearly every frame, hold the 4 corners of the symbol, and its
+   crop must be the pixels of the frame. Prints the share of the frame the
+   decoder is left with, and the host time of a measure at both sizes: the
+   larger frame is read at a pixel out of 2, it must not cost 4 times more.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <chrono>
+#include <vector>
+#include "qr_frame.h"
+#include "qr_render.h"
+
+#define TEST_NB_FRAMES 1000 // of each size
+
+static const uint32_t sizes[] = {240, 480};
+
+static bool inside(const qr_roi_t &roi, float x, float y)
+{
+    return x >= roi.x && y >= roi.y && x <= roi.x + roi.width && y <= roi.y + roi.height;
+}
+
+int main()
+{
+    uint32_t failures = 0;
+    const qr_gate_t gate = QR_GATE_DEFAULT;
+    double measure_us[2] = {};
+    for (uint32_t s = 0; s < 2; s++)
+    {
+        uint32_t size = sizes[s];
+        uint32_t scale = size / sizes[0];
+        qr_image_t image(size, size);
+        std::vector<uint8_t> crop(size * size);
+        uint32_t passed = 0, found = 0, covered = 0, crop_errors = 0;
+        double area = 0;
+        double elapsed_ns = 0;
+        for (uint32_t i = 0; i < TEST_NB_FRAMES; i++)
+        {
+            uint32_t seed = s * TEST_NB_FRAMES + i + 1;
+            srand(seed);
+            render_scene(&image, rand() % 6, seed);
+            float module = (3 + rand() % 3 + (rand() % 100) / 100.0f) * scale;
+            float angle = (rand() % 3600) * (float)M_PI / 1800;
+            // the symbol in view, its quiet zone may go past the frame
+            float half = QR_RENDER_MODULES / 2.0f * module * 1.415f;
+            float cx = half + rand() % (uint32_t)(size - 2 * half + 1);
+            float cy = half + rand() % (uint32_t)(size - 2 * half + 1);
+            render_code_turned(&image, cx, cy, module, angle, 20 + rand() % 40, 170 + rand() % 70, seed);
+            blur_image(&image, rand() % 2);
+            expose_image(&image, 0.8f + (rand() % 40) / 100.0f, (int32_t)(rand() % 41) - 20, rand() % 7, seed);
+
+            qr_frame_quality_t quality;
+            auto start = std::chrono::steady_clock::now();
+            qr_frame_measure(image.pixels.data(), image.width, image.height, &quality, &gate);
+            elapsed_ns += std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+            if (!qr_frame_gate(&quality, &gate)) continue;
+            passed++;
+            qr_roi_t roi;
+            if (!qr_frame_roi(&quality, image.width, image.height, &roi)) continue;
+            found++;
+            area += (double)roi.width * roi.height / (size * size);
+            if (roi.x % QR_ROI_ALIGN || roi.y % QR_ROI_ALIGN || roi.x + roi.width > size || roi.y + roi.height > size)
+                failures++;
+            // corners of the symbol, 12.5 modules from its center on both axes
+            bool all = true;
+            float c = cosf(angle) * module * QR_RENDER_MODULES / 2;
+            float d = sinf(angle) * module * QR_RENDER_MODULES / 2;
+            all &= inside(roi, cx + c - d, cy + d + c);
+            all &= inside(roi, cx - c - d, cy - d + c);
+            all &= inside(roi, cx + c + d, cy + d - c);
+            all &= inside(roi, cx - c + d, cy - d - c);
+            if (all) covered++;
+            qr_frame_crop(image.pixels.data(), image.width, &roi, crop.data());
+            for (uint32_t y = 0; y < roi.height; y++)
+                if (memcmp(crop.data() + y * roi.width, image.row(roi.y + y) + roi.x, roi.width)) crop_errors++;
+        }
+        measure_us[s] = elapsed_ns / TEST_NB_FRAMES / 1000;
+        printf("%ux%u: %.1f%% through the gate, region found on %.1f%%, holding the symbol on %.1f%%, "
+               "%.0f%% of the frame to decode, measure %.1f us on the host\n", size, size,
+               100.0 * passed / TEST_NB_FRAMES, 100.0 * found / TEST_NB_FRAMES, 100.0 * covered / found,
+               100.0 * area / found, measure_us[s]);
+        if (found < TEST_NB_FRAMES * 95 / 100) failures++;
+        if (covered < found * 98 / 100) failures++;
+        if (crop_errors) failures++;
+    }
+    // 4 times the pixels, the same samples
+    if (measure_us[1] > 2 * measure_us[0]) failures++;
+
+    // a frame without finder pattern has no region
+    qr_image_t flat(240, 240, 90);
+    qr_frame_quality_t quality;
+    qr_roi_t roi;
+    qr_frame_measure(flat.pixels.data(), flat.width, flat.height, &quality);
+    if (qr_frame_roi(&quality, flat.width, flat.height, &roi)) failures++;
+
+    printf("-> %u failures\n", failures);
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,244 @@
+/* QR scan strategy
+   Replays scan attempts at three installations, a door where the codes are
+   held close, a desk where they come close or at arm's length and a counter
+   where they stay far, on a corpus of frames rendered with qr_render: the
+   code brought in (blurred), then held still, turned by any angle. Each frame
+   is rendered at 480x480, then binned 2x2 to the 240x240 the sensor gives and
+   again 2x2 for the half level.
+
+   The decoder does not build on the host: a frame decodes when it passes the
+   quality gate, qr_frame_roi finds the code and the code has at least
+   TEST_MIN_MODULE pixels a module at the level decoded. The time of a frame
+   is the longest of the frame period and the decode, TEST_SCAN_NS_PER_PIXEL
+   a pixel of the region decoded, as the pipeline overlaps capture and decode.
+
+   The fixed strategy decodes every frame at 240x240, QrScanStrategy learns a
+   level per installation. Prints the times to the first code of both, and
+   checks the adaptive one is faster where the codes are close, loses no more
+   than its exploration where they are far and learns the level of each
+   installation. Checks
+   the escalation, the exploration and the history of QrScanStrategy first.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <algorithm>
+#include <vector>
+#include "qr_frame.h"
+#include "qr_render.h"
+#include "qr_strategy.h"
+
+#define TEST_ATTEMPTS 100 // per installation
+#define TEST_MAX_FRAMES 25 // of an attempt before it times out, 1 s at 240x240
+#define TEST_BASE_SIZE 240
+#define TEST_MIN_MODULE 2.0f // pixels a module the decoder needs
+#define TEST_SCAN_NS_PER_PIXEL 1700 // decode time of a region on the ESP32-S3, see the qr_pipeline bench
+#define TEST_FRAME_US 40000 // period of a 240x240 frame
+
+typedef struct {
+    const char *name;
+    float near_share; // of the attempts with the code held close
+    float near_module[2]; // pixels a module at 240x240, lowest and highest
+    float far_module[2];
+} installation_t;
+
+static const installation_t installations[] = {
+    {"door", 1.0f, {4.0f, 6.0f}, {0, 0}},
+    {"desk", 0.5f, {4.0f, 6.0f}, {2.2f, 3.5f}},
+    {"counter", 0.0f, {0, 0}, {1.4f, 2.4f}},
+};
+#define TEST_INSTALLATIONS (sizeof(installations) / sizeof(installations[0]))
+
+// A frame of an attempt, rendered finer than the sensor gives it
+typedef struct {
+    qr_image_t render; // 480x480
+    qr_image_t base; // 240x240, binned
+    float module; // pixels a module at 240x240
+} test_frame_t;
+
+static void bin(const qr_image_t &image, qr_image_t *out)
+{
+    *out = qr_image_t(image.width / 2, image.height / 2);
+    qr_frame_downsample(image.pixels.data(), image.width, image.height, out->pixels.data());
+}
+
+static void render_attempt_frame(test_frame_t *frame, const installation_t &site, uint32_t attempt, uint32_t index)
+{
+    srand(attempt * 7919 + 1);
+    bool near = rand() % 100 < site.near_share * 100;
+    const float *range = near ? site.near_module : site.far_module;
+    float module = range[0] + (range[1] - range[0]) * (rand() % 1000) / 1000.0f;
+    float angle = (rand() % 3600) * (float)M_PI / 1800;
+    uint32_t moving = rand() % 5; // frames blurred while the code is brought in
+    float half = QR_RENDER_MODULES / 2.0f * module * 1.415f;
+    float cx = half + rand() % (uint32_t)(TEST_BASE_SIZE - 2 * half + 1);
+    float cy = half + rand() % (uint32_t)(TEST_BASE_SIZE - 2 * half + 1);
+    uint8_t dark = 20 + rand() % 40, light = 170 + rand() % 70;
+    uint32_t seed = attempt * 1000 + index + 1;
+    srand(seed);
+    // the hand shakes a little
+    cx += (rand() % 5) - 2;
+    cy += (rand() % 5) - 2;
+    frame->module = module;
+    frame->render = qr_image_t(2 * TEST_BASE_SIZE, 2 * TEST_BASE_SIZE);
+    render_scene(&frame->render, rand() % 6, attempt + 1);
+    render_code_turned(&frame->render, 2 * cx, 2 * cy, 2 * module, angle + (rand() % 21 - 10) / 500.0f, dark, light,
+                       attempt + 1);
+    blur_image(&frame->render, index < moving ? 6 + rand() % 4 : rand() % 2);
+    expose_image(&frame->render, 0.9f, 0, 3, seed);
+    bin(frame->render, &frame->base);
+}
+
+// Time of the frame at the level, if it goes to the decoder and if it decodes
+static uint32_t scan_frame(const test_frame_t &frame, qr_level_t level, bool *scanned, bool *decoded)
+{
+    const qr_gate_t gate = QR_GATE_DEFAULT;
+    const qr_image_t &captured = frame.base;
+    uint32_t period = TEST_FRAME_US;
+    *decoded = false;
+    qr_frame_quality_t quality;
+    qr_frame_measure(captured.pixels.data(), captured.width, captured.height, &quality, &gate);
+    *scanned = qr_frame_gate(&quality, &gate);
+    if (!*scanned) return period;
+    qr_roi_t roi;
+    uint64_t pixels = captured.width * captured.height;
+    bool found = qr_frame_roi(&quality, captured.width, captured.height, &roi);
+    if (found) pixels = roi.width * roi.height;
+    float module = frame.module;
+    if (level == QR_LEVEL_HALF)
+    {
+        pixels /= 4;
+        module /= 2;
+    }
+    *decoded = found && module >= TEST_MIN_MODULE;
+    uint32_t scan_us = pixels * TEST_SCAN_NS_PER_PIXEL / 1000;
+    return scan_us > period ? scan_us : period;
+}
+
+typedef struct {
+    std::vector<uint32_t> first_code_us;
+    uint32_t frames = 0;
+} strategy_result_t;
+
+static void print_result(const char *strategy, strategy_result_t *result)
+{
+    std::vector<uint32_t> &times = result->first_code_us;
+    std::sort(times.begin(), times.end());
+    double sum = 0;
+    for (uint32_t time : times) sum += time;
+    uint32_t nb = times.size();
+    printf("  %-8s code found in %3u/%u attempts, %4.0f ms on average, median %4u ms, 90%% under %4u ms, "
+           "%4u ms at most, %u frames decoded\n", strategy, nb, TEST_ATTEMPTS, nb ? sum / nb / 1000 : 0.0,
+           nb ? times[(nb - 1) / 2] / 1000 : 0, nb ? times[(nb - 1) * 9 / 10] / 1000 : 0,
+           nb ? times.back() / 1000 : 0, result->frames);
+}
+
+static double mean_ms(const strategy_result_t &result)
+{
+    double sum = 0;
+    for (uint32_t time : result.first_code_us) sum += time;
+    return result.first_code_us.empty() ? 0 : sum / result.first_code_us.size() / 1000;
+}
+
+static uint32_t check_strategy()
+{
+    uint32_t failures = 0;
+    // up a level every QR_STRATEGY_MISSES misses, not past the top
+    QrScanStrategy strategy(QR_LEVEL_FULL);
+    strategy.begin();
+    if (strategy.level() != QR_LEVEL_HALF) failures++;
+    for (uint32_t i = 0; i < QR_STRATEGY_MISSES; i++) strategy.report(QR_LEVEL_HALF, false);
+    if (strategy.level() != QR_LEVEL_FULL) failures++;
+    for (uint32_t i = 0; i < 3 * QR_STRATEGY_MISSES; i++) strategy.report(QR_LEVEL_FULL, false);
+    if (strategy.level() != QR_LEVEL_FULL || strategy.get_stats().escalations != 1) failures++;
+    // a late half frame missing does not count, the code found at full does
+    strategy.report(QR_LEVEL_HALF, false);
+    strategy.report(QR_LEVEL_FULL, true);
+    if (strategy.get_stats().codes[QR_LEVEL_FULL] != 1 || strategy.get_stats().codes[QR_LEVEL_HALF] != 0) failures++;
+    if (strategy.learned() != QR_LEVEL_FULL) failures++;
+
+    // once learned, attempts start at full, but one out of QR_STRATEGY_EXPLORE
+    uint32_t half_starts = 0;
+    for (uint32_t attempt = 0; attempt < 4 * QR_STRATEGY_EXPLORE; attempt++)
+    {
+        strategy.begin();
+        if (strategy.level() == QR_LEVEL_HALF) half_starts++;
+        strategy.report(strategy.level(), strategy.level() == QR_LEVEL_FULL);
+        if (strategy.level() == QR_LEVEL_HALF)
+        {
+            for (uint32_t i = 1; i < QR_STRATEGY_MISSES; i++) strategy.report(QR_LEVEL_HALF, false);
+            strategy.report(QR_LEVEL_FULL, true);
+        }
+    }
+    if (half_starts != 4 || strategy.learned() != QR_LEVEL_FULL) failures++;
+    // the counts stay within the history, the rate with them
+    const qr_strategy_stats_t &stats = strategy.get_stats();
+    if (stats.tries[QR_LEVEL_FULL] > QR_STRATEGY_HISTORY || stats.codes[QR_LEVEL_FULL] > stats.tries[QR_LEVEL_FULL])
+        failures++;
+
+    // half starts to work: learned back on the attempts that explore it
+    for (uint32_t attempt = 0; attempt < 8 * QR_STRATEGY_EXPLORE; attempt++)
+    {
+        strategy.begin();
+        strategy.report(strategy.level(), true);
+    }
+    if (strategy.learned() != QR_LEVEL_HALF) failures++;
+    printf("strategy: escalation, exploration and history -> %u failures\n", failures);
+    return failures;
+}
+
+int main()
+{
+    uint32_t failures = check_strategy();
+    test_frame_t frame;
+    for (uint32_t s = 0; s < TEST_INSTALLATIONS; s++)
+    {
+        const installation_t &site = installations[s];
+        strategy_result_t fixed, adaptive;
+        QrScanStrategy strategy(QR_LEVEL_FULL);
+        for (uint32_t attempt = 0; attempt < TEST_ATTEMPTS; attempt++)
+        {
+            uint32_t id = s * TEST_ATTEMPTS + attempt;
+            strategy.begin();
+            uint32_t fixed_us = 0, adaptive_us = 0;
+            bool fixed_done = false, adaptive_done = false;
+            for (uint32_t i = 0; i < TEST_MAX_FRAMES && !(fixed_done && adaptive_done); i++)
+            {
+                render_attempt_frame(&frame, site, id, i);
+                bool scanned, decoded;
+                if (!fixed_done)
+                {
+                    fixed_us += scan_frame(frame, QR_LEVEL_FULL, &scanned, &decoded);
+                    fixed.frames += scanned;
+                    if (decoded) fixed.first_code_us.push_back(fixed_us);
+                    fixed_done = decoded;
+                }
+                if (!adaptive_done)
+                {
+                    qr_level_t level = strategy.level();
+                    adaptive_us += scan_frame(frame, level, &scanned, &decoded);
+                    adaptive.frames += scanned;
+                    // the gate keeps a frame from the decoder, it is not a miss of the level
+                    if (scanned) strategy.report(level, decoded);
+                    if (decoded) adaptive.first_code_us.push_back(adaptive_us);
+                    adaptive_done = decoded;
+                }
+            }
+        }
+        const qr_strategy_stats_t &stats = strategy.get_stats();
+        printf("%s: attempts start at level %d, codes found at each level %u/%u %u/%u, %u levels up\n",
+               site.name, strategy.learned(), stats.codes[QR_LEVEL_HALF], stats.tries[QR_LEVEL_HALF],
+               stats.codes[QR_LEVEL_FULL], stats.tries[QR_LEVEL_FULL], stats.escalations);
+        double fixed_ms = mean_ms(fixed), adaptive_ms = mean_ms(adaptive);
+        uint32_t fixed_codes = fixed.first_code_us.size(), adaptive_codes = adaptive.first_code_us.size();
+        print_result("fixed", &fixed);
+        print_result("adaptive", &adaptive);
+        if (s == 0 && (strategy.learned() != QR_LEVEL_HALF || adaptive_ms >= fixed_ms || adaptive_codes < fixed_codes))
+            failures++;
+        // far codes: full, the attempts exploring half may run out of frames
+        if (s == 2 && (strategy.learned() != QR_LEVEL_FULL || adaptive_codes + TEST_ATTEMPTS / QR_STRATEGY_EXPLORE < fixed_codes))
+            failures++;
+    }
+    printf("-> %u failures\n", failures);
+    return failures ? 1 : 0;
+}
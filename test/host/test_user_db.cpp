@@ -0,0 +1,324 @@
+/* User list
+   Provisions users of 4, 7 and 10 byte UIDs in the UserStore of the user_db
+   partition, looks every one of them up by raw bytes and by Uid, from the RAM
+   table and from the mapped partition, then UIDs that were never provisioned:
+   they must be reported unknown, not abort, and most of them rejected by the
+   filter. Changes the rights of some users, adds others one by one, then
+   imports a stream of users out of order, some given twice, in one update,
+   replaces the list with another one, reboots and checks the list read back. Keeps the filter in memory that outlives the UserDB, as
+   RTC memory does across deep sleep: it must be rebuilt from garbage, kept
+   while the list is the same and follow the users added. Last, cuts the flash
+   at every few bytes of an update: the list after the reboot must be the old
+   one or the new one.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <iterator>
+#include <map>
+#include <utility>
+#include <vector>
+#include "esp_log.h"
+#include "flash_emu.h"
+#include "database.h"
+
+#define TEST_NB_USERS 20000
+#define TEST_NB_MISSES 100000
+#define TEST_NB_UPDATES 200
+#define TEST_NB_ADDS 50
+#define TEST_NB_IMPORTS 2000 // new users, as many changes of known users
+#define TEST_NB_REPLACE 5000
+#define TEST_CUT_USERS 300
+#define TEST_CUT_STEP 7 // bytes between two cut points
+#define TEST_FILTER_MEMORY 4096 // as much as fits in RTC slow memory
+#define TEST_FILTER_USERS 3000
+
+typedef std::vector<uint8_t> test_uid_t;
+
+// Order of the user list: length, then bytes
+struct uid_order {
+    bool operator()(const test_uid_t &a, const test_uid_t &b) const
+    {
+        return a.size() != b.size() ? a.size() < b.size() : a < b;
+    }
+};
+
+typedef std::map<test_uid_t, uint8_t, uid_order> test_users_t;
+
+static test_uid_t random_uid()
+{
+    uint32_t kind = rand() % 10;
+    test_uid_t uid(kind < 7 ? 4 : kind < 9 ? 7 : 10);
+    for (uint8_t &b : uid) b = (uint8_t)rand();
+    return uid;
+}
+
+static void provision(UserStore &store, const test_users_t &users)
+{
+    store.begin();
+    for (const auto &user : users)
+    {
+        user_record_t record = {};
+        record.uid_len = user.first.size();
+        memcpy(record.uid, user.first.data(), record.uid_len);
+        record.rights = user.second;
+        store.append(&record);
+    }
+    store.commit();
+}
+
+typedef struct {
+    const std::vector<user_entry_t> *users;
+    size_t next;
+} test_stream_t;
+
+static bool next_user(user_entry_t *user, void *arg)
+{
+    test_stream_t *stream = (test_stream_t*) arg;
+    if (stream->next == stream->users->size()) return false;
+    *user = (*stream->users)[stream->next++];
+    return true;
+}
+
+static user_entry_t test_entry(const test_uid_t &uid, uint8_t rights)
+{
+    user_entry_t entry = {};
+    entry.uid_len = uid.size();
+    entry.rights = rights;
+    memcpy(entry.uid, uid.data(), uid.size());
+    return entry;
+}
+
+static uint32_t check(UserDB &user_db, const test_users_t &users, const char *name)
+{
+    uint32_t failures = 0;
+    uint8_t rights;
+    user_filter_stats_t before = user_db.get_filter().get_stats();
+    for (const auto &user : users)
+    {
+        if (!user_db.get(user.first.data(), user.first.size(), &rights) || rights != user.second) failures++;
+        if (!user_db.get(Uid(user.first.data(), user.first.size()), &rights) || rights != user.second) failures++;
+    }
+    uint32_t misses = 0;
+    for (uint32_t i = 0; i < TEST_NB_MISSES; i++)
+    {
+        test_uid_t uid = random_uid();
+        if (users.count(uid)) continue;
+        misses++;
+        if (user_db.get(uid.data(), uid.size(), &rights)) failures++;
+    }
+    const user_filter_stats_t &filter = user_db.get_filter().get_stats();
+    uint32_t rejected = filter.rejected - before.rejected;
+    double passed = (double)(filter.false_positives - before.false_positives) / misses;
+    double expected = user_db.get_filter().get_expected_rate();
+    if (rejected + filter.false_positives - before.false_positives != misses || passed > 2 * expected + 0.001)
+        failures++;
+    // same first bytes, other lengths
+    const test_uid_t &first = users.begin()->first;
+    for (uint8_t len = 1; len <= HISTORY_UID_MAX_SIZE; len++)
+    {
+        test_uid_t uid(first);
+        uid.resize(len, 0);
+        if (!users.count(uid) && user_db.get(uid.data(), len, &rights)) failures++;
+    }
+    if (user_db.get_store().get_nb_records() != users.size()) failures++;
+    const user_store_stats_t &stats = user_db.get_store().get_stats();
+    if (stats.lookups)
+        printf("%s: %u users, %u unknown UIDs, %.2f%% through the filter (%.2f%% expected), "
+               "%.1f records read per search -> %u failures\n", name, (uint32_t)users.size(), misses, passed * 100,
+               expected * 100, (double)stats.lookup_steps / stats.lookups, failures);
+    else
+        printf("%s: %u users, %u unknown UIDs, %.2f%% through the filter (%.2f%% expected), %u bytes of RAM "
+               "-> %u failures\n", name, (uint32_t)users.size(), misses, passed * 100, expected * 100,
+               (uint32_t)(user_db.get_table().get_memory() + user_db.get_filter().get_memory()), failures);
+    return failures;
+}
+
+// Change the rights of user `index` with the flash cut after `cut` bytes
+static uint32_t check_cut(UserDB &user_db, test_users_t &users, uint32_t index, int64_t cut, bool *complete)
+{
+    auto user = users.begin();
+    std::advance(user, index);
+    uint8_t next = (user->second + 1) % 3;
+    uint32_t generation = user_db.get_store().get_generation();
+    emu_flash_cut_after(cut);
+    user_db.set(user->first.data(), user->first.size(), next);
+    emu_flash_cut_after(-1);
+    user_db.close();
+    user_db.open();
+
+    *complete = user_db.get_store().get_generation() == generation + 1;
+    if (*complete) user->second = next;
+    else if (user_db.get_store().get_generation() != generation) return 1;
+    uint8_t rights;
+    for (const auto &u : users)
+    {
+        if (!user_db.get(u.first.data(), u.first.size(), &rights) || rights != u.second) return 1;
+    }
+    return user_db.get_store().get_nb_records() == users.size() ? 0 : 1;
+}
+
+int main()
+{
+    emu_flash_init(NULL);
+    esp_log_level_set("*", ESP_LOG_ERROR);
+    emu_partition_wipe(P_USER);
+
+    uint32_t failures = 0;
+    UserDB user_db;
+    user_db.open();
+    uint8_t rights = 0xAA;
+    uint8_t unknown[4] = {0x12, 0x34, 0x56, 0x78};
+    if (user_db.get(unknown, sizeof(unknown), &rights) || user_db.get(Uid(unknown, sizeof(unknown)), &rights)
+        || rights != 0xAA)
+    {
+        printf("FAILED: empty list finds a user\n");
+        failures++;
+    }
+
+    srand(1);
+    test_users_t users;
+    while (users.size() < TEST_NB_USERS) users[random_uid()] = rand() % 3;
+    provision(user_db.get_store(), users);
+    user_db.close();
+    user_db.open();
+    printf("capacity: %u users\n", user_db.get_store().get_capacity());
+    failures += check(user_db, users, "provisioned");
+
+    // records out of order are refused, the list in use stays
+    UserStore &store = user_db.get_store();
+    user_record_t record = {};
+    record.uid_len = 4;
+    store.begin();
+    bool accepted = store.append(&record) && store.append(&record);
+    record.uid_len = 1;
+    accepted = accepted || store.append(&record);
+    store.abort();
+    if (accepted)
+    {
+        printf("FAILED: records out of order accepted\n");
+        failures++;
+    }
+
+    auto user = users.begin();
+    for (uint32_t i = 0; i < TEST_NB_UPDATES; i++, std::advance(user, TEST_NB_USERS / TEST_NB_UPDATES))
+    {
+        user->second = (user->second + 1) % 3;
+        user_db.set(user->first.data(), user->first.size(), user->second);
+    }
+    // added as UIDs read from text, through their hex string
+    char hex[UID_HEX_SIZE];
+    for (uint32_t i = 0; i < TEST_NB_ADDS; i++)
+    {
+        test_uid_t uid = random_uid();
+        users[uid] = 1;
+        Uid added;
+        if (!Uid::from_hex(Uid(uid.data(), uid.size()).to_hex(hex), &added)
+            || added != Uid(uid.data(), uid.size()))
+            failures++;
+        user_db.set(added, 1);
+    }
+    Uid bad;
+    if (Uid::from_hex("404", &bad) || Uid::from_hex("gate", &bad) || Uid::from_hex("00112233445566778899AA", &bad)
+        || !Uid(unknown, HISTORY_UID_MAX_SIZE + 1).empty() || user_db.set(bad, 1))
+    {
+        printf("FAILED: invalid UID accepted\n");
+        failures++;
+    }
+    failures += check(user_db, users, "updated");
+
+    // import: new users and changes, out of order, the last rights of a UID win
+    std::vector<user_entry_t> imports;
+    user = users.begin();
+    for (uint32_t i = 0; i < TEST_NB_IMPORTS; i++, user++)
+    {
+        test_uid_t uid = random_uid();
+        imports.push_back(test_entry(uid, 0));
+        imports.push_back(test_entry(uid, 1));
+        imports.push_back(test_entry(user->first, 2));
+    }
+    for (size_t i = imports.size() - 1; i > 0; i--) std::swap(imports[i], imports[rand() % (i + 1)]);
+    for (const user_entry_t &entry : imports)
+        users[test_uid_t(entry.uid, entry.uid + entry.uid_len)] = entry.rights;
+    uint32_t generation = user_db.get_store().get_generation();
+    test_stream_t stream = {&imports, 0};
+    if (!user_db.import(next_user, &stream) || user_db.get_store().get_generation() != generation + 1)
+    {
+        printf("FAILED: import not committed once\n");
+        failures++;
+    }
+    failures += check(user_db, users, "imported");
+
+    // a bad UID fails the whole import
+    imports.resize(10);
+    imports[5].uid_len = HISTORY_UID_MAX_SIZE + 1;
+    if (user_db.set(imports.data(), imports.size()) || user_db.get_store().get_generation() != generation + 1)
+    {
+        printf("FAILED: import of a bad UID accepted\n");
+        failures++;
+    }
+
+    // replace: the list holds the users given only
+    imports.clear();
+    users.clear();
+    while (users.size() < TEST_NB_REPLACE) users[random_uid()] = rand() % 3;
+    for (const auto &u : users) imports.push_back(test_entry(u.first, u.second));
+    if (!user_db.set(imports.data(), imports.size(), true)) failures++;
+    failures += check(user_db, users, "replaced");
+
+    user_db.close();
+    user_db.open(false);
+    failures += check(user_db, users, "reboot, mapped");
+    user_db.close();
+
+    // filter kept out of the UserDB, users beyond what it was sized for
+    static uint8_t filter_memory[TEST_FILTER_MEMORY];
+    memset(filter_memory, 0xA5, sizeof(filter_memory));
+    emu_partition_wipe(P_USER);
+    users.clear();
+    while (users.size() < TEST_FILTER_USERS) users[random_uid()] = rand() % 3;
+    UserDB rtc_db;
+    rtc_db.set_filter_memory(filter_memory, sizeof(filter_memory));
+    rtc_db.open();
+    provision(rtc_db.get_store(), users);
+    rtc_db.close();
+    rtc_db.open();
+    uint32_t builds = rtc_db.get_filter().get_stats().builds;
+    rtc_db.close();
+    rtc_db.open(false);
+    bool kept = rtc_db.get_filter().get_stats().builds == builds;
+    for (uint32_t i = 0; i < TEST_NB_ADDS; i++)
+    {
+        test_uid_t uid = random_uid();
+        users[uid] = 2;
+        rtc_db.set(uid.data(), uid.size(), 2);
+    }
+    rtc_db.close();
+    rtc_db.open();
+    kept = kept && rtc_db.get_filter().get_stats().builds == builds && rtc_db.get_filter().get_nb_users() == users.size();
+    if (builds != 2 || !kept)
+    {
+        printf("FAILED: filter in outside memory built %u times, kept: %d\n", builds, kept);
+        failures++;
+    }
+    failures += check(rtc_db, users, "filter kept");
+    rtc_db.close();
+
+    // power cuts
+    emu_partition_wipe(P_USER);
+    users.clear();
+    while (users.size() < TEST_CUT_USERS) users[random_uid()] = rand() % 3;
+    user_db.open();
+    provision(user_db.get_store(), users);
+    uint32_t nb_cuts = 0;
+    uint32_t cut_failures = 0;
+    bool complete = false;
+    for (int64_t cut = 0; !complete; cut += TEST_CUT_STEP, nb_cuts++)
+        cut_failures += check_cut(user_db, users, nb_cuts % TEST_CUT_USERS, cut, &complete);
+    user_db.close();
+    if (emu_flash_stats()->nor_violations) cut_failures++;
+    printf("power cut every %u bytes of a %u-user update: %u cuts -> %u failures\n", TEST_CUT_STEP, TEST_CUT_USERS,
+           nb_cuts, cut_failures);
+    failures += cut_failures;
+    return failures ? 1 : 0;
+}
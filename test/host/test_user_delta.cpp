@@ -0,0 +1,223 @@
+/* User list deltas
+   Provisions 20000 users at version 1, then runs a chain of random changes of
+   the list on the server (adds, removes, changes of rights): each round is
+   turned into 51-byte deltas by make_user_deltas and applied with
+   UserDB::apply_delta, and the list, its version and the lookups must match the
+   server after each delta. A repeated delta must change nothing; a delta out of
+   order, malformed or made for another list must be refused and leave the
+   list as it was; a power cut while a delta is written must leave the old or
+   the new version. Prints the downlink bytes against a reload of the list.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+#include "esp_log.h"
+#include "flash_emu.h"
+#include "database.h"
+#include "user_delta.h"
+
+#define TEST_NB_USERS 20000
+#define TEST_NB_ROUNDS 200
+#define TEST_MAX_CHANGES 40 // per round
+#define TEST_DELTA_SIZE 51 // EU868 application payload at DR0-DR2
+#define TEST_CUT_EVERY 10 // rounds between two power cuts
+
+static delta_uid_t random_uid()
+{
+    uint32_t kind = rand() % 10;
+    delta_uid_t uid(kind < 7 ? 4 : kind < 9 ? 7 : 10);
+    for (uint8_t &b : uid) b = (uint8_t)rand();
+    return uid;
+}
+
+// The list after a delta, decoded on the test side
+static void apply_ops(delta_list_t *list, const std::vector<uint8_t> &delta)
+{
+    size_t pos = 0;
+    while (delta[pos++] & 0x80);
+    while (pos < delta.size())
+    {
+        uint8_t op = delta[pos] >> 4;
+        delta_uid_t uid(delta.begin() + pos + 1, delta.begin() + pos + 1 + (delta[pos] & 0x0F));
+        pos += 1 + uid.size();
+        if (op == USER_DELTA_REMOVE) list->erase(uid);
+        else (*list)[uid] = delta[pos++];
+    }
+}
+
+// The records of the list in use are the users of `list`, in the same order
+static bool same_list(UserDB &user_db, const delta_list_t &list)
+{
+    const user_record_t *records = user_db.get_store().get_records();
+    if (user_db.get_store().get_nb_records() != list.size()) return false;
+    uint32_t i = 0;
+    for (const auto &user : list)
+    {
+        const user_record_t &record = records[i++];
+        if (record.uid_len != user.first.size() || memcmp(record.uid, user.first.data(), record.uid_len) != 0
+            || record.rights != user.second)
+            return false;
+    }
+    return true;
+}
+
+static uint32_t check(UserDB &user_db, const delta_list_t &list, uint32_t version, const std::vector<delta_uid_t> &gone)
+{
+    if (user_db.get_version() != version || !same_list(user_db, list)) return 1;
+    uint8_t rights;
+    for (const delta_uid_t &uid : gone)
+    {
+        if (!list.count(uid) && user_db.get(uid.data(), uid.size(), &rights)) return 1;
+    }
+    for (auto user = list.lower_bound(random_uid()); user != list.end() && rand() % 64; user++)
+    {
+        if (!user_db.get(user->first.data(), user->first.size(), &rights) || rights != user->second) return 1;
+    }
+    return 0;
+}
+
+// The delta must be refused with `expected`, the list left as it was: no commit
+static uint32_t check_refused(UserDB &user_db, const std::vector<uint8_t> &delta, esp_err_t expected, const char *name)
+{
+    uint32_t generation = user_db.get_store().get_generation();
+    esp_err_t err = user_db.apply_delta(delta.data(), delta.size());
+    if (err == expected && user_db.get_store().get_generation() == generation) return 0;
+    printf("FAILED: %s delta: %s\n", name, esp_err_to_name(err));
+    return 1;
+}
+
+int main()
+{
+    emu_flash_init(NULL);
+    esp_log_level_set("*", ESP_LOG_NONE);
+    emu_partition_wipe(P_USER);
+
+    uint32_t failures = 0;
+    srand(1);
+    delta_list_t server;
+    while (server.size() < TEST_NB_USERS) server[random_uid()] = rand() % 3;
+    std::vector<user_entry_t> users;
+    for (const auto &user : server)
+    {
+        user_entry_t entry = {};
+        entry.uid_len = user.first.size();
+        entry.rights = user.second;
+        memcpy(entry.uid, user.first.data(), user.first.size());
+        users.push_back(entry);
+    }
+    UserDB user_db;
+    user_db.open();
+    uint32_t version = 1;
+    if (!user_db.set(users.data(), users.size(), true, version) || check(user_db, server, version, {}))
+    {
+        printf("FAILED: provisioning at version %u\n", version);
+        failures++;
+    }
+
+    delta_list_t device = server;
+    uint32_t nb_changes = 0;
+    uint32_t nb_deltas = 0;
+    uint32_t delta_bytes = 0;
+    uint32_t refused = 0;
+    uint32_t nb_cuts = 0;
+    uint32_t cuts_applied = 0;
+    for (uint32_t round = 0; round < TEST_NB_ROUNDS; round++)
+    {
+        // changes on the server
+        std::vector<delta_uid_t> gone;
+        uint32_t changes = 1 + rand() % TEST_MAX_CHANGES;
+        for (uint32_t i = 0; i < changes; i++)
+        {
+            uint32_t kind = rand() % 10;
+            auto user = server.lower_bound(random_uid());
+            if (user == server.end()) user = server.begin();
+            if (kind < 4) server[random_uid()] = rand() % 3;
+            else if (kind < 7)
+            {
+                gone.push_back(user->first);
+                server.erase(user);
+            }
+            else user->second = (user->second + 1) % 3;
+        }
+        nb_changes += changes;
+        std::vector<std::vector<uint8_t>> deltas = make_user_deltas(device, server, version, TEST_DELTA_SIZE);
+
+        if (deltas.size() > 1)
+        {
+            failures += check_refused(user_db, deltas[1], ESP_ERR_INVALID_VERSION, "out of order");
+            refused++;
+        }
+        for (size_t d = 0; d < deltas.size(); d++)
+        {
+            const std::vector<uint8_t> &delta = deltas[d];
+            nb_deltas++;
+            delta_bytes += delta.size();
+
+            if (round % TEST_CUT_EVERY == 0 && d == 0)
+            {
+                // power cut somewhere in the update of the list, or around its commit
+                uint32_t size = USER_STORE_HEADER_SIZE + user_db.get_store().get_nb_records() * sizeof(user_record_t);
+                emu_flash_cut_after(nb_cuts % 2 ? size - 32 + rand() % 64 : rand() % size);
+                user_db.apply_delta(delta.data(), delta.size());
+                emu_flash_cut_after(-1);
+                user_db.close();
+                user_db.open();
+                nb_cuts++;
+                if (user_db.get_version() == version + 1)
+                {
+                    cuts_applied++;
+                    delta_list_t next = device;
+                    apply_ops(&next, delta);
+                    failures += check(user_db, next, version + 1, gone);
+                }
+                else failures += check(user_db, device, version, {});
+            }
+            esp_err_t err = user_db.apply_delta(delta.data(), delta.size());
+            uint32_t generation = user_db.get_store().get_generation();
+            // the downlink repeated
+            if (user_db.apply_delta(delta.data(), delta.size()) != ESP_OK
+                || user_db.get_store().get_generation() != generation)
+                failures++;
+            version++;
+            apply_ops(&device, delta);
+            if (err != ESP_OK || check(user_db, device, version, gone))
+            {
+                printf("FAILED: delta %u of round %u: %s\n", (uint32_t)d, round, esp_err_to_name(err));
+                failures++;
+            }
+        }
+        if (device != server) failures++;
+
+        // deltas made for another list, or malformed: the ops of a delta only
+        // depend on the users that differ
+        const delta_uid_t known = device.begin()->first;
+        uint8_t rights = device.begin()->second;
+        failures += check_refused(user_db, make_user_deltas({}, {{known, rights}}, version, TEST_DELTA_SIZE)[0],
+                                  ESP_ERR_INVALID_STATE, "add of a known UID");
+        std::vector<uint8_t> delta = make_user_deltas({{random_uid(), 1}}, {}, version, TEST_DELTA_SIZE)[0];
+        failures += check_refused(user_db, delta, ESP_ERR_INVALID_STATE, "remove of an unknown UID");
+        delta.pop_back();
+        failures += check_refused(user_db, delta, ESP_ERR_INVALID_ARG, "truncated");
+        delta = make_user_deltas({{known, rights}}, {{known, (uint8_t)((rights + 1) % 3)}}, version, TEST_DELTA_SIZE)[0];
+        std::vector<uint8_t> op(delta.end() - (2 + known.size()), delta.end());
+        delta.insert(delta.end(), op.begin(), op.end());
+        failures += check_refused(user_db, delta, ESP_ERR_INVALID_ARG, "UID twice in a");
+        refused += 4;
+    }
+    user_db.close();
+    user_db.open(false);
+    failures += check(user_db, server, version, {});
+    user_db.close();
+    if (emu_flash_stats()->nor_violations) failures++;
+
+    uint32_t reload = 0;
+    for (const std::vector<uint8_t> &delta : make_user_deltas(delta_list_t(), server, 0, TEST_DELTA_SIZE))
+        reload += delta.size();
+    printf("%u rounds, %u changes of a %u-user list: %u deltas, %u downlink bytes, %.1f bytes/change, "
+           "a reload takes %u bytes\n", TEST_NB_ROUNDS, nb_changes, (uint32_t)server.size(), nb_deltas, delta_bytes,
+           (double)delta_bytes / nb_changes, reload);
+    printf("%u deltas refused, %u power cuts (%u after the commit), version %u -> %u failures\n", refused, nb_cuts,
+           cuts_applied, version, failures);
+    return failures ? 1 : 0;
+}
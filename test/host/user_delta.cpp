@@ -0,0 +1,70 @@
+#include "user_delta.h"
+
+static size_t put_varint(uint8_t *out, uint32_t value)
+{
+    size_t len = 0;
+    while (value >= 0x80)
+    {
+        out[len++] = (uint8_t)(value | 0x80);
+        value >>= 7;
+    }
+    out[len++] = (uint8_t)value;
+    return len;
+}
+
+static size_t put_op(uint8_t *out, uint8_t op, const delta_uid_t &uid, uint8_t rights)
+{
+    size_t len = 0;
+    out[len++] = (uint8_t)(op << 4 | uid.size());
+    for (uint8_t b : uid) out[len++] = b;
+    if (op != USER_DELTA_REMOVE) out[len++] = rights;
+    return len;
+}
+
+std::vector<std::vector<uint8_t>> make_user_deltas(const delta_list_t &from, const delta_list_t &to,
+                                                   uint32_t version, size_t max_size)
+{
+    std::vector<std::vector<uint8_t>> deltas;
+    std::vector<uint8_t> delta;
+    auto add = [&](uint8_t op, const delta_uid_t &uid, uint8_t rights) {
+        uint8_t buffer[USER_DELTA_MAX_OP];
+        size_t len = put_op(buffer, op, uid, rights);
+        if (!delta.empty() && delta.size() + len > max_size)
+        {
+            deltas.push_back(delta);
+            delta.clear();
+            version++;
+        }
+        if (delta.empty())
+        {
+            uint8_t head[5];
+            delta.insert(delta.end(), head, head + put_varint(head, version));
+        }
+        delta.insert(delta.end(), buffer, buffer + len);
+    };
+
+    delta_uid_order before;
+    auto a = from.begin();
+    auto b = to.begin();
+    while (a != from.end() || b != to.end())
+    {
+        if (b == to.end() || (a != from.end() && before(a->first, b->first)))
+        {
+            add(USER_DELTA_REMOVE, a->first, 0);
+            a++;
+        }
+        else if (a == from.end() || before(b->first, a->first))
+        {
+            add(USER_DELTA_ADD, b->first, b->second);
+            b++;
+        }
+        else
+        {
+            if (a->second != b->second) add(USER_DELTA_MODIFY, b->first, b->second);
+            a++;
+            b++;
+        }
+    }
+    if (!delta.empty()) deltas.push_back(delta);
+    return deltas;
+}
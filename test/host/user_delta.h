@@ -0,0 +1,28 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <map>
+#include <vector>
+#include "database.h"
+
+typedef std::vector<uint8_t> delta_uid_t;
+
+// Order of the user list: length, then bytes
+struct delta_uid_order {
+    bool operator()(const delta_uid_t &a, const delta_uid_t &b) const
+    {
+        return a.size() != b.size() ? a.size() < b.size() : a < b;
+    }
+};
+
+typedef std::map<delta_uid_t, uint8_t, delta_uid_order> delta_list_t; // rights of each UID
+
+/**
+ * @brief Deltas of the user list (see USER_DELTA_* in database.h) that move
+ *        the list `from`, at `version`, to the list `to`, on the host
+ *
+ * @param max_size bytes of a delta at most, a downlink payload
+ * @return one delta per version from `version`, none if the lists are equal
+ */
+std::vector<std::vector<uint8_t>> make_user_deltas(const delta_list_t &from, const delta_list_t &to,
+                                                   uint32_t version, size_t max_size);
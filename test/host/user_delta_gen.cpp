@@ -0,0 +1,73 @@
+/* User list delta generator
+   Compares two user lists and prints the deltas that move a device from the
+   first one to the second, one downlink per line in hex (see USER_DELTA_* in
+   database.h), for UserDB::apply_delta.
+
+   user_delta_gen <old list> <new list> <version of the old list> [max delta size, 51 by default]
+   A list is a text file of "UID in hex,rights" lines, other lines are skipped.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "user_delta.h"
+
+#define DELTA_DEFAULT_SIZE 51 // EU868 application payload at DR0-DR2
+
+static bool load_list(const char *path, delta_list_t *list)
+{
+    FILE *file = fopen(path, "r");
+    if (!file)
+    {
+        perror(path);
+        return false;
+    }
+    char line[128];
+    char hex[2 * HISTORY_UID_MAX_SIZE + 1];
+    unsigned rights;
+    while (fgets(line, sizeof(line), file))
+    {
+        if (sscanf(line, "%20[0-9a-fA-F],%u", hex, &rights) != 2 || strlen(hex) % 2 || rights > 0xFF) continue;
+        delta_uid_t uid(strlen(hex) / 2);
+        for (size_t i = 0; i < uid.size(); i++)
+        {
+            unsigned byte;
+            sscanf(hex + 2*i, "%2x", &byte);
+            uid[i] = (uint8_t)byte;
+        }
+        (*list)[uid] = (uint8_t)rights;
+    }
+    fclose(file);
+    return true;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 4)
+    {
+        fprintf(stderr, "usage: %s <old list> <new list> <version of the old list> [max delta size]\n", argv[0]);
+        return 1;
+    }
+    delta_list_t from, to;
+    if (!load_list(argv[1], &from) || !load_list(argv[2], &to)) return 1;
+    uint32_t version = strtoul(argv[3], NULL, 0);
+    size_t max_size = argc > 4 ? strtoul(argv[4], NULL, 0) : DELTA_DEFAULT_SIZE;
+    if (max_size < 5 + USER_DELTA_MAX_OP)
+    {
+        fprintf(stderr, "a delta takes %u bytes at least\n", 5 + USER_DELTA_MAX_OP);
+        return 1;
+    }
+
+    std::vector<std::vector<uint8_t>> deltas = make_user_deltas(from, to, version, max_size);
+    size_t bytes = 0;
+    for (const std::vector<uint8_t> &delta : deltas)
+    {
+        for (uint8_t b : delta) printf("%02x", b);
+        printf("\n");
+        bytes += delta.size();
+    }
+    size_t reload = 0;
+    for (const std::vector<uint8_t> &delta : make_user_deltas(delta_list_t(), to, 0, max_size)) reload += delta.size();
+    fprintf(stderr, "%zu deltas, %zu bytes, version %u -> %u; the whole list takes %zu bytes\n", deltas.size(), bytes,
+            version, version + (uint32_t)deltas.size(), reload);
+    return 0;
+}
@@ -1,6 +1,8 @@
 #include <esp_log.h>
 #include <esp_task_wdt.h>
 #include <esp_sleep.h>
+#include <time.h>
+#include <stdlib.h>
 
 #include <freertos/FreeRTOS.h>
 #include <freertos/task.h>
@@ -8,6 +10,11 @@
 #include "rak3172.h"
 
 #include "LoRaWAN_Default.h"
+#include "database.h"
+
+#define HISTORY_PORT 2
+#define USER_PORT 3 // uplink of the user list version, downlinks of user list deltas
+#define PAYLOAD_SIZE 51 // EU868 application payload at DR0-DR2
 
 static RAK3172_t _Device = {
     .Interface = (uart_port_t)CONFIG_RAK3172_UART,
@@ -18,6 +25,61 @@ static RAK3172_t _Device = {
 
 static const char* TAG 							= "LORA";
 
+// Send the scans not acknowledged yet, one confirmed uplink per batch
+static void upload_history(RAK3172_t* p_Device, ScanHistoryDB &history_db)
+{
+    uint8_t payload[PAYLOAD_SIZE];
+    uint32_t end_entry;
+    size_t len;
+    while((len = history_db.get_upload_batch(payload, sizeof(payload), &end_entry)) > 0)
+    {
+        RAK3172_Error_t Error = RAK3172_LoRaWAN_Transmit(p_Device, HISTORY_PORT, payload, len, LORAWAN_TX_TIMEOUT_S, true);
+        if(Error != RAK3172_OK)
+        {
+            ESP_LOGE(TAG, "History batch not confirmed! Error: 0x%04X", Error);
+            return;
+        }
+        history_db.ack_upload(end_entry);
+        ESP_LOGI(TAG, "Scans up to %u uploaded", end_entry - 1);
+    }
+}
+
+// Send the version of the user list, the server answers with the next delta
+// in the downlink window until the list is up to date
+static void sync_user_list(RAK3172_t* p_Device, UserDB &user_db)
+{
+    uint8_t payload[PAYLOAD_SIZE];
+    while(true)
+    {
+        uint32_t version = user_db.get_version();
+        for(uint8_t i = 0; i < 4; i++) payload[i] = (uint8_t)(version >> (8*i));
+        RAK3172_Error_t Error = RAK3172_LoRaWAN_Transmit(p_Device, USER_PORT, payload, 4, LORAWAN_TX_TIMEOUT_S, true);
+        if(Error != RAK3172_OK)
+        {
+            ESP_LOGE(TAG, "User list version not confirmed! Error: 0x%04X", Error);
+            return;
+        }
+
+        // no downlink: the list is up to date
+        std::string Downlink;
+        if(RAK3172_LoRaWAN_Receive(p_Device, &Downlink, NULL, NULL, LORAWAN_RX_TIMEOUT_S) != RAK3172_OK) return;
+
+        // the module gives the payload as hex text
+        size_t len = Downlink.length() / 2;
+        if(len > sizeof(payload)) len = 0;
+        for(size_t i = 0; i < len; i++) payload[i] = (uint8_t)strtoul(Downlink.substr(2*i, 2).c_str(), NULL, 16);
+        esp_err_t err = user_db.apply_delta(payload, len);
+        if(err != ESP_OK)
+        {
+            // the next uplink tells the server the version the list is still at
+            ESP_LOGW(TAG, "User list delta refused at version %u: %s", version, esp_err_to_name(err));
+            return;
+        }
+        ESP_LOGI(TAG, "User list at version %u", user_db.get_version());
+        if(user_db.get_version() == version) return;
+    }
+}
+
 static void applicationTask(void* p_Parameter)
 {
     bool Status;
@@ -58,6 +120,21 @@ static void applicationTask(void* p_Parameter)
         {
             ESP_LOGI(TAG, "Joined...");
 
+            ScanHistoryDB history_db;
+            const uint8_t badge[] = {0x04, 0xA2, 0x00, 0x3D};
+            Uid uid(badge, sizeof(badge));
+            for(int i = 0; i < 10; i++)
+            {
+                history_db.add_history(uid, time(NULL) + i);
+            }
+            upload_history(&_Device, history_db);
+            history_db.close();
+
+            UserDB user_db;
+            user_db.open();
+            sync_user_list(&_Device, user_db);
+            user_db.close();
+
             /*char Payload[] = {'H', 'e', 'l', 'l', 'o', ' ', 'J', 'a', 'c', 'l', 'a'};
 
             Error = RAK3172_LoRaWAN_Transmit(&_Device, 1, Payload, sizeof(Payload), LORAWAN_TX_TIMEOUT_S, true, NULL);
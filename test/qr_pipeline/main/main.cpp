@@ -0,0 +1,181 @@
+/* QR pipeline benchmark
+   Runs BENCH_ATTEMPTS scan attempts as read_qr() does after a wakeup, first
+   with the sequential loop of one frame buffer (grab a frame, decode it, give
+   it back, wait 10 ms), then with QrPipeline and CAMERA_FB_COUNT buffers
+   (capture on core 1, decode on core 0), without then with the frame quality
+   gate. For each mode, reports the frames decoded per second and the time
+   from the start of an attempt to the first code found, with a QR code held in
+   front of the camera, and the frames the gate kept from the decoder. The
+   last mode decodes at the level of resolution QrScanStrategy learns, to
+   compare the spread of the times to the first code with the fixed one.
+*/
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <algorithm>
+#include "esp_log.h"
+#include "esp_system.h"
+#include "esp_timer.h"
+#include "esp_heap_caps.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "camera.h"
+#include "code_scanner.h"
+#include "qr_pipeline.h"
+#include "misc.h"
+
+static const char *TAG = "QR_PIPELINE_BENCH";
+
+#define BENCH_ATTEMPTS 20
+#define BENCH_TIMEOUT_MS 5000 // an attempt without a code
+#define BENCH_PAUSE_MS 1000 // between two attempts, as between two wakeups
+
+typedef struct {
+    uint32_t scanned;
+    uint32_t gated;
+    int64_t gate_us;
+    uint32_t cropped;
+    uint64_t scanned_pixels;
+    uint64_t frame_pixels;
+    int64_t scan_us;
+    int64_t elapsed_us;
+    uint32_t codes;
+    int64_t first_code_us; // sum over the attempts with a code
+    int64_t first_code_min_us;
+    int64_t first_code_max_us;
+    int64_t first_codes_us[BENCH_ATTEMPTS]; // of the attempts with a code, in order
+} bench_result_t;
+
+static void add_attempt(bench_result_t *result, uint32_t scanned, int64_t elapsed_us, int64_t first_code_us)
+{
+    result->scanned += scanned;
+    result->elapsed_us += elapsed_us;
+    if (first_code_us < 0) return;
+    result->first_codes_us[result->codes++] = first_code_us;
+    result->first_code_us += first_code_us;
+    if (result->codes == 1 || first_code_us < result->first_code_min_us) result->first_code_min_us = first_code_us;
+    if (first_code_us > result->first_code_max_us) result->first_code_max_us = first_code_us;
+}
+
+static void print_result(const char *name, const bench_result_t &result)
+{
+    ESP_LOGI(TAG, "%s: %.1f frames decoded/s, code found in %u/%u attempts, first code after %lld ms "
+             "(%lld to %lld ms)", name, result.scanned * 1000000.0 / result.elapsed_us, result.codes, BENCH_ATTEMPTS,
+             result.codes ? result.first_code_us / result.codes / 1000 : 0, result.first_code_min_us / 1000,
+             result.first_code_max_us / 1000);
+    if (result.codes)
+    {
+        int64_t sorted[BENCH_ATTEMPTS];
+        std::copy(result.first_codes_us, result.first_codes_us + result.codes, sorted);
+        std::sort(sorted, sorted + result.codes);
+        ESP_LOGI(TAG, "%s: first code after %lld ms for half the attempts, %lld ms for 90%%", name,
+                 sorted[(result.codes - 1) / 2] / 1000, sorted[(result.codes - 1) * 9 / 10] / 1000);
+    }
+    if (result.gated)
+    {
+        ESP_LOGI(TAG, "%s: %.1f%% of the frames skipped by the gate in %lld us a frame", name,
+                 100.0 * result.gated / (result.gated + result.scanned),
+                 result.gate_us / (result.gated + result.scanned));
+    }
+    if (result.frame_pixels)
+    {
+        ESP_LOGI(TAG, "%s: %u/%u frames cropped, %.1f%% of the pixels decoded, %lld us a scan", name, result.cropped,
+                 result.scanned, 100.0 * result.scanned_pixels / result.frame_pixels,
+                 result.scanned ? result.scan_us / result.scanned : 0);
+    }
+}
+
+// The loop of read_qr() before the pipeline
+static void bench_sequential(bench_result_t *result)
+{
+    for (uint32_t attempt = 0; attempt < BENCH_ATTEMPTS; attempt++)
+    {
+        CodeScanner scanner;
+        int64_t first_code_us = -1;
+        int64_t start = esp_timer_get_time();
+        while (esp_timer_get_time() - start < BENCH_TIMEOUT_MS * 1000)
+        {
+            {
+                CameraFrame fb;
+                if (fb && scanner.scan(fb.get()))
+                {
+                    first_code_us = esp_timer_get_time() - start;
+                    break;
+                }
+            }
+            vTaskDelay(10 / portTICK_PERIOD_MS);
+        }
+        add_attempt(result, scanner.get_stats().frames, esp_timer_get_time() - start, first_code_us);
+        vTaskDelay(BENCH_PAUSE_MS / portTICK_PERIOD_MS);
+    }
+}
+
+static void bench_pipeline(bench_result_t *result, const qr_gate_t &gate, bool crop, bool adaptive)
+{
+    QrPipeline pipeline;
+    pipeline.set_gate(gate);
+    pipeline.set_crop(crop);
+    pipeline.set_adaptive(adaptive);
+    char data[QR_PIPELINE_DATA_SIZE];
+    uint32_t stack_free = UINT32_MAX;
+    for (uint32_t attempt = 0; attempt < BENCH_ATTEMPTS; attempt++)
+    {
+        if (pipeline.start(1, 0) != ESP_OK) return;
+        pipeline.wait(data, sizeof(data), BENCH_TIMEOUT_MS / portTICK_PERIOD_MS);
+        pipeline.stop();
+        const qr_pipeline_stats_t &stats = pipeline.get_stats();
+        add_attempt(result, stats.scanned, stats.elapsed_us, stats.first_code_us);
+        result->gated += stats.gated;
+        result->gate_us += stats.gate_us;
+        result->cropped += stats.cropped;
+        result->scanned_pixels += stats.scanned_pixels;
+        result->frame_pixels += stats.frame_pixels;
+        result->scan_us += stats.scan_us;
+        if (stats.decoder_stack_free < stack_free) stack_free = stats.decoder_stack_free;
+        vTaskDelay(BENCH_PAUSE_MS / portTICK_PERIOD_MS);
+    }
+    ESP_LOGI(TAG, "decoder task: %u of %u bytes of stack never used", stack_free, QR_DECODER_STACK);
+    if (!adaptive) return;
+    const qr_strategy_stats_t &strategy = pipeline.get_strategy().get_stats();
+    for (uint32_t level = 0; level < QR_LEVELS; level++)
+    {
+        ESP_LOGI(TAG, "level %u: %u frames, code found in %u/%u attempts", level, strategy.frames[level],
+                 strategy.codes[level], strategy.tries[level]);
+    }
+    ESP_LOGI(TAG, "%u levels up, attempts start at level %d", strategy.escalations,
+             pipeline.get_strategy().learned());
+}
+
+static void bench_task(void *arg)
+{
+    bench_result_t sequential = {};
+    SANITY_CHECK_M(app_camera_init_with(1, CAMERA_GRAB_WHEN_EMPTY), ESP_OK, TAG, "Fail to init camera");
+    ESP_LOGI(TAG, "sequential, 1 frame buffer: %u bytes free", (unsigned)heap_caps_get_free_size(MALLOC_CAP_8BIT));
+    bench_sequential(&sequential);
+    esp_camera_deinit();
+
+    bench_result_t pipelined = {};
+    bench_result_t gated = {};
+    bench_result_t cropped = {};
+    bench_result_t adaptive = {};
+    SANITY_CHECK_M(app_camera_init(), ESP_OK, TAG, "Fail to init camera");
+    ESP_LOGI(TAG, "pipelined, %u frame buffers: %u bytes free", CAMERA_FB_COUNT,
+             (unsigned)heap_caps_get_free_size(MALLOC_CAP_8BIT));
+    bench_pipeline(&pipelined, QR_GATE_OFF, false, false);
+    bench_pipeline(&gated, QR_GATE_DEFAULT, false, false);
+    bench_pipeline(&cropped, QR_GATE_DEFAULT, true, false);
+    bench_pipeline(&adaptive, QR_GATE_DEFAULT, true, true);
+
+    print_result("sequential", sequential);
+    print_result("pipelined", pipelined);
+    print_result("pipelined, gated", gated);
+    print_result("pipelined, gated, cropped", cropped);
+    print_result("pipelined, gated, cropped, adaptive", adaptive);
+    vTaskDelete(NULL);
+}
+
+extern "C" void app_main(void)
+{
+    // the sequential loop decodes in this task, as the state machine does
+    xTaskCreatePinnedToCore(bench_task, TAG, 100 * 1024, NULL, 6, NULL, 0);
+}
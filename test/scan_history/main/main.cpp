@@ -37,14 +37,15 @@ static void IRAM_ATTR button_isr_handler(void* arg)
 // scan task waits for events from scan actions (ISR)
 static void scan_history_task(void* arg)
 {
-    char uid[] = "ABCD";
+    const uint8_t badge[] = {0x04, 0xA2, 0x00, 0x3D}; // a zero byte inside the UID is kept
+    Uid uid(badge, sizeof(badge));
     time_t now, debounce_now;
     debounce_now = 0;
 
-    ScanHistoryDB history_db(4);
+    ScanHistoryDB history_db;
 
-    ESP_LOGI(TAG, "block size %zd bytes", history_db.get_block_size());
-    ESP_LOGI(TAG, "uid size %zd bytes", history_db.get_uid_size());
+    char hex[UID_HEX_SIZE];
+    ESP_LOGI(TAG, "uid %s, %u bytes", uid.to_hex(hex), uid.size());
     ESP_LOGI(TAG, "Number of entries: %d", history_db.get_nb_entries());
 
     history_db.clear_history();
@@ -84,7 +85,7 @@ extern "C" void app_main(void)
     
     scan_evt_queue = xQueueCreate(10, 0);
     
-    // ScanHistoryDB history_db(4);
+    // ScanHistoryDB history_db;
     // history_db.clear_history();
     // history_db.close();
 
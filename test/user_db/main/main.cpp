@@ -1,35 +1,144 @@
-/* Non-Volatile Storage (NVS) Read and Write a Value - Example
-   For other examples please check:
-   https://github.com/espressif/esp-idf/tree/master/examples
-   This example code is in the Public Domain (or CC0 licensed, at your option.)
-   Unless required by applicable law or agreed to in writing, this
-   software is distributed on an "AS IS" BASIS, WITHOUT WARRANTIES OR
-   CONDITIONS OF ANY KIND, either express or implied.
+/* UserDB import and lookup benchmark
+   Imports lists of 10k, 50k, 100k then 500k users out of order in one
+   UserDB::set and, for each size, reports the time, the users/s and the flash
+   the import takes, then reopens UserDB as after a reboot and reports the time open()
+   takes to load the RAM table and the latency of UserDB::get for users that
+   exist and UIDs that were never provisioned, from the RAM table and from the
+   mapped partition, with the share of unknown UIDs the filter lets through.
+   A size is skipped when its users do not fit in a slot of the partition or
+   the import or the table do not fit in the heap.
 */
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
 #include "esp_log.h"
 #include "esp_system.h"
-#include "nvs_flash.h"
-#include "nvs.h"
+#include "esp_timer.h"
+#include "esp_heap_caps.h"
 #include "database.h"
 
-static const char *TAG = "NVS_APP";
+static const char *TAG = "USER_DB_BENCH";
+
+#define BENCH_NB_LOOKUPS 100000
+#define BENCH_YIELD_EVERY 1000 // records written between two ticks given to the idle task
+
+static const uint32_t bench_sizes[] = {10000, 50000, 100000, 500000};
+
+static void user_uid(uint32_t user, uint8_t *uid, uint8_t *uid_len)
+{
+    *uid_len = user % 5 ? 4 : 7;
+    // 3 more bytes of the user number for the 7 byte UIDs, so that they stay distinct
+    uint32_t hash = (user + 1) * 2654435761u;
+    for (uint8_t i = 0; i < 4; i++) uid[i] = (uint8_t)(hash >> (8*i));
+    for (uint8_t i = 4; i < *uid_len; i++) uid[i] = (uint8_t)(user >> (8*(i-4)));
+}
+
+// Average us of a lookup of random users from `first`
+static double bench_lookup(UserDB &user_db, uint32_t first, uint32_t nb_users, uint32_t *found)
+{
+    uint8_t uid[HISTORY_UID_MAX_SIZE];
+    uint8_t uid_len;
+    uint8_t rights;
+    uint32_t seed = 1;
+    int64_t elapsed = 0;
+    *found = 0;
+    for (uint32_t i = 0; i < BENCH_NB_LOOKUPS; i++)
+    {
+        seed = seed * 1103515245 + 12345;
+        user_uid(first + (seed >> 4) % nb_users, uid, &uid_len);
+        int64_t start = esp_timer_get_time();
+        bool hit = user_db.get(uid, uid_len, &rights);
+        elapsed += esp_timer_get_time() - start;
+        if (hit) (*found)++;
+    }
+    return (double)elapsed / BENCH_NB_LOOKUPS;
+}
+
+static bool bench_import(UserDB &user_db, uint32_t size)
+{
+    user_entry_t *users = (user_entry_t*)malloc(size * sizeof(user_entry_t));
+    if (users == NULL)
+    {
+        ESP_LOGW(TAG, "%u users: %u KB of users do not fit in the heap", size,
+                 (unsigned)(size * sizeof(user_entry_t) / 1024));
+        return false;
+    }
+    for (uint32_t i = 0; i < size; i++)
+    {
+        users[i] = {}; // no policy: the user may pass at any time
+        user_uid(i, users[i].uid, &users[i].uid_len);
+        users[i].rights = 1;
+    }
+
+    user_store_stats_t before = user_db.get_store().get_stats();
+    int64_t start = esp_timer_get_time();
+    bool ok = user_db.set(users, size, true);
+    int64_t import_us = esp_timer_get_time() - start;
+    free(users);
+    const user_store_stats_t &after = user_db.get_store().get_stats();
+    ESP_LOGI(TAG, "%u users: imported in %lld ms, %.0f users/s, %u KB, %u sectors erased -> %s", size,
+             import_us / 1000, (double)size * 1000000 / import_us,
+             (unsigned)((after.bytes_written - before.bytes_written) / 1024), after.erases - before.erases,
+             ok ? "OK" : "FAILED");
+    return ok;
+}
 
 extern "C" void app_main(void)
 {
     UserDB user_db;
+    user_db.open(false);
+    uint32_t capacity = user_db.get_store().get_capacity();
+    ESP_LOGI(TAG, "capacity of the %s partition: %u users of %u bytes", P_USER, capacity,
+             (unsigned)sizeof(user_record_t));
 
-    user_db.open();
+    for (uint32_t size : bench_sizes)
+    {
+        size_t table_bytes = ((uint64_t)size * 4 / 3 + 1) * sizeof(user_entry_t);
+        if (size > capacity)
+        {
+            ESP_LOGW(TAG, "%u users: do not fit in a slot of the %s partition", size, P_USER);
+            break;
+        }
+        if (!bench_import(user_db, size)) break;
 
-    // user_db.set("123456", 1);
-    // user_db.set("543210", 0);
-
-    ESP_LOGI(TAG, "123456: %d", user_db.get("123456"));
-    ESP_LOGI(TAG, "543210: %d", user_db.get("543210"));
-    // ESP_LOGI(TAG, "404: %d", user_db.get("404"));
+        // mapped partition
+        user_db.close();
+        user_db.open(false);
+        uint32_t map_hits, map_misses;
+        user_store_stats_t before = user_db.get_store().get_stats();
+        double map_hit_us = bench_lookup(user_db, 0, size, &map_hits);
+        uint32_t false_positives = user_db.get_filter().get_stats().false_positives;
+        double map_miss_us = bench_lookup(user_db, size, size, &map_misses);
+        false_positives = user_db.get_filter().get_stats().false_positives - false_positives;
+        const user_store_stats_t &stats = user_db.get_store().get_stats();
+        double steps = (double)(stats.lookup_steps - before.lookup_steps) / (stats.lookups - before.lookups);
+        bool ok = map_hits == BENCH_NB_LOOKUPS && map_misses == 0;
+        ESP_LOGI(TAG, "%u users mapped: get %.2f us (unknown %.2f us), %.1f records read per search, "
+                 "filter of %u KB lets %.2f%% of unknown UIDs through (%.2f%% expected) -> %s", size, map_hit_us,
+                 map_miss_us, steps, (unsigned)(user_db.get_filter().get_memory() / 1024),
+                 100.0 * false_positives / BENCH_NB_LOOKUPS, user_db.get_filter().get_expected_rate() * 100,
+                 ok ? "OK" : "FAILED");
 
+        // RAM table
+        if (table_bytes > heap_caps_get_largest_free_block(MALLOC_CAP_8BIT))
+        {
+            ESP_LOGW(TAG, "%u users: a table of %u KB does not fit in the heap", size, (unsigned)(table_bytes / 1024));
+            continue;
+        }
+        user_db.close();
+        int64_t start = esp_timer_get_time();
+        user_db.open();
+        int64_t load_ms = (esp_timer_get_time() - start) / 1000;
+        uint32_t hits, misses;
+        double hit_us = bench_lookup(user_db, 0, size, &hits);
+        double miss_us = bench_lookup(user_db, size, size, &misses);
+        ok = user_db.get_table().get_nb_users() == size && hits == BENCH_NB_LOOKUPS && misses == 0;
+        ESP_LOGI(TAG, "%u users in RAM: %u KB, loaded in %lld ms, get %.2f us (unknown %.2f us) -> %s", size,
+                 (unsigned)(user_db.get_table().get_memory() / 1024), load_ms, hit_us, miss_us, ok ? "OK" : "FAILED");
+        user_db.close();
+        user_db.open(false);
+    }
     user_db.close();
-
-}
\ No newline at end of file
+}